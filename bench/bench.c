@@ -0,0 +1,836 @@
+/*
+    buf - Command line tool for flashing ISO images onto USB drives.
+    Copyright (C) 2026  Bryson Kelly
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+*/
+
+
+// Benchmarks, run with `make bench`
+// Builds synthetic source trees (lots of tiny files, a distro-like mix and one huge file),
+// packs them into ISO9660 images when there's a tool for it, and times the copy phases
+// against plain files and directories, or loop devices with --loop, so no stick is needed.
+// Every run is appended to results.csv and results.jsonl tagged with the commit, so numbers
+// from two commits can be put side by side
+#define _GNU_SOURCE
+#include "../include/buf.h"
+#include <fcntl.h>
+#include <ftw.h>
+#include <sys/utsname.h>
+
+#define BENCH_BLOCK (1024 * 1024)
+#define BENCH_MB (1024.0 * 1024.0)
+
+typedef struct {
+    const char *name;
+    int (*generate)(const char *root, double scale, char *buffer);
+} BenchShape;
+
+typedef struct {
+    const char *phase;   // scan, copy, verify, fat32 or raw
+    const char *engine;
+    SyncMode sync;
+    int jobs;
+    CopyOrder order;
+} BenchCase;
+
+typedef struct {
+    char dir[MAX_PATH];
+    char out[MAX_PATH];
+    char commit[64];
+    char shapes[256];
+    char engines[256];
+    char loop_fs[16];    // Filesystem for loop targets, empty for plain files and directories
+    char loop[MAX_PATH]; // Loop device backing the copy target
+    double scale;
+    int runs;
+    int cold;            // Drop the page cache before every timed call
+    int verbose;
+} Bench;
+
+typedef struct {
+    const char *shape;
+    const char *source;  // "dir" or "iso"
+    const BenchCase *test;
+    int run;
+    size_t files;
+    unsigned long long bytes;
+    double seconds;
+    double flush;        // Time to get it onto the target after the call returned (syncfs or umount)
+    const char *status;
+} BenchResult;
+
+static const BenchCase bench_cases[] = {
+    { "scan",   "default",         SYNC_FILE,     1, ORDER_NONE },
+    { "copy",   "default",         SYNC_FILE,     1, ORDER_NONE },
+    { "copy",   "copy_file_range", SYNC_FILE,     1, ORDER_NONE },
+    { "copy",   "sendfile",        SYNC_FILE,     1, ORDER_NONE },
+    { "copy",   "mmap",            SYNC_FILE,     1, ORDER_NONE },
+    { "copy",   "buffered",        SYNC_FILE,     1, ORDER_NONE },
+    { "copy",   "direct",          SYNC_FILE,     1, ORDER_NONE },
+    { "copy",   "io_uring",        SYNC_FILE,     1, ORDER_NONE },
+    { "copy",   "default",         SYNC_DEFERRED, 1, ORDER_NONE },
+    { "copy",   "default",         SYNC_DEFERRED, 4, ORDER_NONE },
+    { "copy",   "default",         SYNC_DEFERRED, 1, ORDER_PHYSICAL },
+    { "copy",   "default",         SYNC_DEFERRED, 1, ORDER_LARGEST },
+    { "verify", "default",         SYNC_DEFERRED, 1, ORDER_NONE },
+    { "verify", "default",         SYNC_DEFERRED, 4, ORDER_NONE },
+    { "fat32",  "default",         SYNC_FILE,     1, ORDER_PHYSICAL },
+    { "raw",    "default",         SYNC_FILE,     1, ORDER_NONE },
+};
+
+static const char *sync_names[] = { "file", "deferred" };
+static const char *order_names[] = { "none", "physical", "largest" };
+
+// Same bytes for the same seed on every machine, and nothing a filesystem could compress
+static uint64_t bench_random(uint64_t *state) {
+    uint64_t z = (*state += 0x9E3779B97F4A7C15ULL);
+    
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+    return z ^ (z >> 31);
+}
+
+static int bench_file(const char *path, unsigned long long size, uint64_t seed, char *buffer) {
+    uint64_t state = seed;
+    unsigned long long done = 0;
+    size_t length;
+    size_t i;
+    int fd;
+    
+    fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        fprintf(stderr, "Error: Cannot create %s - %s\n", path, strerror(errno));
+        return -1;
+    }
+    
+    while (done < size) {
+        length = size - done > BENCH_BLOCK ? BENCH_BLOCK : (size_t)(size - done);
+        for (i = 0; i < length; i += sizeof(uint64_t)) {
+            uint64_t value = bench_random(&state);
+            
+            memcpy(buffer + i, &value, length - i < sizeof(value) ? length - i : sizeof(value));
+        }
+        if (write(fd, buffer, length) != (ssize_t)length) {
+            fprintf(stderr, "Error: Cannot write %s - %s\n", path, strerror(errno));
+            close(fd);
+            return -1;
+        }
+        done += length;
+    }
+    
+    return close(fd);
+}
+
+// 50000 files of up to 4 KB in 100 directories, the worst case for per-file overhead
+static int shape_tiny(const char *root, double scale, char *buffer) {
+    char path[MAX_PATH];
+    uint64_t state = 1;
+    long count = (long)(50000 * scale) > 0 ? (long)(50000 * scale) : 1;
+    long i;
+    
+    for (i = 0; i < count; i++) {
+        if (i % 500 == 0) {
+            snprintf(path, sizeof(path), "%s/d%03ld", root, i / 500);
+            if (mkdir(path, 0755) != 0 && errno != EEXIST) {
+                return -1;
+            }
+        }
+        snprintf(path, sizeof(path), "%s/d%03ld/f%05ld.bin", root, i / 500, i);
+        if (bench_file(path, bench_random(&state) % 4097, (uint64_t)i, buffer) != 0) {
+            return -1;
+        }
+    }
+    
+    return 0;
+}
+
+// Roughly what a Linux ISO looks like: thousands of small files, a few hundred medium ones
+// and a handful of big squashfs-sized images, about 2.7 GB at full scale
+static int shape_mix(const char *root, double scale, char *buffer) {
+    char path[MAX_PATH];
+    uint64_t state = 2;
+    long small = (long)(2700 * scale) > 0 ? (long)(2700 * scale) : 1;
+    long medium = (long)(270 * scale) > 0 ? (long)(270 * scale) : 1;
+    long large = (long)(30 * scale) > 0 ? (long)(30 * scale) : 1;
+    unsigned long long size;
+    long i;
+    
+    snprintf(path, sizeof(path), "%s/boot", root);
+    mkdir(path, 0755);
+    snprintf(path, sizeof(path), "%s/pool", root);
+    mkdir(path, 0755);
+    snprintf(path, sizeof(path), "%s/live", root);
+    mkdir(path, 0755);
+    
+    for (i = 0; i < small + medium + large; i++) {
+        if (i < small) {
+            if (i % 100 == 0) {
+                snprintf(path, sizeof(path), "%s/pool/p%02ld", root, i / 100);
+                mkdir(path, 0755);
+            }
+            snprintf(path, sizeof(path), "%s/pool/p%02ld/s%05ld", root, i / 100, i);
+            size = 1024 + bench_random(&state) % (64 * 1024);
+        } else if (i < small + medium) {
+            snprintf(path, sizeof(path), "%s/boot/m%04ld", root, i - small);
+            size = 64 * 1024 + bench_random(&state) % (4 * 1024 * 1024);
+        } else {
+            snprintf(path, sizeof(path), "%s/live/l%02ld.img", root, i - small - medium);
+            size = (16ULL << 20) + bench_random(&state) % (112ULL << 20);
+        }
+        if (bench_file(path, size, (uint64_t)i, buffer) != 0) {
+            return -1;
+        }
+    }
+    
+    return 0;
+}
+
+// One 5 GB file, too big for FAT32 and split into several extents inside the ISO
+static int shape_big(const char *root, double scale, char *buffer) {
+    char path[MAX_PATH];
+    
+    snprintf(path, sizeof(path), "%s/big.img", root);
+    return bench_file(path, (unsigned long long)(5.0 * 1024 * 1024 * 1024 * scale), 3, buffer);
+}
+
+static const BenchShape bench_shapes[] = {
+    { "tiny", shape_tiny },
+    { "mix",  shape_mix },
+    { "big",  shape_big },
+};
+
+static int remove_entry(const char *path, const struct stat *st, int type, struct FTW *ftw) {
+    (void)st;
+    (void)type;
+    
+    // The top directory stays, it's the mountpoint or the target
+    return ftw->level > 0 ? remove(path) : 0;
+}
+
+static void empty_directory(const char *path) {
+    nftw(path, remove_entry, 32, FTW_DEPTH | FTW_PHYS);
+}
+
+// Lets the next call read from the source instead of memory, when we're allowed to
+static void drop_caches(Bench *bench) {
+    int fd;
+    
+    sync();
+    if (!bench->cold) {
+        return;
+    }
+    
+    fd = open("/proc/sys/vm/drop_caches", O_WRONLY | O_CLOEXEC);
+    if (fd < 0 || write(fd, "3", 1) != 1) {
+        fprintf(stderr, "Can't drop the page cache, timing with a warm cache from here on\n");
+        bench->cold = 0;
+    }
+    if (fd >= 0) {
+        close(fd);
+    }
+}
+
+static int run_quiet(const char *command) {
+    char line[MAX_PATH * 3];
+    
+    snprintf(line, sizeof(line), "%s >/dev/null 2>&1", command);
+    return system(line);
+}
+
+static int have_tool(const char *tool) {
+    char line[128];
+    
+    snprintf(line, sizeof(line), "command -v %s", tool);
+    return run_quiet(line) == 0;
+}
+
+// Generate the tree for shape unless the last run left an identical one behind
+static int prepare_tree(const Bench *bench, const BenchShape *shape, char *root, size_t size, char *buffer) {
+    char stamp_path[MAX_PATH];
+    char wanted[64];
+    char stamp[64] = "";
+    char line[MAX_PATH * 2];
+    FILE *file;
+    
+    snprintf(root, size, "%s/src-%s", bench->dir, shape->name);
+    snprintf(stamp_path, sizeof(stamp_path), "%s/src-%s.stamp", bench->dir, shape->name);
+    snprintf(wanted, sizeof(wanted), "%s %g 1\n", shape->name, bench->scale);
+    
+    file = fopen(stamp_path, "r");
+    if (file != NULL) {
+        if (fgets(stamp, sizeof(stamp), file) == NULL) {
+            stamp[0] = '\0';
+        }
+        fclose(file);
+    }
+    if (strcmp(stamp, wanted) == 0) {
+        return 0;
+    }
+    
+    fprintf(stderr, "Generating %s source tree...\n", shape->name);
+    unlink(stamp_path);
+    snprintf(line, sizeof(line), "%s/%s.iso", bench->dir, shape->name);
+    unlink(line);
+    snprintf(line, sizeof(line), "rm -rf '%s'", root);
+    run_quiet(line);
+    if (mkdir(root, 0755) != 0 || shape->generate(root, bench->scale, buffer) != 0) {
+        fprintf(stderr, "Error: Cannot generate the %s source tree\n", shape->name);
+        return -1;
+    }
+    
+    file = fopen(stamp_path, "w");
+    if (file != NULL) {
+        fputs(wanted, file);
+        fclose(file);
+    }
+    return 0;
+}
+
+// Pack the tree as ISO9660 with Rock Ridge and Joliet. Level 3 lets the 5 GB file in as
+// several extents. Returns -1 without an ISO tool, the image cases are skipped then
+static int prepare_iso(const Bench *bench, const BenchShape *shape, const char *root, char *iso, size_t size) {
+    static const char *tools[] = { "xorriso -as mkisofs", "genisoimage", "mkisofs" };
+    char line[MAX_PATH * 3];
+    struct stat st;
+    size_t i;
+    
+    snprintf(iso, size, "%s/%s.iso", bench->dir, shape->name);
+    if (stat(iso, &st) == 0 && st.st_size > 0) {
+        return 0;
+    }
+    
+    for (i = 0; i < sizeof(tools) / sizeof(tools[0]); i++) {
+        char tool[32];
+        
+        sscanf(tools[i], "%31s", tool);
+        if (!have_tool(tool)) {
+            continue;
+        }
+        
+        fprintf(stderr, "Packing %s into an ISO with %s...\n", shape->name, tool);
+        snprintf(line, sizeof(line), "%s -iso-level 3 -R -J -V BENCH -o '%s' '%s'", tools[i], iso, root);
+        if (run_quiet(line) == 0) {
+            return 0;
+        }
+        unlink(iso);
+        fprintf(stderr, "%s couldn't pack %s, skipping the ISO source for it\n", tool, shape->name);
+        return -1;
+    }
+    
+    return -1;
+}
+
+// Plain file of size bytes, sparse so creating it costs nothing
+static int make_image(const char *path, unsigned long long size) {
+    int fd;
+    
+    fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        fprintf(stderr, "Error: Cannot create %s - %s\n", path, strerror(errno));
+        return -1;
+    }
+    if (ftruncate(fd, (off_t)size) != 0) {
+        fprintf(stderr, "Error: Cannot size %s - %s\n", path, strerror(errno));
+        close(fd);
+        return -1;
+    }
+    return close(fd);
+}
+
+// Attach the copy target image to a loop device, kept for the whole run
+static int attach_loop(Bench *bench, unsigned long long size) {
+    char image[MAX_PATH];
+    char line[MAX_PATH * 2];
+    FILE *pipe;
+    
+    snprintf(image, sizeof(image), "%s/target.img", bench->dir);
+    if (make_image(image, size) != 0) {
+        return -1;
+    }
+    
+    snprintf(line, sizeof(line), "losetup -f --show '%s' 2>/dev/null", image);
+    pipe = popen(line, "r");
+    if (pipe == NULL || fgets(bench->loop, sizeof(bench->loop), pipe) == NULL) {
+        bench->loop[0] = '\0';
+    }
+    if (pipe != NULL) {
+        pclose(pipe);
+    }
+    bench->loop[strcspn(bench->loop, "\n")] = '\0';
+    
+    if (bench->loop[0] == '\0') {
+        fprintf(stderr, "Error: Cannot attach %s to a loop device, run as root or without --loop\n", image);
+        return -1;
+    }
+    return 0;
+}
+
+static void detach_loop(Bench *bench) {
+    char line[MAX_PATH];
+    
+    if (bench->loop[0] != '\0') {
+        snprintf(line, sizeof(line), "losetup -d %s", bench->loop);
+        run_quiet(line);
+        bench->loop[0] = '\0';
+    }
+}
+
+// Fresh empty target for a copy: a new filesystem on the loop device, or an emptied directory
+static int prepare_target(const Bench *bench, const char *target) {
+    char line[MAX_PATH * 2];
+    
+    mkdir(target, 0755);
+    if (bench->loop[0] == '\0') {
+        empty_directory(target);
+        return 0;
+    }
+    
+    if (strcmp(bench->loop_fs, "vfat") == 0) {
+        snprintf(line, sizeof(line), "mkfs.vfat -F 32 %s", bench->loop);
+    } else {
+        snprintf(line, sizeof(line), "mkfs.%s -F %s", bench->loop_fs, bench->loop);
+    }
+    if (run_quiet(line) != 0) {
+        fprintf(stderr, "Error: %s failed\n", line);
+        return -1;
+    }
+    if (mount(bench->loop, target, bench->loop_fs, 0, NULL) != 0) {
+        fprintf(stderr, "Error: Cannot mount %s on %s - %s\n", bench->loop, target, strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+// Time until everything the call left dirty is on the target
+static double finish_target(const Bench *bench, const char *target) {
+    double started = tune_now();
+    int fd;
+    
+    if (bench->loop[0] != '\0') {
+        umount(target);
+        return tune_now() - started;
+    }
+    
+    fd = open(target, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd >= 0) {
+        syncfs(fd);
+        close(fd);
+    }
+    return tune_now() - started;
+}
+
+// Library output goes to stdout, which would bury the results. Returns the fd to restore
+static int quiet_begin(const Bench *bench) {
+    int saved;
+    int null_fd;
+    
+    if (bench->verbose) {
+        return -1;
+    }
+    
+    fflush(stdout);
+    saved = dup(STDOUT_FILENO);
+    null_fd = open("/dev/null", O_WRONLY | O_CLOEXEC);
+    if (saved >= 0 && null_fd >= 0) {
+        dup2(null_fd, STDOUT_FILENO);
+    }
+    if (null_fd >= 0) {
+        close(null_fd);
+    }
+    return saved;
+}
+
+static void quiet_end(int saved) {
+    if (saved >= 0) {
+        fflush(stdout);
+        dup2(saved, STDOUT_FILENO);
+        close(saved);
+    }
+}
+
+static int load_manifest(SourceManifest *manifest, const char *source, const char *root, const char *iso) {
+    if (strcmp(source, "iso") == 0) {
+        return manifest_build_image(manifest, iso);
+    }
+    return manifest_build(manifest, root);
+}
+
+static int has_huge_file(const SourceManifest *manifest) {
+    size_t i;
+    
+    for (i = 0; i < manifest->count; i++) {
+        if (S_ISREG(manifest->entries[i].mode) && (unsigned long long)manifest->entries[i].size > 0xFFFFFFFFULL) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static void record(const Bench *bench, const BenchResult *result) {
+    char path[MAX_PATH];
+    char date[32];
+    struct utsname host;
+    time_t now = time(NULL);
+    const BenchCase *test = result->test;
+    double total = result->seconds + result->flush;
+    double rate = total > 0 ? (double)result->bytes / BENCH_MB / total : 0;
+    struct stat st;
+    FILE *file;
+    int fresh;
+    
+    strftime(date, sizeof(date), "%Y-%m-%dT%H:%M:%SZ", gmtime(&now));
+    if (uname(&host) != 0) {
+        strcpy(host.nodename, "unknown");
+    }
+    
+    fprintf(stderr, "%-5s %-4s %-6s %-15s %-8s j%-2d %-8s run %d: %8.2fs + %6.2fs flush %9.1f MB/s  %s\n",
+            result->shape, result->source, test->phase, test->engine, sync_names[test->sync], test->jobs,
+            order_names[test->order], result->run, result->seconds, result->flush, rate, result->status);
+    
+    snprintf(path, sizeof(path), "%s/results.csv", bench->out);
+    fresh = stat(path, &st) != 0 || st.st_size == 0;
+    file = fopen(path, "a");
+    if (file != NULL) {
+        if (fresh) {
+            fprintf(file, "commit,date,host,shape,source,target,phase,engine,sync,jobs,order,cold,run,"
+                          "files,bytes,seconds,flush_seconds,mb_per_s,status\n");
+        }
+        fprintf(file, "%s,%s,%s,%s,%s,%s,%s,%s,%s,%d,%s,%d,%d,%zu,%llu,%.3f,%.3f,%.1f,%s\n",
+                bench->commit, date, host.nodename, result->shape, result->source,
+                bench->loop_fs[0] != '\0' ? bench->loop_fs : "plain", test->phase, test->engine,
+                sync_names[test->sync], test->jobs, order_names[test->order], bench->cold, result->run,
+                result->files, result->bytes, result->seconds, result->flush, rate, result->status);
+        fclose(file);
+    }
+    
+    snprintf(path, sizeof(path), "%s/results.jsonl", bench->out);
+    file = fopen(path, "a");
+    if (file != NULL) {
+        fprintf(file, "{\"commit\":\"%s\",\"date\":\"%s\",\"host\":\"%s\",\"shape\":\"%s\",\"source\":\"%s\","
+                      "\"target\":\"%s\",\"phase\":\"%s\",\"engine\":\"%s\",\"sync\":\"%s\",\"jobs\":%d,"
+                      "\"order\":\"%s\",\"cold\":%s,\"run\":%d,\"files\":%zu,\"bytes\":%llu,\"seconds\":%.3f,"
+                      "\"flush_seconds\":%.3f,\"mb_per_s\":%.1f,\"status\":\"%s\"}\n",
+                bench->commit, date, host.nodename, result->shape, result->source,
+                bench->loop_fs[0] != '\0' ? bench->loop_fs : "plain", test->phase, test->engine,
+                sync_names[test->sync], test->jobs, order_names[test->order], bench->cold ? "true" : "false",
+                result->run, result->files, result->bytes, result->seconds, result->flush, rate, result->status);
+        fclose(file);
+    }
+}
+
+static int listed(const char *list, const char *name) {
+    const char *p = list;
+    size_t length = strlen(name);
+    
+    if (list[0] == '\0') {
+        return 1;
+    }
+    
+    while ((p = strstr(p, name)) != NULL) {
+        if ((p == list || p[-1] == ',') && (p[length] == ',' || p[length] == '\0')) {
+            return 1;
+        }
+        p += length;
+    }
+    return 0;
+}
+
+// One timed case. Returns the result's status, "skipped" when it doesn't apply to this source
+static void run_case(Bench *bench, const BenchCase *test, BenchResult *result,
+                     const char *root, const char *iso) {
+    SourceManifest manifest;
+    CopyOptions options;
+    char target[MAX_PATH];
+    char image[MAX_PATH];
+    uint64_t hash;
+    double started;
+    int saved;
+    int status = 0;
+    
+    memset(&options, 0, sizeof(options));
+    options.jobs = test->jobs;
+    options.sync = test->sync;
+    options.order = test->order;
+    copy_engine_from_name(test->engine, &options.engine);
+    snprintf(target, sizeof(target), "%s/target", bench->dir);
+    
+    result->seconds = 0;
+    result->flush = 0;
+    result->status = "ok";
+    
+    // The raw image copy doesn't look inside the source, everything else needs the manifest
+    if (strcmp(test->phase, "raw") == 0) {
+        struct stat st;
+        
+        if (strcmp(result->source, "iso") != 0 || stat(iso, &st) != 0) {
+            result->status = "skipped";
+            return;
+        }
+        snprintf(image, sizeof(image), "%s/raw.img", bench->dir);
+        if (make_image(image, (unsigned long long)st.st_size) != 0) {
+            result->status = "failed";
+            return;
+        }
+        result->files = 1;
+        result->bytes = (unsigned long long)st.st_size;
+        
+        drop_caches(bench);
+        saved = quiet_begin(bench);
+        started = tune_now();
+        status = copy_image(iso, image, &options, &hash);
+        result->seconds = tune_now() - started;
+        quiet_end(saved);
+        unlink(image);
+        result->status = status == 0 ? "ok" : "failed";
+        return;
+    }
+    
+    drop_caches(bench);
+    started = tune_now();
+    if (load_manifest(&manifest, result->source, root, iso) != 0) {
+        result->status = "failed";
+        return;
+    }
+    result->files = manifest.file_count;
+    result->bytes = manifest.total_size;
+    
+    if (strcmp(test->phase, "scan") == 0) {
+        result->seconds = tune_now() - started;
+        manifest_free(&manifest);
+        return;
+    }
+    
+    if (strcmp(test->phase, "fat32") == 0) {
+        if (has_huge_file(&manifest)) {
+            result->status = "skipped";
+            manifest_free(&manifest);
+            return;
+        }
+        snprintf(image, sizeof(image), "%s/fat32.img", bench->dir);
+        if (make_image(image, manifest.total_size + manifest.total_size / 10 + (512ULL << 20)) != 0) {
+            result->status = "failed";
+            manifest_free(&manifest);
+            return;
+        }
+        
+        drop_caches(bench);
+        saved = quiet_begin(bench);
+        started = tune_now();
+        status = write_fat32(&manifest, image, "BENCH", 0, &options);
+        result->seconds = tune_now() - started;
+        quiet_end(saved);
+        unlink(image);
+        result->status = status == 0 ? "ok" : "failed";
+        manifest_free(&manifest);
+        return;
+    }
+    
+    if (strcmp(bench->loop_fs, "vfat") == 0 && has_huge_file(&manifest)) {
+        result->status = "skipped";
+        manifest_free(&manifest);
+        return;
+    }
+    if (prepare_target(bench, target) != 0) {
+        result->status = "failed";
+        manifest_free(&manifest);
+        return;
+    }
+    
+    drop_caches(bench);
+    saved = quiet_begin(bench);
+    started = tune_now();
+    status = copy_filesystem_files(&manifest, target, 0, &options);
+    result->seconds = tune_now() - started;
+    quiet_end(saved);
+    
+    // Verify is timed on its own, reading back a copy that has left the cache
+    if (status == 0 && strcmp(test->phase, "verify") == 0) {
+        finish_target(bench, target);
+        if (bench->loop[0] != '\0' && mount(bench->loop, target, bench->loop_fs, 0, NULL) != 0) {
+            status = -1;
+        } else {
+            drop_caches(bench);
+            saved = quiet_begin(bench);
+            started = tune_now();
+            status = verify_target(&manifest, target, test->jobs);
+            result->seconds = tune_now() - started;
+            quiet_end(saved);
+        }
+    }
+    
+    result->flush = finish_target(bench, target);
+    result->status = status == 0 ? "ok" : "failed";
+    manifest_free(&manifest);
+}
+
+static void usage(void) {
+    fprintf(stderr,
+            "Usage: bench [options]\n"
+            "  --dir=DIR         Where source trees, images and targets go (default /var/tmp/buf-bench)\n"
+            "  --out=DIR         Where results.csv and results.jsonl are appended (default DIR/results)\n"
+            "  --commit=ID       Commit the results are tagged with\n"
+            "  --shapes=LIST     Any of tiny,mix,big (default all)\n"
+            "  --engines=LIST    Copy engines to time (default all)\n"
+            "  --runs=N          Times every case is run (default 1)\n"
+            "  --scale=F         Multiply file counts and sizes by F (default 1)\n"
+            "  --quick           Same as --scale=0.02\n"
+            "  --loop[=FS]       Copy onto a loop device formatted FS (vfat or ext4, default vfat)\n"
+            "  --warm            Don't drop the page cache between runs\n"
+            "  -v                Show buf's own output\n");
+}
+
+static int parse_options(Bench *bench, int argc, char *argv[]) {
+    int i;
+    
+    for (i = 1; i < argc; i++) {
+        const char *arg = argv[i];
+        
+        if (strncmp(arg, "--dir=", 6) == 0) {
+            snprintf(bench->dir, sizeof(bench->dir), "%s", arg + 6);
+        } else if (strncmp(arg, "--out=", 6) == 0) {
+            snprintf(bench->out, sizeof(bench->out), "%s", arg + 6);
+        } else if (strncmp(arg, "--commit=", 9) == 0) {
+            snprintf(bench->commit, sizeof(bench->commit), "%s", arg + 9);
+        } else if (strncmp(arg, "--shapes=", 9) == 0) {
+            snprintf(bench->shapes, sizeof(bench->shapes), "%s", arg + 9);
+        } else if (strncmp(arg, "--engines=", 10) == 0) {
+            snprintf(bench->engines, sizeof(bench->engines), "%s", arg + 10);
+        } else if (strncmp(arg, "--runs=", 7) == 0) {
+            bench->runs = atoi(arg + 7);
+        } else if (strncmp(arg, "--scale=", 8) == 0) {
+            bench->scale = atof(arg + 8);
+        } else if (strcmp(arg, "--quick") == 0) {
+            bench->scale = 0.02;
+        } else if (strcmp(arg, "--loop") == 0) {
+            strcpy(bench->loop_fs, "vfat");
+        } else if (strncmp(arg, "--loop=", 7) == 0) {
+            snprintf(bench->loop_fs, sizeof(bench->loop_fs), "%s", arg + 7);
+        } else if (strcmp(arg, "--warm") == 0) {
+            bench->cold = 0;
+        } else if (strcmp(arg, "-v") == 0) {
+            bench->verbose = 1;
+        } else {
+            usage();
+            return -1;
+        }
+    }
+    
+    if (bench->runs < 1 || bench->scale <= 0) {
+        fprintf(stderr, "Error: --runs and --scale must be positive\n");
+        return -1;
+    }
+    if (bench->loop_fs[0] != '\0' && strcmp(bench->loop_fs, "vfat") != 0 && strcmp(bench->loop_fs, "ext4") != 0) {
+        fprintf(stderr, "Error: --loop takes vfat or ext4\n");
+        return -1;
+    }
+    if (bench->out[0] == '\0') {
+        snprintf(bench->out, sizeof(bench->out), "%s/results", bench->dir);
+    }
+    return 0;
+}
+
+int main(int argc, char *argv[]) {
+    Bench bench;
+    BenchResult result;
+    char root[MAX_PATH];
+    char iso[MAX_PATH];
+    char *buffer;
+    size_t s, c;
+    int has_iso;
+    int failed = 0;
+    int run;
+    
+    memset(&bench, 0, sizeof(bench));
+    strcpy(bench.dir, "/var/tmp/buf-bench");
+    strcpy(bench.commit, "unknown");
+    bench.scale = 1;
+    bench.runs = 1;
+    bench.cold = geteuid() == 0;
+    
+    if (parse_options(&bench, argc, argv) != 0) {
+        return 1;
+    }
+    
+    if (mkdir(bench.dir, 0755) != 0 && errno != EEXIST) {
+        fprintf(stderr, "Error: Cannot create %s - %s\n", bench.dir, strerror(errno));
+        return 1;
+    }
+    if (mkdir(bench.out, 0755) != 0 && errno != EEXIST) {
+        fprintf(stderr, "Error: Cannot create %s - %s\n", bench.out, strerror(errno));
+        return 1;
+    }
+    
+    buffer = malloc(BENCH_BLOCK);
+    if (buffer == NULL) {
+        fprintf(stderr, "Error: Out of memory\n");
+        return 1;
+    }
+    
+    // Big enough for the largest shape at this scale, sparse until something is written
+    if (bench.loop_fs[0] != '\0' && attach_loop(&bench, (unsigned long long)(6.0 * 1024 * 1024 * 1024 * bench.scale) + (1ULL << 30)) != 0) {
+        free(buffer);
+        return 1;
+    }
+    
+    fprintf(stderr, "Benchmarking %s in %s, results in %s%s\n", bench.commit, bench.dir, bench.out,
+            bench.cold ? "" : " (warm page cache)");
+    
+    for (s = 0; s < sizeof(bench_shapes) / sizeof(bench_shapes[0]); s++) {
+        const BenchShape *shape = &bench_shapes[s];
+        
+        if (!listed(bench.shapes, shape->name)) {
+            continue;
+        }
+        if (prepare_tree(&bench, shape, root, sizeof(root), buffer) != 0) {
+            failed = 1;
+            continue;
+        }
+        has_iso = prepare_iso(&bench, shape, root, iso, sizeof(iso)) == 0;
+        if (!has_iso) {
+            fprintf(stderr, "No xorriso, genisoimage or mkisofs, timing %s from its directory only\n", shape->name);
+        }
+        
+        for (c = 0; c < sizeof(bench_cases) / sizeof(bench_cases[0]); c++) {
+            const BenchCase *test = &bench_cases[c];
+            int source;
+            
+            if (strcmp(test->phase, "copy") == 0 && !listed(bench.engines, test->engine)) {
+                continue;
+            }
+            
+            for (source = 0; source < 1 + has_iso; source++) {
+                for (run = 1; run <= bench.runs; run++) {
+                    memset(&result, 0, sizeof(result));
+                    result.shape = shape->name;
+                    result.source = source == 0 ? "dir" : "iso";
+                    result.test = test;
+                    result.run = run;
+                    
+                    run_case(&bench, test, &result, root, iso);
+                    if (strcmp(result.status, "skipped") == 0) {
+                        break;
+                    }
+                    failed |= strcmp(result.status, "failed") == 0;
+                    record(&bench, &result);
+                }
+            }
+        }
+    }
+    
+    detach_loop(&bench);
+    free(buffer);
+    return failed ? 1 : 0;
+}
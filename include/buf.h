@@ -35,6 +35,7 @@
 #include <ctype.h>
 #include <signal.h>
 #include <pwd.h>
+#include <stdint.h>
 
 #define VERSION "1.6.1"
 #define APP_NAME "buf"
@@ -42,11 +43,16 @@
 #define MAX_PATH 4096 // Max path for file operations
 #define MAX_DEVICES 64 // Max number of devices that will be listed when using --list flag
 #define FAT32_MAX_FILESIZE 4294967295ULL // FAT32 has a maximum file size of 4GB - 1 byte
+#define MAX_JOBS 64 // Max number of copy worker threads (can be changed via --jobs flag)
+#define MAX_TARGETS 16 // Max number of devices flashed at once (several --target devices)
+#define COMMAND_TIMEOUT 120 // Seconds an external command gets before it's killed
+#define COMMAND_TIMEOUT_LONG 900 // For the slow ones: formatting, GRUB, extracting from install.wim
 
 typedef enum {
     MODE_NONE,
     MODE_WIPE,
-    MODE_PARTITION
+    MODE_PARTITION,
+    MODE_RAW        // Hybrid image written block for block onto the device
 } InstallMode;
 
 typedef enum {
@@ -69,10 +75,112 @@ typedef enum {
     ISO_OTHER
 } ISOType;
 
+// Every engine except ENGINE_BUFFERED falls back to a buffered copy when it fails
+typedef enum {
+    ENGINE_DEFAULT,    // sendfile for large files, buffered and hashing when the hashes are needed
+    ENGINE_AUTO,       // Time every engine on the real source/target and use the fastest
+    ENGINE_COPY_RANGE, // copy_file_range, reflinks when the filesystem supports it
+    ENGINE_SENDFILE,   // sendfile for every file
+    ENGINE_MMAP,       // mmap the source and write from the mapping
+    ENGINE_BUFFERED,   // read/write through a pair of aligned buffers
+    ENGINE_DIRECT,     // Buffered copy with the target opened O_DIRECT
+    ENGINE_URING       // io_uring with registered buffers
+} CopyEngine;
+
+typedef enum {
+    SYNC_FILE,    // fsync() every file as soon as it's copied
+    SYNC_DEFERRED // Background writeback while copying, one syncfs() once everything is copied
+} SyncMode;
+
+typedef enum {
+    ORDER_NONE,     // Directory order, as readdir returns it
+    ORDER_PHYSICAL, // Where each file starts on the source, so it's read front to back
+    ORDER_LARGEST   // Biggest files first, physical location between files of equal size
+} CopyOrder;
+
+// Where metrics_wait() accounts time blocked in the kernel
+typedef enum {
+    WAIT_SYNC,   // fsync and syncfs
+    WAIT_UMOUNT, // Unmounting, which flushes whatever is still dirty
+    WAIT_KINDS
+} MetricsWait;
+
+// Options that control how files are copied onto the target
+typedef struct {
+    int jobs;          // Number of worker threads copying files concurrently
+    CopyEngine engine; // How file data is moved (can be changed via --copy-engine flag)
+    SyncMode sync;     // When data is forced to the device (can be changed via --sync flag)
+    CopyOrder order;   // What order files are copied in (can be changed via --order flag)
+    int direct_io;     // Write the target with O_DIRECT (can be changed via --direct-io flag)
+    int resume;        // Skip files a failed run already finished (can be changed via --resume flag)
+    int verify;        // Read everything back and compare with the source (can be changed via --verify flag)
+    char checksums[MAX_PATH]; // Write every file's digest here, empty for none (can be changed via --checksums flag)
+} CopyOptions;
+
+#define PHYSICAL_UNKNOWN (~0ULL)
+
+// One file or directory in the source tree
+typedef struct {
+    const char *path;            // Relative to the source root, stored in the manifest arena
+    off_t size;
+    mode_t mode;
+    struct timespec atime;
+    struct timespec mtime;
+    unsigned long long physical; // Byte offset of the first block on the source, PHYSICAL_UNKNOWN until located
+    off_t extent;                // Where the data starts inside the source image, -1 when it's read by path
+    uint64_t hash;               // Content hash, only valid once hashed is set
+    unsigned char hashed;
+    unsigned char unchanged;     // Identical copy already on the target, nothing to do
+} ManifestEntry;
+
+typedef struct ArenaBlock ArenaBlock;
+
+// Running XXH64 of a file's content
+typedef struct {
+    uint64_t v[4];
+    uint64_t total;
+    unsigned char buffer[32];
+    size_t buffered;
+} HashState;
+
+// Everything we need to know about the source tree, gathered in a single walk
+typedef struct {
+    char root[MAX_PATH];
+    char image[MAX_PATH];        // Image the files are read out of directly, empty when root is a directory
+    ManifestEntry *entries;      // Directories always come before anything inside them
+    size_t count;
+    size_t capacity;
+    size_t file_count;
+    size_t dir_count;
+    unsigned long long total_size;
+    long largest;                // Index of the biggest file, -1 if there are no files
+    ArenaBlock *arena;           // Holds every path string
+} SourceManifest;
+
+// One stick of a fan-out copy. begin_file points fd and base at where a file's data goes,
+// end_file finishes the file off, both return 0 on success. wrote, if set, is told how much
+// of the current file has been written after every chunk
+typedef struct FanoutTarget FanoutTarget;
+struct FanoutTarget {
+    const char *name;          // Device or partition, for messages
+    int fd;
+    off_t base;                // Offset of the current file's data in fd
+    int pad;                   // Last chunk of a file may be written rounded up to whole sectors
+    int (*begin_file)(FanoutTarget *target, const ManifestEntry *entry);
+    int (*end_file)(FanoutTarget *target, const ManifestEntry *entry);
+    void (*wrote)(FanoutTarget *target, off_t written);
+    off_t flushed;             // For wrote, how much of the current file writeback was started on
+    void *data;                // Whatever the callbacks need
+    _Atomic unsigned long long written;
+    _Atomic int failed;        // Set once anything goes wrong, the other targets carry on
+};
+
 typedef struct {
     InstallMode mode;
     char source[MAX_PATH];
-    char target[MAX_PATH];
+    char target[MAX_PATH];     // First of targets, the only one for most runs
+    char targets[MAX_TARGETS][MAX_PATH];
+    int target_count;
     char target_device[MAX_PATH];
     char target_partition[MAX_PATH];
     FilesystemType filesystem;
@@ -80,6 +188,12 @@ typedef struct {
     int verbose;
     int no_log;
     ISOType iso_type;
+    CopyOptions copy;
+    char metrics[MAX_PATH];          // Phase metrics as JSON, empty for none (can be changed via --metrics flag)
+    char metrics_textfile[MAX_PATH]; // Same for node_exporter (can be changed via --metrics-textfile flag)
+    int progress_fd;                 // Progress records go here as JSON lines, -1 for none (can be changed via --progress flag)
+    int native_fat;                  // Write FAT32 in one pass instead of mkfs and a copy (can be changed via --native-fat flag)
+    int mount_source;                // Loop mount the ISO instead of reading it directly (can be changed via --mount-source flag)
 } Config;
 
 typedef struct {
@@ -88,6 +202,13 @@ typedef struct {
     char temp_directory[MAX_PATH];
 } MountPoints;
 
+// One mounted filesystem, as /proc/self/mountinfo lists it
+typedef struct {
+    dev_t device;      // st_dev of the filesystem, the block device's st_rdev for disk filesystems
+    char *mountpoint;
+    char *source;      // What was mounted, like /dev/sdb1, as the kernel has it
+} MountEntry;
+
 typedef struct {
     FILE *file;
     char filepath[MAX_PATH];
@@ -108,7 +229,7 @@ int check_dependencies(void);
 int check_source_media(const char *source);
 int check_target_media(const char *target, InstallMode mode);
 int determine_target_parameters(Config *config);
-ISOType detect_iso_type(const char *source_mountpoint);
+ISOType detect_iso_type(const SourceManifest *manifest);
 
 int is_device_busy(const char *device);
 int unmount_device(const char *device);
@@ -116,21 +237,98 @@ int unmount_device(const char *device);
 int create_mountpoints(MountPoints *mounts);
 int mount_source(const char *source, const char *mountpoint);
 int mount_target(const char *target, const char *mountpoint);
+int mount_table_read(MountEntry **entries, size_t *count);
+void mount_table_free(MountEntry *entries, size_t count);
+int is_mountpoint(const char *path);
 
 int wipe_device(const char *device);
 int create_partition_table(const char *device);
-int create_partition(const char *device, const char *partition, FilesystemType fs_type, const char *label);
+int create_partition(const char *device, const char *partition, FilesystemType fs_type);
+int format_partition(const char *partition, FilesystemType fs_type, const char *label);
 int create_uefi_ntfs_partition(const char *device);
 int install_uefi_ntfs(const char *partition, const char *temp_dir);
 
-unsigned long long get_directory_size(const char *path);
+int manifest_build(SourceManifest *manifest, const char *root);
+int manifest_build_image(SourceManifest *manifest, const char *image);
+int manifest_add(SourceManifest *manifest, const char *parent, const char *name, const struct stat *st, off_t extent);
+const ManifestEntry *manifest_find(const SourceManifest *manifest, const char *path);
+void manifest_free(SourceManifest *manifest);
+
 unsigned long long get_free_space(const char *path);
-int check_fat32_limitation(const char *source_mountpoint, FilesystemType *fs_type);
-int check_free_space(const char *source_mountpoint, const char *target_mountpoint, const char *target_partition);
+int check_fat32_limitation(const SourceManifest *manifest, FilesystemType *fs_type);
+int check_free_space(const SourceManifest *manifest, const char *target_mountpoint);
+
+int copy_filesystem_files(SourceManifest *manifest, const char *target, int verbose, const CopyOptions *options);
+int copy_file(const char *source, const char *target, ManifestEntry *entry);
+int copy_image(const char *source, const char *device, const CopyOptions *options, uint64_t *hash);
+void copy_progress_add(unsigned long long bytes);
+void copy_progress_start(unsigned long long total);
+int copy_entry_to_fd(const SourceManifest *manifest, ManifestEntry *entry, int dst_fd);
+int copy_engine_from_name(const char *name, CopyEngine *engine);
+const char *copy_engine_name(CopyEngine engine);
+
+void schedule_files(ManifestEntry **files, size_t count, const char *root, CopyOrder order);
+unsigned long long get_physical_offset(const char *path);
+
+int delta_load(const char *target);
+unsigned long long delta_reclaimable(void);
+int delta_plan(SourceManifest *manifest, const char *target);
+int delta_save(SourceManifest *manifest, const char *target);
+int delta_active(void);
+void delta_free(void);
+
+int verify_target(SourceManifest *manifest, const char *target, int jobs);
+
+int write_fat32(SourceManifest *manifest, const char *partition, const char *label, int verbose, const CopyOptions *options);
+int write_fat32_targets(SourceManifest *manifest, FanoutTarget *targets, int count, const char *label,
+                        int verbose, const CopyOptions *options);
+
+int fanout_copy(const SourceManifest *manifest, ManifestEntry **files, size_t count,
+                FanoutTarget *targets, int target_count, int verbose);
+int copy_fanout_mounted(SourceManifest *manifest, FanoutTarget *targets, int count, int verbose, const CopyOptions *options);
+int write_raw_targets(const char *source, FanoutTarget *targets, int count, const CopyOptions *options);
+int flash_targets(Config *config);
+
+int is_hybrid_image(const char *source);
+int write_raw_image(const char *source, const char *device, const CopyOptions *options);
+
+int journal_open(const SourceManifest *manifest, const char *target, int resume, SyncMode sync);
+int journal_finished(const ManifestEntry *entry, const char *target_path);
+void journal_add(const ManifestEntry *entry);
+void journal_close(int success);
+
+void hash_init(HashState *state);
+void hash_update(HashState *state, const void *data, size_t length);
+uint64_t hash_final(const HashState *state);
+int hash_file(const char *path, int uncached, uint64_t *hash);
+int hash_file_range(const char *path, off_t offset, off_t length, int uncached, uint64_t *hash);
+int hash_entry(const SourceManifest *manifest, ManifestEntry *entry);
+int hash_manifest(SourceManifest *manifest);
+int hash_write_list(SourceManifest *manifest, const char *path);
+
+int metrics_init(const char *json, const char *textfile);
+void metrics_phase(const char *name);
+void metrics_wait(MetricsWait kind, double started);
+void metrics_success(void);
+
+void progress_init(int fd);
+void progress_phase(const char *name);
+void progress_start(unsigned long long total);
+void progress_update(const char *operation, unsigned long long done, const char *file,
+                     const FanoutTarget *targets, int count, char *text, size_t size);
+
+double tune_now(void);
+void tune_reset(int jobs);
+size_t tune_chunk_size(void);
+size_t tune_chunk_limit(int depth);
+int tune_depth(void);
+void tune_record(size_t bytes, double seconds);
+void tune_report(void);
 
-int copy_filesystem_files(const char *source, const char *target, int verbose);
-int copy_file(const char *source, const char *target);
-int copy_directory_recursive(const char *source, const char *target, int verbose);
+int uring_available(void);
+int uring_copy_fd(int src_fd, off_t src_offset, int dst_fd, off_t size, HashState *hash,
+                  void (*written)(int dst_fd, off_t written, off_t *flushed));
+void uring_release(void);
 
 int install_grub(const char *target_mountpoint, const char *target_device);
 int install_grub_config(const char *target_mountpoint);
@@ -139,8 +337,10 @@ int workaround_win7_uefi(const char *source_mountpoint, const char *target_mount
 int cleanup_mountpoint(const char *mountpoint);
 void cleanup(MountPoints *mounts, const char *target_media);
 
-int run_command(const char *command);
-int run_command_with_output(const char *command, char *output, size_t output_size);
+const char *find_program(const char *name);
+int run_program(const char *const argv[], int timeout);
+int run_program_output(const char *const argv[], int timeout, char *output, size_t output_size);
+int run_program_to_file(const char *const argv[], int timeout, const char *path);
 char *trim_whitespace(char *str);
 int file_exists(const char *path);
 int is_block_device(const char *path);
@@ -154,7 +354,7 @@ void log_write(LogContext *ctx, LogLevel level, const char *format, ...);
 void log_section(LogContext *ctx, const char *section_name);
 void log_system_info(LogContext *ctx);
 void log_config(LogContext *ctx, Config *config);
-void log_command(LogContext *ctx, const char *command, int result);
+void log_command(LogContext *ctx, const char *command, int result, double seconds);
 void log_command_invocation(LogContext *ctx, int argc, char *argv[]);
 
 extern LogContext *g_log_ctx;
@@ -19,6 +19,126 @@
 
 
 #include "../include/buf.h"
+#include <fcntl.h>
+#include <limits.h>
+
+// Parse the worker thread count given to --jobs
+static int parse_jobs(const char *value, int *jobs) {
+    char *end;
+    long count = strtol(value, &end, 10);
+    
+    if (*value == '\0' || *end != '\0' || count < 1 || count > MAX_JOBS) {
+        fprintf(stderr, "Error: --jobs must be a number between 1 and %d\n", MAX_JOBS);
+        fprintf(stderr, "Run `sudo buf -h` for help on commands\n");
+        return -1;
+    }
+    
+    *jobs = (int)count;
+    return 0;
+}
+
+// Parse the engine name given to --copy-engine
+static int parse_copy_engine(const char *value, CopyEngine *engine) {
+    if (copy_engine_from_name(value, engine) != 0) {
+        fprintf(stderr, "Error: Unknown copy engine '%s'\n", value);
+        fprintf(stderr, "Run `sudo buf -h` for help on commands\n");
+        return -1;
+    }
+    
+    return 0;
+}
+
+// Parse the durability mode given to --sync
+static int parse_sync_mode(const char *value, SyncMode *sync) {
+    if (strcmp(value, "file") == 0) {
+        *sync = SYNC_FILE;
+    } else if (strcmp(value, "deferred") == 0) {
+        *sync = SYNC_DEFERRED;
+    } else {
+        fprintf(stderr, "Error: Unknown sync mode '%s' (use file or deferred)\n", value);
+        fprintf(stderr, "Run `sudo buf -h` for help on commands\n");
+        return -1;
+    }
+    
+    return 0;
+}
+
+// Parse the copy order given to --order
+static int parse_copy_order(const char *value, CopyOrder *order) {
+    if (strcmp(value, "none") == 0) {
+        *order = ORDER_NONE;
+    } else if (strcmp(value, "physical") == 0) {
+        *order = ORDER_PHYSICAL;
+    } else if (strcmp(value, "largest") == 0) {
+        *order = ORDER_LARGEST;
+    } else {
+        fprintf(stderr, "Error: Unknown copy order '%s' (use none, physical or largest)\n", value);
+        fprintf(stderr, "Run `sudo buf -h` for help on commands\n");
+        return -1;
+    }
+    
+    return 0;
+}
+
+// Parse the stream given to --progress, json:FD with FD a descriptor the caller left open for us
+static int parse_progress(const char *value, int *fd) {
+    char *end;
+    long number;
+    
+    if (strncmp(value, "json:", 5) != 0) {
+        fprintf(stderr, "Error: Unknown progress format '%s' (use json:FD)\n", value);
+        fprintf(stderr, "Run `sudo buf -h` for help on commands\n");
+        return -1;
+    }
+    
+    number = strtol(value + 5, &end, 10);
+    if (value[5] == '\0' || *end != '\0' || number < 0 || number > INT_MAX || fcntl((int)number, F_GETFD) < 0) {
+        fprintf(stderr, "Error: --progress needs an open file descriptor, '%s' isn't one\n", value + 5);
+        fprintf(stderr, "Run `sudo buf -h` for help on commands\n");
+        return -1;
+    }
+    
+    *fd = (int)number;
+    return 0;
+}
+
+// Add the devices given to --target, a comma separated list. -t can also be repeated
+static int parse_targets(const char *value, Config *config) {
+    char list[MAX_PATH];
+    char *save = NULL;
+    char *device;
+    int i;
+    
+    strncpy(list, value, sizeof(list) - 1);
+    list[sizeof(list) - 1] = '\0';
+    
+    for (device = strtok_r(list, ",", &save); device != NULL; device = strtok_r(NULL, ",", &save)) {
+        if (config->target_count == MAX_TARGETS) {
+            fprintf(stderr, "Error: At most %d targets can be written at once\n", MAX_TARGETS);
+            fprintf(stderr, "Run `sudo buf -h` for help on commands\n");
+            return -1;
+        }
+        
+        for (i = 0; i < config->target_count; i++) {
+            if (strcmp(config->targets[i], device) == 0) {
+                fprintf(stderr, "Error: Target %s given twice\n", device);
+                fprintf(stderr, "Run `sudo buf -h` for help on commands\n");
+                return -1;
+            }
+        }
+        
+        strncpy(config->targets[config->target_count++], device, MAX_PATH - 1);
+    }
+    
+    if (config->target_count == 0) {
+        fprintf(stderr, "Error: Target media not specified\n");
+        fprintf(stderr, "Run `sudo buf -h` for help on commands\n");
+        return -1;
+    }
+    
+    strncpy(config->target, config->targets[0], sizeof(config->target) - 1);
+    return 0;
+}
 
 int parse_arguments(int argc, char *argv[], Config *config) {
     int i;
@@ -64,11 +184,43 @@ int parse_arguments(int argc, char *argv[], Config *config) {
             continue;
         }
         
+        if (strcmp(arg, "-r") == 0 || strcmp(arg, "--raw") == 0) {
+            config->mode = MODE_RAW;
+            has_mode = 1;
+            mode_count++;
+            continue;
+        }
+        
         if (strcmp(arg, "-v") == 0 || strcmp(arg, "--verbose") == 0) {
             config->verbose = 1;
             continue;
         }
         
+        if (strcmp(arg, "--direct-io") == 0) {
+            config->copy.direct_io = 1;
+            continue;
+        }
+        
+        if (strcmp(arg, "--resume") == 0) {
+            config->copy.resume = 1;
+            continue;
+        }
+        
+        if (strcmp(arg, "--verify") == 0) {
+            config->copy.verify = 1;
+            continue;
+        }
+        
+        if (strcmp(arg, "--native-fat") == 0) {
+            config->native_fat = 1;
+            continue;
+        }
+        
+        if (strcmp(arg, "--mount-source") == 0) {
+            config->mount_source = 1;
+            continue;
+        }
+        
         if (strcmp(arg, "-nl") == 0 || strcmp(arg, "--no-log") == 0) {
             config->no_log = 1;
             continue;
@@ -83,7 +235,9 @@ int parse_arguments(int argc, char *argv[], Config *config) {
         
         if (strncmp(arg, "-t=", 3) == 0 || strncmp(arg, "--target=", 9) == 0) {
             value = strchr(arg, '=') + 1;
-            strncpy(config->target, value, sizeof(config->target) - 1);
+            if (parse_targets(value, config) != 0) {
+                return -1;
+            }
             has_target = 1;
             continue;
         }
@@ -94,6 +248,64 @@ int parse_arguments(int argc, char *argv[], Config *config) {
             continue;
         }
         
+        if (strncmp(arg, "-j=", 3) == 0 || strncmp(arg, "--jobs=", 7) == 0) {
+            value = strchr(arg, '=') + 1;
+            if (parse_jobs(value, &config->copy.jobs) != 0) {
+                return -1;
+            }
+            continue;
+        }
+        
+        if (strncmp(arg, "--copy-engine=", 14) == 0) {
+            value = strchr(arg, '=') + 1;
+            if (parse_copy_engine(value, &config->copy.engine) != 0) {
+                return -1;
+            }
+            continue;
+        }
+        
+        if (strncmp(arg, "--sync=", 7) == 0) {
+            value = strchr(arg, '=') + 1;
+            if (parse_sync_mode(value, &config->copy.sync) != 0) {
+                return -1;
+            }
+            continue;
+        }
+        
+        if (strncmp(arg, "--order=", 8) == 0) {
+            value = strchr(arg, '=') + 1;
+            if (parse_copy_order(value, &config->copy.order) != 0) {
+                return -1;
+            }
+            continue;
+        }
+        
+        if (strncmp(arg, "--checksums=", 12) == 0) {
+            value = strchr(arg, '=') + 1;
+            strncpy(config->copy.checksums, value, sizeof(config->copy.checksums) - 1);
+            continue;
+        }
+        
+        if (strncmp(arg, "--progress=", 11) == 0) {
+            value = strchr(arg, '=') + 1;
+            if (parse_progress(value, &config->progress_fd) != 0) {
+                return -1;
+            }
+            continue;
+        }
+        
+        if (strncmp(arg, "--metrics=", 10) == 0) {
+            value = strchr(arg, '=') + 1;
+            strncpy(config->metrics, value, sizeof(config->metrics) - 1);
+            continue;
+        }
+        
+        if (strncmp(arg, "--metrics-textfile=", 19) == 0) {
+            value = strchr(arg, '=') + 1;
+            strncpy(config->metrics_textfile, value, sizeof(config->metrics_textfile) - 1);
+            continue;
+        }
+        
         if (i + 1 < argc) {
             if (strcmp(arg, "-s") == 0 || strcmp(arg, "--source") == 0) {
                 strncpy(config->source, argv[++i], sizeof(config->source) - 1);
@@ -102,7 +314,9 @@ int parse_arguments(int argc, char *argv[], Config *config) {
             }
             
             if (strcmp(arg, "-t") == 0 || strcmp(arg, "--target") == 0) {
-                strncpy(config->target, argv[++i], sizeof(config->target) - 1);
+                if (parse_targets(argv[++i], config) != 0) {
+                    return -1;
+                }
                 has_target = 1;
                 continue;
             }
@@ -111,6 +325,56 @@ int parse_arguments(int argc, char *argv[], Config *config) {
                 strncpy(config->label, argv[++i], sizeof(config->label) - 1);
                 continue;
             }
+            
+            if (strcmp(arg, "-j") == 0 || strcmp(arg, "--jobs") == 0) {
+                if (parse_jobs(argv[++i], &config->copy.jobs) != 0) {
+                    return -1;
+                }
+                continue;
+            }
+            
+            if (strcmp(arg, "--copy-engine") == 0) {
+                if (parse_copy_engine(argv[++i], &config->copy.engine) != 0) {
+                    return -1;
+                }
+                continue;
+            }
+            
+            if (strcmp(arg, "--sync") == 0) {
+                if (parse_sync_mode(argv[++i], &config->copy.sync) != 0) {
+                    return -1;
+                }
+                continue;
+            }
+            
+            if (strcmp(arg, "--order") == 0) {
+                if (parse_copy_order(argv[++i], &config->copy.order) != 0) {
+                    return -1;
+                }
+                continue;
+            }
+            
+            if (strcmp(arg, "--checksums") == 0) {
+                strncpy(config->copy.checksums, argv[++i], sizeof(config->copy.checksums) - 1);
+                continue;
+            }
+            
+            if (strcmp(arg, "--progress") == 0) {
+                if (parse_progress(argv[++i], &config->progress_fd) != 0) {
+                    return -1;
+                }
+                continue;
+            }
+            
+            if (strcmp(arg, "--metrics") == 0) {
+                strncpy(config->metrics, argv[++i], sizeof(config->metrics) - 1);
+                continue;
+            }
+            
+            if (strcmp(arg, "--metrics-textfile") == 0) {
+                strncpy(config->metrics_textfile, argv[++i], sizeof(config->metrics_textfile) - 1);
+                continue;
+            }
         }
         
         fprintf(stderr, "Error: Unknown argument '%s'\n", arg);
@@ -119,13 +383,13 @@ int parse_arguments(int argc, char *argv[], Config *config) {
     }
     
     if (mode_count > 1) {
-        fprintf(stderr, "Error: Cannot use both --wipe and --partition modes\n");
+        fprintf(stderr, "Error: Only one of --wipe, --partition and --raw can be used\n");
         fprintf(stderr, "Run `sudo buf -h` for help on commands\n");
         return -1;
     }
     
     if (!has_mode) {
-        fprintf(stderr, "Error: Installation mode not specified (use -w or -p)\n");
+        fprintf(stderr, "Error: Installation mode not specified (use -w, -p or -r)\n");
         fprintf(stderr, "Run `sudo buf -h` for help on commands\n");
         return -1;
     }
@@ -142,9 +406,44 @@ int parse_arguments(int argc, char *argv[], Config *config) {
         return -1;
     }
     
-    if (config->mode == MODE_WIPE) {
+    // Several sticks at once only makes sense when every one of them starts from scratch
+    if (config->target_count > 1 && (config->mode == MODE_PARTITION || config->copy.resume)) {
+        fprintf(stderr, "Error: Multiple targets only work with --wipe or --raw, and without --resume\n");
+        fprintf(stderr, "Run `sudo buf -h` for help on commands\n");
+        return -1;
+    }
+    
+    // The one-pass writer makes the filesystem itself, so it needs a device it wipes and it
+    // doesn't go through the copy engines at all
+    if (config->native_fat) {
+        if (config->mode != MODE_WIPE || config->copy.resume) {
+            fprintf(stderr, "Error: --native-fat only works with --wipe, and without --resume\n");
+            fprintf(stderr, "Run `sudo buf -h` for help on commands\n");
+            return -1;
+        }
+        
+        if (config->copy.jobs != 1 || config->copy.engine != ENGINE_DEFAULT || config->copy.sync != SYNC_FILE ||
+            config->copy.order != ORDER_NONE || config->copy.direct_io) {
+            fprintf(stderr, "Error: --jobs, --copy-engine, --sync, --order and --direct-io can't be used with --native-fat\n");
+            fprintf(stderr, "Run `sudo buf -h` for help on commands\n");
+            return -1;
+        }
+    }
+    
+    if (config->mode == MODE_WIPE || config->mode == MODE_RAW) {
         char response[10];
-        printf("\nWARNING: The --wipe/-w flag will erase ALL DATA on this device, are you sure you want to continue? Y/N: ");
+        
+        if (config->target_count > 1) {
+            printf("\nTargets:");
+            for (i = 0; i < config->target_count; i++) {
+                printf(" %s", config->targets[i]);
+            }
+            printf("\nWARNING: The %s flag will erase ALL DATA on these %d devices, are you sure you want to continue? Y/N: ",
+                   config->mode == MODE_RAW ? "--raw/-r" : "--wipe/-w", config->target_count);
+        } else {
+            printf("\nWARNING: The %s flag will erase ALL DATA on this device, are you sure you want to continue? Y/N: ",
+                   config->mode == MODE_RAW ? "--raw/-r" : "--wipe/-w");
+        }
         fflush(stdout);
         
         if (fgets(response, sizeof(response), stdin) == NULL) {
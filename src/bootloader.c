@@ -24,27 +24,20 @@
 // Using GRUB, just incase a user is on a BIOS-based system
 // By the way, if your computer is still running BIOS, why? 
 int install_grub(const char *target_mountpoint, const char *target_device) {
-    char command[MAX_PATH];
-    char grub_cmd[256];
+    char boot_directory[MAX_PATH + 32];
+    const char *argv[] = { "grub-install", "--target=i386-pc", boot_directory, "--force", target_device, NULL };
     
     log_write(g_log_ctx, LOG_STEP, "Installing GRUB to: %s", target_device);
     
-    snprintf(grub_cmd, sizeof(grub_cmd), "which grub-install >/dev/null 2>&1");
-    if (run_command(grub_cmd) == 0) {
-        // Use grub-install if available
-        snprintf(command, sizeof(command), 
-                "grub-install --target=i386-pc --boot-directory='%s' --force '%s' 2>/dev/null", 
-                target_mountpoint, target_device);
-        log_write(g_log_ctx, LOG_INFO, "Using grub-install command");
-    } else {
-        // Fall back to grub2 if grub-install fails
-        snprintf(command, sizeof(command), 
-                "grub2-install --target=i386-pc --boot-directory='%s' --force '%s' 2>/dev/null", 
-                target_mountpoint, target_device);
-        log_write(g_log_ctx, LOG_INFO, "Using grub2-install command");
+    snprintf(boot_directory, sizeof(boot_directory), "--boot-directory=%s", target_mountpoint);
+    
+    // Use grub-install if available, fall back to grub2-install otherwise
+    if (find_program("grub-install") == NULL) {
+        argv[0] = "grub2-install";
     }
+    log_write(g_log_ctx, LOG_INFO, "Using %s command", argv[0]);
     
-    if (run_command(command) != 0) {
+    if (run_program(argv, COMMAND_TIMEOUT_LONG) != 0) {
         fprintf(stderr, "Error: GRUB installation failed\n");
         log_write(g_log_ctx, LOG_ERROR, "GRUB installation command failed");
         return -1;
@@ -59,13 +52,11 @@ int install_grub_config(const char *target_mountpoint) {
     char grub_cfg_path[MAX_PATH];
     char grub_dir[MAX_PATH];
     FILE *cfg_file;
-    char test_cmd[MAX_PATH];
     
     log_write(g_log_ctx, LOG_STEP, "Creating GRUB configuration");
     
     // Determine the GRUB dir name (grub vs grub2)
-    snprintf(test_cmd, sizeof(test_cmd), "which grub-install >/dev/null 2>&1");
-    if (run_command(test_cmd) == 0) {
+    if (find_program("grub-install") != NULL) {
         snprintf(grub_dir, sizeof(grub_dir), "%s/grub", target_mountpoint);
         log_write(g_log_ctx, LOG_INFO, "Using grub directory");
     } else {
@@ -99,6 +90,23 @@ int install_grub_config(const char *target_mountpoint) {
     return 0;
 }
 
+// First path under mountpoint that matches pattern without caring about case, like
+// "efi/boot". Returns -1 if there's none
+static int find_ignoring_case(const char *mountpoint, const char *pattern, char *found, size_t size) {
+    char path_pattern[MAX_PATH];
+    char output[MAX_PATH];
+    const char *argv[] = { "find", mountpoint, "-ipath", path_pattern, NULL };
+    
+    snprintf(path_pattern, sizeof(path_pattern), "%s/%s", mountpoint, pattern);
+    if (run_program_output(argv, COMMAND_TIMEOUT, output, sizeof(output)) != 0 || output[0] == '\0') {
+        return -1;
+    }
+    
+    output[strcspn(output, "\n")] = '\0';
+    snprintf(found, size, "%s", output);
+    return 0;
+}
+
 // Windows 7 ISOs lack a proper UEFI bootloader, so we extract it from install.wim
 // This lets windows 7 boot on UEFI systems
 int workaround_win7_uefi(const char *source_mountpoint, const char *target_mountpoint) {
@@ -108,8 +116,8 @@ int workaround_win7_uefi(const char *source_mountpoint, const char *target_mount
     char efi_boot_dir[MAX_PATH];
     char bootloader_path[MAX_PATH];
     char sources_install[MAX_PATH];
-    FILE *pipe;
-    char buffer[1024];
+    const char *grep_argv[] = { "grep", "-q", "-E", "^MinServer=7[0-9]{3}\\.[0-9]", cversion_path, NULL };
+    const char *extract_argv[] = { "7z", "e", "-so", sources_install, "Windows/Boot/EFI/bootmgfw.efi", NULL };
     int is_win7 = 0;
     
     log_write(g_log_ctx, LOG_INFO, "Checking for Windows 7 UEFI workaround requirement");
@@ -118,8 +126,7 @@ int workaround_win7_uefi(const char *source_mountpoint, const char *target_mount
     snprintf(cversion_path, sizeof(cversion_path), "%s/sources/cversion.ini", source_mountpoint);
     if (file_exists(cversion_path)) {
         // Check for windows 7 version string (7xxx.x format)
-        snprintf(command, sizeof(command), "grep -E '^MinServer=7[0-9]{3}\\.[0-9]' '%s'", cversion_path);
-        if (run_command(command) == 0) {
+        if (run_program(grep_argv, COMMAND_TIMEOUT) == 0) {
             is_win7 = 1;
             log_write(g_log_ctx, LOG_INFO, "Detected Windows 7 installation media");
         }
@@ -136,56 +143,24 @@ int workaround_win7_uefi(const char *source_mountpoint, const char *target_mount
     log_write(g_log_ctx, LOG_STEP, "Applying Windows 7 UEFI workaround");
     
     // Find EFI directory (case-insensitive)
-    snprintf(command, sizeof(command), "find '%s' -ipath '%s/efi' 2>/dev/null", 
-            target_mountpoint, target_mountpoint);
-    
-    pipe = popen(command, "r");
-    if (pipe != NULL) {
-        if (fgets(buffer, sizeof(buffer), pipe) != NULL) {
-            buffer[strcspn(buffer, "\n")] = 0;
-            strncpy(efi_dir, buffer, sizeof(efi_dir) - 1);
-        } else {
-            snprintf(efi_dir, sizeof(efi_dir), "%s/efi", target_mountpoint);
-        }
-        pclose(pipe);
-    } else {
+    if (find_ignoring_case(target_mountpoint, "efi", efi_dir, sizeof(efi_dir)) != 0) {
         snprintf(efi_dir, sizeof(efi_dir), "%s/efi", target_mountpoint);
     }
     
     log_write(g_log_ctx, LOG_INFO, "EFI directory: %s", efi_dir);
     
     // Find EFI boot directory (case-insensitive)
-    snprintf(command, sizeof(command), "find '%s' -ipath '%s/boot' 2>/dev/null", 
-            target_mountpoint, target_mountpoint);
-    
-    pipe = popen(command, "r");
-    if (pipe != NULL) {
-        if (fgets(buffer, sizeof(buffer), pipe) != NULL) {
-            buffer[strcspn(buffer, "\n")] = 0;
-            strncpy(efi_boot_dir, buffer, sizeof(efi_boot_dir) - 1);
-        } else {
-            snprintf(efi_boot_dir, sizeof(efi_boot_dir), "%s/efi/boot", target_mountpoint);
-        }
-        pclose(pipe);
-    } else {
+    if (find_ignoring_case(target_mountpoint, "boot", efi_boot_dir, sizeof(efi_boot_dir)) != 0) {
         snprintf(efi_boot_dir, sizeof(efi_boot_dir), "%s/efi/boot", target_mountpoint);
     }
     
     log_write(g_log_ctx, LOG_INFO, "EFI boot directory: %s", efi_boot_dir);
     
     // Check if EFI bootloader already exists. If so, skip this workaround
-    snprintf(command, sizeof(command), "find '%s' -ipath '%s/efi/boot/boot*.efi' 2>/dev/null", 
-            target_mountpoint, target_mountpoint);
-    
-    pipe = popen(command, "r");
-    if (pipe != NULL) {
-        if (fgets(buffer, sizeof(buffer), pipe) != NULL) {
-            pclose(pipe);
-            print_colored("Existing EFI bootloader found, skipping workaround", "");
-            log_write(g_log_ctx, LOG_INFO, "Existing EFI bootloader found, skipping workaround");
-            return 0;
-        }
-        pclose(pipe);
+    if (find_ignoring_case(target_mountpoint, "efi/boot/boot*.efi", bootloader_path, sizeof(bootloader_path)) == 0) {
+        print_colored("Existing EFI bootloader found, skipping workaround", "");
+        log_write(g_log_ctx, LOG_INFO, "Existing EFI bootloader found, skipping workaround");
+        return 0;
     }
     
     // Create EFI boot directory
@@ -203,11 +178,7 @@ int workaround_win7_uefi(const char *source_mountpoint, const char *target_mount
     log_write(g_log_ctx, LOG_STEP, "Extracting EFI bootloader from install.wim");
     
     // Extract bootmgfw.efi from install.wim and rename to bootx64.efi
-    snprintf(command, sizeof(command), 
-            "7z e -so '%s' Windows/Boot/EFI/bootmgfw.efi > '%s' 2>/dev/null", 
-            sources_install, bootloader_path);
-    
-    if (run_command(command) != 0) {
+    if (run_program_to_file(extract_argv, COMMAND_TIMEOUT_LONG, bootloader_path) != 0) {
         fprintf(stderr, "Warning: Failed to extract EFI bootloader\n");
         log_write(g_log_ctx, LOG_WARNING, "Failed to extract EFI bootloader from install.wim");
         return -1;
@@ -19,20 +19,19 @@
 
 
 #include "../include/buf.h"
+#include <sys/sysmacros.h>
 
 int check_dependencies(void) {
     const char *required_commands[] = {
         // User needs these commands on their system for this to work
-        "mount", "umount", "wipefs", "lsblk", "blockdev", 
+        "mount", "wipefs", "lsblk", "blockdev", 
         "df", "parted", "7z", NULL
     };
     int i;
-    char command[256];
     int missing = 0;
     
     for (i = 0; required_commands[i] != NULL; i++) {
-        snprintf(command, sizeof(command), "which %s >/dev/null 2>&1", required_commands[i]);
-        if (run_command(command) != 0) {
+        if (find_program(required_commands[i]) == NULL) {
             fprintf(stderr, "Error: Required command '%s' not found\n", required_commands[i]);
             log_write(g_log_ctx, LOG_ERROR, "Required command not found: %s", required_commands[i]);
             missing = 1;
@@ -40,24 +39,21 @@ int check_dependencies(void) {
     }
     
     // Check for FAT stuff 
-    snprintf(command, sizeof(command), "which mkdosfs >/dev/null 2>&1 || which mkfs.vfat >/dev/null 2>&1 || which mkfs.fat >/dev/null 2>&1");
-    if (run_command(command) != 0) {
+    if (find_program("mkdosfs") == NULL && find_program("mkfs.vfat") == NULL && find_program("mkfs.fat") == NULL) {
         fprintf(stderr, "Error: FAT filesystem tools not found (install dosfstools)\n");
         log_write(g_log_ctx, LOG_ERROR, "FAT filesystem tools not found (dosfstools required)");
         missing = 1;
     }
     
     // Check NTFS tools
-    snprintf(command, sizeof(command), "which mkntfs >/dev/null 2>&1");
-    if (run_command(command) != 0) {
+    if (find_program("mkntfs") == NULL) {
         fprintf(stderr, "Error: NTFS filesystem tools not found (install ntfs-3g)\n");
         log_write(g_log_ctx, LOG_ERROR, "NTFS filesystem tools not found (ntfs-3g required)");
         missing = 1;
     }
     
     // Check for GRUB (supports both grub and grub2 naming)
-    snprintf(command, sizeof(command), "which grub-install >/dev/null 2>&1 || which grub2-install >/dev/null 2>&1");
-    if (run_command(command) != 0) {
+    if (find_program("grub-install") == NULL && find_program("grub2-install") == NULL) {
         fprintf(stderr, "Error: GRUB not found (install grub2 or grub-pc)\n");
         log_write(g_log_ctx, LOG_ERROR, "GRUB not found (grub2 or grub-pc required)");
         missing = 1;
@@ -100,11 +96,12 @@ int check_target_media(const char *target, InstallMode mode) {
         return -1;
     }
     
-    if (mode == MODE_WIPE) {
+    if (mode == MODE_WIPE || mode == MODE_RAW) {
         // Device names end with a letter, and partition names end with a digit
         if (isdigit(target[strlen(target) - 1])) {
             fprintf(stderr, "Error: Target must be a device (e.g., /dev/sdb), not a partition\n");
-            log_write(g_log_ctx, LOG_ERROR, "Wipe mode requires a device, not partition: %s", target);
+            log_write(g_log_ctx, LOG_ERROR, "%s mode requires a device, not partition: %s",
+                      mode == MODE_RAW ? "Raw" : "Wipe", target);
             return -1;
         }
     } else if (mode == MODE_PARTITION) {
@@ -146,160 +143,174 @@ int determine_target_parameters(Config *config) {
     return 0;
 }
 
-ISOType detect_iso_type(const char *source_mountpoint) {
-    char bootmgr_path[MAX_PATH];
-    char sources_path[MAX_PATH];
-    char isolinux_path[MAX_PATH];
-    char syslinux_path[MAX_PATH];
-    
-    snprintf(bootmgr_path, sizeof(bootmgr_path), "%s/bootmgr", source_mountpoint);
-    snprintf(sources_path, sizeof(sources_path), "%s/sources", source_mountpoint);
-    
-    if (file_exists(bootmgr_path) && is_directory(sources_path)) {
+// Works from the manifest, so it doesn't matter whether the image was mounted or read directly
+ISOType detect_iso_type(const SourceManifest *manifest) {
+    const ManifestEntry *bootmgr = manifest_find(manifest, "bootmgr");
+    const ManifestEntry *sources = manifest_find(manifest, "sources");
+    const ManifestEntry *isolinux = manifest_find(manifest, "isolinux");
+    const ManifestEntry *syslinux = manifest_find(manifest, "syslinux");
+    
+    if (bootmgr != NULL && S_ISREG(bootmgr->mode) && sources != NULL && S_ISDIR(sources->mode)) {
         return ISO_WINDOWS;
     }
     
-    snprintf(isolinux_path, sizeof(isolinux_path), "%s/isolinux", source_mountpoint);
-    snprintf(syslinux_path, sizeof(syslinux_path), "%s/syslinux", source_mountpoint);
-    
-    if (is_directory(isolinux_path) || is_directory(syslinux_path)) {
+    if ((isolinux != NULL && S_ISDIR(isolinux->mode)) || (syslinux != NULL && S_ISDIR(syslinux->mode))) {
         return ISO_LINUX;
     }
     
     return ISO_OTHER;
 }
 
-int is_device_busy(const char *device) {
-    char command[MAX_PATH];
+// Where the kernel keeps a block device in sysfs. A partition sits inside its disk there,
+// like .../block/sdb/sdb1
+static int sysfs_block_path(dev_t device, char *path) {
+    char link[64];
+    
+    snprintf(link, sizeof(link), "/sys/dev/block/%u:%u", major(device), minor(device));
+    return realpath(link, path) != NULL ? 0 : -1;
+}
+
+// Is the filesystem mounted from device or from one of its partitions. Matching on device
+// numbers rather than names keeps /dev/sdb1 from matching a mounted /dev/sdb10
+static int mount_uses_device(const MountEntry *entry, dev_t device, const char *device_sysfs) {
+    char path[MAX_PATH];
+    dev_t mounted = entry->device;
+    struct stat st;
+    size_t length;
+    
+    // btrfs and friends report an anonymous device number, the source node has the real one
+    if (major(mounted) == 0 && entry->source[0] == '/' && stat(entry->source, &st) == 0 && S_ISBLK(st.st_mode)) {
+        mounted = st.st_rdev;
+    }
     
-    snprintf(command, sizeof(command), "mount | grep -q '%s'", device);
-    if (run_command(command) == 0) {
-        return 1; //  Device is mounted
+    if (mounted == device) {
+        return 1;
+    }
+    if (device_sysfs[0] == '\0' || major(mounted) == 0 || sysfs_block_path(mounted, path) != 0) {
+        return 0;
     }
     
-    return 0; // Device is not busy
+    length = strlen(device_sysfs);
+    return strncmp(path, device_sysfs, length) == 0 && path[length] == '/';
 }
 
-int unmount_device(const char *device) {
-    char command[MAX_PATH];
-    FILE *pipe;
-    char line[512];
-    int unmounted = 0;
-    
-    // Get all the mount points for this device
-    snprintf(command, sizeof(command), "mount | grep '^%s'", device);
-    pipe = popen(command, "r");
+// The mounts of device and its partitions. Returns -1 if device isn't a block device or the
+// mount table can't be read, nothing can be mounted from it then
+static int device_mounts(const char *device, MountEntry **mounts, size_t *count, dev_t *rdev, char *sysfs) {
+    struct stat st;
     
-    if (pipe == NULL) {
-        log_write(g_log_ctx, LOG_ERROR, "Failed to check mount status for: %s", device);
+    if (stat(device, &st) != 0 || !S_ISBLK(st.st_mode)) {
         return -1;
     }
     
-    // Get each mounted partition
-    while (fgets(line, sizeof(line), pipe) != NULL) {
-        char device_name[MAX_PATH];
-        char mount_point[MAX_PATH];
-        char umount_cmd[MAX_PATH];
-        char *space_pos;
-        char *type_pos;
-        size_t len;
-        
-        if (sscanf(line, "%s on %s", device_name, mount_point) == 2) {
-            space_pos = strstr(line, " on ");
-            if (space_pos != NULL) {
-                space_pos += 4;
-                type_pos = strstr(space_pos, " type ");
-                if (type_pos != NULL) {
-                    len = type_pos - space_pos;
-                    if (len < sizeof(mount_point)) {
-                        strncpy(mount_point, space_pos, len);
-                        mount_point[len] = '\0';
-                    }
-                }
-            }
-            
-            printf("Unmounting %s from %s...\n", device_name, mount_point);
-            log_write(g_log_ctx, LOG_INFO, "Unmounting %s from %s", device_name, mount_point);
-            
-            // Try a normal unmount first
-            snprintf(umount_cmd, sizeof(umount_cmd), "umount '%s' 2>/dev/null", mount_point);
-            if (run_command(umount_cmd) != 0) {
-                // If normal unmount fails, be lazy and try it the other way
-                snprintf(umount_cmd, sizeof(umount_cmd), "umount -l '%s' 2>/dev/null", mount_point);
-                if (run_command(umount_cmd) != 0) {
-                    fprintf(stderr, "Warning: Failed to unmount %s\n", mount_point);
-                    log_write(g_log_ctx, LOG_ERROR, "Failed to unmount: %s", mount_point);
-                    pclose(pipe);
-                    return -1;
-                }
-            }
-            unmounted = 1;
-        }
+    *rdev = st.st_rdev;
+    if (sysfs_block_path(st.st_rdev, sysfs) != 0) {
+        sysfs[0] = '\0';
     }
     
-    pclose(pipe);
+    return mount_table_read(mounts, count);
+}
+
+// Is device, or any partition on it, mounted. Only block devices get mounted, an ISO file
+// never counts as busy
+int is_device_busy(const char *device) {
+    MountEntry *mounts;
+    char sysfs[MAX_PATH];
+    size_t count;
+    size_t i;
+    dev_t rdev;
+    int busy = 0;
+    
+    if (device_mounts(device, &mounts, &count, &rdev, sysfs) != 0) {
+        return 0;
+    }
     
-    if (unmounted) {
-        sleep(1);
+    for (i = 0; i < count && !busy; i++) {
+        busy = mount_uses_device(&mounts[i], rdev, sysfs);
     }
     
-    return 0;
+    mount_table_free(mounts, count);
+    return busy; // 1 if the device is mounted
 }
 
-// Check if the source contains files larger than 4GB
-int check_fat32_limitation(const char *source_mountpoint, FilesystemType *fs_type) {
-    DIR *dir;
-    struct dirent *entry;
-    struct stat st;
-    char full_path[MAX_PATH];
-    
-    dir = opendir(source_mountpoint);
-    if (dir == NULL) {
+int unmount_device(const char *device) {
+    MountEntry *mounts;
+    char sysfs[MAX_PATH];
+    size_t count;
+    size_t i;
+    dev_t rdev;
+    int result = 0;
+    
+    if (device_mounts(device, &mounts, &count, &rdev, sysfs) != 0) {
+        if (is_block_device(device)) {
+            log_write(g_log_ctx, LOG_ERROR, "Failed to check mount status for: %s", device);
+            return -1;
+        }
         return 0;
     }
     
-    while ((entry = readdir(dir)) != NULL) {
-        // Skip . and .. 
-        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
-            continue;
-        }
+    // Last mounted first, so anything mounted inside another mount goes before it
+    for (i = count; i-- > 0 && result == 0;) {
+        const MountEntry *entry = &mounts[i];
+        double started;
         
-        snprintf(full_path, sizeof(full_path), "%s/%s", source_mountpoint, entry->d_name);
-        
-        if (lstat(full_path, &st) != 0) {
+        if (!mount_uses_device(entry, rdev, sysfs)) {
             continue;
         }
         
-        if (S_ISDIR(st.st_mode)) {
-            if (check_fat32_limitation(full_path, fs_type) != 0) {
-                closedir(dir);
-                return 1;
-            }
-        } else if (S_ISREG(st.st_mode)) {
-            // FAT32 max file size is 4GB - 1 byte
-            if (st.st_size > FAT32_MAX_FILESIZE) {
-                log_write(g_log_ctx, LOG_WARNING, "Large file detected (>4GB): %s (%llu bytes)", 
-                          full_path, (unsigned long long)st.st_size);
-                closedir(dir);
-                *fs_type = FS_NTFS; // It's exceeded 4GB; switch to NTFS
-                return 1;
+        printf("Unmounting %s from %s...\n", entry->source, entry->mountpoint);
+        log_write(g_log_ctx, LOG_INFO, "Unmounting %s from %s", entry->source, entry->mountpoint);
+        
+        // Try a normal unmount first
+        started = tune_now();
+        if (umount2(entry->mountpoint, 0) != 0) {
+            // If normal unmount fails, be lazy and detach it, it goes away once nobody uses it
+            log_write(g_log_ctx, LOG_WARNING, "Unmounting %s failed: %s, detaching it lazily",
+                      entry->mountpoint, strerror(errno));
+            if (umount2(entry->mountpoint, MNT_DETACH) != 0) {
+                fprintf(stderr, "Warning: Failed to unmount %s\n", entry->mountpoint);
+                log_write(g_log_ctx, LOG_ERROR, "Failed to unmount: %s - %s", entry->mountpoint, strerror(errno));
+                result = -1;
             }
         }
+        metrics_wait(WAIT_UMOUNT, started);
+    }
+    
+    mount_table_free(mounts, count);
+    return result;
+}
+
+// Check if the source contains files larger than 4GB
+int check_fat32_limitation(const SourceManifest *manifest, FilesystemType *fs_type) {
+    const ManifestEntry *largest;
+    
+    if (manifest->largest < 0) {
+        return 0;
+    }
+    
+    largest = &manifest->entries[manifest->largest];
+    
+    // FAT32 max file size is 4GB - 1 byte
+    if ((unsigned long long)largest->size > FAT32_MAX_FILESIZE) {
+        log_write(g_log_ctx, LOG_WARNING, "Large file detected (>4GB): %s/%s (%llu bytes)", 
+                  manifest->root, largest->path, (unsigned long long)largest->size);
+        *fs_type = FS_NTFS; // It's exceeded 4GB; switch to NTFS
+        return 1;
     }
     
-    closedir(dir);
     return 0;
 }
 
-int check_free_space(const char *source_mountpoint, const char *target_mountpoint, 
-                    const char *target_partition) {
+int check_free_space(const SourceManifest *manifest, const char *target_mountpoint) {
     unsigned long long needed_space;
     unsigned long long free_space;
     unsigned long long additional_space = 10 * 1024 * 1024; // 10MB buffer for edge cases where copy might fail because of insufficient space
     
     // Calculate space needed (source size + buffer)
-    needed_space = get_directory_size(source_mountpoint) + additional_space;
-    free_space = get_free_space(target_mountpoint);
+    needed_space = manifest->total_size + additional_space;
+    
+    // A previous flash on the target gets reused or deleted, so its space counts as free
+    free_space = get_free_space(target_mountpoint) + delta_reclaimable();
     
     if (needed_space > free_space) {
         fprintf(stderr, "Error: Not enough space on target partition\n");
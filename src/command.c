@@ -0,0 +1,334 @@
+/*
+    buf - Command line tool for flashing ISO images onto USB drives.
+    Copyright (C) 2026  Bryson Kelly
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+*/
+
+
+// Running external programs
+// Programs are started straight from an argv array with posix_spawn, no shell in between, so
+// paths with quotes or spaces in them can't break a command. Where a program lives is looked
+// up in PATH once and remembered for the whole run. Every command gets a time limit, is killed
+// when it runs over, and is logged with how long it took
+#define _GNU_SOURCE
+#include "../include/buf.h"
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <spawn.h>
+#include <sys/wait.h>
+
+#define PROGRAM_CACHE_SIZE 64
+#define DEFAULT_PATH "/usr/local/sbin:/usr/local/bin:/usr/sbin:/usr/bin:/sbin:/bin"
+#define KILL_GRACE 2.0  // Seconds between SIGTERM and SIGKILL for a command that ran over
+
+extern char **environ;
+
+typedef struct {
+    char name[64];
+    char path[MAX_PATH];
+    int found;
+} ProgramPath;
+
+// Misses are remembered too, check_dependencies and the GRUB fallbacks ask about the same ones
+static ProgramPath program_cache[PROGRAM_CACHE_SIZE];
+static int program_count;
+static pthread_mutex_t program_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static int search_path(const char *name, char *path, size_t size) {
+    const char *dirs = getenv("PATH");
+    const char *start;
+    const char *end;
+    struct stat st;
+    size_t length;
+    
+    if (dirs == NULL || dirs[0] == '\0') {
+        dirs = DEFAULT_PATH;
+    }
+    
+    for (start = dirs;; start = end + 1) {
+        end = strchr(start, ':');
+        if (end == NULL) {
+            end = start + strlen(start);
+        }
+        length = (size_t)(end - start);
+        
+        // Empty and relative entries would run whatever sits in the current directory as root
+        if (length > 0 && start[0] == '/') {
+            snprintf(path, size, "%.*s/%s", (int)length, start, name);
+            if (stat(path, &st) == 0 && S_ISREG(st.st_mode) && access(path, X_OK) == 0) {
+                return 0;
+            }
+        }
+        
+        if (*end == '\0') {
+            return -1;
+        }
+    }
+}
+
+// Full path of a program, or NULL if it isn't in PATH. Names with a slash are taken as they are
+const char *find_program(const char *name) {
+    ProgramPath *entry = NULL;
+    int i;
+    
+    if (strchr(name, '/') != NULL) {
+        return access(name, X_OK) == 0 ? name : NULL;
+    }
+    
+    pthread_mutex_lock(&program_lock);
+    
+    for (i = 0; i < program_count; i++) {
+        if (strcmp(program_cache[i].name, name) == 0) {
+            entry = &program_cache[i];
+            break;
+        }
+    }
+    
+    // Never happens with the handful of programs buf uses. Other threads may still hold a path
+    // out of any slot, so none can be reused
+    if (entry == NULL && program_count == PROGRAM_CACHE_SIZE) {
+        pthread_mutex_unlock(&program_lock);
+        log_write(g_log_ctx, LOG_ERROR, "Too many different programs looked up, cannot look up %s", name);
+        return NULL;
+    }
+    
+    if (entry == NULL) {
+        entry = &program_cache[program_count++];
+        snprintf(entry->name, sizeof(entry->name), "%s", name);
+        entry->found = search_path(name, entry->path, sizeof(entry->path)) == 0;
+        log_write(g_log_ctx, LOG_INFO, "Program %s: %s", name, entry->found ? entry->path : "not found");
+    }
+    
+    pthread_mutex_unlock(&program_lock);
+    return entry->found ? entry->path : NULL;
+}
+
+// The command as it would be typed, for the log
+static void command_text(const char *const argv[], char *text, size_t size) {
+    size_t used = 0;
+    int i;
+    
+    text[0] = '\0';
+    for (i = 0; argv[i] != NULL && used < size; i++) {
+        used += (size_t)snprintf(text + used, size - used, "%s%s", i > 0 ? " " : "", argv[i]);
+    }
+}
+
+// Read everything the program writes to the pipe, keeping what fits in output. Gives up at
+// the deadline (0 for none), the caller kills the program then
+static void collect_output(int fd, double deadline, char *output, size_t output_size) {
+    struct pollfd poller;
+    char discard[4096];
+    size_t used = 0;
+    ssize_t got;
+    int wait_ms;
+    
+    poller.fd = fd;
+    poller.events = POLLIN;
+    
+    for (;;) {
+        wait_ms = -1;
+        if (deadline > 0) {
+            wait_ms = (int)((deadline - tune_now()) * 1000);
+            if (wait_ms <= 0) {
+                break;
+            }
+        }
+        
+        if (poll(&poller, 1, wait_ms) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            break;
+        }
+        if (poller.revents == 0) {
+            break;
+        }
+        
+        if (used + 1 < output_size) {
+            got = read(fd, output + used, output_size - used - 1);
+        } else {
+            got = read(fd, discard, sizeof(discard));
+        }
+        if (got < 0 && errno == EINTR) {
+            continue;
+        }
+        if (got <= 0) {
+            break;
+        }
+        if (used + 1 < output_size) {
+            used += (size_t)got;
+        }
+    }
+    
+    if (output_size > 0) {
+        output[used] = '\0';
+    }
+}
+
+// Wait for pid to exit, killing it once the deadline passes. Returns 1 if it had to be killed
+static int wait_program(pid_t pid, double deadline, int *status) {
+    struct timespec delay = { 0, 1000000 };
+    double killed = 0;
+    pid_t done;
+    
+    if (deadline <= 0) {
+        while (waitpid(pid, status, 0) < 0) {
+            if (errno != EINTR) {
+                return -1;
+            }
+        }
+        return 0;
+    }
+    
+    // Most commands are done within milliseconds, so start polling fast and back off
+    for (;;) {
+        done = waitpid(pid, status, WNOHANG);
+        if (done == pid) {
+            return killed > 0;
+        }
+        if (done < 0 && errno != EINTR) {
+            return -1;
+        }
+        
+        if (killed == 0 && tune_now() >= deadline) {
+            kill(pid, SIGTERM);
+            killed = tune_now();
+        } else if (killed > 0 && tune_now() - killed >= KILL_GRACE) {
+            kill(pid, SIGKILL);
+            while (waitpid(pid, status, 0) < 0 && errno == EINTR) {
+            }
+            return 1;
+        }
+        
+        nanosleep(&delay, NULL);
+        if (delay.tv_nsec < 50000000) {
+            delay.tv_nsec *= 2;
+        }
+    }
+}
+
+// Start argv[0] with stdin and stderr on /dev/null. stdout goes to out_fd when it's >= 0,
+// into output when that's given, and is left alone otherwise. Returns the exit code, 127
+// when the program doesn't exist and -1 when it couldn't be started or ran out of time
+static int spawn_program(const char *const argv[], int timeout, int out_fd, char *output, size_t output_size) {
+    posix_spawn_file_actions_t actions;
+    posix_spawnattr_t attributes;
+    sigset_t defaults;
+    char text[MAX_PATH * 2];
+    const char *path;
+    double started = tune_now();
+    double deadline = timeout > 0 ? started + timeout : 0;
+    int pipe_fds[2] = { -1, -1 };
+    int status = 0;
+    int waited;
+    int result;
+    pid_t pid;
+    
+    command_text(argv, text, sizeof(text));
+    
+    path = find_program(argv[0]);
+    if (path == NULL) {
+        log_command(g_log_ctx, text, 127, 0);
+        return 127;
+    }
+    
+    if (output != NULL && pipe2(pipe_fds, O_CLOEXEC) != 0) {
+        log_write(g_log_ctx, LOG_ERROR, "Cannot create a pipe for %s: %s", argv[0], strerror(errno));
+        return -1;
+    }
+    
+    posix_spawn_file_actions_init(&actions);
+    posix_spawn_file_actions_addopen(&actions, STDIN_FILENO, "/dev/null", O_RDONLY, 0);
+    posix_spawn_file_actions_addopen(&actions, STDERR_FILENO, "/dev/null", O_WRONLY, 0);
+    if (output != NULL) {
+        posix_spawn_file_actions_adddup2(&actions, pipe_fds[1], STDOUT_FILENO);
+    } else if (out_fd >= 0) {
+        posix_spawn_file_actions_adddup2(&actions, out_fd, STDOUT_FILENO);
+    }
+    
+    // The progress stream ignores SIGPIPE, and ignored signals would carry over into the program
+    posix_spawnattr_init(&attributes);
+    sigemptyset(&defaults);
+    sigaddset(&defaults, SIGPIPE);
+    posix_spawnattr_setsigdefault(&attributes, &defaults);
+    posix_spawnattr_setflags(&attributes, POSIX_SPAWN_SETSIGDEF);
+    
+    result = posix_spawn(&pid, path, &actions, &attributes, (char *const *)argv, environ);
+    
+    posix_spawnattr_destroy(&attributes);
+    posix_spawn_file_actions_destroy(&actions);
+    if (pipe_fds[1] >= 0) {
+        close(pipe_fds[1]);
+    }
+    
+    if (result != 0) {
+        if (pipe_fds[0] >= 0) {
+            close(pipe_fds[0]);
+        }
+        log_write(g_log_ctx, LOG_ERROR, "Cannot start %s: %s", path, strerror(result));
+        return -1;
+    }
+    
+    if (output != NULL) {
+        collect_output(pipe_fds[0], deadline, output, output_size);
+        close(pipe_fds[0]);
+    }
+    
+    waited = wait_program(pid, deadline, &status);
+    
+    if (waited != 0) {
+        result = -1;
+        if (waited > 0) {
+            log_write(g_log_ctx, LOG_ERROR, "Command ran longer than %d seconds and was killed: %s", timeout, text);
+        }
+    } else if (WIFEXITED(status)) {
+        result = WEXITSTATUS(status);
+    } else {
+        result = 128 + WTERMSIG(status);
+    }
+    
+    log_command(g_log_ctx, text, result, tune_now() - started);
+    return result;
+}
+
+// Run a program and wait for it, at most timeout seconds (0 for no limit). Its output goes
+// to the terminal as usual, error messages are dropped. Returns the exit code
+int run_program(const char *const argv[], int timeout) {
+    return spawn_program(argv, timeout, -1, NULL, 0);
+}
+
+// Same, with what the program prints collected in output instead
+int run_program_output(const char *const argv[], int timeout, char *output, size_t output_size) {
+    return spawn_program(argv, timeout, -1, output, output_size);
+}
+
+// Same, with what the program prints written to the file at path
+int run_program_to_file(const char *const argv[], int timeout, const char *path) {
+    int result;
+    int fd;
+    
+    fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        log_write(g_log_ctx, LOG_ERROR, "Cannot create %s: %s", path, strerror(errno));
+        return -1;
+    }
+    
+    result = spawn_program(argv, timeout, fd, NULL, 0);
+    close(fd);
+    return result;
+}
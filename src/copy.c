@@ -18,6 +18,9 @@
 */
 
 
+// sync_file_range() and syncfs() are Linux-only
+#define _GNU_SOURCE
+
 // https://stackoverflow.com/questions/10368305/how-to-test-posix-compatibility
 #ifndef _POSIX_C_SOURCE
 #define _POSIX_C_SOURCE 200809L 
@@ -25,22 +28,88 @@
 
 #include "../include/buf.h"
 #include <sys/sendfile.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/mman.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+
+#define PIPELINE_MAX_DEPTH 16         // Most buffers the buffered copy keeps in flight
+#define COPY_QUEUE_DEPTH 256          // Max files waiting for a worker thread
+#define WRITEBACK_WINDOW (64 * 1024 * 1024) // Start writeback every 64MB in deferred sync mode
+#define DIRECT_ALIGN 4096             // Buffer and length alignment O_DIRECT needs
+#define PROBE_SIZE (16 * 1024 * 1024) // How much auto mode copies to time each engine
+#define ZERO_ALIGN 512                // BLKZEROOUT works in whole sectors
+
+// Progress state is shared between the tree walk and the worker threads
+static _Atomic unsigned long long total_copied = 0; // Bytes copied so far
+static unsigned long long total_size = 0;           // Total size to copy
+static time_t last_update = 0;                      // Last time progress was displayed
+static char current_file[MAX_PATH] = "";            // Currently copying file (for display)
+static pthread_mutex_t progress_lock = PTHREAD_MUTEX_INITIALIZER; // Guards the three above
+
+// A single file waiting to be copied by a worker thread
+typedef struct {
+    char source[MAX_PATH];
+    char target[MAX_PATH];
+    ManifestEntry *entry;
+} CopyJob;
 
-#define BLOCK_SIZE (32 * 1024 * 1024) // 32MB block size
+// Bounded queue that the tree walk fills and the worker threads drain
+typedef struct {
+    CopyJob *jobs;
+    int head;
+    int tail;
+    int count;
+    int closed; // Set once the walk is done, workers exit when the queue runs dry
+    int verbose;
+    pthread_mutex_t lock;
+    pthread_cond_t not_empty;
+    pthread_cond_t not_full;
+} CopyQueue;
 
-static unsigned long long total_copied = 0; // Bytes copied so far
-static unsigned long long total_size = 0;   // Total size to copy
-static time_t last_update = 0;              // Last time progress was displayed
-static char current_file[MAX_PATH] = "";    // Currently copying file (for display)
+// Moves the data of one open file. Returns 0 on success, -1 with errno set on failure.
+// The file starts at src_offset in src_fd, which is only non-zero when it's read out of an image.
+// Engines that see the data feed it to hash on the way through, hash is NULL when nobody wants it
+typedef int (*CopyDataFn)(int src_fd, off_t src_offset, int dst_fd, const struct stat *st, HashState *hash);
+
+// One way of copying file data, selectable with --copy-engine
+typedef struct {
+    const char *name;
+    CopyEngine engine;
+    int open_flags;       // Extra flags for opening the target, e.g. O_DIRECT
+    int user_memory;      // Data passes through user memory, so it can be hashed and written O_DIRECT
+    CopyDataFn copy_data;
+} CopyStrategy;
+
+static const CopyOptions *copy_options = NULL; // Options for the copy in progress
+static const char *source_image = NULL;        // Image files with an extent are read out of
+static _Atomic CopyEngine active_engine = ENGINE_DEFAULT; // Engine in use, auto mode resolves to one
+static CopyQueue *active_queue = NULL; // Non-NULL while running with --jobs > 1
+static atomic_int direct_refused = 0;  // Already warned that the target won't do O_DIRECT
+static atomic_int copy_failed = 0;     // Set by any worker that hits an error
+
+// While copy_image writes a device: runs of zeros are zeroed by the device itself instead
+// of being written, and holes in a sparse source aren't read
+static int image_write = 0;
+static unsigned long long zeroed_bytes = 0;
 
 void print_progress(int verbose) {
     time_t now = time(NULL);
     int percent;
+    unsigned long long copied;
     unsigned long long copied_mb;
     unsigned long long total_mb;
+    char rate[64];
+    
+    // Another thread is already drawing the line, no need to wait for it
+    if (pthread_mutex_trylock(&progress_lock) != 0) {
+        return;
+    }
     
     // Throttle updates to once per-second when not using --verbose flag
     if (!verbose && (now - last_update) < 1) {
+        pthread_mutex_unlock(&progress_lock);
         return;
     }
     
@@ -48,313 +117,1623 @@ void print_progress(int verbose) {
     
     if (total_size > 0) {
         // Calculate and display progress %
-        percent = (int)((total_copied * 100) / total_size);
-        copied_mb = total_copied / (1024 * 1024);
+        copied = atomic_load(&total_copied);
+        percent = (int)((copied * 100) / total_size);
+        copied_mb = copied / (1024 * 1024);
         total_mb = total_size / (1024 * 1024);
         
-        printf("\rCopying: %llu MB / %llu MB (%d%%) - %s", 
-               copied_mb, total_mb, percent, 
+        progress_update("copy", copied, current_file, NULL, 0, rate, sizeof(rate));
+        printf("\rCopying: %llu MB / %llu MB (%d%%)%s - %s", 
+               copied_mb, total_mb, percent, rate,
                current_file[0] ? current_file : "");
         fflush(stdout);
     }
+    
+    pthread_mutex_unlock(&progress_lock);
 }
 
-// Try to copy using sendfile() - zero-copy kernel transfer.
-static int copy_file_sendfile(const char *source, const char *target) {
-    int src_fd, dst_fd;
-    struct stat st;
-    off_t offset = 0;
-    ssize_t bytes_sent;
+// Used by copy engines that live outside this file
+void copy_progress_add(unsigned long long bytes) {
+    atomic_fetch_add(&total_copied, bytes);
+    print_progress(0);
+}
+
+// Per-file durability. With --sync=deferred the data is only pushed towards the device here
+// and copy_filesystem_files() makes it durable with a single syncfs() at the end
+static void sync_target_file(int dst_fd, const char *target) {
+    double started;
     
-    src_fd = open(source, O_RDONLY);
-    if (src_fd < 0) {
-        return -1;
+    if (copy_options != NULL && copy_options->sync == SYNC_DEFERRED) {
+        sync_file_range(dst_fd, 0, 0, SYNC_FILE_RANGE_WRITE);
+        return;
     }
     
-    if (fstat(src_fd, &st) != 0) {
-        close(src_fd);
-        return -1;
+    started = tune_now();
+    if (fsync(dst_fd) != 0) {
+        log_write(g_log_ctx, LOG_WARNING, "fsync failed for: %s", target);
+    }
+    metrics_wait(WAIT_SYNC, started);
+}
+
+// Start writeback on each full window behind us so dirty pages don't pile up until syncfs()
+static void writeback_window(int dst_fd, off_t written, off_t *flushed) {
+    if (copy_options == NULL || copy_options->sync != SYNC_DEFERRED) {
+        return;
     }
     
-    // Don't use sendfile for small files (overhead not worth it)
-    if (st.st_size < 1024 * 1024) {
-        close(src_fd);
-        return -1;
+    if (written - *flushed >= WRITEBACK_WINDOW) {
+        sync_file_range(dst_fd, *flushed, written - *flushed, SYNC_FILE_RANGE_WRITE);
+        *flushed = written;
     }
+}
+
+static void set_current_file(const char *path) {
+    const char *display_name;
     
-    dst_fd = open(target, O_WRONLY | O_CREAT | O_TRUNC, 0644);
-    if (dst_fd < 0) {
-        close(src_fd);
-        return -1;
+    // Truncate long file paths for display
+    display_name = path;
+    if (strlen(path) > 50) {
+        display_name = path + strlen(path) - 50;
     }
     
-    // Advise kernel about access pattern
-    posix_fadvise(src_fd, 0, st.st_size, POSIX_FADV_SEQUENTIAL);
+    pthread_mutex_lock(&progress_lock);
+    strncpy(current_file, display_name, sizeof(current_file) - 1);
+    current_file[sizeof(current_file) - 1] = '\0';
+    pthread_mutex_unlock(&progress_lock);
+}
+
+// Write a whole buffer, handling partial writes
+static int write_all(int fd, const char *buffer, ssize_t length) {
+    ssize_t bytes_written;
+    ssize_t total_written = 0;
     
-    while (offset < st.st_size) {
-        bytes_sent = sendfile(dst_fd, src_fd, &offset, st.st_size - offset);
-        if (bytes_sent <= 0) {
+    while (total_written < length) {
+        bytes_written = write(fd, buffer + total_written, length - total_written);
+        
+        if (bytes_written < 0) {
             if (errno == EINTR) {
                 continue;  // Interrupted, retry
             }
-            if (errno == EINVAL || errno == ENOSYS) {
-                // sendfile not supported for this file type
-                close(src_fd);
-                close(dst_fd);
-                return -1;
-            }
-            // Real error
-            log_write(g_log_ctx, LOG_ERROR, "sendfile failed: %s", strerror(errno));
-            close(src_fd);
-            close(dst_fd);
             return -1;
         }
         
-        total_copied += bytes_sent;
-        print_progress(0);
+        total_written += bytes_written;
     }
     
-    // Sync to disk
-    if (fsync(dst_fd) != 0) {
-        log_write(g_log_ctx, LOG_WARNING, "fsync failed for: %s", target);
+    return 0;
+}
+
+static void warn_direct_refused(void) {
+    if (atomic_exchange(&direct_refused, 1) == 0) {
+        log_write(g_log_ctx, LOG_WARNING, "Target filesystem refused O_DIRECT, writing those files through the page cache");
     }
+}
+
+// Write one block of a copy. O_DIRECT needs aligned lengths, so an unaligned tail is written
+// with O_DIRECT switched off (it's always the last block of the file). Some filesystems take
+// O_DIRECT at open and then refuse the writes, those files carry on through the page cache
+static int write_block(int fd, const char *buffer, ssize_t length, int *direct) {
+    ssize_t aligned;
+    off_t position;
     
-    close(src_fd);
-    close(dst_fd);
+    if (!*direct) {
+        return write_all(fd, buffer, length);
+    }
     
-    struct timespec times[2];
-    times[0].tv_sec = st.st_atime;
-    times[0].tv_nsec = 0;
-    times[1].tv_sec = st.st_mtime;
-    times[1].tv_nsec = 0;
-    utimensat(AT_FDCWD, target, times, 0);
+    aligned = length - (length % DIRECT_ALIGN);
+    position = lseek(fd, 0, SEEK_CUR);
+    if (aligned > 0 && write_all(fd, buffer, aligned) != 0) {
+        if (errno != EINVAL || lseek(fd, position, SEEK_SET) < 0) {
+            return -1;
+        }
+        warn_direct_refused();
+        aligned = 0;
+    }
     
-    chmod(target, st.st_mode);
+    if (aligned < length) {
+        fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_DIRECT);
+        *direct = 0;
+        return write_all(fd, buffer + aligned, length - aligned);
+    }
     
     return 0;
 }
 
-// Copy using aligned buffers
-// This is a fallback for when sendfile doesn't work
-static int copy_file_buffered(const char *source, const char *target) {
-    int src_fd, dst_fd;
-    char *buffer = NULL;
-    ssize_t bytes_read, bytes_written, total_written;
-    struct stat st;
-    int result = 0;
+// Is the whole buffer zero? OR-ing 64 bytes at a time has no branch in the inner loop, so
+// the compiler turns it into vector instructions. Stops at the first non-zero block
+static int buffer_is_zero(const char *buffer, size_t length) {
+    const unsigned char *p = (const unsigned char *)buffer;
+    size_t i = 0;
     
-    src_fd = open(source, O_RDONLY);
-    if (src_fd < 0) {
-        log_write(g_log_ctx, LOG_ERROR, "Failed to open source: %s (%s)", 
-                  source, strerror(errno));
+    // Most data chunks give themselves away in the first few bytes
+    if (length >= 16 && memcmp(p, "\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0", 16) != 0) {
+        return 0;
+    }
+    
+    for (; i + 64 <= length; i += 64) {
+        uint64_t block[8];
+        uint64_t bits = 0;
+        int j;
+        
+        memcpy(block, p + i, sizeof(block));
+        for (j = 0; j < 8; j++) {
+            bits |= block[j];
+        }
+        if (bits != 0) {
+            return 0;
+        }
+    }
+    
+    for (; i < length; i++) {
+        if (p[i] != 0) {
+            return 0;
+        }
+    }
+    
+    return 1;
+}
+
+// Let the device zero a run of zeros instead of sending them over USB. Returns 0 if it did,
+// -1 if the chunk has to be written as usual
+static int zero_block(int fd, const char *buffer, ssize_t length, int known_zero) {
+    uint64_t range[2];
+    off_t position;
+    
+    if (!image_write || length % ZERO_ALIGN != 0 || (!known_zero && !buffer_is_zero(buffer, length))) {
         return -1;
     }
     
-    if (fstat(src_fd, &st) != 0) {
-        log_write(g_log_ctx, LOG_ERROR, "Failed to stat source: %s", source);
-        close(src_fd);
+    position = lseek(fd, 0, SEEK_CUR);
+    if (position < 0 || position % ZERO_ALIGN != 0) {
         return -1;
     }
     
-    dst_fd = open(target, O_WRONLY | O_CREAT | O_TRUNC, 0644);
-    if (dst_fd < 0) {
-        log_write(g_log_ctx, LOG_ERROR, "Failed to open target: %s (%s)", 
-                  target, strerror(errno));
-        close(src_fd);
+    range[0] = (uint64_t)position;
+    range[1] = (uint64_t)length;
+    if (ioctl(fd, BLKZEROOUT, range) != 0) {
+        // Not a block device or the driver can't, don't ask again for this image
+        log_write(g_log_ctx, LOG_INFO, "Device can't zero ranges (%s), writing zeros", strerror(errno));
+        image_write = 0;
         return -1;
     }
     
-    if (posix_memalign((void **)&buffer, 4096, BLOCK_SIZE) != 0) {
-        log_write(g_log_ctx, LOG_ERROR, "Memory allocation failed");
-        close(src_fd);
-        close(dst_fd);
+    if (lseek(fd, position + length, SEEK_SET) < 0) {
         return -1;
     }
     
-    // Advise kernel about our access patterns
-    posix_fadvise(src_fd, 0, st.st_size, POSIX_FADV_SEQUENTIAL);
-    posix_fadvise(dst_fd, 0, 0, POSIX_FADV_DONTNEED);  // Don't cache writes
+    zeroed_bytes += length;
+    return 0;
+}
+
+// Write one chunk of the buffered copy and tell the tuner how long it took. Zero chunks of
+// an image go to the device as a zero-out instead, known_zero when the source had a hole there
+static int write_chunk(int fd, const char *buffer, ssize_t length, int *direct, int known_zero) {
+    double started;
+    
+    if (zero_block(fd, buffer, length, known_zero) == 0) {
+        return 0;
+    }
+    
+    started = tune_now();
+    if (write_block(fd, buffer, length, direct) != 0) {
+        return -1;
+    }
+    
+    tune_record(length, tune_now() - started);
+    return 0;
+}
+
+// Bytes landed on the target, update progress and keep writeback moving
+static void copy_advance(int dst_fd, off_t *written, off_t *flushed, ssize_t bytes) {
+    atomic_fetch_add(&total_copied, bytes);
+    *written += bytes;
+    writeback_window(dst_fd, *written, flushed);
+    print_progress(0);
+}
+
+// copy_file_range() - the kernel moves the data, and reflinks it when both ends share a filesystem
+static int copy_data_range(int src_fd, off_t src_offset, int dst_fd, const struct stat *st, HashState *hash) {
+    off_t offset = src_offset;
+    off_t end = src_offset + st->st_size;
+    off_t written = 0;
+    off_t flushed = 0;
+    ssize_t bytes_copied;
+    size_t chunk;
+    double started;
+    
+    (void)hash; // The data never leaves the kernel
     
-    // Copy data in large blocks
-    while ((bytes_read = read(src_fd, buffer, BLOCK_SIZE)) > 0) {
-        total_written = 0;
+    while (offset < end) {
+        // Copy in blocks so the progress line keeps moving
+        chunk = tune_chunk_size();
+        if ((off_t)chunk > end - offset) {
+            chunk = (size_t)(end - offset);
+        }
+        started = tune_now();
+        bytes_copied = copy_file_range(src_fd, &offset, dst_fd, NULL, chunk, 0);
+        if (bytes_copied < 0) {
+            if (errno == EINTR) {
+                continue;  // Interrupted, retry
+            }
+            return -1;
+        }
+        if (bytes_copied == 0) {
+            errno = ENODATA; // Source got shorter than it was when we started
+            return -1;
+        }
         
-        // Handle partial writes
-        while (total_written < bytes_read) {
-            bytes_written = write(dst_fd, buffer + total_written, 
-                                 bytes_read - total_written);
-            
-            if (bytes_written < 0) {
-                if (errno == EINTR) {
-                    continue;  // Interrupted, retry
-                }
-                log_write(g_log_ctx, LOG_ERROR, "Write failed: %s (%s)", 
-                          target, strerror(errno));
-                result = -1;
-                goto cleanup;
+        tune_record(bytes_copied, tune_now() - started);
+        copy_advance(dst_fd, &written, &flushed, bytes_copied);
+    }
+    
+    return 0;
+}
+
+// sendfile() - zero-copy kernel transfer, in tuned chunks so big files don't freeze the progress line
+static int copy_data_sendfile(int src_fd, off_t src_offset, int dst_fd, const struct stat *st, HashState *hash) {
+    off_t offset = src_offset;
+    off_t end = src_offset + st->st_size;
+    off_t written = 0;
+    off_t flushed = 0;
+    ssize_t bytes_sent;
+    size_t chunk;
+    double started;
+    
+    (void)hash; // The data never leaves the kernel
+    
+    while (offset < end) {
+        chunk = tune_chunk_size();
+        if ((off_t)chunk > end - offset) {
+            chunk = (size_t)(end - offset);
+        }
+        started = tune_now();
+        bytes_sent = sendfile(dst_fd, src_fd, &offset, chunk);
+        if (bytes_sent < 0) {
+            if (errno == EINTR) {
+                continue;  // Interrupted, retry
             }
-            
-            total_written += bytes_written;
+            return -1;
+        }
+        if (bytes_sent == 0) {
+            errno = ENODATA;
+            return -1;
         }
         
-        total_copied += bytes_read;
-        print_progress(0);
+        tune_record(bytes_sent, tune_now() - started);
+        copy_advance(dst_fd, &written, &flushed, bytes_sent);
     }
     
-    if (bytes_read < 0) {
-        log_write(g_log_ctx, LOG_ERROR, "Read failed: %s (%s)", 
-                  source, strerror(errno));
-        result = -1;
-        goto cleanup;
+    return 0;
+}
+
+// Map the source and write straight out of the page cache, skipping the copy into a user buffer
+static int copy_data_mmap(int src_fd, off_t src_offset, int dst_fd, const struct stat *st, HashState *hash) {
+    char *map;
+    char *data;
+    off_t skip = src_offset % sysconf(_SC_PAGESIZE); // Mappings start on a page boundary
+    size_t length = (size_t)(st->st_size + skip);
+    off_t offset = 0;
+    off_t written = 0;
+    off_t flushed = 0;
+    ssize_t chunk;
+    int direct = (fcntl(dst_fd, F_GETFL) & O_DIRECT) != 0;
+    double started;
+    
+    if (st->st_size == 0) {
+        return 0;
     }
     
-    // Force write to disk
-    if (fsync(dst_fd) != 0) {
-        log_write(g_log_ctx, LOG_WARNING, "fsync failed: %s", target);
+    map = mmap(NULL, length, PROT_READ, MAP_PRIVATE, src_fd, src_offset - skip);
+    if (map == MAP_FAILED) {
+        return -1;
     }
+    data = map + skip;
     
-cleanup:
-    free(buffer);
-    close(src_fd);
-    close(dst_fd);
+    madvise(map, length, MADV_SEQUENTIAL);
     
-    if (result == 0) {
-        struct timespec times[2];
-        times[0].tv_sec = st.st_atime;
-        times[0].tv_nsec = 0;
-        times[1].tv_sec = st.st_mtime;
-        times[1].tv_nsec = 0;
-        utimensat(AT_FDCWD, target, times, 0);
+    while (offset < st->st_size) {
+        chunk = (ssize_t)tune_chunk_size();
+        if (chunk > st->st_size - offset) {
+            chunk = (ssize_t)(st->st_size - offset);
+        }
+        started = tune_now();
+        if (write_block(dst_fd, data + offset, chunk, &direct) != 0) {
+            munmap(map, length);
+            return -1;
+        }
         
-        chmod(target, st.st_mode);
-    } else {        // Remove incomplete file on error
-        unlink(target);
+        tune_record(chunk, tune_now() - started);
+        if (hash != NULL) {
+            hash_update(hash, data + offset, chunk);
+        }
+        offset += chunk;
+        copy_advance(dst_fd, &written, &flushed, chunk);
     }
     
-    return result;
+    munmap(map, length);
+    return 0;
 }
 
-int copy_file(const char *source, const char *target) {
-    const char *display_name;
+// Ring of buffers for the buffered copy. The reader thread fills them in turn while the
+// writer drains them in the same order, so the source and the target are both kept busy
+typedef struct {
+    int src_fd;
+    off_t remaining;    // Bytes the reader still has to read
+    int count;          // Buffers in the ring, the tuned depth when the file started
+    size_t capacity;    // Size of each buffer, the tuned chunk can shrink below it mid-file
+    char *buffers[PIPELINE_MAX_DEPTH];
+    ssize_t lengths[PIPELINE_MAX_DEPTH];
+    int full[PIPELINE_MAX_DEPTH]; // Buffer holds data the writer hasn't written yet
+    int done;           // Reader hit end of file or an error
+    int read_error;     // errno from the reader, 0 if it finished cleanly
+    int abort;          // Writer failed, reader should stop
+    HashState *hash;    // Reader hashes each buffer as it fills it, NULL if not hashing
+    int holes;          // Source may be sparse, look for holes instead of reading them
+    int zero[PIPELINE_MAX_DEPTH]; // Buffer came from a hole, it's zeros without checking
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+} CopyPipeline;
+
+// If the reader is sitting in a hole of the source, fill the buffer with zeros up to the
+// next data instead of reading. Returns the bytes filled, 0 to read normally
+static ssize_t pipeline_hole(CopyPipeline *pipe, int index, size_t want) {
+    off_t position = lseek(pipe->src_fd, 0, SEEK_CUR);
+    off_t data;
     
-    // Set current file for progress display
-    display_name = source;
-    if (strlen(source) > 50) {
-        display_name = source + strlen(source) - 50;
+    if (position < 0) {
+        return 0;
     }
-    strncpy(current_file, display_name, sizeof(current_file) - 1);
-    current_file[sizeof(current_file) - 1] = '\0';
     
-    // Try sendfile first
-    if (copy_file_sendfile(source, target) == 0) {
+    data = lseek(pipe->src_fd, position, SEEK_DATA);
+    if (data < 0 && errno != ENXIO) {
+        pipe->holes = 0; // Filesystem doesn't know, stop asking
+        lseek(pipe->src_fd, position, SEEK_SET);
         return 0;
     }
     
-    // Fall back to buffered copy
-    return copy_file_buffered(source, target);
+    if (data == position) {
+        return 0; // In data
+    }
+    
+    // ENXIO means there's only a hole left until the end
+    if (data >= 0 && data - position < (off_t)want) {
+        want = (size_t)(data - position);
+    }
+    
+    memset(pipe->buffers[index], 0, want);
+    lseek(pipe->src_fd, position + (off_t)want, SEEK_SET);
+    pipe->zero[index] = 1;
+    return (ssize_t)want;
 }
 
-// This is for subdirectories
-int copy_directory_recursive(const char *source, const char *target, int verbose) {
-    DIR *dir;
-    struct dirent *entry;
-    struct stat st;
-    char source_path[MAX_PATH];
-    char target_path[MAX_PATH];
-    const char *display_name;
+static void *pipeline_reader(void *arg) {
+    CopyPipeline *pipe = (CopyPipeline *)arg;
+    int index = 0;
+    ssize_t bytes_read;
+    size_t want;
     
-    dir = opendir(source);
-    if (dir == NULL) {
-        fprintf(stderr, "\nError: Failed to open directory: %s - %s\n", source, strerror(errno));
-        log_write(g_log_ctx, LOG_ERROR, "Failed to open directory: %s", source);
-        return -1;
+    for (;;) {
+        // Wait for the writer to hand this buffer back
+        pthread_mutex_lock(&pipe->lock);
+        while (pipe->full[index] && !pipe->abort) {
+            pthread_cond_wait(&pipe->changed, &pipe->lock);
+        }
+        if (pipe->abort) {
+            pthread_mutex_unlock(&pipe->lock);
+            break;
+        }
+        pthread_mutex_unlock(&pipe->lock);
+        
+        want = tune_chunk_size();
+        if (want > pipe->capacity) {
+            want = pipe->capacity;
+        }
+        if ((off_t)want > pipe->remaining) {
+            want = (size_t)pipe->remaining;
+        }
+        bytes_read = 0;
+        pipe->zero[index] = 0;
+        if (want > 0 && pipe->holes) {
+            bytes_read = pipeline_hole(pipe, index, want);
+        }
+        if (want > 0 && bytes_read == 0) {
+            do {
+                bytes_read = read(pipe->src_fd, pipe->buffers[index], want);
+            } while (bytes_read < 0 && errno == EINTR);
+        }
+        
+        // Hash while the data is still hot in the cache, the writer is busy with earlier buffers
+        if (bytes_read > 0 && pipe->hash != NULL) {
+            hash_update(pipe->hash, pipe->buffers[index], bytes_read);
+        }
+        
+        pthread_mutex_lock(&pipe->lock);
+        if (bytes_read <= 0) {
+            pipe->read_error = bytes_read < 0 ? errno : 0;
+            pipe->done = 1;
+            pthread_cond_broadcast(&pipe->changed);
+            pthread_mutex_unlock(&pipe->lock);
+            break;
+        }
+        pipe->remaining -= bytes_read;
+        pipe->lengths[index] = bytes_read;
+        pipe->full[index] = 1;
+        pthread_cond_broadcast(&pipe->changed);
+        pthread_mutex_unlock(&pipe->lock);
+        
+        index = (index + 1) % pipe->count;
     }
     
-    // Create target directory if it doesn't already exist
-    if (!is_directory(target)) {
-        if (make_directory(target) != 0) {
-            fprintf(stderr, "\nError: Failed to create directory: %s - %s\n", target, strerror(errno));
-            log_write(g_log_ctx, LOG_ERROR, "Failed to create directory: %s", target);
-            closedir(dir);
-            return -1;
-        }
+    return NULL;
+}
+
+// Copy using aligned buffers
+// This is the fallback for every other engine.
+// Files bigger than one chunk go through a reader/writer pipeline
+// so the source and the target are both busy at the same time
+static int copy_data_buffered(int src_fd, off_t src_offset, int dst_fd, const struct stat *st, HashState *hash) {
+    char *buffer = NULL;
+    ssize_t bytes_read;
+    off_t remaining = st->st_size;
+    off_t written = 0;
+    off_t flushed = 0;
+    size_t chunk = tune_chunk_size();
+    size_t size;
+    int direct = (fcntl(dst_fd, F_GETFL) & O_DIRECT) != 0;
+    int result = 0;
+    int saved_errno;
+    
+    // Both the pipeline and the small file path read from the current position
+    if (src_offset > 0 && lseek(src_fd, src_offset, SEEK_SET) < 0) {
+        return -1;
     }
     
-    while ((entry = readdir(dir)) != NULL) {
-        // Skip all . and .. entries
-        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
-            continue;
+    if (st->st_size > (off_t)chunk) {
+        CopyPipeline pipe;
+        pthread_t reader;
+        int index = 0;
+        int i;
+        
+        memset(&pipe, 0, sizeof(pipe));
+        pipe.src_fd = src_fd;
+        pipe.remaining = st->st_size;
+        pipe.hash = hash;
+        pipe.holes = image_write;
+        pipe.count = tune_depth();
+        if (pipe.count > PIPELINE_MAX_DEPTH) {
+            pipe.count = PIPELINE_MAX_DEPTH;
         }
         
-        // Build full paths
-        snprintf(source_path, sizeof(source_path), "%s/%s", source, entry->d_name);
-        snprintf(target_path, sizeof(target_path), "%s/%s", target, entry->d_name);
+        // Room for the chunk to grow back later in the file. Pages are only touched as they're used
+        pipe.capacity = tune_chunk_limit(pipe.count);
+        if (pipe.capacity < chunk) {
+            pipe.capacity = chunk;
+        }
         
-        // Get entry metadata
-        if (lstat(source_path, &st) != 0) {
-            fprintf(stderr, "\nWarning: Cannot stat: %s - %s\n", source_path, strerror(errno));
-            log_write(g_log_ctx, LOG_WARNING, "Cannot stat: %s", source_path);
-            continue;
+        if (posix_memalign((void **)&buffer, DIRECT_ALIGN, pipe.capacity * pipe.count) != 0) {
+            errno = ENOMEM;
+            return -1;
+        }
+        for (i = 0; i < pipe.count; i++) {
+            pipe.buffers[i] = buffer + pipe.capacity * i;
+        }
+        pthread_mutex_init(&pipe.lock, NULL);
+        pthread_cond_init(&pipe.changed, NULL);
+        
+        if (pthread_create(&reader, NULL, pipeline_reader, &pipe) != 0) {
+            pthread_cond_destroy(&pipe.changed);
+            pthread_mutex_destroy(&pipe.lock);
+            free(buffer);
+            errno = EAGAIN;
+            return -1;
         }
         
-        if (S_ISDIR(st.st_mode)) {
-            if (copy_directory_recursive(source_path, target_path, verbose) != 0) {
-                closedir(dir);
-                return -1;
+        for (;;) {
+            // Wait for the reader to fill the next buffer
+            pthread_mutex_lock(&pipe.lock);
+            while (!pipe.full[index] && !pipe.done) {
+                pthread_cond_wait(&pipe.changed, &pipe.lock);
+            }
+            if (!pipe.full[index]) {
+                // Reader is done and every buffer it filled has been written
+                pthread_mutex_unlock(&pipe.lock);
+                break;
             }
-        } else if (S_ISREG(st.st_mode)) {
-            // Truncate long file paths for display
-            display_name = source_path;
-            if (strlen(source_path) > 50) {
-                display_name = source_path + strlen(source_path) - 50;
+            bytes_read = pipe.lengths[index];
+            pthread_mutex_unlock(&pipe.lock);
+            
+            if (write_chunk(dst_fd, pipe.buffers[index], bytes_read, &direct, pipe.zero[index]) != 0) {
+                saved_errno = errno;
+                result = -1;
+                
+                pthread_mutex_lock(&pipe.lock);
+                pipe.abort = 1;
+                pthread_cond_broadcast(&pipe.changed);
+                pthread_mutex_unlock(&pipe.lock);
+                break;
             }
-            strncpy(current_file, display_name, sizeof(current_file) - 1);
-            current_file[sizeof(current_file) - 1] = '\0';
             
-            if (verbose) {
-                printf("\nCopying: %s", source_path);
-                fflush(stdout);
+            copy_advance(dst_fd, &written, &flushed, bytes_read);
+            
+            // Hand the buffer back to the reader
+            pthread_mutex_lock(&pipe.lock);
+            pipe.full[index] = 0;
+            pthread_cond_broadcast(&pipe.changed);
+            pthread_mutex_unlock(&pipe.lock);
+            
+            index = (index + 1) % pipe.count;
+        }
+        
+        pthread_join(reader, NULL);
+        pthread_cond_destroy(&pipe.changed);
+        pthread_mutex_destroy(&pipe.lock);
+        
+        if (result == 0 && pipe.read_error != 0) {
+            saved_errno = pipe.read_error;
+            result = -1;
+        }
+        if (result == 0 && pipe.remaining > 0) {
+            saved_errno = ENODATA;
+            result = -1;
+        }
+    } else {
+        // Small file, one read and one write is all it takes. Only allocate what the file needs
+        size = ((size_t)st->st_size + DIRECT_ALIGN - 1) & ~((size_t)DIRECT_ALIGN - 1);
+        if (posix_memalign((void **)&buffer, DIRECT_ALIGN, size > 0 ? size : DIRECT_ALIGN) != 0) {
+            errno = ENOMEM;
+            return -1;
+        }
+        
+        while (remaining > 0) {
+            bytes_read = read(src_fd, buffer, (size_t)remaining);
+            if (bytes_read < 0 && errno == EINTR) {
+                continue;
+            }
+            if (bytes_read <= 0) {
+                saved_errno = bytes_read < 0 ? errno : ENODATA;
+                result = -1;
+                break;
             }
             
-            if (copy_file(source_path, target_path) != 0) {
-                fprintf(stderr, "\nFailed to copy: %s\n", source_path);
-                closedir(dir);
-                return -1;
+            if (write_chunk(dst_fd, buffer, bytes_read, &direct, 0) != 0) {
+                saved_errno = errno;
+                result = -1;
+                break;
             }
             
-            print_progress(verbose);
+            if (hash != NULL) {
+                hash_update(hash, buffer, bytes_read);
+            }
+            remaining -= bytes_read;
+            copy_advance(dst_fd, &written, &flushed, bytes_read);
         }
-        // Skip symlinks, device files, etc.
     }
     
-    closedir(dir);
-    return 0;
+    free(buffer);
+    
+    if (result != 0) {
+        errno = saved_errno;
+    }
+    return result;
 }
 
-int copy_filesystem_files(const char *source, const char *target, int verbose) {
-    // Reset progress tracking
-    total_copied = 0;
-    total_size = get_directory_size(source);
-    last_update = 0;
+// io_uring, keeping several chunks in flight at once. Writes finish out of order, so the
+// writeback windows follow the bytes completed so far rather than a file position
+static int copy_data_uring(int src_fd, off_t src_offset, int dst_fd, const struct stat *st, HashState *hash) {
+    return uring_copy_fd(src_fd, src_offset, dst_fd, st->st_size, hash, writeback_window);
+}
+
+// Every engine --copy-engine can pick. Order is the order auto mode probes them in
+static const CopyStrategy copy_strategies[] = {
+    { "copy_file_range", ENGINE_COPY_RANGE, 0,        0, copy_data_range },
+    { "sendfile",        ENGINE_SENDFILE,   0,        0, copy_data_sendfile },
+    { "mmap",            ENGINE_MMAP,       0,        1, copy_data_mmap },
+    { "buffered",        ENGINE_BUFFERED,   0,        1, copy_data_buffered },
+    { "direct",          ENGINE_DIRECT,     O_DIRECT, 1, copy_data_buffered },
+    { "io_uring",        ENGINE_URING,      0,        1, copy_data_uring },
+    { NULL,              ENGINE_DEFAULT,    0,        0, NULL }
+};
+
+static const CopyStrategy *find_strategy(CopyEngine engine) {
+    int i;
     
-    if (total_size == 0) {
-        fprintf(stderr, "Error: Source directory appears to be empty\n");
-        log_write(g_log_ctx, LOG_ERROR, "Source directory appears to be empty");
-        return -1;
+    for (i = 0; copy_strategies[i].name != NULL; i++) {
+        if (copy_strategies[i].engine == engine) {
+            return &copy_strategies[i];
+        }
     }
     
-    printf("Total size to copy: %llu MB\n", total_size / (1024 * 1024));
-    log_write(g_log_ctx, LOG_INFO, "Total size to copy: %llu MB", total_size / (1024 * 1024));
+    return NULL;
+}
+
+int copy_engine_from_name(const char *name, CopyEngine *engine) {
+    int i;
     
-    if (copy_directory_recursive(source, target, verbose) != 0) {
-        fprintf(stderr, "\nError: File copy failed\n");
-        log_write(g_log_ctx, LOG_ERROR, "File copy operation failed");
-        return -1;
+    if (strcmp(name, "default") == 0) {
+        *engine = ENGINE_DEFAULT;
+        return 0;
     }
     
-    printf("\n");
-    print_colored("File copy complete", "green");
-    log_write(g_log_ctx, LOG_SUCCESS, "File copy completed - %llu MB copied", total_copied / (1024 * 1024));
+    if (strcmp(name, "auto") == 0) {
+        *engine = ENGINE_AUTO;
+        return 0;
+    }
     
-    return 0;
-}
\ No newline at end of file
+    for (i = 0; copy_strategies[i].name != NULL; i++) {
+        if (strcmp(copy_strategies[i].name, name) == 0) {
+            *engine = copy_strategies[i].engine;
+            return 0;
+        }
+    }
+    
+    return -1;
+}
+
+const char *copy_engine_name(CopyEngine engine) {
+    const CopyStrategy *strategy;
+    
+    if (engine == ENGINE_DEFAULT) {
+        return "default";
+    }
+    
+    if (engine == ENGINE_AUTO) {
+        return "auto";
+    }
+    
+    strategy = find_strategy(engine);
+    return strategy != NULL ? strategy->name : "unknown";
+}
+
+// Tell the target filesystem how big the file is going to be before any data arrives,
+// so vfat and ntfs get one contiguous cluster run instead of growing the chain per write.
+// KEEP_SIZE leaves i_size alone, which matters on vfat where a size change zero-fills
+static void preallocate_target(int dst_fd, off_t size, const char *target) {
+    if (size == 0) {
+        return;
+    }
+    
+    if (fallocate(dst_fd, FALLOC_FL_KEEP_SIZE, 0, size) == 0) {
+        return;
+    }
+    
+    // ntfs-3g and other FUSE targets usually don't do fallocate, setting the size still helps them
+    if ((errno == EOPNOTSUPP || errno == ENOSYS) && ftruncate(dst_fd, size) == 0) {
+        return;
+    }
+    
+    if (errno == ENOSPC) {
+        log_write(g_log_ctx, LOG_WARNING, "Not enough space to preallocate: %s", target);
+    }
+}
+
+// Copy one file with the given strategy. Files smaller than min_size are skipped (returns -1
+// without touching the target) and a non-zero limit copies only that many bytes, for probing.
+// On failure the partial target is removed and errno says what went wrong.
+// When the strategy sees the whole file, entry gets the content hash of what was copied.
+// Entries with an extent are read out of the source image rather than opened by path
+static int copy_file_with(const CopyStrategy *strategy, const char *source, const char *target,
+                          off_t min_size, off_t limit, ManifestEntry *entry) {
+    int src_fd, dst_fd;
+    struct stat st;
+    off_t src_offset = 0;
+    HashState state;
+    HashState *hash = NULL;
+    int flags = O_WRONLY | O_CREAT | O_TRUNC | strategy->open_flags;
+    int saved_errno;
+    
+    if (entry != NULL && entry->extent >= 0) {
+        // Every file opens the image for itself, so workers never share a file position
+        src_fd = open(source_image, O_RDONLY);
+        if (src_fd < 0) {
+            return -1;
+        }
+        
+        memset(&st, 0, sizeof(st));
+        st.st_mode = entry->mode;
+        st.st_size = entry->size;
+        st.st_atim = entry->atime;
+        st.st_mtim = entry->mtime;
+        src_offset = entry->extent;
+    } else {
+        src_fd = open(source, O_RDONLY);
+        if (src_fd < 0) {
+            return -1;
+        }
+        
+        if (fstat(src_fd, &st) != 0) {
+            saved_errno = errno;
+            close(src_fd);
+            errno = saved_errno;
+            return -1;
+        }
+    }
+    
+    if (st.st_size < min_size) {
+        close(src_fd);
+        errno = 0;
+        return -1;
+    }
+    
+    if (limit > 0 && st.st_size > limit) {
+        st.st_size = limit;
+    }
+    
+    if (copy_options != NULL && copy_options->direct_io && strategy->user_memory) {
+        flags |= O_DIRECT;
+    }
+    
+    dst_fd = open(target, flags, 0644);
+    if (dst_fd < 0 && errno == EINVAL && (flags & O_DIRECT)) {
+        // Filesystem doesn't do O_DIRECT at all, write this one through the page cache
+        warn_direct_refused();
+        dst_fd = open(target, flags & ~O_DIRECT, 0644);
+    }
+    if (dst_fd < 0) {
+        saved_errno = errno;
+        close(src_fd);
+        errno = saved_errno;
+        return -1;
+    }
+    
+    preallocate_target(dst_fd, st.st_size, target);
+    
+    // Advise kernel about our access patterns
+    posix_fadvise(src_fd, src_offset, st.st_size, POSIX_FADV_SEQUENTIAL);
+    
+    if (entry != NULL && strategy->user_memory && limit == 0) {
+        hash_init(&state);
+        hash = &state;
+    }
+    
+    if (strategy->copy_data(src_fd, src_offset, dst_fd, &st, hash) != 0) {
+        saved_errno = errno;
+        close(src_fd);
+        close(dst_fd);
+        unlink(target); // Remove incomplete file on error
+        errno = saved_errno;
+        return -1;
+    }
+    
+    // Sync to disk
+    sync_target_file(dst_fd, target);
+    
+    // Don't cache writes. Only clean pages can be dropped, so this has to come after the sync
+    posix_fadvise(dst_fd, 0, 0, POSIX_FADV_DONTNEED);
+    
+    close(src_fd);
+    close(dst_fd);
+    
+    struct timespec times[2];
+    times[0].tv_sec = st.st_atime;
+    times[0].tv_nsec = 0;
+    times[1].tv_sec = st.st_mtime;
+    times[1].tv_nsec = 0;
+    utimensat(AT_FDCWD, target, times, 0);
+    
+    chmod(target, st.st_mode);
+    
+    if (hash != NULL) {
+        entry->hash = hash_final(hash);
+        entry->hashed = 1;
+    }
+    
+    return 0;
+}
+
+// sendfile can't write O_DIRECT, so the default chain goes straight to buffered with --direct-io
+static int copy_options_direct(void) {
+    return copy_options != NULL && copy_options->direct_io;
+}
+
+// Something reads the file hashes afterwards: --verify, --checksums or the file manifest
+// in partition mode. Without one there's no point passing the data through user memory
+static int copy_hashes_wanted(void) {
+    return copy_options != NULL && (copy_options->verify || copy_options->checksums[0] != '\0' || delta_active());
+}
+
+// The engine can't work on this source/target pair at all, as opposed to a one-off failure
+static int engine_unsupported(int error) {
+    return error == EXDEV || error == EINVAL || error == ENOSYS || error == EOPNOTSUPP;
+}
+
+int copy_file(const char *source, const char *target, ManifestEntry *entry) {
+    CopyEngine engine = atomic_load(&active_engine);
+    const CopyStrategy *strategy;
+    
+    // Set current file for progress display
+    set_current_file(source);
+    
+    if (engine == ENGINE_DEFAULT) {
+        // Try sendfile first, but not for small files (overhead not worth it). When the hashes
+        // are needed the buffered copy computes them on the way through instead, sendfile would
+        // leave every file to be read a second time
+        if (!copy_options_direct() && !copy_hashes_wanted() &&
+            copy_file_with(find_strategy(ENGINE_SENDFILE), source, target, 1024 * 1024, 0, entry) == 0) {
+            return 0;
+        }
+    } else if (engine != ENGINE_BUFFERED) {
+        strategy = find_strategy(engine);
+        if (strategy != NULL && (engine != ENGINE_URING || uring_available())) {
+            if (copy_file_with(strategy, source, target, 0, 0, entry) == 0) {
+                return 0;
+            }
+            
+            if (engine_unsupported(errno)) {
+                // Don't bother trying it again for every remaining file
+                if (atomic_exchange(&active_engine, ENGINE_DEFAULT) == engine) {
+                    log_write(g_log_ctx, LOG_WARNING, "%s not supported on this target (%s), using default copy", 
+                              strategy->name, strerror(errno));
+                }
+            } else {
+                log_write(g_log_ctx, LOG_WARNING, "%s failed for %s (%s), retrying with buffered copy", 
+                          strategy->name, source, strerror(errno));
+            }
+        }
+    }
+    
+    // Fall back to buffered copy
+    if (copy_file_with(find_strategy(ENGINE_BUFFERED), source, target, 0, 0, entry) != 0) {
+        log_write(g_log_ctx, LOG_ERROR, "Failed to copy: %s -> %s (%s)", 
+                  source, target, strerror(errno));
+        return -1;
+    }
+    
+    return 0;
+}
+
+// Copy a single regular file and report it, used by both the serial walk and the workers
+static int copy_one_file(const char *source_path, const char *target_path, ManifestEntry *entry, int verbose) {
+    if (verbose) {
+        printf("\nCopying: %s", source_path);
+        fflush(stdout);
+    }
+    
+    if (copy_file(source_path, target_path, entry) != 0) {
+        fprintf(stderr, "\nFailed to copy: %s\n", source_path);
+        return -1;
+    }
+    
+    if (entry->hashed) {
+        log_write(g_log_ctx, LOG_INFO, "Copied %s (xxh64 %016llx)", entry->path, (unsigned long long)entry->hash);
+    }
+    
+    journal_add(entry);
+    print_progress(verbose);
+    return 0;
+}
+
+// Hand a file to the worker pool, blocking while the queue is full
+static int queue_push(CopyQueue *queue, const char *source, const char *target, ManifestEntry *entry) {
+    CopyJob *job;
+    
+    pthread_mutex_lock(&queue->lock);
+    while (queue->count == COPY_QUEUE_DEPTH && !atomic_load(&copy_failed)) {
+        pthread_cond_wait(&queue->not_full, &queue->lock);
+    }
+    
+    // A worker failed, stop feeding the pool
+    if (atomic_load(&copy_failed)) {
+        pthread_mutex_unlock(&queue->lock);
+        return -1;
+    }
+    
+    job = &queue->jobs[queue->tail];
+    strncpy(job->source, source, sizeof(job->source) - 1);
+    job->source[sizeof(job->source) - 1] = '\0';
+    strncpy(job->target, target, sizeof(job->target) - 1);
+    job->target[sizeof(job->target) - 1] = '\0';
+    job->entry = entry;
+    
+    queue->tail = (queue->tail + 1) % COPY_QUEUE_DEPTH;
+    queue->count++;
+    
+    pthread_cond_signal(&queue->not_empty);
+    pthread_mutex_unlock(&queue->lock);
+    return 0;
+}
+
+// Take the next file off the queue. Returns -1 once the queue is closed and empty
+static int queue_pop(CopyQueue *queue, CopyJob *job) {
+    pthread_mutex_lock(&queue->lock);
+    while (queue->count == 0 && !queue->closed) {
+        pthread_cond_wait(&queue->not_empty, &queue->lock);
+    }
+    
+    if (queue->count == 0) {
+        pthread_mutex_unlock(&queue->lock);
+        return -1;
+    }
+    
+    *job = queue->jobs[queue->head];
+    queue->head = (queue->head + 1) % COPY_QUEUE_DEPTH;
+    queue->count--;
+    
+    pthread_cond_signal(&queue->not_full);
+    pthread_mutex_unlock(&queue->lock);
+    return 0;
+}
+
+static void queue_close(CopyQueue *queue) {
+    pthread_mutex_lock(&queue->lock);
+    queue->closed = 1;
+    pthread_cond_broadcast(&queue->not_empty);
+    pthread_cond_broadcast(&queue->not_full);
+    pthread_mutex_unlock(&queue->lock);
+}
+
+static void *copy_worker(void *arg) {
+    CopyQueue *queue = (CopyQueue *)arg;
+    CopyJob job;
+    
+    while (queue_pop(queue, &job) == 0) {
+        // Drain whatever is left without copying once something has failed
+        if (atomic_load(&copy_failed)) {
+            continue;
+        }
+        
+        if (copy_one_file(job.source, job.target, job.entry, queue->verbose) != 0) {
+            atomic_store(&copy_failed, 1);
+            
+            // Wake the tree walk if it's waiting for space
+            pthread_mutex_lock(&queue->lock);
+            pthread_cond_broadcast(&queue->not_full);
+            pthread_mutex_unlock(&queue->lock);
+        }
+    }
+    
+    uring_release();
+    return NULL;
+}
+
+// Send a file to the worker pool, or straight to copy_file when there isn't one
+static int dispatch_file(const char *source_path, const char *target_path, ManifestEntry *entry, int verbose) {
+    if (active_queue != NULL) {
+        return queue_push(active_queue, source_path, target_path, entry);
+    }
+    
+    return copy_one_file(source_path, target_path, entry, verbose);
+}
+
+// Create every directory of the manifest under target. Parents come before their children,
+// and each one is made relative to the target fd rather than by its full path
+static int create_directories(const SourceManifest *manifest, const char *target) {
+    int target_fd;
+    size_t i;
+    
+    // Create target directory if it doesn't already exist
+    if (!is_directory(target) && make_directory(target) != 0) {
+        fprintf(stderr, "\nError: Failed to create directory: %s - %s\n", target, strerror(errno));
+        log_write(g_log_ctx, LOG_ERROR, "Failed to create directory: %s", target);
+        return -1;
+    }
+    
+    target_fd = open(target, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (target_fd < 0) {
+        fprintf(stderr, "\nError: Failed to open directory: %s - %s\n", target, strerror(errno));
+        log_write(g_log_ctx, LOG_ERROR, "Failed to open directory: %s", target);
+        return -1;
+    }
+    
+    for (i = 0; i < manifest->count; i++) {
+        if (!S_ISDIR(manifest->entries[i].mode)) {
+            continue;
+        }
+        
+        if (mkdirat(target_fd, manifest->entries[i].path, 0755) != 0 && errno != EEXIST) {
+            fprintf(stderr, "\nError: Failed to create directory: %s/%s - %s\n", target, 
+                    manifest->entries[i].path, strerror(errno));
+            log_write(g_log_ctx, LOG_ERROR, "Failed to create directory: %s/%s", target, manifest->entries[i].path);
+            close(target_fd);
+            return -1;
+        }
+    }
+    
+    close(target_fd);
+    return 0;
+}
+
+// Copy every file in the manifest, in the order asked for with --order
+static int copy_manifest(SourceManifest *manifest, const char *target, int verbose) {
+    ManifestEntry **files;
+    char source_path[MAX_PATH];
+    char target_path[MAX_PATH];
+    size_t count = 0;
+    size_t skipped = 0;
+    size_t i;
+    int result = 0;
+    
+    if (create_directories(manifest, target) != 0) {
+        return -1;
+    }
+    
+    files = (ManifestEntry **)malloc((manifest->file_count + 1) * sizeof(ManifestEntry *));
+    if (files == NULL) {
+        log_write(g_log_ctx, LOG_ERROR, "Memory allocation failed");
+        return -1;
+    }
+    
+    for (i = 0; i < manifest->count; i++) {
+        if (S_ISREG(manifest->entries[i].mode)) {
+            files[count++] = &manifest->entries[i];
+        }
+    }
+    
+    schedule_files(files, count, manifest->root, copy_options->order);
+    
+    for (i = 0; i < count; i++) {
+        snprintf(source_path, sizeof(source_path), "%s/%s", manifest->root, files[i]->path);
+        snprintf(target_path, sizeof(target_path), "%s/%s", target, files[i]->path);
+        
+        // Already on the target, from the last flash or from a run that didn't finish
+        if (files[i]->unchanged || journal_finished(files[i], target_path)) {
+            copy_progress_add(files[i]->size);
+            skipped++;
+            continue;
+        }
+        
+        if (dispatch_file(source_path, target_path, files[i], verbose) != 0) {
+            result = -1;
+            break;
+        }
+    }
+    
+    if (skipped > 0) {
+        log_write(g_log_ctx, LOG_INFO, "Skipped %zu files already on the target", skipped);
+    }
+    
+    free(files);
+    return result;
+}
+
+// Feed the manifest to a pool of workers that copy the files concurrently
+static int copy_manifest_parallel(SourceManifest *manifest, const char *target, int verbose, int jobs) {
+    CopyQueue queue;
+    pthread_t threads[MAX_JOBS];
+    int started = 0;
+    int result;
+    int i;
+    
+    memset(&queue, 0, sizeof(queue));
+    queue.verbose = verbose;
+    queue.jobs = (CopyJob *)malloc(COPY_QUEUE_DEPTH * sizeof(CopyJob));
+    if (queue.jobs == NULL) {
+        log_write(g_log_ctx, LOG_ERROR, "Memory allocation failed");
+        return -1;
+    }
+    
+    pthread_mutex_init(&queue.lock, NULL);
+    pthread_cond_init(&queue.not_empty, NULL);
+    pthread_cond_init(&queue.not_full, NULL);
+    atomic_store(&copy_failed, 0);
+    
+    for (i = 0; i < jobs; i++) {
+        if (pthread_create(&threads[i], NULL, copy_worker, &queue) != 0) {
+            log_write(g_log_ctx, LOG_WARNING, "Failed to start copy worker %d, continuing with %d", i + 1, started);
+            break;
+        }
+        started++;
+    }
+    
+    if (started == 0) {
+        // No workers at all, copy everything on this thread instead
+        result = copy_manifest(manifest, target, verbose);
+    } else {
+        active_queue = &queue;
+        result = copy_manifest(manifest, target, verbose);
+        queue_close(&queue);
+        
+        for (i = 0; i < started; i++) {
+            pthread_join(threads[i], NULL);
+        }
+        active_queue = NULL;
+    }
+    
+    if (atomic_load(&copy_failed)) {
+        result = -1;
+    }
+    
+    pthread_cond_destroy(&queue.not_full);
+    pthread_cond_destroy(&queue.not_empty);
+    pthread_mutex_destroy(&queue.lock);
+    free(queue.jobs);
+    
+    return result;
+}
+
+// Auto mode: copy the start of a real source file to the target with every engine
+// and keep the fastest one. Timing includes fsync so page cache writes don't count
+static CopyEngine probe_copy_engine(SourceManifest *manifest, const char *target) {
+    char probe_source[MAX_PATH];
+    char probe_target[MAX_PATH];
+    off_t probe_size = 0;
+    unsigned long long saved_copied;
+    unsigned long long saved_size;
+    struct timespec start, end;
+    double elapsed;
+    double rate;
+    double best_rate = 0;
+    CopyEngine best = ENGINE_DEFAULT;
+    ManifestEntry *largest = NULL;
+    int fd;
+    int i;
+    
+    // The biggest file is the one most like the bulk of the copy
+    if (manifest->largest >= 0) {
+        largest = &manifest->entries[manifest->largest];
+        probe_size = largest->size;
+        snprintf(probe_source, sizeof(probe_source), "%s/%s", manifest->root, largest->path);
+    }
+    
+    if (probe_size == 0) {
+        log_write(g_log_ctx, LOG_INFO, "No file to probe copy engines with, using default engine");
+        return ENGINE_DEFAULT;
+    }
+    
+    if (probe_size > PROBE_SIZE) {
+        probe_size = PROBE_SIZE;
+    }
+    
+    print_colored("Probing copy engines...", "");
+    log_write(g_log_ctx, LOG_STEP, "Probing copy engines with %lld bytes of %s", 
+              (long long)probe_size, probe_source);
+    
+    snprintf(probe_target, sizeof(probe_target), "%s/.buf-probe", target);
+    saved_copied = atomic_load(&total_copied);
+    saved_size = total_size;
+    total_size = 0; // Keeps print_progress quiet while probing
+    
+    for (i = 0; copy_strategies[i].name != NULL; i++) {
+        if (copy_strategies[i].engine == ENGINE_URING && !uring_available()) {
+            continue;
+        }
+        
+        // Drop the source from the page cache so every engine reads it cold
+        fd = open(largest->extent >= 0 ? manifest->image : probe_source, O_RDONLY);
+        if (fd >= 0) {
+            posix_fadvise(fd, largest->extent >= 0 ? largest->extent : 0, probe_size, POSIX_FADV_DONTNEED);
+            close(fd);
+        }
+        
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        if (copy_file_with(&copy_strategies[i], probe_source, probe_target, 0, probe_size, largest) != 0) {
+            log_write(g_log_ctx, LOG_INFO, "Engine %s: not usable (%s)", 
+                      copy_strategies[i].name, strerror(errno));
+            continue;
+        }
+        
+        fd = open(probe_target, O_RDONLY);
+        if (fd >= 0) {
+            fsync(fd);
+            close(fd);
+        }
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        unlink(probe_target);
+        
+        elapsed = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+        rate = elapsed > 0 ? probe_size / elapsed : 0;
+        log_write(g_log_ctx, LOG_INFO, "Engine %s: %.1f MB/s", copy_strategies[i].name, rate / (1024 * 1024));
+        
+        if (rate > best_rate) {
+            best_rate = rate;
+            best = copy_strategies[i].engine;
+        }
+    }
+    
+    // Probe copies don't count towards the real progress
+    atomic_store(&total_copied, saved_copied);
+    total_size = saved_size;
+    
+    printf("Selected copy engine: %s\n", copy_engine_name(best));
+    log_write(g_log_ctx, LOG_SUCCESS, "Selected copy engine: %s", copy_engine_name(best));
+    return best;
+}
+
+// Flush every dirty page and the metadata of the filesystem that holds target
+static int sync_target_filesystem(const char *target) {
+    double started;
+    int fd;
+    
+    print_colored("\nSyncing target filesystem...", "");
+    log_write(g_log_ctx, LOG_INFO, "Syncing target filesystem: %s", target);
+    
+    fd = open(target, O_RDONLY | O_DIRECTORY);
+    if (fd < 0) {
+        log_write(g_log_ctx, LOG_ERROR, "Failed to open target for sync: %s (%s)", target, strerror(errno));
+        return -1;
+    }
+    
+    started = tune_now();
+    if (syncfs(fd) != 0) {
+        log_write(g_log_ctx, LOG_ERROR, "syncfs failed: %s (%s)", target, strerror(errno));
+        close(fd);
+        return -1;
+    }
+    metrics_wait(WAIT_SYNC, started);
+    
+    close(fd);
+    return 0;
+}
+
+int copy_filesystem_files(SourceManifest *manifest, const char *target, int verbose, const CopyOptions *options) {
+    int result;
+    
+    // Reset progress tracking
+    atomic_store(&total_copied, 0);
+    copy_options = options;
+    source_image = manifest->image;
+    total_size = manifest->total_size;
+    last_update = 0;
+    progress_start(total_size);
+    
+    if (total_size == 0) {
+        fprintf(stderr, "Error: Source directory appears to be empty\n");
+        log_write(g_log_ctx, LOG_ERROR, "Source directory appears to be empty");
+        return -1;
+    }
+    
+    printf("Total size to copy: %llu MB\n", total_size / (1024 * 1024));
+    log_write(g_log_ctx, LOG_INFO, "Total size to copy: %llu MB", total_size / (1024 * 1024));
+    
+    if (options->engine == ENGINE_AUTO) {
+        atomic_store(&active_engine, probe_copy_engine(manifest, target));
+    } else {
+        atomic_store(&active_engine, options->engine);
+    }
+    
+    // After the probe, so its cold one-file writes don't skew where the real copy starts
+    tune_reset(options->jobs);
+    
+    if (delta_plan(manifest, target) != 0) {
+        copy_options = NULL;
+        delta_free();
+        return -1;
+    }
+    
+    journal_open(manifest, target, options->resume, options->sync);
+    
+    if (options->direct_io) {
+        const CopyStrategy *strategy = find_strategy(atomic_load(&active_engine));
+        
+        if (strategy != NULL && !strategy->user_memory) {
+            log_write(g_log_ctx, LOG_WARNING, "--direct-io has no effect with the %s engine", strategy->name);
+        }
+    }
+    
+    if (options->jobs > 1) {
+        log_write(g_log_ctx, LOG_INFO, "Copying with %d worker threads", options->jobs);
+        result = copy_manifest_parallel(manifest, target, verbose, options->jobs);
+    } else {
+        result = copy_manifest(manifest, target, verbose);
+    }
+    
+    uring_release();
+    tune_report();
+    
+    // Deferred mode skipped the per-file fsync, make everything durable in one go
+    if (result == 0 && options->sync == SYNC_DEFERRED) {
+        result = sync_target_filesystem(target);
+    }
+    
+    journal_close(result == 0);
+    
+    // Only once the journal is gone, a stick that fails this must not be resumed from it
+    if (result == 0 && options->verify) {
+        result = verify_target(manifest, target, options->jobs);
+    }
+    
+    copy_options = NULL;
+    
+    if (result != 0) {
+        delta_free();
+        fprintf(stderr, "\nError: File copy failed\n");
+        log_write(g_log_ctx, LOG_ERROR, "File copy operation failed");
+        return -1;
+    }
+    
+    // Neither is fatal, the files themselves are all on the target by now
+    if (options->checksums[0] != '\0') {
+        hash_write_list(manifest, options->checksums);
+    }
+    
+    // If this fails the next flash onto this stick just copies everything
+    delta_save(manifest, target);
+    delta_free();
+    
+    printf("\n");
+    print_colored("File copy complete", "green");
+    log_write(g_log_ctx, LOG_SUCCESS, "File copy completed - %llu MB copied", 
+              atomic_load(&total_copied) / (1024 * 1024));
+    
+    return 0;
+}
+
+// Stream a whole image onto a device, for raw mode. One long sequential write through the
+// buffered pipeline, the device opened O_DIRECT so gigabytes of page cache don't pile up
+// in front of a slow stick. Zero runs and source holes are zeroed out by the device rather
+// than sent to it. hash gets the content hash of everything written
+int copy_image(const char *source, const char *device, const CopyOptions *options, uint64_t *hash) {
+    HashState state;
+    struct stat st;
+    double synced;
+    int src_fd, dst_fd;
+    int result;
+    
+    src_fd = open(source, O_RDONLY | O_CLOEXEC);
+    if (src_fd < 0) {
+        fprintf(stderr, "Error: Cannot open image: %s - %s\n", source, strerror(errno));
+        log_write(g_log_ctx, LOG_ERROR, "Cannot open image: %s - %s", source, strerror(errno));
+        return -1;
+    }
+    
+    // lseek rather than st_size so a block device source works too
+    memset(&st, 0, sizeof(st));
+    st.st_size = lseek(src_fd, 0, SEEK_END);
+    if (st.st_size <= 0 || lseek(src_fd, 0, SEEK_SET) != 0) {
+        fprintf(stderr, "Error: Cannot read image: %s\n", source);
+        log_write(g_log_ctx, LOG_ERROR, "Cannot determine image size: %s", source);
+        close(src_fd);
+        return -1;
+    }
+    
+    dst_fd = open(device, O_WRONLY | O_DIRECT | O_CLOEXEC);
+    if (dst_fd < 0 && errno == EINVAL) {
+        dst_fd = open(device, O_WRONLY | O_CLOEXEC);
+    }
+    if (dst_fd < 0) {
+        fprintf(stderr, "Error: Cannot open device: %s - %s\n", device, strerror(errno));
+        log_write(g_log_ctx, LOG_ERROR, "Cannot open device: %s - %s", device, strerror(errno));
+        close(src_fd);
+        return -1;
+    }
+    
+    // Reset progress tracking
+    atomic_store(&total_copied, 0);
+    copy_options = options;
+    total_size = (unsigned long long)st.st_size;
+    last_update = 0;
+    progress_start(total_size);
+    set_current_file(source);
+    tune_reset(1);
+    
+    printf("Image size: %llu MB\n", total_size / (1024 * 1024));
+    log_write(g_log_ctx, LOG_INFO, "Writing %llu MB image to %s", total_size / (1024 * 1024), device);
+    
+    posix_fadvise(src_fd, 0, st.st_size, POSIX_FADV_SEQUENTIAL);
+    hash_init(&state);
+    image_write = 1;
+    zeroed_bytes = 0;
+    
+    result = copy_data_buffered(src_fd, 0, dst_fd, &st, &state);
+    image_write = 0;
+    if (result != 0) {
+        fprintf(stderr, "\nError: Failed to write image: %s\n", strerror(errno));
+        log_write(g_log_ctx, LOG_ERROR, "Failed to write image to %s: %s", device, strerror(errno));
+    }
+    
+    tune_report();
+    
+    if (zeroed_bytes > 0) {
+        log_write(g_log_ctx, LOG_INFO, "Zeroed %llu MB on the device instead of writing it", zeroed_bytes / (1024 * 1024));
+    }
+    
+    // Raw mode always waits for the device, the stick is only usable once every block is on it
+    synced = tune_now();
+    if (result == 0 && fsync(dst_fd) != 0) {
+        fprintf(stderr, "\nError: Failed to sync device: %s\n", strerror(errno));
+        log_write(g_log_ctx, LOG_ERROR, "Failed to sync %s: %s", device, strerror(errno));
+        result = -1;
+    }
+    metrics_wait(WAIT_SYNC, synced);
+    
+    close(src_fd);
+    close(dst_fd);
+    copy_options = NULL;
+    
+    if (result != 0) {
+        return -1;
+    }
+    
+    *hash = hash_final(&state);
+    printf("\n");
+    log_write(g_log_ctx, LOG_SUCCESS, "Image written - %llu MB", total_size / (1024 * 1024));
+    return 0;
+}
+
+// Start a fresh progress line for writers outside this file that stream files themselves
+void copy_progress_start(unsigned long long total) {
+    atomic_store(&total_copied, 0);
+    copy_options = NULL;
+    total_size = total;
+    last_update = 0;
+    progress_start(total);
+    tune_reset(1);
+}
+
+// Stream one file of the source to dst_fd at its current position, for writers that lay out
+// the target filesystem themselves. Same buffered pipeline as a normal copy, and the entry
+// gets the content hash of what was written
+int copy_entry_to_fd(const SourceManifest *manifest, ManifestEntry *entry, int dst_fd) {
+    char path[MAX_PATH];
+    HashState state;
+    struct stat st;
+    off_t src_offset = 0;
+    int saved_errno;
+    int src_fd;
+    int result;
+    
+    if (entry->extent >= 0) {
+        src_fd = open(manifest->image, O_RDONLY | O_CLOEXEC);
+        src_offset = entry->extent;
+    } else {
+        snprintf(path, sizeof(path), "%s/%s", manifest->root, entry->path);
+        src_fd = open(path, O_RDONLY | O_CLOEXEC);
+    }
+    if (src_fd < 0) {
+        return -1;
+    }
+    
+    memset(&st, 0, sizeof(st));
+    st.st_mode = entry->mode;
+    st.st_size = entry->size;
+    
+    set_current_file(entry->path);
+    posix_fadvise(src_fd, src_offset, st.st_size, POSIX_FADV_SEQUENTIAL);
+    hash_init(&state);
+    
+    result = copy_data_buffered(src_fd, src_offset, dst_fd, &st, &state);
+    saved_errno = errno;
+    close(src_fd);
+    
+    if (result != 0) {
+        errno = saved_errno;
+        return -1;
+    }
+    
+    entry->hash = hash_final(&state);
+    entry->hashed = 1;
+    return 0;
+}
+
+// Fan-out into a mounted target: every file is created under the mountpoint in target->data.
+// The fan-out buffers are aligned, so --direct-io works as for a single target
+static int fanout_begin_mounted(FanoutTarget *target, const ManifestEntry *entry) {
+    char path[MAX_PATH];
+    int flags = O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC;
+    
+    if (copy_options != NULL && copy_options->direct_io) {
+        flags |= O_DIRECT;
+    }
+    
+    snprintf(path, sizeof(path), "%s/%s", (const char *)target->data, entry->path);
+    target->fd = open(path, flags, 0644);
+    if (target->fd < 0 && errno == EINVAL && (flags & O_DIRECT)) {
+        warn_direct_refused();
+        target->fd = open(path, flags & ~O_DIRECT, 0644);
+    }
+    if (target->fd < 0) {
+        return -1;
+    }
+    
+    target->base = 0;
+    target->flushed = 0;
+    preallocate_target(target->fd, entry->size, path);
+    return 0;
+}
+
+// Keep writeback going on each stick while a big file is still being written
+static void fanout_wrote_mounted(FanoutTarget *target, off_t written) {
+    writeback_window(target->fd, written, &target->flushed);
+}
+
+static int fanout_end_mounted(FanoutTarget *target, const ManifestEntry *entry) {
+    char path[MAX_PATH];
+    struct timespec times[2];
+    
+    snprintf(path, sizeof(path), "%s/%s", (const char *)target->data, entry->path);
+    sync_target_file(target->fd, path);
+    posix_fadvise(target->fd, 0, 0, POSIX_FADV_DONTNEED);
+    
+    if (close(target->fd) != 0) {
+        target->fd = -1;
+        return -1;
+    }
+    target->fd = -1;
+    
+    times[0] = entry->atime;
+    times[1] = entry->mtime;
+    utimensat(AT_FDCWD, path, times, 0);
+    chmod(path, entry->mode);
+    return 0;
+}
+
+// Copy the manifest onto several mounted targets at once, reading the source only once.
+// targets name the mountpoints. A target that fails is marked failed and the rest carry on,
+// returns -1 only if the source couldn't be read or none of them made it
+int copy_fanout_mounted(SourceManifest *manifest, FanoutTarget *targets, int count, int verbose, const CopyOptions *options) {
+    ManifestEntry **files;
+    size_t file_count = 0;
+    int alive = 0;
+    int result;
+    size_t i;
+    int t;
+    
+    if (manifest->total_size == 0) {
+        fprintf(stderr, "Error: Source directory appears to be empty\n");
+        log_write(g_log_ctx, LOG_ERROR, "Source directory appears to be empty");
+        return -1;
+    }
+    
+    files = (ManifestEntry **)malloc((manifest->file_count + 1) * sizeof(ManifestEntry *));
+    if (files == NULL) {
+        log_write(g_log_ctx, LOG_ERROR, "Memory allocation failed");
+        return -1;
+    }
+    
+    for (i = 0; i < manifest->count; i++) {
+        if (S_ISREG(manifest->entries[i].mode)) {
+            files[file_count++] = &manifest->entries[i];
+        }
+    }
+    schedule_files(files, file_count, manifest->root, options->order);
+    
+    for (t = 0; t < count; t++) {
+        targets[t].data = (void *)targets[t].name;
+        targets[t].fd = -1;
+        targets[t].pad = 0;
+        targets[t].begin_file = fanout_begin_mounted;
+        targets[t].end_file = fanout_end_mounted;
+        targets[t].wrote = fanout_wrote_mounted;
+        
+        if (!targets[t].failed && create_directories(manifest, targets[t].name) != 0) {
+            targets[t].failed = 1;
+        }
+    }
+    
+    printf("Total size to copy: %llu MB\n", manifest->total_size / (1024 * 1024));
+    copy_options = options;
+    
+    result = fanout_copy(manifest, files, file_count, targets, count, verbose);
+    
+    for (t = 0; t < count; t++) {
+        // A target that failed halfway through a file still has it open
+        if (targets[t].fd >= 0) {
+            close(targets[t].fd);
+            targets[t].fd = -1;
+        }
+        
+        if (result != 0 || targets[t].failed) {
+            continue;
+        }
+        
+        if ((options->sync == SYNC_DEFERRED && sync_target_filesystem(targets[t].name) != 0) ||
+            (options->verify && verify_target(manifest, targets[t].name, options->jobs) != 0)) {
+            fprintf(stderr, "Error: File copy to %s failed\n", targets[t].name);
+            log_write(g_log_ctx, LOG_ERROR, "File copy to %s failed", targets[t].name);
+            targets[t].failed = 1;
+            continue;
+        }
+        
+        // If this fails the next flash onto this stick just copies everything
+        delta_save(manifest, targets[t].name);
+        alive++;
+    }
+    
+    copy_options = NULL;
+    free(files);
+    
+    if (result != 0 || alive == 0) {
+        fprintf(stderr, "\nError: File copy failed\n");
+        log_write(g_log_ctx, LOG_ERROR, "File copy operation failed");
+        return -1;
+    }
+    
+    if (options->checksums[0] != '\0') {
+        hash_write_list(manifest, options->checksums);
+    }
+    
+    printf("\n");
+    print_colored("File copy complete", "green");
+    log_write(g_log_ctx, LOG_SUCCESS, "File copy completed to %d of %d targets - %llu MB each",
+              alive, count, manifest->total_size / (1024 * 1024));
+    return 0;
+}
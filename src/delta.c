@@ -0,0 +1,362 @@
+/*
+    buf - Command line tool for flashing ISO images onto USB drives.
+    Copyright (C) 2026  Bryson Kelly
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+*/
+
+
+// Delta re-flash
+// After a successful flash DELTA_NAME on the target lists each file buf put there with its
+// size, content hash and the modification time it has on the target. Flashing a newer build of the same ISO onto that stick in
+// partition mode then only copies what changed, removes what's gone and leaves the rest alone
+#define _GNU_SOURCE
+#include "../include/buf.h"
+#include <fcntl.h>
+
+#define DELTA_NAME ".buf-manifest"
+#define DELTA_MAGIC "buf-manifest 2"
+
+typedef struct {
+    const char *path;
+    off_t size;
+    uint64_t hash;
+    struct timespec mtime; // Of the copy on the target, anything that touched it since changes this
+} DeltaEntry;
+
+// What the last flash left on the target, sorted by path
+static DeltaEntry *previous = NULL;
+static size_t previous_count = 0;
+static char *previous_text = NULL; // The manifest file, entries point into it
+static unsigned long long previous_size = 0;
+static int delta_loaded = 0; // Partition mode, this flash is compared against the last one
+
+static int compare_delta(const void *a, const void *b) {
+    return strcmp(((const DeltaEntry *)a)->path, ((const DeltaEntry *)b)->path);
+}
+
+static int compare_paths(const void *a, const void *b) {
+    return strcmp((*(const ManifestEntry * const *)a)->path, (*(const ManifestEntry * const *)b)->path);
+}
+
+// Read the manifest a previous flash left on the target. Returns how many files it lists
+int delta_load(const char *target) {
+    char path[MAX_PATH];
+    char *line;
+    char *next;
+    size_t capacity = 0;
+    struct stat st;
+    int fd;
+    
+    delta_free();
+    delta_loaded = 1;
+    snprintf(path, sizeof(path), "%s/%s", target, DELTA_NAME);
+    
+    fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return 0;
+    }
+    
+    if (fstat(fd, &st) != 0 || st.st_size == 0 || (previous_text = (char *)malloc(st.st_size + 1)) == NULL) {
+        close(fd);
+        return 0;
+    }
+    
+    if (read(fd, previous_text, st.st_size) != st.st_size) {
+        close(fd);
+        delta_free();
+        return 0;
+    }
+    previous_text[st.st_size] = '\0';
+    close(fd);
+    
+    next = strchr(previous_text, '\n');
+    if (next == NULL || strncmp(previous_text, DELTA_MAGIC "\n", strlen(DELTA_MAGIC) + 1) != 0) {
+        log_write(g_log_ctx, LOG_WARNING, "Ignoring unrecognised file manifest on target: %s", path);
+        delta_free();
+        return 0;
+    }
+    
+    for (line = next + 1; *line != '\0'; line = next + 1) {
+        unsigned long long hash;
+        long long size;
+        long long seconds;
+        long nanoseconds;
+        int consumed = 0;
+        
+        next = strchr(line, '\n');
+        if (next == NULL) {
+            break;
+        }
+        *next = '\0';
+        
+        if (sscanf(line, "%llx %lld %lld.%ld %n", &hash, &size, &seconds, &nanoseconds, &consumed) != 4 || consumed == 0) {
+            continue;
+        }
+        
+        if (previous_count == capacity) {
+            DeltaEntry *entries;
+            
+            capacity = capacity ? capacity * 2 : 1024;
+            entries = (DeltaEntry *)realloc(previous, capacity * sizeof(DeltaEntry));
+            if (entries == NULL) {
+                delta_free();
+                return 0;
+            }
+            previous = entries;
+        }
+        
+        previous[previous_count].path = line + consumed;
+        previous[previous_count].size = (off_t)size;
+        previous[previous_count].hash = hash;
+        previous[previous_count].mtime.tv_sec = (time_t)seconds;
+        previous[previous_count].mtime.tv_nsec = nanoseconds;
+        previous_size += size;
+        previous_count++;
+    }
+    
+    qsort(previous, previous_count, sizeof(DeltaEntry), compare_delta);
+    log_write(g_log_ctx, LOG_INFO, "Target holds a previous flash: %zu files (%llu MB)",
+              previous_count, previous_size / (1024 * 1024));
+    
+    return (int)previous_count;
+}
+
+// Space the previous flash takes up, all of it is either reused or freed by the delta
+unsigned long long delta_reclaimable(void) {
+    return previous_size;
+}
+
+// Remove a file the new source doesn't have, and any directories that leaves empty
+static void delta_remove(const char *target, const char *relative) {
+    char path[MAX_PATH];
+    char *slash;
+    
+    snprintf(path, sizeof(path), "%s/%s", target, relative);
+    if (unlink(path) != 0 && errno != ENOENT) {
+        log_write(g_log_ctx, LOG_WARNING, "Could not remove stale file: %s - %s", path, strerror(errno));
+        return;
+    }
+    
+    while ((slash = strrchr(path, '/')) != NULL && (size_t)(slash - path) > strlen(target)) {
+        *slash = '\0';
+        if (rmdir(path) != 0) {
+            break;
+        }
+    }
+}
+
+// Compare the source against the previous flash. Identical files are marked unchanged so
+// the copy skips them, files the source no longer has are deleted. Changed and new files
+// are left for the copy to write as usual
+int delta_plan(SourceManifest *manifest, const char *target) {
+    ManifestEntry **files;
+    char path[MAX_PATH];
+    struct stat st;
+    size_t count = 0;
+    size_t unchanged = 0;
+    size_t changed = 0;
+    size_t removed = 0;
+    unsigned long long unchanged_size = 0;
+    size_t i = 0;
+    size_t j = 0;
+    int fd;
+    
+    // From here on the stick no longer matches the old manifest. It has to be gone for good
+    // before anything is written, a flash that dies halfway must not leave it behind. A new
+    // one is only written once this flash has gone through completely
+    snprintf(path, sizeof(path), "%s/%s", target, DELTA_NAME);
+    if (unlink(path) == 0) {
+        fd = open(target, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (fd < 0 || fsync(fd) != 0) {
+            log_write(g_log_ctx, LOG_ERROR, "Could not remove the old file manifest: %s - %s", path, strerror(errno));
+            if (fd >= 0) {
+                close(fd);
+            }
+            return -1;
+        }
+        close(fd);
+    }
+    
+    if (previous_count == 0) {
+        return 0;
+    }
+    
+    files = (ManifestEntry **)malloc((manifest->file_count + 1) * sizeof(ManifestEntry *));
+    if (files == NULL) {
+        log_write(g_log_ctx, LOG_ERROR, "Memory allocation failed");
+        return -1;
+    }
+    
+    for (i = 0; i < manifest->count; i++) {
+        if (S_ISREG(manifest->entries[i].mode)) {
+            files[count++] = &manifest->entries[i];
+        }
+    }
+    qsort(files, count, sizeof(ManifestEntry *), compare_paths);
+    
+    print_colored("Comparing source with the files already on the target...", "");
+    log_write(g_log_ctx, LOG_STEP, "Comparing source with previous flash");
+    
+    // Both lists are sorted by path, walk them side by side
+    i = 0;
+    while (i < count || j < previous_count) {
+        int order;
+        
+        if (i == count) {
+            order = 1;
+        } else if (j == previous_count) {
+            order = -1;
+        } else {
+            order = strcmp(files[i]->path, previous[j].path);
+        }
+        
+        if (order > 0) {
+            // Only on the target, the new build dropped it
+            delta_remove(target, previous[j].path);
+            removed++;
+            j++;
+            continue;
+        }
+        
+        if (order < 0) {
+            i++; // New file
+            continue;
+        }
+        
+        // Same path on both. The copy on the target must still be exactly what the last flash
+        // left there, same size and untouched since. Only then is the source worth hashing
+        snprintf(path, sizeof(path), "%s/%s", target, files[i]->path);
+        if (files[i]->size == previous[j].size && lstat(path, &st) == 0 && S_ISREG(st.st_mode) &&
+            st.st_size == files[i]->size && st.st_mtim.tv_sec == previous[j].mtime.tv_sec &&
+            st.st_mtim.tv_nsec == previous[j].mtime.tv_nsec && hash_entry(manifest, files[i]) == 0 &&
+            files[i]->hash == previous[j].hash) {
+            files[i]->unchanged = 1;
+            unchanged++;
+            unchanged_size += files[i]->size;
+        } else {
+            changed++;
+        }
+        
+        i++;
+        j++;
+    }
+    
+    free(files);
+    
+    log_write(g_log_ctx, LOG_INFO, "Delta: %zu files unchanged (%llu MB), %zu changed, %zu removed",
+              unchanged, unchanged_size / (1024 * 1024), changed, removed);
+    printf("%zu files already up to date, %zu changed, %zu removed\n", unchanged, changed, removed);
+    
+    return 0;
+}
+
+// Record what's on the target now, for the next flash to compare against. Only done when
+// the copy hashed every file along the way, reading the whole source a second time just for
+// this would cost more than the next flash could save
+int delta_save(SourceManifest *manifest, const char *target) {
+    char path[MAX_PATH];
+    char temp_path[MAX_PATH];
+    char file_path[MAX_PATH];
+    struct stat st;
+    FILE *file;
+    size_t i;
+    int fd;
+    
+    for (i = 0; i < manifest->count; i++) {
+        if (S_ISREG(manifest->entries[i].mode) && !manifest->entries[i].hashed) {
+            log_write(g_log_ctx, LOG_INFO, "Not saving file manifest, the copy engine didn't hash %s",
+                      manifest->entries[i].path);
+            return 0;
+        }
+    }
+    
+    // Everything the manifest vouches for has to be on the stick before the manifest is
+    fd = open(target, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0 || syncfs(fd) != 0) {
+        log_write(g_log_ctx, LOG_WARNING, "Not saving file manifest, syncing %s failed: %s", target, strerror(errno));
+        if (fd >= 0) {
+            close(fd);
+        }
+        return -1;
+    }
+    close(fd);
+    
+    snprintf(path, sizeof(path), "%s/%s", target, DELTA_NAME);
+    snprintf(temp_path, sizeof(temp_path), "%s/%s.tmp", target, DELTA_NAME);
+    
+    file = fopen(temp_path, "w");
+    if (file == NULL) {
+        log_write(g_log_ctx, LOG_WARNING, "Could not write file manifest: %s - %s", temp_path, strerror(errno));
+        return -1;
+    }
+    
+    fprintf(file, "%s\n", DELTA_MAGIC);
+    for (i = 0; i < manifest->count; i++) {
+        const ManifestEntry *entry = &manifest->entries[i];
+        
+        if (!S_ISREG(entry->mode) || strchr(entry->path, '\n') != NULL) {
+            continue;
+        }
+        
+        // A file that isn't there as copied is left out, the next flash just copies it again
+        snprintf(file_path, sizeof(file_path), "%s/%s", target, entry->path);
+        if (lstat(file_path, &st) != 0 || !S_ISREG(st.st_mode) || st.st_size != entry->size) {
+            continue;
+        }
+        
+        fprintf(file, "%016llx %lld %lld.%09ld %s\n", (unsigned long long)entry->hash, (long long)entry->size,
+                (long long)st.st_mtim.tv_sec, (long)st.st_mtim.tv_nsec, entry->path);
+    }
+    
+    if (fflush(file) != 0 || fsync(fileno(file)) != 0) {
+        log_write(g_log_ctx, LOG_WARNING, "Could not write file manifest: %s - %s", temp_path, strerror(errno));
+        fclose(file);
+        unlink(temp_path);
+        return -1;
+    }
+    fclose(file);
+    
+    // Swap it in whole, a half written manifest would be worse than none
+    if (rename(temp_path, path) != 0) {
+        log_write(g_log_ctx, LOG_WARNING, "Could not write file manifest: %s - %s", path, strerror(errno));
+        unlink(temp_path);
+        return -1;
+    }
+    
+    fd = open(target, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd >= 0) {
+        fsync(fd);
+        close(fd);
+    }
+    
+    log_write(g_log_ctx, LOG_INFO, "Saved file manifest for next time: %zu files", manifest->file_count);
+    return 0;
+}
+
+// Whether this run keeps a file manifest at all, even when the target had none yet
+int delta_active(void) {
+    return delta_loaded;
+}
+
+void delta_free(void) {
+    free(previous);
+    free(previous_text);
+    previous = NULL;
+    previous_text = NULL;
+    previous_count = 0;
+    previous_size = 0;
+    delta_loaded = 0;
+}
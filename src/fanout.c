@@ -0,0 +1,399 @@
+/*
+    buf - Command line tool for flashing ISO images onto USB drives.
+    Copyright (C) 2026  Bryson Kelly
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+*/
+
+
+// Fan-out copy
+// Flashing one ISO onto several sticks at once. A single reader goes through the source and
+// every chunk it reads is written to all targets by one writer thread per target, so the
+// source is read once however many sticks there are. The reader can only get a few chunks
+// ahead of the slowest stick. A target that fails is dropped and the others carry on
+#define _GNU_SOURCE
+#include "../include/buf.h"
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+#define FANOUT_SLOTS 8                   // Chunks in flight between the reader and the writers
+#define FANOUT_CHUNK (4 * 1024 * 1024)
+#define FANOUT_ALIGN 4096                // Buffer alignment O_DIRECT writes need
+#define FANOUT_SECTOR 512
+
+typedef struct {
+    char *buffer;
+    ManifestEntry *entry;  // File the chunk belongs to
+    off_t offset;          // Where in the file it goes
+    size_t length;
+    int last;              // Last chunk of the file
+    long sequence;         // Which chunk is in the slot, -1 until the first one
+    int pending;           // Writers that haven't written it yet
+} FanoutSlot;
+
+typedef struct {
+    FanoutSlot slots[FANOUT_SLOTS];
+    FanoutTarget *targets;
+    int target_count;
+    long produced;         // Chunks the reader has filled so far
+    int done;              // Reader is finished, produced won't change any more
+    int abort;             // Source failed, everybody stops
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+    unsigned long long total;
+    unsigned long long read;
+    const char *file;      // What the reader is on
+    time_t last_update;
+} Fanout;
+
+typedef struct {
+    Fanout *fanout;
+    FanoutTarget *target;
+} FanoutWriter;
+
+static const char *target_short_name(const FanoutTarget *target) {
+    const char *slash = strrchr(target->name, '/');
+    
+    return slash != NULL ? slash + 1 : target->name;
+}
+
+// One line for all targets, throttled like the single target progress
+static void fanout_progress(Fanout *fanout, int verbose, int final) {
+    time_t now = time(NULL);
+    unsigned long long total = fanout->total > 0 ? fanout->total : 1;
+    unsigned long long slowest = fanout->read;
+    char rate[64];
+    int i;
+    
+    if (!final && !verbose && now - fanout->last_update < 1) {
+        return;
+    }
+    fanout->last_update = now;
+    
+    // The run takes as long as the slowest stick, that's the one the rate and ETA follow
+    for (i = 0; i < fanout->target_count; i++) {
+        if (!atomic_load(&fanout->targets[i].failed) && atomic_load(&fanout->targets[i].written) < slowest) {
+            slowest = atomic_load(&fanout->targets[i].written);
+        }
+    }
+    progress_update("copy", slowest, fanout->file, fanout->targets, fanout->target_count, rate, sizeof(rate));
+    
+    printf("\rCopying: %llu MB / %llu MB (%d%%)%s -", fanout->read / (1024 * 1024), fanout->total / (1024 * 1024),
+           (int)(fanout->read * 100 / total), rate);
+    
+    for (i = 0; i < fanout->target_count; i++) {
+        FanoutTarget *target = &fanout->targets[i];
+        
+        if (atomic_load(&target->failed)) {
+            printf(" %s failed", target_short_name(target));
+        } else {
+            printf(" %s %d%%", target_short_name(target), (int)(atomic_load(&target->written) * 100 / total));
+        }
+    }
+    
+    printf("   ");
+    fflush(stdout);
+}
+
+// Write the whole chunk at position, handling partial writes
+static int fanout_pwrite(FanoutTarget *target, const char *buffer, size_t length, off_t position) {
+    ssize_t written;
+    size_t done = 0;
+    
+    while (done < length) {
+        written = pwrite(target->fd, buffer + done, length - done, position + (off_t)done);
+        if (written < 0 && errno == EINTR) {
+            continue;
+        }
+        if (written < 0 && errno == EINVAL && (fcntl(target->fd, F_GETFL) & O_DIRECT)) {
+            // Device won't do O_DIRECT in this size, the rest goes through the page cache
+            fcntl(target->fd, F_SETFL, fcntl(target->fd, F_GETFL) & ~O_DIRECT);
+            continue;
+        }
+        if (written <= 0) {
+            return -1;
+        }
+        done += (size_t)written;
+    }
+    
+    return 0;
+}
+
+static int fanout_write(FanoutTarget *target, const FanoutSlot *slot) {
+    size_t length = slot->length;
+    
+    if (slot->offset == 0 && target->begin_file(target, slot->entry) != 0) {
+        return -1;
+    }
+    
+    // The reader zero-filled the buffer up to the next sector, targets that allow it get
+    // the tail as a whole sector and their fd can stay O_DIRECT
+    if (slot->last && target->pad) {
+        length = (length + FANOUT_SECTOR - 1) & ~((size_t)FANOUT_SECTOR - 1);
+    }
+    
+    if (length > 0 && fanout_pwrite(target, slot->buffer, length, target->base + slot->offset) != 0) {
+        return -1;
+    }
+    
+    atomic_fetch_add(&target->written, slot->length);
+    
+    if (target->wrote != NULL) {
+        target->wrote(target, slot->offset + (off_t)slot->length);
+    }
+    
+    if (slot->last && target->end_file != NULL && target->end_file(target, slot->entry) != 0) {
+        return -1;
+    }
+    
+    return 0;
+}
+
+static void *fanout_writer(void *arg) {
+    FanoutWriter *writer = (FanoutWriter *)arg;
+    Fanout *fanout = writer->fanout;
+    FanoutTarget *target = writer->target;
+    long sequence;
+    
+    for (sequence = 0;; sequence++) {
+        FanoutSlot *slot = &fanout->slots[sequence % FANOUT_SLOTS];
+        
+        pthread_mutex_lock(&fanout->lock);
+        while (!fanout->abort && slot->sequence != sequence && !(fanout->done && sequence >= fanout->produced)) {
+            pthread_cond_wait(&fanout->changed, &fanout->lock);
+        }
+        if (fanout->abort || slot->sequence != sequence) {
+            pthread_mutex_unlock(&fanout->lock);
+            break;
+        }
+        pthread_mutex_unlock(&fanout->lock);
+        
+        // A failed target keeps taking chunks without writing them, so the others never wait on it
+        if (!atomic_load(&target->failed) && fanout_write(target, slot) != 0) {
+            atomic_store(&target->failed, 1);
+            fprintf(stderr, "\nError: Writing %s to %s failed: %s, carrying on without it\n",
+                    slot->entry->path, target->name, strerror(errno));
+            log_write(g_log_ctx, LOG_ERROR, "Target %s failed on %s: %s", target->name, slot->entry->path, strerror(errno));
+        }
+        
+        pthread_mutex_lock(&fanout->lock);
+        if (--slot->pending == 0) {
+            pthread_cond_broadcast(&fanout->changed);
+        }
+        pthread_mutex_unlock(&fanout->lock);
+    }
+    
+    return NULL;
+}
+
+static int fanout_alive(const Fanout *fanout) {
+    int alive = 0;
+    int i;
+    
+    for (i = 0; i < fanout->target_count; i++) {
+        alive += !atomic_load(&fanout->targets[i].failed);
+    }
+    return alive;
+}
+
+// Read files in order and hand every chunk to the writers. Returns -1 if the source failed
+static int fanout_read(Fanout *fanout, const SourceManifest *manifest, ManifestEntry **files, size_t count, int verbose) {
+    char path[MAX_PATH];
+    HashState state;
+    long sequence = 0;
+    int image_fd = -1;
+    size_t i;
+    
+    if (manifest->image[0] != '\0') {
+        image_fd = open(manifest->image, O_RDONLY | O_CLOEXEC);
+        if (image_fd < 0) {
+            fprintf(stderr, "Error: Cannot open image: %s - %s\n", manifest->image, strerror(errno));
+            log_write(g_log_ctx, LOG_ERROR, "Cannot open image: %s - %s", manifest->image, strerror(errno));
+            return -1;
+        }
+    }
+    
+    for (i = 0; i < count; i++) {
+        ManifestEntry *entry = files[i];
+        off_t start = entry->extent >= 0 ? entry->extent : 0;
+        off_t offset = 0;
+        int fd = image_fd;
+        
+        if (fanout_alive(fanout) == 0) {
+            break;
+        }
+        
+        if (entry->extent < 0) {
+            snprintf(path, sizeof(path), "%s/%s", manifest->root, entry->path);
+            fd = open(path, O_RDONLY | O_CLOEXEC);
+            if (fd < 0) {
+                fprintf(stderr, "\nError: Cannot open %s - %s\n", path, strerror(errno));
+                log_write(g_log_ctx, LOG_ERROR, "Cannot open source file: %s - %s", path, strerror(errno));
+                break;
+            }
+        }
+        
+        posix_fadvise(fd, start, entry->size, POSIX_FADV_SEQUENTIAL);
+        hash_init(&state);
+        fanout->file = entry->path;
+        
+        // Every file takes at least one chunk, even an empty one, so the targets create it
+        do {
+            FanoutSlot *slot = &fanout->slots[sequence % FANOUT_SLOTS];
+            size_t want = entry->size - offset > FANOUT_CHUNK ? FANOUT_CHUNK : (size_t)(entry->size - offset);
+            size_t got = 0;
+            ssize_t bytes = 0;
+            
+            pthread_mutex_lock(&fanout->lock);
+            while (slot->pending > 0) {
+                pthread_cond_wait(&fanout->changed, &fanout->lock);
+            }
+            pthread_mutex_unlock(&fanout->lock);
+            
+            while (got < want) {
+                bytes = pread(fd, slot->buffer + got, want - got, start + offset + (off_t)got);
+                if (bytes < 0 && errno == EINTR) {
+                    continue;
+                }
+                if (bytes <= 0) {
+                    break;
+                }
+                got += (size_t)bytes;
+            }
+            
+            if (got < want) {
+                fprintf(stderr, "\nError: Cannot read %s - %s\n", entry->path, bytes == 0 ? "ended early" : strerror(errno));
+                log_write(g_log_ctx, LOG_ERROR, "Cannot read source file: %s", entry->path);
+                break;
+            }
+            
+            memset(slot->buffer + got, 0, ((got + FANOUT_SECTOR - 1) & ~((size_t)FANOUT_SECTOR - 1)) - got);
+            hash_update(&state, slot->buffer, got);
+            
+            slot->entry = entry;
+            slot->offset = offset;
+            slot->length = got;
+            offset += (off_t)got;
+            slot->last = offset == entry->size;
+            
+            pthread_mutex_lock(&fanout->lock);
+            slot->pending = fanout->target_count;
+            slot->sequence = sequence++;
+            fanout->produced = sequence;
+            pthread_cond_broadcast(&fanout->changed);
+            pthread_mutex_unlock(&fanout->lock);
+            
+            fanout->read += got;
+            fanout_progress(fanout, verbose, 0);
+        } while (offset < entry->size);
+        
+        if (fd != image_fd) {
+            close(fd);
+        }
+        if (offset < entry->size) {
+            break;
+        }
+        
+        entry->hash = hash_final(&state);
+        entry->hashed = 1;
+    }
+    
+    if (image_fd >= 0) {
+        close(image_fd);
+    }
+    
+    return i == count ? 0 : -1;
+}
+
+// Copy files, in the order given, onto every target. Returns -1 when the source couldn't be
+// read or no target is left, otherwise each target's failed flag says how it went
+int fanout_copy(const SourceManifest *manifest, ManifestEntry **files, size_t count,
+                FanoutTarget *targets, int target_count, int verbose) {
+    Fanout fanout;
+    FanoutWriter writers[MAX_TARGETS];
+    pthread_t threads[MAX_TARGETS];
+    char *buffers;
+    int started = 0;
+    int result;
+    size_t i;
+    int t;
+    
+    memset(&fanout, 0, sizeof(fanout));
+    fanout.targets = targets;
+    fanout.target_count = target_count;
+    for (i = 0; i < count; i++) {
+        fanout.total += (unsigned long long)files[i]->size;
+    }
+    progress_start(fanout.total);
+    
+    if (posix_memalign((void **)&buffers, FANOUT_ALIGN, (size_t)FANOUT_CHUNK * FANOUT_SLOTS) != 0) {
+        fprintf(stderr, "Error: Out of memory\n");
+        log_write(g_log_ctx, LOG_ERROR, "Out of memory for fan-out buffers");
+        return -1;
+    }
+    for (i = 0; i < FANOUT_SLOTS; i++) {
+        fanout.slots[i].buffer = buffers + (size_t)FANOUT_CHUNK * i;
+        fanout.slots[i].sequence = -1;
+    }
+    pthread_mutex_init(&fanout.lock, NULL);
+    pthread_cond_init(&fanout.changed, NULL);
+    
+    for (t = 0; t < target_count; t++) {
+        atomic_store(&targets[t].written, 0);
+        writers[t].fanout = &fanout;
+        writers[t].target = &targets[t];
+        if (pthread_create(&threads[t], NULL, fanout_writer, &writers[t]) != 0) {
+            break;
+        }
+        started++;
+    }
+    
+    log_write(g_log_ctx, LOG_INFO, "Fan-out copy of %zu files (%llu MB) to %d targets",
+              count, fanout.total / (1024 * 1024), target_count);
+    
+    if (started < target_count) {
+        fprintf(stderr, "Error: Cannot start writer threads\n");
+        log_write(g_log_ctx, LOG_ERROR, "Started only %d of %d writer threads", started, target_count);
+        result = -1;
+    } else {
+        result = fanout_read(&fanout, manifest, files, count, verbose);
+    }
+    
+    pthread_mutex_lock(&fanout.lock);
+    fanout.done = 1;
+    fanout.abort = result != 0;
+    pthread_cond_broadcast(&fanout.changed);
+    pthread_mutex_unlock(&fanout.lock);
+    
+    for (t = 0; t < started; t++) {
+        pthread_join(threads[t], NULL);
+    }
+    
+    fanout_progress(&fanout, verbose, 1);
+    printf("\n");
+    
+    pthread_cond_destroy(&fanout.changed);
+    pthread_mutex_destroy(&fanout.lock);
+    free(buffers);
+    
+    if (fanout_alive(&fanout) == 0) {
+        fprintf(stderr, "Error: Every target failed\n");
+        log_write(g_log_ctx, LOG_ERROR, "Every target failed");
+        result = -1;
+    }
+    
+    return result;
+}
@@ -0,0 +1,1331 @@
+/*
+    buf - Command line tool for flashing ISO images onto USB drives.
+    Copyright (C) 2026  Bryson Kelly
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+*/
+
+
+// Native FAT32 writer
+// mkfs.vfat and a copy through the vfat driver make the kernel jump between the FAT, the
+// directories and the file data for every file it writes. All of that is known up front from
+// the manifest, so buf lays the filesystem out itself: boot sector, both FATs and every
+// directory in memory, each file in one contiguous run of clusters. Then the partition is
+// written once from front to back and nothing gets mounted
+#define _GNU_SOURCE
+#include "../include/buf.h"
+#include <fcntl.h>
+#include <pthread.h>
+
+#define SECTOR_SIZE 512
+#define MIN_RESERVED_SECTORS 32
+#define DATA_ALIGN_SECTORS 2048        // Data region starts on a 1MB boundary, flash erase blocks line up
+#define FSINFO_SECTOR 1
+#define BACKUP_BOOT_SECTOR 6
+#define ROOT_CLUSTER 2
+#define FAT_MIN_CLUSTERS 65525         // Any fewer and it's FAT16, whatever the boot sector says
+#define FAT_MAX_CLUSTERS 0x0FFFFFF5
+#define FAT_END 0x0FFFFFFF
+#define FAT_CHUNK (4 * 1024 * 1024)    // FATs are generated and written in pieces this big
+#define WRITE_ALIGN 4096               // Buffer alignment O_DIRECT writes need
+
+#define DIR_ENTRY_SIZE 32
+#define MAX_DIR_ENTRIES 65536          // FAT directories can't be any bigger
+#define LFN_CHARS 13                   // UTF-16 characters per long name entry
+#define LFN_MAX 255
+#define ATTR_VOLUME_ID 0x08
+#define ATTR_DIRECTORY 0x10
+#define ATTR_ARCHIVE 0x20
+#define ATTR_LFN 0x0F
+#define CASE_LOWER_BASE 0x08           // Windows NT flags for an all lowercase short name,
+#define CASE_LOWER_EXT 0x10            // saves the long name entries for names like "boot"
+
+// Where one manifest entry ends up on the partition
+typedef struct {
+    unsigned char short_name[11];
+    unsigned char case_flags;
+    unsigned char slots;    // Directory entries it takes, long name entries included
+    unsigned char needs_lfn;
+    uint32_t parent;        // Index into FatLayout.dirs
+    uint32_t cluster;       // First cluster, 0 for an empty file
+    uint32_t clusters;
+} FatNode;
+
+typedef struct {
+    SourceManifest *manifest;
+    FatNode *nodes;             // One per manifest entry
+    long *dirs;                 // Manifest index of every directory, -1 for the root
+    uint32_t *dir_slots;        // Directory entries each directory holds
+    size_t dir_count;
+    uint32_t root_cluster;
+    uint32_t root_clusters;
+    unsigned char label[11];
+    
+    uint64_t total_sectors;
+    uint32_t hidden_sectors;    // Where the partition starts on the device
+    uint32_t sectors_per_cluster;
+    uint32_t cluster_size;
+    uint32_t reserved_sectors;
+    uint32_t fat_sectors;
+    uint32_t cluster_count;
+    uint32_t next_cluster;      // First cluster nothing was allocated to
+    off_t data_offset;          // Byte offset of cluster 2
+    unsigned char *run_end;     // Bit per cluster, set on the last cluster of each chain
+} FatLayout;
+
+static void put16(unsigned char *p, uint32_t value) {
+    p[0] = value & 0xFF;
+    p[1] = (value >> 8) & 0xFF;
+}
+
+static void put32(unsigned char *p, uint32_t value) {
+    put16(p, value & 0xFFFF);
+    put16(p + 2, value >> 16);
+}
+
+// Sectors per cluster, same table Windows and mkfs.fat use for FAT32
+static uint32_t fat_cluster_sectors(uint64_t sectors) {
+    if (sectors <= 532480) {
+        return 1;   // Up to 260MB
+    }
+    if (sectors <= 16777216) {
+        return 8;   // Up to 8GB
+    }
+    if (sectors <= 33554432) {
+        return 16;  // Up to 16GB
+    }
+    if (sectors <= 67108864) {
+        return 32;  // Up to 32GB
+    }
+    return 64;
+}
+
+// Where the partition starts, the boot sector carries it as hidden sectors. 0 for a whole device
+static uint32_t partition_start(const char *partition) {
+    char resolved[MAX_PATH];
+    char path[MAX_PATH];
+    unsigned long long start = 0;
+    const char *name;
+    FILE *file;
+    
+    if (realpath(partition, resolved) == NULL) {
+        return 0;
+    }
+    
+    name = strrchr(resolved, '/');
+    snprintf(path, sizeof(path), "/sys/class/block/%s/start", name != NULL ? name + 1 : resolved);
+    
+    file = fopen(path, "r");
+    if (file == NULL) {
+        return 0;
+    }
+    if (fscanf(file, "%llu", &start) != 1 || start > 0xFFFFFFFFULL) {
+        start = 0;
+    }
+    fclose(file);
+    
+    return (uint32_t)start;
+}
+
+// Work out the FAT size and where the data region starts for a partition of size bytes
+static int fat_geometry(FatLayout *layout, off_t size) {
+    uint64_t data_start;
+    uint64_t per_fat;
+    uint64_t clusters;
+    uint32_t misalign;
+    
+    layout->total_sectors = (uint64_t)size / SECTOR_SIZE;
+    if (layout->total_sectors > 0xFFFFFFFFULL) {
+        fprintf(stderr, "Error: Partition is too big for FAT32 (%lld GB)\n", (long long)size / (1024LL * 1024 * 1024));
+        log_write(g_log_ctx, LOG_ERROR, "Partition has %llu sectors, more than FAT32 can address",
+                  (unsigned long long)layout->total_sectors);
+        return -1;
+    }
+    
+    layout->sectors_per_cluster = fat_cluster_sectors(layout->total_sectors);
+    layout->cluster_size = layout->sectors_per_cluster * SECTOR_SIZE;
+    
+    // Microsoft's formula, a slight overestimate of the FAT size for the clusters that fit
+    per_fat = (256ULL * layout->sectors_per_cluster + 2) / 2;
+    layout->fat_sectors = (uint32_t)((layout->total_sectors - MIN_RESERVED_SECTORS + per_fat - 1) / per_fat);
+    
+    // Pad the reserved sectors so the data region, and so every cluster, is aligned on the device
+    layout->reserved_sectors = MIN_RESERVED_SECTORS;
+    data_start = layout->reserved_sectors + 2ULL * layout->fat_sectors;
+    misalign = (uint32_t)((layout->hidden_sectors + data_start) % DATA_ALIGN_SECTORS);
+    if (misalign != 0) {
+        layout->reserved_sectors += DATA_ALIGN_SECTORS - misalign;
+        data_start += DATA_ALIGN_SECTORS - misalign;
+    }
+    
+    clusters = data_start < layout->total_sectors ? (layout->total_sectors - data_start) / layout->sectors_per_cluster : 0;
+    if (clusters > FAT_MAX_CLUSTERS - 2) {
+        clusters = FAT_MAX_CLUSTERS - 2;
+    }
+    if (clusters > (uint64_t)layout->fat_sectors * (SECTOR_SIZE / 4) - 2) {
+        clusters = (uint64_t)layout->fat_sectors * (SECTOR_SIZE / 4) - 2;
+    }
+    
+    if (clusters < FAT_MIN_CLUSTERS) {
+        fprintf(stderr, "Error: Partition is too small for FAT32 (%lld MB)\n", (long long)size / (1024 * 1024));
+        log_write(g_log_ctx, LOG_ERROR, "Only room for %llu clusters, FAT32 needs %d",
+                  (unsigned long long)clusters, FAT_MIN_CLUSTERS);
+        return -1;
+    }
+    
+    layout->cluster_count = (uint32_t)clusters;
+    layout->data_offset = (off_t)data_start * SECTOR_SIZE;
+    
+    log_write(g_log_ctx, LOG_INFO, "FAT32 layout: %u byte clusters, %u clusters, %u sectors per FAT, data at sector %llu",
+              layout->cluster_size, layout->cluster_count, layout->fat_sectors, (unsigned long long)data_start);
+    return 0;
+}
+
+// Characters a short name can hold besides letters and digits
+static int short_name_char(unsigned char c) {
+    return (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') || (c != '\0' && strchr("$%'-_@~`!(){}^#&", c) != NULL);
+}
+
+// One case throughout, so the NT case flags can describe it. Returns the flag, or -1 if mixed
+static int short_part_case(const char *part, size_t length, unsigned char lower_flag) {
+    int upper = 0;
+    int lower = 0;
+    size_t i;
+    
+    for (i = 0; i < length; i++) {
+        unsigned char c = (unsigned char)part[i];
+        
+        if (c >= 'a' && c <= 'z') {
+            lower = 1;
+            c = (unsigned char)toupper(c);
+        } else if (c >= 'A' && c <= 'Z') {
+            upper = 1;
+        }
+        if (!short_name_char(c)) {
+            return -1;
+        }
+    }
+    
+    if (upper && lower) {
+        return -1;
+    }
+    return lower ? lower_flag : 0;
+}
+
+// Can name be stored as a plain 8.3 short name, with no long name entries?
+static int short_name_exact(const char *name, FatNode *node) {
+    const char *dot = strrchr(name, '.');
+    size_t base_length = dot != NULL ? (size_t)(dot - name) : strlen(name);
+    size_t ext_length = dot != NULL ? strlen(dot + 1) : 0;
+    int base_case, ext_case;
+    size_t i;
+    
+    if (base_length == 0 || base_length > 8 || ext_length > 3 || (dot != NULL && ext_length == 0)) {
+        return 0;
+    }
+    
+    base_case = short_part_case(name, base_length, CASE_LOWER_BASE);
+    ext_case = short_part_case(dot != NULL ? dot + 1 : "", ext_length, CASE_LOWER_EXT);
+    if (base_case < 0 || ext_case < 0) {
+        return 0;
+    }
+    
+    memset(node->short_name, ' ', sizeof(node->short_name));
+    for (i = 0; i < base_length; i++) {
+        node->short_name[i] = (unsigned char)toupper((unsigned char)name[i]);
+    }
+    for (i = 0; i < ext_length; i++) {
+        node->short_name[8 + i] = (unsigned char)toupper((unsigned char)dot[1 + i]);
+    }
+    
+    // A name starting with 0xE5 would read as deleted, 0x05 stands in for it
+    if (node->short_name[0] == 0xE5) {
+        node->short_name[0] = 0x05;
+    }
+    
+    node->case_flags = (unsigned char)(base_case | ext_case);
+    return 1;
+}
+
+// Short name of a file that also gets a long name: the long name squeezed into 8.3 with a ~N tail
+static void short_name_generate(const char *name, unsigned long number, FatNode *node) {
+    unsigned char base[8];
+    unsigned char ext[3];
+    char tail[16];
+    const char *dot = strrchr(name, '.');
+    const unsigned char *p = (const unsigned char *)name;
+    size_t base_length = 0;
+    size_t ext_length = 0;
+    size_t tail_length;
+    size_t keep;
+    
+    if (dot == name) {
+        dot = NULL; // A hidden file like ".disk" has no extension
+    }
+    
+    while (*p == '.' || *p == ' ') {
+        p++;
+    }
+    
+    for (; *p != '\0' && (dot == NULL || p < (const unsigned char *)dot); p++) {
+        unsigned char c = (unsigned char)toupper(*p);
+        
+        if (c == ' ' || c == '.' || (c >= 0x80 && c < 0xC0)) {
+            continue; // Spaces, dots and UTF-8 continuation bytes don't take a character
+        }
+        if (base_length < sizeof(base)) {
+            base[base_length++] = short_name_char(c) ? c : '_';
+        }
+    }
+    
+    if (dot != NULL) {
+        for (p = (const unsigned char *)dot + 1; *p != '\0' && ext_length < sizeof(ext); p++) {
+            unsigned char c = (unsigned char)toupper(*p);
+            
+            if (c == ' ' || (c >= 0x80 && c < 0xC0)) {
+                continue;
+            }
+            ext[ext_length++] = short_name_char(c) ? c : '_';
+        }
+    }
+    
+    if (base_length == 0) {
+        base[base_length++] = '_';
+    }
+    
+    tail_length = (size_t)snprintf(tail, sizeof(tail), "~%lu", number);
+    keep = base_length + tail_length > 8 ? 8 - tail_length : base_length;
+    
+    memset(node->short_name, ' ', sizeof(node->short_name));
+    memcpy(node->short_name, base, keep);
+    memcpy(node->short_name + keep, tail, tail_length);
+    memcpy(node->short_name + 8, ext, ext_length);
+    node->case_flags = 0;
+}
+
+// Short names have to be unique within their directory. Open addressing over the node
+// indexes, keyed by parent directory and name
+typedef struct {
+    size_t *slots; // Node index + 1, 0 when empty
+    size_t capacity;
+    const FatNode *nodes;
+} ShortNameSet;
+
+static size_t short_name_hash(uint32_t parent, const unsigned char *name) {
+    uint64_t hash = 0xCBF29CE484222325ULL ^ parent;
+    int i;
+    
+    for (i = 0; i < 11; i++) {
+        hash = (hash ^ name[i]) * 0x100000001B3ULL;
+    }
+    return (size_t)hash;
+}
+
+// Add a node's short name, 0 if its directory already has that name
+static int short_name_insert(ShortNameSet *set, size_t index) {
+    const FatNode *node = &set->nodes[index];
+    size_t slot = short_name_hash(node->parent, node->short_name) & (set->capacity - 1);
+    
+    while (set->slots[slot] != 0) {
+        const FatNode *other = &set->nodes[set->slots[slot] - 1];
+        
+        if (other->parent == node->parent && memcmp(other->short_name, node->short_name, 11) == 0) {
+            return 0;
+        }
+        slot = (slot + 1) & (set->capacity - 1);
+    }
+    
+    set->slots[slot] = index + 1;
+    return 1;
+}
+
+// Decode the next UTF-8 character. Bytes that aren't valid UTF-8 are taken as Latin-1
+static uint32_t utf8_next(const unsigned char **p) {
+    const unsigned char *s = *p;
+    uint32_t c = s[0];
+    int extra = 0;
+    int i;
+    
+    if (c >= 0xF0 && c < 0xF5) {
+        extra = 3;
+        c &= 0x07;
+    } else if (c >= 0xE0) {
+        extra = c < 0xF0 ? 2 : 0;
+        c &= 0x0F;
+    } else if (c >= 0xC2) {
+        extra = 1;
+        c &= 0x1F;
+    }
+    
+    for (i = 1; i <= extra; i++) {
+        if ((s[i] & 0xC0) != 0x80) {
+            *p = s + 1;
+            return s[0];
+        }
+        c = (c << 6) | (s[i] & 0x3F);
+    }
+    
+    if (extra == 0) {
+        c = s[0];
+    }
+    *p = s + 1 + extra;
+    return c;
+}
+
+// Long names are stored as UTF-16. Returns how many units name takes, -1 if it's too long
+static int utf16_encode(const char *name, uint16_t *out) {
+    const unsigned char *p = (const unsigned char *)name;
+    int length = 0;
+    
+    while (*p != '\0') {
+        uint32_t c = utf8_next(&p);
+        
+        if (c >= 0x10000) {
+            if (length + 2 > LFN_MAX) {
+                return -1;
+            }
+            c -= 0x10000;
+            out[length++] = (uint16_t)(0xD800 | (c >> 10));
+            out[length++] = (uint16_t)(0xDC00 | (c & 0x3FF));
+        } else {
+            if (length + 1 > LFN_MAX) {
+                return -1;
+            }
+            out[length++] = (uint16_t)c;
+        }
+    }
+    
+    return length;
+}
+
+static const char *entry_name(const ManifestEntry *entry) {
+    const char *slash = strrchr(entry->path, '/');
+    
+    return slash != NULL ? slash + 1 : entry->path;
+}
+
+static size_t path_hash(const char *path, size_t length) {
+    uint64_t hash = 0xCBF29CE484222325ULL;
+    size_t i;
+    
+    for (i = 0; i < length; i++) {
+        hash = (hash ^ (unsigned char)path[i]) * 0x100000001B3ULL;
+    }
+    return (size_t)hash;
+}
+
+// Find every entry's directory. Directories are looked up by path, a directory's contents
+// come in one block so that only happens when the parent changes
+static int fat_assign_parents(FatLayout *layout) {
+    SourceManifest *manifest = layout->manifest;
+    size_t capacity = 64;
+    size_t *table;
+    size_t current = 0;
+    size_t i, slot;
+    
+    layout->dirs[layout->dir_count++] = -1;
+    for (i = 0; i < manifest->count; i++) {
+        if (S_ISDIR(manifest->entries[i].mode)) {
+            layout->dirs[layout->dir_count++] = (long)i;
+        }
+    }
+    
+    // Open addressing, directory index + 1 and 0 when empty. The root isn't in it
+    while (capacity < layout->dir_count * 2) {
+        capacity *= 2;
+    }
+    table = calloc(capacity, sizeof(size_t));
+    if (table == NULL) {
+        fprintf(stderr, "Error: Out of memory\n");
+        log_write(g_log_ctx, LOG_ERROR, "Out of memory laying out FAT32 directories");
+        return -1;
+    }
+    for (i = 1; i < layout->dir_count; i++) {
+        const char *path = manifest->entries[layout->dirs[i]].path;
+        
+        slot = path_hash(path, strlen(path)) & (capacity - 1);
+        while (table[slot] != 0) {
+            slot = (slot + 1) & (capacity - 1);
+        }
+        table[slot] = i + 1;
+    }
+    
+    for (i = 0; i < manifest->count; i++) {
+        const char *path = manifest->entries[i].path;
+        const char *slash = strrchr(path, '/');
+        size_t parent_length = slash != NULL ? (size_t)(slash - path) : 0;
+        const char *parent = current > 0 ? manifest->entries[layout->dirs[current]].path : "";
+        
+        if (strlen(parent) != parent_length || strncmp(parent, path, parent_length) != 0) {
+            current = 0;
+            if (parent_length > 0) {
+                slot = path_hash(path, parent_length) & (capacity - 1);
+                while (table[slot] != 0) {
+                    parent = manifest->entries[layout->dirs[table[slot] - 1]].path;
+                    if (strlen(parent) == parent_length && strncmp(parent, path, parent_length) == 0) {
+                        current = table[slot] - 1;
+                        break;
+                    }
+                    slot = (slot + 1) & (capacity - 1);
+                }
+                
+                if (current == 0) {
+                    fprintf(stderr, "Error: Cannot place %s on FAT32\n", path);
+                    log_write(g_log_ctx, LOG_ERROR, "Directory of %s is not in the manifest", path);
+                    free(table);
+                    return -1;
+                }
+            }
+        }
+        
+        layout->nodes[i].parent = (uint32_t)current;
+    }
+    
+    free(table);
+    return 0;
+}
+
+// Give every entry a short name unique in its directory, and count the directory entries
+static int fat_assign_names(FatLayout *layout) {
+    SourceManifest *manifest = layout->manifest;
+    uint16_t units[LFN_MAX];
+    ShortNameSet set;
+    unsigned long number;
+    size_t i;
+    int length;
+    
+    set.capacity = 64;
+    while (set.capacity < manifest->count * 2) {
+        set.capacity *= 2;
+    }
+    set.slots = calloc(set.capacity, sizeof(size_t));
+    set.nodes = layout->nodes;
+    if (set.slots == NULL) {
+        fprintf(stderr, "Error: Out of memory\n");
+        log_write(g_log_ctx, LOG_ERROR, "Out of memory laying out FAT32 directories");
+        return -1;
+    }
+    
+    // Names that fit 8.3 as they are go first, so a generated ~N name never takes one of them
+    for (i = 0; i < manifest->count; i++) {
+        FatNode *node = &layout->nodes[i];
+        
+        node->needs_lfn = !short_name_exact(entry_name(&manifest->entries[i]), node) || !short_name_insert(&set, i);
+    }
+    
+    for (i = 0; i < manifest->count; i++) {
+        FatNode *node = &layout->nodes[i];
+        const char *name = entry_name(&manifest->entries[i]);
+        
+        node->slots = 1;
+        if (node->needs_lfn) {
+            length = utf16_encode(name, units);
+            if (length < 0) {
+                fprintf(stderr, "Error: Name is too long for FAT32: %s\n", manifest->entries[i].path);
+                log_write(g_log_ctx, LOG_ERROR, "Name longer than %d characters: %s", LFN_MAX, manifest->entries[i].path);
+                free(set.slots);
+                return -1;
+            }
+            node->slots += (unsigned char)((length + LFN_CHARS - 1) / LFN_CHARS);
+            
+            for (number = 1; number < 1000000; number++) {
+                short_name_generate(name, number, node);
+                if (short_name_insert(&set, i)) {
+                    break;
+                }
+            }
+        }
+        
+        layout->dir_slots[node->parent] += node->slots;
+    }
+    
+    free(set.slots);
+    
+    for (i = 0; i < layout->dir_count; i++) {
+        // Everything but the root starts with "." and ".."
+        layout->dir_slots[i] += i == 0 ? (layout->label[0] != ' ' ? 1 : 0) : 2;
+        
+        if (layout->dir_slots[i] > MAX_DIR_ENTRIES) {
+            fprintf(stderr, "Error: Directory has too many files for FAT32: %s\n",
+                    i == 0 ? "/" : manifest->entries[layout->dirs[i]].path);
+            log_write(g_log_ctx, LOG_ERROR, "Directory needs %u entries, FAT32 allows %d",
+                      layout->dir_slots[i], MAX_DIR_ENTRIES);
+            return -1;
+        }
+    }
+    
+    return 0;
+}
+
+static uint32_t fat_clusters_for(const FatLayout *layout, uint64_t bytes) {
+    return (uint32_t)((bytes + layout->cluster_size - 1) / layout->cluster_size);
+}
+
+// Hand out the next clusters as one chain
+static uint32_t fat_allocate(FatLayout *layout, uint32_t clusters) {
+    uint32_t first = layout->next_cluster;
+    uint32_t last = first + clusters - 1;
+    
+    layout->run_end[last / 8] |= (unsigned char)(1 << (last % 8));
+    layout->next_cluster += clusters;
+    return first;
+}
+
+// Directories first, right behind the FATs, then the file data in the order it sits on the
+// source, so both ends of the copy move front to back
+static int fat_assign_clusters(FatLayout *layout, ManifestEntry **files, size_t file_count) {
+    SourceManifest *manifest = layout->manifest;
+    uint64_t needed;
+    size_t i;
+    
+    layout->root_clusters = fat_clusters_for(layout, (uint64_t)layout->dir_slots[0] * DIR_ENTRY_SIZE);
+    if (layout->root_clusters == 0) {
+        layout->root_clusters = 1;
+    }
+    
+    needed = layout->root_clusters;
+    for (i = 1; i < layout->dir_count; i++) {
+        needed += fat_clusters_for(layout, (uint64_t)layout->dir_slots[i] * DIR_ENTRY_SIZE);
+    }
+    for (i = 0; i < file_count; i++) {
+        needed += fat_clusters_for(layout, (uint64_t)files[i]->size);
+    }
+    
+    if (needed > layout->cluster_count) {
+        fprintf(stderr, "Error: Not enough space on target partition\n");
+        fprintf(stderr, "       Required: %llu MB, Available: %llu MB\n",
+                (unsigned long long)(needed * layout->cluster_size / (1024 * 1024)),
+                (unsigned long long)layout->cluster_count * layout->cluster_size / (1024 * 1024));
+        log_write(g_log_ctx, LOG_ERROR, "Need %llu clusters, the partition has %u",
+                  (unsigned long long)needed, layout->cluster_count);
+        return -1;
+    }
+    
+    layout->run_end = calloc((size_t)needed / 8 + ROOT_CLUSTER + 1, 1);
+    if (layout->run_end == NULL) {
+        fprintf(stderr, "Error: Out of memory\n");
+        log_write(g_log_ctx, LOG_ERROR, "Out of memory laying out FAT32 clusters");
+        return -1;
+    }
+    
+    layout->next_cluster = ROOT_CLUSTER;
+    layout->root_cluster = fat_allocate(layout, layout->root_clusters);
+    
+    for (i = 1; i < layout->dir_count; i++) {
+        FatNode *node = &layout->nodes[layout->dirs[i]];
+        
+        node->clusters = fat_clusters_for(layout, (uint64_t)layout->dir_slots[i] * DIR_ENTRY_SIZE);
+        node->cluster = fat_allocate(layout, node->clusters);
+    }
+    
+    for (i = 0; i < file_count; i++) {
+        FatNode *node = &layout->nodes[files[i] - manifest->entries];
+        
+        node->clusters = fat_clusters_for(layout, (uint64_t)files[i]->size);
+        node->cluster = node->clusters > 0 ? fat_allocate(layout, node->clusters) : 0;
+    }
+    
+    return 0;
+}
+
+// FAT timestamps are local time with two second resolution, from 1980 on
+static void fat_time(const struct timespec *when, uint16_t *date, uint16_t *time_of_day) {
+    struct tm tm;
+    time_t seconds = when->tv_sec;
+    
+    if (localtime_r(&seconds, &tm) == NULL || tm.tm_year < 80) {
+        *date = (1 << 5) | 1; // 1980-01-01
+        *time_of_day = 0;
+        return;
+    }
+    if (tm.tm_year > 207) {
+        *date = (127 << 9) | (12 << 5) | 31;
+        *time_of_day = (23 << 11) | (59 << 5) | 29;
+        return;
+    }
+    
+    *date = (uint16_t)(((tm.tm_year - 80) << 9) | ((tm.tm_mon + 1) << 5) | tm.tm_mday);
+    *time_of_day = (uint16_t)((tm.tm_hour << 11) | (tm.tm_min << 5) | (tm.tm_sec / 2));
+}
+
+static void fat_dirent(unsigned char *e, const unsigned char *name, unsigned char attributes, unsigned char case_flags,
+                       uint32_t cluster, uint32_t size, const ManifestEntry *entry) {
+    uint16_t date = (1 << 5) | 1;
+    uint16_t time_of_day = 0;
+    uint16_t access_date = date;
+    uint16_t unused;
+    
+    if (entry != NULL) {
+        fat_time(&entry->mtime, &date, &time_of_day);
+        fat_time(&entry->atime, &access_date, &unused);
+    }
+    
+    memcpy(e, name, 11);
+    e[11] = attributes;
+    e[12] = case_flags;
+    put16(e + 14, time_of_day); // Created
+    put16(e + 16, date);
+    put16(e + 18, access_date);
+    put16(e + 20, cluster >> 16);
+    put16(e + 22, time_of_day); // Modified
+    put16(e + 24, date);
+    put16(e + 26, cluster & 0xFFFF);
+    put32(e + 28, size);
+}
+
+static unsigned char short_name_checksum(const unsigned char *name) {
+    unsigned char sum = 0;
+    int i;
+    
+    for (i = 0; i < 11; i++) {
+        sum = (unsigned char)(((sum & 1) << 7) + (sum >> 1) + name[i]);
+    }
+    return sum;
+}
+
+// Long name entries go in front of the short entry, last piece of the name first
+static unsigned char *fat_lfn_entries(unsigned char *e, const char *name, const unsigned char *short_name) {
+    static const int offsets[LFN_CHARS] = { 1, 3, 5, 7, 9, 14, 16, 18, 20, 22, 24, 28, 30 };
+    uint16_t units[LFN_MAX];
+    unsigned char checksum = short_name_checksum(short_name);
+    int length = utf16_encode(name, units);
+    int count = (length + LFN_CHARS - 1) / LFN_CHARS;
+    int piece, i;
+    
+    for (piece = count; piece >= 1; piece--) {
+        memset(e, 0, DIR_ENTRY_SIZE);
+        e[0] = (unsigned char)(piece | (piece == count ? 0x40 : 0));
+        e[11] = ATTR_LFN;
+        e[13] = checksum;
+        
+        for (i = 0; i < LFN_CHARS; i++) {
+            int index = (piece - 1) * LFN_CHARS + i;
+            
+            // NUL after the name, 0xFFFF padding after that
+            put16(e + offsets[i], index < length ? units[index] : index == length ? 0x0000 : 0xFFFF);
+        }
+        e += DIR_ENTRY_SIZE;
+    }
+    
+    return e;
+}
+
+// Write a whole buffer at the current position. Only file data goes through the copy
+// pipeline, metadata is written from here
+static int fat_write(int fd, const unsigned char *buffer, size_t length, int *direct) {
+    size_t done = 0;
+    ssize_t written;
+    
+    while (done < length) {
+        written = write(fd, buffer + done, length - done);
+        if (written < 0 && errno == EINTR) {
+            continue;
+        }
+        if (written < 0 && errno == EINVAL && *direct) {
+            // Device takes O_DIRECT at open but not in these sizes, go through the page cache
+            fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_DIRECT);
+            *direct = 0;
+            continue;
+        }
+        if (written <= 0) {
+            return -1;
+        }
+        done += (size_t)written;
+    }
+    
+    return 0;
+}
+
+// Boot sector, FSInfo and their backups
+static int fat_write_reserved(int fd, const FatLayout *layout, int *direct) {
+    static const unsigned char boot_code[] = { 0xF4, 0xEB, 0xFD }; // hlt, jump back. Boots off the MBR, not this
+    size_t length = (size_t)layout->reserved_sectors * SECTOR_SIZE;
+    uint32_t serial = (uint32_t)time(NULL) ^ ((uint32_t)getpid() << 16);
+    unsigned char *buffer;
+    unsigned char *boot;
+    unsigned char *info;
+    int result;
+    
+    if (posix_memalign((void **)&buffer, WRITE_ALIGN, length) != 0) {
+        errno = ENOMEM;
+        return -1;
+    }
+    memset(buffer, 0, length);
+    
+    boot = buffer;
+    boot[0] = 0xEB;
+    boot[1] = 0x58;
+    boot[2] = 0x90;
+    memcpy(boot + 3, "MSWIN4.1", 8);
+    put16(boot + 11, SECTOR_SIZE);
+    boot[13] = (unsigned char)layout->sectors_per_cluster;
+    put16(boot + 14, layout->reserved_sectors);
+    boot[16] = 2;                      // FATs
+    boot[21] = 0xF8;                   // Media, fixed disk
+    put16(boot + 24, 63);              // Sectors per track
+    put16(boot + 26, 255);             // Heads
+    put32(boot + 28, layout->hidden_sectors);
+    put32(boot + 32, (uint32_t)layout->total_sectors);
+    put32(boot + 36, layout->fat_sectors);
+    put32(boot + 44, ROOT_CLUSTER);
+    put16(boot + 48, FSINFO_SECTOR);
+    put16(boot + 50, BACKUP_BOOT_SECTOR);
+    boot[64] = 0x80;                   // Drive number
+    boot[66] = 0x29;                   // Extended boot signature, the next three fields are valid
+    put32(boot + 67, serial);
+    memcpy(boot + 71, layout->label, 11);
+    memcpy(boot + 82, "FAT32   ", 8);
+    memcpy(boot + 90, boot_code, sizeof(boot_code));
+    boot[510] = 0x55;
+    boot[511] = 0xAA;
+    
+    info = buffer + FSINFO_SECTOR * SECTOR_SIZE;
+    put32(info, 0x41615252);
+    put32(info + 484, 0x61417272);
+    put32(info + 488, layout->cluster_count - (layout->next_cluster - ROOT_CLUSTER));
+    put32(info + 492, layout->next_cluster);
+    put32(info + 508, 0xAA550000);
+    
+    memcpy(buffer + BACKUP_BOOT_SECTOR * SECTOR_SIZE, buffer, 2 * SECTOR_SIZE);
+    
+    result = fat_write(fd, buffer, length, direct);
+    free(buffer);
+    return result;
+}
+
+// Both FATs. Every chain is a contiguous run, so each entry just points at the next cluster
+static int fat_write_tables(int fd, const FatLayout *layout, int *direct) {
+    uint64_t entries = (uint64_t)layout->fat_sectors * (SECTOR_SIZE / 4);
+    unsigned char *buffer;
+    uint64_t first, cluster;
+    size_t chunk_entries = FAT_CHUNK / 4;
+    size_t count;
+    int copy;
+    
+    if (posix_memalign((void **)&buffer, WRITE_ALIGN, FAT_CHUNK) != 0) {
+        errno = ENOMEM;
+        return -1;
+    }
+    
+    for (copy = 0; copy < 2; copy++) {
+        for (first = 0; first < entries; first += count) {
+            count = entries - first < chunk_entries ? (size_t)(entries - first) : chunk_entries;
+            memset(buffer, 0, count * 4);
+            
+            for (cluster = first; cluster < first + count && cluster < layout->next_cluster; cluster++) {
+                uint32_t value;
+                
+                if (cluster == 0) {
+                    value = 0x0FFFFFF8; // Media byte
+                } else if (cluster == 1) {
+                    value = FAT_END;    // Clean, no errors
+                } else if (layout->run_end[cluster / 8] & (1 << (cluster % 8))) {
+                    value = FAT_END;
+                } else {
+                    value = (uint32_t)cluster + 1;
+                }
+                put32(buffer + (cluster - first) * 4, value);
+            }
+            
+            if (fat_write(fd, buffer, count * 4, direct) != 0) {
+                free(buffer);
+                return -1;
+            }
+        }
+    }
+    
+    free(buffer);
+    return 0;
+}
+
+// Every directory, in the order they were allocated, which is the order they sit on the partition
+static int fat_write_directories(int fd, const FatLayout *layout, int *direct) {
+    SourceManifest *manifest = layout->manifest;
+    unsigned char **cursors;
+    unsigned char *buffer = NULL;
+    size_t capacity = 0;
+    size_t d, i;
+    int result = 0;
+    
+    // Where the next entry of each directory goes, they're filled in one pass over the manifest
+    cursors = calloc(layout->dir_count, sizeof(unsigned char *));
+    if (cursors == NULL) {
+        errno = ENOMEM;
+        return -1;
+    }
+    
+    for (d = 0; d < layout->dir_count; d++) {
+        uint32_t clusters = d == 0 ? layout->root_clusters : layout->nodes[layout->dirs[d]].clusters;
+        capacity += (size_t)clusters * layout->cluster_size;
+    }
+    
+    if (posix_memalign((void **)&buffer, WRITE_ALIGN, capacity) != 0) {
+        free(cursors);
+        errno = ENOMEM;
+        return -1;
+    }
+    memset(buffer, 0, capacity);
+    
+    cursors[0] = buffer;
+    if (layout->label[0] != ' ') {
+        fat_dirent(cursors[0], layout->label, ATTR_VOLUME_ID, 0, 0, 0, NULL);
+        cursors[0] += DIR_ENTRY_SIZE;
+    }
+    
+    // Directories were allocated back to back from the root cluster on
+    for (d = 1; d < layout->dir_count; d++) {
+        const FatNode *node = &layout->nodes[layout->dirs[d]];
+        const ManifestEntry *entry = &manifest->entries[layout->dirs[d]];
+        uint32_t parent_cluster = node->parent == 0 ? 0 : layout->nodes[layout->dirs[node->parent]].cluster;
+        
+        cursors[d] = buffer + (size_t)(node->cluster - layout->root_cluster) * layout->cluster_size;
+        fat_dirent(cursors[d], (const unsigned char *)".          ", ATTR_DIRECTORY, 0, node->cluster, 0, entry);
+        fat_dirent(cursors[d] + DIR_ENTRY_SIZE, (const unsigned char *)"..         ", ATTR_DIRECTORY, 0, parent_cluster, 0, entry);
+        cursors[d] += 2 * DIR_ENTRY_SIZE;
+    }
+    
+    for (i = 0; i < manifest->count; i++) {
+        const ManifestEntry *entry = &manifest->entries[i];
+        const FatNode *node = &layout->nodes[i];
+        unsigned char *e = cursors[node->parent];
+        
+        if (node->needs_lfn) {
+            e = fat_lfn_entries(e, entry_name(entry), node->short_name);
+        }
+        
+        if (S_ISDIR(entry->mode)) {
+            fat_dirent(e, node->short_name, ATTR_DIRECTORY, node->case_flags, node->cluster, 0, entry);
+        } else {
+            fat_dirent(e, node->short_name, ATTR_ARCHIVE, node->case_flags, node->cluster, (uint32_t)entry->size, entry);
+        }
+        cursors[node->parent] = e + DIR_ENTRY_SIZE;
+    }
+    
+    result = fat_write(fd, buffer, capacity, direct);
+    
+    free(buffer);
+    free(cursors);
+    return result;
+}
+
+// Byte offset of a cluster on the partition
+static off_t fat_cluster_offset(const FatLayout *layout, uint32_t cluster) {
+    return layout->data_offset + (off_t)(cluster - ROOT_CLUSTER) * layout->cluster_size;
+}
+
+// Copy the file data into the clusters laid out for it
+static int fat_write_files(int fd, FatLayout *layout, ManifestEntry **files, size_t file_count, int verbose, int direct) {
+    SourceManifest *manifest = layout->manifest;
+    size_t i;
+    
+    for (i = 0; i < file_count; i++) {
+        const FatNode *node = &layout->nodes[files[i] - manifest->entries];
+        off_t offset = fat_cluster_offset(layout, node->cluster);
+        
+        if (node->clusters == 0) {
+            continue;
+        }
+        
+        if (verbose) {
+            printf("\nCopying: %s", files[i]->path);
+            fflush(stdout);
+        }
+        
+        // The copy writes a file's unaligned tail through the page cache, every file starts aligned
+        if (direct) {
+            fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_DIRECT);
+        }
+        
+        if (lseek(fd, offset, SEEK_SET) != offset || copy_entry_to_fd(manifest, files[i], fd) != 0) {
+            fprintf(stderr, "\nFailed to copy: %s\n", files[i]->path);
+            log_write(g_log_ctx, LOG_ERROR, "Failed to write %s to the FAT32 partition: %s", files[i]->path, strerror(errno));
+            return -1;
+        }
+        
+        log_write(g_log_ctx, LOG_INFO, "Copied %s (xxh64 %016llx)", files[i]->path, (unsigned long long)files[i]->hash);
+    }
+    
+    return 0;
+}
+
+// Read every file back off the partition and compare it with what was written
+static int fat_verify(FatLayout *layout, ManifestEntry **files, size_t file_count, const char *partition) {
+    SourceManifest *manifest = layout->manifest;
+    uint64_t hash;
+    size_t failed = 0;
+    size_t i;
+    
+    print_colored("Verifying files on target...", "green");
+    log_write(g_log_ctx, LOG_STEP, "Reading back %zu files from %s", file_count, partition);
+    
+    for (i = 0; i < file_count; i++) {
+        const FatNode *node = &layout->nodes[files[i] - manifest->entries];
+        off_t offset = fat_cluster_offset(layout, node->cluster);
+        
+        if (node->clusters == 0) {
+            continue;
+        }
+        
+        if (hash_file_range(partition, offset, files[i]->size, 1, &hash) != 0 || hash != files[i]->hash) {
+            fprintf(stderr, "Error: %s does not match the source\n", files[i]->path);
+            log_write(g_log_ctx, LOG_ERROR, "Verification failed: %s", files[i]->path);
+            failed++;
+        }
+    }
+    
+    if (failed > 0) {
+        fprintf(stderr, "Error: %zu files on the target do not match the source\n", failed);
+        return -1;
+    }
+    
+    log_write(g_log_ctx, LOG_SUCCESS, "Verified %zu files", file_count);
+    return 0;
+}
+
+// Volume label: uppercase, at most 11 characters, and only what a short name can hold
+static void fat_label(unsigned char *out, const char *label) {
+    const char *rest = label;
+    size_t length = 0;
+    
+    memset(out, ' ', 11);
+    for (; *rest != '\0' && length < 11; rest++) {
+        unsigned char c = (unsigned char)toupper((unsigned char)*rest);
+        
+        out[length++] = (short_name_char(c) || c == ' ') ? c : '_';
+    }
+    
+    // The default is one character too long as well, only a --label the user gave is worth a warning
+    if (out[0] == ' ') {
+        memcpy(out, "NO NAME    ", 11);
+    } else if (*rest != '\0' && strcmp(label, DEFAULT_FS_LABEL) != 0) {
+        log_write(g_log_ctx, LOG_WARNING, "FAT32 labels hold 11 characters, label shortened to %.11s", out);
+    }
+}
+
+// Every file, in the order their data goes onto the partition. NULL if one can't go on FAT32
+static ManifestEntry **fat_files(SourceManifest *manifest, size_t *count) {
+    ManifestEntry **files;
+    size_t i;
+    
+    for (i = 0; i < manifest->count; i++) {
+        if (S_ISREG(manifest->entries[i].mode) && (unsigned long long)manifest->entries[i].size > FAT32_MAX_FILESIZE) {
+            fprintf(stderr, "Error: %s is bigger than FAT32 allows\n", manifest->entries[i].path);
+            log_write(g_log_ctx, LOG_ERROR, "File over 4GB can't go on FAT32: %s", manifest->entries[i].path);
+            return NULL;
+        }
+    }
+    
+    files = calloc(manifest->file_count + 1, sizeof(ManifestEntry *));
+    if (files == NULL) {
+        fprintf(stderr, "Error: Out of memory\n");
+        log_write(g_log_ctx, LOG_ERROR, "Out of memory laying out FAT32");
+        return NULL;
+    }
+    
+    *count = 0;
+    for (i = 0; i < manifest->count; i++) {
+        if (S_ISREG(manifest->entries[i].mode)) {
+            files[(*count)++] = &manifest->entries[i];
+        }
+    }
+    schedule_files(files, *count, manifest->root, ORDER_PHYSICAL);
+    
+    return files;
+}
+
+static void fat_free(FatLayout *layout) {
+    free(layout->run_end);
+    free(layout->nodes);
+    free(layout->dirs);
+    free(layout->dir_slots);
+}
+
+// Open partition and lay out the filesystem for its size. Returns the fd, -1 on failure
+static int fat_open(FatLayout *layout, SourceManifest *manifest, const char *partition, const unsigned char *label,
+                    ManifestEntry **files, size_t file_count, int *direct) {
+    off_t size;
+    int fd;
+    
+    memset(layout, 0, sizeof(*layout));
+    layout->manifest = manifest;
+    memcpy(layout->label, label, sizeof(layout->label));
+    
+    fd = open(partition, O_WRONLY | O_DIRECT | O_CLOEXEC);
+    *direct = fd >= 0;
+    if (fd < 0 && errno == EINVAL) {
+        fd = open(partition, O_WRONLY | O_CLOEXEC);
+    }
+    if (fd < 0) {
+        fprintf(stderr, "Error: Cannot open partition: %s - %s\n", partition, strerror(errno));
+        log_write(g_log_ctx, LOG_ERROR, "Cannot open partition: %s - %s", partition, strerror(errno));
+        return -1;
+    }
+    
+    size = lseek(fd, 0, SEEK_END);
+    if (size <= 0 || lseek(fd, 0, SEEK_SET) != 0) {
+        fprintf(stderr, "Error: Cannot determine the size of %s\n", partition);
+        log_write(g_log_ctx, LOG_ERROR, "Cannot determine the size of %s", partition);
+        close(fd);
+        return -1;
+    }
+    
+    layout->hidden_sectors = partition_start(partition);
+    if (fat_geometry(layout, size) != 0) {
+        close(fd);
+        return -1;
+    }
+    
+    layout->nodes = calloc(manifest->count + 1, sizeof(FatNode));
+    layout->dirs = calloc(manifest->dir_count + 1, sizeof(long));
+    layout->dir_slots = calloc(manifest->dir_count + 1, sizeof(uint32_t));
+    if (layout->nodes == NULL || layout->dirs == NULL || layout->dir_slots == NULL) {
+        fprintf(stderr, "Error: Out of memory\n");
+        log_write(g_log_ctx, LOG_ERROR, "Out of memory laying out FAT32");
+        fat_free(layout);
+        close(fd);
+        return -1;
+    }
+    
+    if (fat_assign_parents(layout) != 0 || fat_assign_names(layout) != 0 ||
+        fat_assign_clusters(layout, files, file_count) != 0) {
+        fat_free(layout);
+        close(fd);
+        return -1;
+    }
+    
+    log_write(g_log_ctx, LOG_INFO, "Writing %zu files and %zu directories as FAT32 to %s, %u clusters in use",
+              file_count, layout->dir_count - 1, partition, layout->next_cluster - ROOT_CLUSTER);
+    return fd;
+}
+
+// Everything in front of the file data
+static int fat_write_metadata(int fd, const FatLayout *layout, const char *partition, int *direct) {
+    if (fat_write_reserved(fd, layout, direct) != 0 || fat_write_tables(fd, layout, direct) != 0 ||
+        fat_write_directories(fd, layout, direct) != 0) {
+        fprintf(stderr, "Error: Failed to write FAT32 filesystem to %s: %s\n", partition, strerror(errno));
+        log_write(g_log_ctx, LOG_ERROR, "Failed to write FAT32 metadata to %s: %s", partition, strerror(errno));
+        return -1;
+    }
+    
+    return 0;
+}
+
+// Format partition as FAT32 and write every file of the manifest onto it in one pass
+int write_fat32(SourceManifest *manifest, const char *partition, const char *label, int verbose, const CopyOptions *options) {
+    FatLayout layout;
+    ManifestEntry **files;
+    unsigned char fat_name[11];
+    size_t file_count;
+    double synced;
+    int direct;
+    int result = -1;
+    int fd;
+    
+    fat_label(fat_name, label);
+    
+    files = fat_files(manifest, &file_count);
+    if (files == NULL) {
+        return -1;
+    }
+    
+    fd = fat_open(&layout, manifest, partition, fat_name, files, file_count, &direct);
+    if (fd < 0) {
+        free(files);
+        return -1;
+    }
+    
+    printf("Total size to copy: %llu MB\n", manifest->total_size / (1024 * 1024));
+    
+    if (fat_write_metadata(fd, &layout, partition, &direct) != 0) {
+        goto done;
+    }
+    
+    copy_progress_start(manifest->total_size);
+    if (fat_write_files(fd, &layout, files, file_count, verbose, direct) != 0) {
+        goto done;
+    }
+    tune_report();
+    
+    synced = tune_now();
+    if (fsync(fd) != 0) {
+        fprintf(stderr, "\nError: Failed to sync partition: %s\n", strerror(errno));
+        log_write(g_log_ctx, LOG_ERROR, "Failed to sync %s: %s", partition, strerror(errno));
+        goto done;
+    }
+    metrics_wait(WAIT_SYNC, synced);
+    printf("\n");
+    
+    if (options->verify && fat_verify(&layout, files, file_count, partition) != 0) {
+        goto done;
+    }
+    
+    // Not fatal, the files themselves are all on the target by now
+    if (options->checksums[0] != '\0') {
+        hash_write_list(manifest, options->checksums);
+    }
+    
+    print_colored("File copy complete", "green");
+    log_write(g_log_ctx, LOG_SUCCESS, "FAT32 written - %llu MB in %zu files", manifest->total_size / (1024 * 1024), file_count);
+    result = 0;
+
+done:
+    close(fd);
+    fat_free(&layout);
+    free(files);
+    return result;
+}
+
+// One partition of a multi-target write
+typedef struct {
+    FatLayout layout;
+    FanoutTarget *target;
+    ManifestEntry **files;
+    size_t file_count;
+    const unsigned char *label;
+    int verify;
+    int direct;
+    pthread_t thread;
+} FatTarget;
+
+// Point the fan-out at the clusters laid out for this file
+static int fat_begin_file(FanoutTarget *target, const ManifestEntry *entry) {
+    FatTarget *fat = (FatTarget *)target->data;
+    const FatNode *node = &fat->layout.nodes[entry - fat->layout.manifest->entries];
+    
+    target->base = node->clusters > 0 ? fat_cluster_offset(&fat->layout, node->cluster) : 0;
+    return 0;
+}
+
+static void *fat_prepare_target(void *arg) {
+    FatTarget *fat = (FatTarget *)arg;
+    FanoutTarget *target = fat->target;
+    
+    target->fd = fat_open(&fat->layout, fat->layout.manifest, target->name, fat->label, fat->files, fat->file_count, &fat->direct);
+    if (target->fd < 0) {
+        target->failed = 1;
+        return NULL;
+    }
+    
+    if (fat_write_metadata(target->fd, &fat->layout, target->name, &fat->direct) != 0) {
+        target->failed = 1;
+    }
+    return NULL;
+}
+
+static void *fat_finish_target(void *arg) {
+    FatTarget *fat = (FatTarget *)arg;
+    FanoutTarget *target = fat->target;
+    double synced = tune_now();
+    
+    if (fsync(target->fd) != 0) {
+        fprintf(stderr, "Error: Failed to sync %s: %s\n", target->name, strerror(errno));
+        log_write(g_log_ctx, LOG_ERROR, "Failed to sync %s: %s", target->name, strerror(errno));
+        target->failed = 1;
+        return NULL;
+    }
+    metrics_wait(WAIT_SYNC, synced);
+    
+    if (fat->verify && fat_verify(&fat->layout, fat->files, fat->file_count, target->name) != 0) {
+        target->failed = 1;
+    }
+    return NULL;
+}
+
+// Run fn for every target that hasn't failed yet, all at the same time
+static void fat_each_target(FatTarget *fats, int count, void *(*fn)(void *)) {
+    int started[MAX_TARGETS];
+    int i;
+    
+    for (i = 0; i < count; i++) {
+        started[i] = !fats[i].target->failed && pthread_create(&fats[i].thread, NULL, fn, &fats[i]) == 0;
+        if (!fats[i].target->failed && !started[i]) {
+            fn(&fats[i]);
+        }
+    }
+    for (i = 0; i < count; i++) {
+        if (started[i]) {
+            pthread_join(fats[i].thread, NULL);
+        }
+    }
+}
+
+// Same as write_fat32 for several partitions at once, each laid out for its own size. The file
+// data is read once and fanned out to all of them. targets name the partitions, and every
+// one that fails gets its failed flag set. Returns -1 if none of them made it
+int write_fat32_targets(SourceManifest *manifest, FanoutTarget *targets, int count, const char *label,
+                        int verbose, const CopyOptions *options) {
+    FatTarget *fats;
+    ManifestEntry **files;
+    unsigned char fat_name[11];
+    size_t file_count;
+    int alive = 0;
+    int result;
+    int i;
+    
+    fat_label(fat_name, label);
+    
+    files = fat_files(manifest, &file_count);
+    fats = calloc(count, sizeof(FatTarget));
+    if (files == NULL || fats == NULL) {
+        free(files);
+        free(fats);
+        return -1;
+    }
+    
+    for (i = 0; i < count; i++) {
+        fats[i].layout.manifest = manifest;
+        fats[i].target = &targets[i];
+        fats[i].files = files;
+        fats[i].file_count = file_count;
+        fats[i].label = fat_name;
+        fats[i].verify = options->verify;
+        targets[i].fd = -1;
+        targets[i].pad = 1; // Tail sectors past the end of a file are slack in its last cluster
+        targets[i].begin_file = fat_begin_file;
+        targets[i].end_file = NULL;
+        targets[i].wrote = NULL;
+        targets[i].data = &fats[i];
+    }
+    
+    printf("Total size to copy: %llu MB\n", manifest->total_size / (1024 * 1024));
+    
+    fat_each_target(fats, count, fat_prepare_target);
+    result = fanout_copy(manifest, files, file_count, targets, count, verbose);
+    if (result == 0) {
+        fat_each_target(fats, count, fat_finish_target);
+    }
+    
+    for (i = 0; i < count; i++) {
+        if (targets[i].fd >= 0) {
+            close(targets[i].fd);
+            targets[i].fd = -1;
+            fat_free(&fats[i].layout);
+        }
+        alive += !targets[i].failed;
+    }
+    
+    if (result == 0 && alive > 0) {
+        if (options->checksums[0] != '\0') {
+            hash_write_list(manifest, options->checksums);
+        }
+        print_colored("File copy complete", "green");
+        log_write(g_log_ctx, LOG_SUCCESS, "FAT32 written to %d of %d targets - %llu MB in %zu files",
+                  alive, count, manifest->total_size / (1024 * 1024), file_count);
+    }
+    
+    free(fats);
+    free(files);
+    return result == 0 && alive > 0 ? 0 : -1;
+}
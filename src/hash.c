@@ -0,0 +1,332 @@
+/*
+    buf - Command line tool for flashing ISO images onto USB drives.
+    Copyright (C) 2026  Bryson Kelly
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+*/
+
+
+// File content hashing
+// XXH64, written out here so we don't need libxxhash. It runs at memory speed, so hashing
+// a file costs about as much as reading it, which is what telling files apart needs
+#define _GNU_SOURCE
+#include "../include/buf.h"
+#include <fcntl.h>
+
+#define HASH_READ_SIZE (4 * 1024 * 1024) // Read files in 4MB pieces
+#define HASH_ALIGN 4096                  // Buffer alignment O_DIRECT reads need
+
+#define PRIME64_1 0x9E3779B185EBCA87ULL
+#define PRIME64_2 0xC2B2AE3D27D4EB4FULL
+#define PRIME64_3 0x165667B19E3779F9ULL
+#define PRIME64_4 0x85EBCA77C2B2AE63ULL
+#define PRIME64_5 0x27D4EB2F165667C5ULL
+
+static uint64_t rotl64(uint64_t value, int bits) {
+    return (value << bits) | (value >> (64 - bits));
+}
+
+// Unaligned little endian loads
+static uint64_t read64(const unsigned char *p) {
+    return (uint64_t)p[0] | ((uint64_t)p[1] << 8) | ((uint64_t)p[2] << 16) | ((uint64_t)p[3] << 24) |
+           ((uint64_t)p[4] << 32) | ((uint64_t)p[5] << 40) | ((uint64_t)p[6] << 48) | ((uint64_t)p[7] << 56);
+}
+
+static uint32_t read32(const unsigned char *p) {
+    return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static uint64_t round64(uint64_t acc, uint64_t input) {
+    acc += input * PRIME64_2;
+    acc = rotl64(acc, 31);
+    return acc * PRIME64_1;
+}
+
+static uint64_t merge64(uint64_t acc, uint64_t value) {
+    acc ^= round64(0, value);
+    return acc * PRIME64_1 + PRIME64_4;
+}
+
+void hash_init(HashState *state) {
+    memset(state, 0, sizeof(*state));
+    state->v[0] = PRIME64_1 + PRIME64_2;
+    state->v[1] = PRIME64_2;
+    state->v[2] = 0;
+    state->v[3] = 0 - PRIME64_1;
+}
+
+void hash_update(HashState *state, const void *data, size_t length) {
+    const unsigned char *p = (const unsigned char *)data;
+    const unsigned char *end = p + length;
+    
+    state->total += length;
+    
+    // Finish a stripe left over from the last call
+    if (state->buffered > 0) {
+        size_t take = 32 - state->buffered;
+        
+        if (take > length) {
+            take = length;
+        }
+        memcpy(state->buffer + state->buffered, p, take);
+        state->buffered += take;
+        p += take;
+        
+        if (state->buffered < 32) {
+            return;
+        }
+        
+        state->v[0] = round64(state->v[0], read64(state->buffer));
+        state->v[1] = round64(state->v[1], read64(state->buffer + 8));
+        state->v[2] = round64(state->v[2], read64(state->buffer + 16));
+        state->v[3] = round64(state->v[3], read64(state->buffer + 24));
+        state->buffered = 0;
+    }
+    
+    while (end - p >= 32) {
+        state->v[0] = round64(state->v[0], read64(p));
+        state->v[1] = round64(state->v[1], read64(p + 8));
+        state->v[2] = round64(state->v[2], read64(p + 16));
+        state->v[3] = round64(state->v[3], read64(p + 24));
+        p += 32;
+    }
+    
+    if (p < end) {
+        memcpy(state->buffer, p, end - p);
+        state->buffered = end - p;
+    }
+}
+
+uint64_t hash_final(const HashState *state) {
+    const unsigned char *p = state->buffer;
+    const unsigned char *end = p + state->buffered;
+    uint64_t hash;
+    
+    if (state->total >= 32) {
+        hash = rotl64(state->v[0], 1) + rotl64(state->v[1], 7) + rotl64(state->v[2], 12) + rotl64(state->v[3], 18);
+        hash = merge64(hash, state->v[0]);
+        hash = merge64(hash, state->v[1]);
+        hash = merge64(hash, state->v[2]);
+        hash = merge64(hash, state->v[3]);
+    } else {
+        hash = state->v[2] + PRIME64_5;
+    }
+    
+    hash += state->total;
+    
+    while (end - p >= 8) {
+        hash ^= round64(0, read64(p));
+        hash = rotl64(hash, 27) * PRIME64_1 + PRIME64_4;
+        p += 8;
+    }
+    
+    if (end - p >= 4) {
+        hash ^= (uint64_t)read32(p) * PRIME64_1;
+        hash = rotl64(hash, 23) * PRIME64_2 + PRIME64_3;
+        p += 4;
+    }
+    
+    while (p < end) {
+        hash ^= (*p) * PRIME64_5;
+        hash = rotl64(hash, 11) * PRIME64_1;
+        p++;
+    }
+    
+    hash ^= hash >> 33;
+    hash *= PRIME64_2;
+    hash ^= hash >> 29;
+    hash *= PRIME64_3;
+    hash ^= hash >> 32;
+    
+    return hash;
+}
+
+// Hash length bytes of a file or device starting at offset, or everything from there on when
+// length is negative. Returns -1 with errno set if it can't be read.
+// uncached reads around the page cache, for checking what's really on the device: O_DIRECT
+// where the filesystem allows it, otherwise cached pages are dropped before and after reading
+int hash_file_range(const char *path, off_t offset, off_t length, int uncached, uint64_t *hash) {
+    HashState state;
+    char *buffer;
+    ssize_t bytes_read;
+    size_t want;
+    int saved_errno;
+    int direct = 0;
+    int fd = -1;
+    
+    if (uncached) {
+        fd = open(path, O_RDONLY | O_DIRECT);
+        direct = fd >= 0;
+    }
+    if (fd < 0) {
+        fd = open(path, O_RDONLY);
+        if (fd < 0) {
+            return -1;
+        }
+        if (uncached) {
+            posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+        }
+    }
+    
+    if (posix_memalign((void **)&buffer, HASH_ALIGN, HASH_READ_SIZE) != 0) {
+        close(fd);
+        errno = ENOMEM;
+        return -1;
+    }
+    
+    if (offset > 0 && lseek(fd, offset, SEEK_SET) < 0) {
+        saved_errno = errno;
+        free(buffer);
+        close(fd);
+        errno = saved_errno;
+        return -1;
+    }
+    
+    posix_fadvise(fd, offset, length >= 0 ? length : 0, POSIX_FADV_SEQUENTIAL);
+    hash_init(&state);
+    
+    for (;;) {
+        want = HASH_READ_SIZE;
+        if (length >= 0 && (off_t)want > length) {
+            // Rounded up so O_DIRECT still works, anything past length is ignored
+            want = ((size_t)length + HASH_ALIGN - 1) & ~((size_t)HASH_ALIGN - 1);
+        }
+        if (want == 0) {
+            break;
+        }
+        
+        bytes_read = read(fd, buffer, want);
+        if (bytes_read == 0) {
+            if (length < 0) {
+                break;
+            }
+            bytes_read = -1;
+            errno = ENODATA; // Ended before length
+        }
+        if (bytes_read < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EINVAL && direct) {
+                // Opened fine but won't actually read O_DIRECT, go through the cache instead
+                fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_DIRECT);
+                posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+                direct = 0;
+                continue;
+            }
+            saved_errno = errno;
+            free(buffer);
+            close(fd);
+            errno = saved_errno;
+            return -1;
+        }
+        if (length >= 0 && bytes_read > length) {
+            bytes_read = (ssize_t)length;
+        }
+        hash_update(&state, buffer, bytes_read);
+        if (length >= 0) {
+            length -= bytes_read;
+        }
+    }
+    
+    if (uncached) {
+        posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+    }
+    
+    free(buffer);
+    close(fd);
+    *hash = hash_final(&state);
+    return 0;
+}
+
+// Hash a whole file
+int hash_file(const char *path, int uncached, uint64_t *hash) {
+    return hash_file_range(path, 0, -1, uncached, hash);
+}
+
+// Hash one file of the source, by its path or out of the image it lives in
+int hash_entry(const SourceManifest *manifest, ManifestEntry *entry) {
+    char path[MAX_PATH];
+    int result;
+    
+    if (entry->extent >= 0) {
+        result = hash_file_range(manifest->image, entry->extent, entry->size, 0, &entry->hash);
+    } else {
+        snprintf(path, sizeof(path), "%s/%s", manifest->root, entry->path);
+        result = hash_file(path, 0, &entry->hash);
+    }
+    
+    if (result == 0) {
+        entry->hashed = 1;
+    }
+    
+    return result;
+}
+
+// Hash every file of the manifest the copy didn't already hash on its way through
+int hash_manifest(SourceManifest *manifest) {
+    size_t i;
+    
+    for (i = 0; i < manifest->count; i++) {
+        ManifestEntry *entry = &manifest->entries[i];
+        
+        if (!S_ISREG(entry->mode) || entry->hashed) {
+            continue;
+        }
+        
+        if (hash_entry(manifest, entry) != 0) {
+            log_write(g_log_ctx, LOG_WARNING, "Could not hash %s/%s - %s", manifest->root, entry->path, strerror(errno));
+            return -1;
+        }
+    }
+    
+    return 0;
+}
+
+// Write every file's digest to path, one "hash  path" line each relative to the USB root.
+// Same layout as xxhsum -H64, so the stick can be checked later with xxhsum -c
+int hash_write_list(SourceManifest *manifest, const char *path) {
+    FILE *file;
+    size_t i;
+    
+    if (hash_manifest(manifest) != 0) {
+        fprintf(stderr, "Warning: Could not hash every file, no checksums written to %s\n", path);
+        return -1;
+    }
+    
+    file = fopen(path, "w");
+    if (file == NULL) {
+        fprintf(stderr, "Warning: Could not write checksums: %s - %s\n", path, strerror(errno));
+        log_write(g_log_ctx, LOG_WARNING, "Could not write checksums: %s - %s", path, strerror(errno));
+        return -1;
+    }
+    
+    for (i = 0; i < manifest->count; i++) {
+        const ManifestEntry *entry = &manifest->entries[i];
+        
+        if (S_ISREG(entry->mode)) {
+            fprintf(file, "%016llx  %s\n", (unsigned long long)entry->hash, entry->path);
+        }
+    }
+    
+    if (fclose(file) != 0) {
+        fprintf(stderr, "Warning: Could not write checksums: %s - %s\n", path, strerror(errno));
+        log_write(g_log_ctx, LOG_WARNING, "Could not write checksums: %s - %s", path, strerror(errno));
+        return -1;
+    }
+    
+    log_write(g_log_ctx, LOG_INFO, "Wrote checksums of %zu files to %s", manifest->file_count, path);
+    return 0;
+}
@@ -0,0 +1,1093 @@
+/*
+    buf - Command line tool for flashing ISO images onto USB drives.
+    Copyright (C) 2026  Bryson Kelly
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+*/
+
+
+// Source image reader
+// Builds the manifest straight from the filesystem inside an ISO instead of loop mounting
+// it. Every file on a mastered disc image is one contiguous run of blocks, so each entry
+// just records where its data starts and the copy engines read it out of the image with
+// big preads. UDF is read first like mount -t udf,iso9660 does, then ISO9660 with Rock
+// Ridge or Joliet names. Anything this doesn't understand returns -1 and the image gets
+// mounted the old way
+#define _GNU_SOURCE
+#include "../include/buf.h"
+#include <fcntl.h>
+
+#define ISO_SECTOR 2048
+#define ISO_FIRST_DESCRIPTOR 16          // Volume descriptors start at sector 16
+#define ISO_MAX_DESCRIPTORS 64           // Give up if there's no terminator by then
+#define ISO_RECORD_SIZE 34               // Directory record without its name
+#define UDF_ANCHOR_SECTOR 256            // Where the anchor volume descriptor pointer lives
+#define UDF_MAX_BLOCK 4096
+#define IMAGE_MAX_DEPTH 64               // Deeper than any real disc, stops directory loops
+#define IMAGE_MAX_ENTRIES (4 * 1024 * 1024)
+#define IMAGE_MAX_DIRECTORY (64 * 1024 * 1024)
+#define IMAGE_MAX_NAME 1024              // 255 characters of UCS-2 as UTF-8, with room to spare
+#define SUSP_MAX_AREAS 16                // Continuation areas followed per record
+
+// ISO9660 file flags
+#define ISO_FLAG_DIRECTORY 0x02
+#define ISO_FLAG_ASSOCIATED 0x04
+#define ISO_FLAG_MULTI_EXTENT 0x80
+
+// UDF descriptor tags and file identifier characteristics
+#define UDF_TAG_AVDP 2
+#define UDF_TAG_PARTITION 5
+#define UDF_TAG_LOGICAL_VOLUME 6
+#define UDF_TAG_TERMINATOR 8
+#define UDF_TAG_FILE_SET 256
+#define UDF_TAG_FILE_ID 257
+#define UDF_TAG_FILE_ENTRY 261
+#define UDF_TAG_EXTENDED_FILE_ENTRY 266
+#define UDF_FID_HIDDEN 0x01
+#define UDF_FID_DELETED 0x04
+#define UDF_FID_PARENT 0x08
+
+typedef struct {
+    int fd;
+    off_t size;
+    unsigned block_size;
+    unsigned long long partition; // UDF: byte offset of the partition blocks are counted from
+    int joliet;                   // ISO9660: names are UCS-2 from the Joliet tree
+    int rock_ridge;               // ISO9660: names, modes and times come from Rock Ridge entries
+    int susp_skip;                // Bytes to skip at the start of every system use area
+} ImageReader;
+
+// A subdirectory found while reading its parent, read once the parent is done so the
+// manifest keeps directories ahead of their contents like manifest_walk does
+typedef struct {
+    size_t index;
+    unsigned long long offset;
+    unsigned long long length;
+} ImageDir;
+
+typedef struct {
+    ImageDir *dirs;
+    size_t count;
+    size_t capacity;
+} ImageDirList;
+
+// What the Rock Ridge entries of one directory record say
+typedef struct {
+    char name[IMAGE_MAX_NAME];
+    size_t name_len;
+    int has_name;
+    mode_t mode;
+    int has_mode;
+    struct timespec mtime;
+    struct timespec atime;
+    int has_mtime;
+    int has_atime;
+    long long child;  // CL: the directory was relocated to this block, -1 if not
+    int relocated;    // RE: this is where a relocated directory really lives, skip it
+} RockRidge;
+
+static unsigned le16(const unsigned char *p) {
+    return (unsigned)p[0] | ((unsigned)p[1] << 8);
+}
+
+static uint32_t le32(const unsigned char *p) {
+    return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static uint64_t le64(const unsigned char *p) {
+    return (uint64_t)le32(p) | ((uint64_t)le32(p + 4) << 32);
+}
+
+// Read exactly length bytes at offset, -1 if any of it is outside the image
+static int image_read(ImageReader *reader, void *buffer, size_t length, unsigned long long offset) {
+    size_t done = 0;
+    ssize_t bytes_read;
+    
+    if (offset > (unsigned long long)reader->size || length > (unsigned long long)reader->size - offset) {
+        errno = ERANGE;
+        return -1;
+    }
+    
+    while (done < length) {
+        bytes_read = pread(reader->fd, (char *)buffer + done, length - done, (off_t)(offset + done));
+        if (bytes_read < 0 && errno == EINTR) {
+            continue;
+        }
+        if (bytes_read <= 0) {
+            if (bytes_read == 0) {
+                errno = ENODATA;
+            }
+            return -1;
+        }
+        done += bytes_read;
+    }
+    
+    return 0;
+}
+
+// Read a whole directory into a fresh buffer
+static unsigned char *image_read_directory(ImageReader *reader, unsigned long long offset, unsigned long long length) {
+    unsigned char *buffer;
+    
+    if (length > IMAGE_MAX_DIRECTORY) {
+        log_write(g_log_ctx, LOG_INFO, "Image directory too big to read directly: %llu bytes", length);
+        return NULL;
+    }
+    
+    buffer = (unsigned char *)malloc(length > 0 ? length : 1);
+    if (buffer == NULL) {
+        return NULL;
+    }
+    
+    if (image_read(reader, buffer, length, offset) != 0) {
+        log_write(g_log_ctx, LOG_INFO, "Cannot read image directory at %llu - %s", offset, strerror(errno));
+        free(buffer);
+        return NULL;
+    }
+    
+    return buffer;
+}
+
+// Append one code point as UTF-8
+static void put_utf8(char *out, size_t size, size_t *len, uint32_t code) {
+    unsigned char bytes[4];
+    size_t count;
+    size_t i;
+    
+    if (code < 0x80) {
+        bytes[0] = (unsigned char)code;
+        count = 1;
+    } else if (code < 0x800) {
+        bytes[0] = (unsigned char)(0xC0 | (code >> 6));
+        bytes[1] = (unsigned char)(0x80 | (code & 0x3F));
+        count = 2;
+    } else if (code < 0x10000) {
+        bytes[0] = (unsigned char)(0xE0 | (code >> 12));
+        bytes[1] = (unsigned char)(0x80 | ((code >> 6) & 0x3F));
+        bytes[2] = (unsigned char)(0x80 | (code & 0x3F));
+        count = 3;
+    } else {
+        bytes[0] = (unsigned char)(0xF0 | (code >> 18));
+        bytes[1] = (unsigned char)(0x80 | ((code >> 12) & 0x3F));
+        bytes[2] = (unsigned char)(0x80 | ((code >> 6) & 0x3F));
+        bytes[3] = (unsigned char)(0x80 | (code & 0x3F));
+        count = 4;
+    }
+    
+    if (*len + count >= size) {
+        return;
+    }
+    
+    for (i = 0; i < count; i++) {
+        out[(*len)++] = (char)bytes[i];
+    }
+    out[*len] = '\0';
+}
+
+// Big endian UTF-16 to UTF-8. Joliet says UCS-2 but Windows writes surrogate pairs anyway
+static void utf16_name(const unsigned char *in, size_t units, char *out, size_t size) {
+    size_t len = 0;
+    size_t i;
+    
+    out[0] = '\0';
+    for (i = 0; i < units; i++) {
+        uint32_t code = ((uint32_t)in[i * 2] << 8) | in[i * 2 + 1];
+        
+        if (code >= 0xD800 && code < 0xDC00 && i + 1 < units) {
+            uint32_t low = ((uint32_t)in[i * 2 + 2] << 8) | in[i * 2 + 3];
+            
+            if (low >= 0xDC00 && low < 0xE000) {
+                code = 0x10000 + ((code - 0xD800) << 10) + (low - 0xDC00);
+                i++;
+            }
+        }
+        put_utf8(out, size, &len, code);
+    }
+}
+
+// Names that can't be created on the target as they are
+static int name_usable(const char *name) {
+    return name[0] != '\0' && strcmp(name, ".") != 0 && strcmp(name, "..") != 0 && strchr(name, '/') == NULL;
+}
+
+// ISO9660 7 byte date: years since 1900, month, day, hour, minute, second, and the
+// offset from GMT in 15 minute steps
+static struct timespec iso_time(const unsigned char *date) {
+    struct timespec ts = { 0, 0 };
+    struct tm tm;
+    
+    memset(&tm, 0, sizeof(tm));
+    tm.tm_year = date[0];
+    tm.tm_mon = date[1] - 1;
+    tm.tm_mday = date[2];
+    tm.tm_hour = date[3];
+    tm.tm_min = date[4];
+    tm.tm_sec = date[5];
+    
+    if (date[1] == 0 || date[2] == 0) {
+        return ts;
+    }
+    
+    ts.tv_sec = timegm(&tm) - (time_t)(signed char)date[6] * 15 * 60;
+    return ts;
+}
+
+// Rock Ridge TF long form: the 17 byte ASCII date of the volume descriptors
+static struct timespec iso_long_time(const unsigned char *date) {
+    struct timespec ts = { 0, 0 };
+    struct tm tm;
+    char digits[17];
+    
+    memcpy(digits, date, 16);
+    digits[16] = '\0';
+    memset(&tm, 0, sizeof(tm));
+    
+    if (sscanf(digits, "%4d%2d%2d%2d%2d%2d", &tm.tm_year, &tm.tm_mon, &tm.tm_mday,
+               &tm.tm_hour, &tm.tm_min, &tm.tm_sec) != 6 || tm.tm_year == 0) {
+        return ts;
+    }
+    
+    tm.tm_year -= 1900;
+    tm.tm_mon -= 1;
+    ts.tv_sec = timegm(&tm) - (time_t)(signed char)date[16] * 15 * 60;
+    return ts;
+}
+
+// UDF timestamp: type and time zone, year, month, day, hour, minute, second, then fractions
+static struct timespec udf_time(const unsigned char *stamp) {
+    struct timespec ts = { 0, 0 };
+    struct tm tm;
+    int zone = le16(stamp) & 0x0FFF;
+    
+    memset(&tm, 0, sizeof(tm));
+    tm.tm_year = (int)le16(stamp + 2) - 1900;
+    tm.tm_mon = stamp[4] - 1;
+    tm.tm_mday = stamp[5];
+    tm.tm_hour = stamp[6];
+    tm.tm_min = stamp[7];
+    tm.tm_sec = stamp[8];
+    
+    if (stamp[4] == 0 || stamp[5] == 0) {
+        return ts;
+    }
+    
+    ts.tv_sec = timegm(&tm);
+    ts.tv_nsec = (stamp[9] * 10000000L) + (stamp[10] * 100000L) + (stamp[11] * 1000L);
+    
+    // 12 bit signed minutes from UTC, -2047 when the zone isn't specified
+    if (zone & 0x800) {
+        zone -= 0x1000;
+    }
+    if (zone != -2047 && (le16(stamp) >> 12) == 1) {
+        ts.tv_sec -= (time_t)zone * 60;
+    }
+    
+    return ts;
+}
+
+// Add an entry read out of the image. Directories don't have an extent of their own in the manifest
+static int image_add(SourceManifest *manifest, const char *parent, const char *name, mode_t mode, off_t size,
+                     struct timespec atime, struct timespec mtime, unsigned long long offset) {
+    struct stat st;
+    
+    if (manifest->count >= IMAGE_MAX_ENTRIES) {
+        log_write(g_log_ctx, LOG_INFO, "Image has too many files to read directly");
+        return -1;
+    }
+    
+    memset(&st, 0, sizeof(st));
+    st.st_mode = mode;
+    st.st_size = size;
+    st.st_atim = atime;
+    st.st_mtim = mtime;
+    
+    if (manifest_add(manifest, parent, name, &st, S_ISREG(mode) ? (off_t)offset : -1) != 0) {
+        log_write(g_log_ctx, LOG_ERROR, "Memory allocation failed");
+        return -1;
+    }
+    
+    return 0;
+}
+
+static int dir_list_push(ImageDirList *list, size_t index, unsigned long long offset, unsigned long long length) {
+    if (list->count == list->capacity) {
+        size_t capacity = list->capacity ? list->capacity * 2 : 32;
+        ImageDir *dirs = (ImageDir *)realloc(list->dirs, capacity * sizeof(ImageDir));
+        
+        if (dirs == NULL) {
+            log_write(g_log_ctx, LOG_ERROR, "Memory allocation failed");
+            return -1;
+        }
+        list->dirs = dirs;
+        list->capacity = capacity;
+    }
+    
+    list->dirs[list->count].index = index;
+    list->dirs[list->count].offset = offset;
+    list->dirs[list->count].length = length;
+    list->count++;
+    return 0;
+}
+
+// Walk the System Use Sharing Protocol entries of one directory record, following
+// continuation areas, and pick out the Rock Ridge ones we care about
+static int rock_ridge_parse(ImageReader *reader, const unsigned char *area, size_t length, RockRidge *rr) {
+    unsigned char *continuation = NULL;
+    int areas = 0;
+    
+    memset(rr, 0, sizeof(*rr));
+    rr->child = -1;
+    
+    while (area != NULL) {
+        const unsigned char *p = area;
+        const unsigned char *end = area + length;
+        unsigned long long next_offset = 0;
+        size_t next_length = 0;
+        
+        while (end - p >= 4 && p[2] >= 4 && p[2] <= end - p) {
+            const unsigned char *data = p + 4;
+            size_t data_len = p[2] - 4;
+            
+            if (p[0] == 'S' && p[1] == 'T') {
+                break;
+            } else if (p[0] == 'C' && p[1] == 'E' && data_len >= 24) {
+                next_offset = (unsigned long long)le32(data) * reader->block_size + le32(data + 8);
+                next_length = le32(data + 16);
+            } else if (p[0] == 'N' && p[1] == 'M' && data_len >= 1) {
+                // Flag bits 1 and 2 mark the names of . and .., not real names
+                if (!(data[0] & 0x06) && rr->name_len + data_len - 1 < sizeof(rr->name)) {
+                    memcpy(rr->name + rr->name_len, data + 1, data_len - 1);
+                    rr->name_len += data_len - 1;
+                    rr->name[rr->name_len] = '\0';
+                    rr->has_name = 1;
+                }
+            } else if (p[0] == 'P' && p[1] == 'X' && data_len >= 8) {
+                rr->mode = (mode_t)le32(data);
+                rr->has_mode = 1;
+            } else if (p[0] == 'T' && p[1] == 'F' && data_len >= 1) {
+                // Stamps follow in a fixed order, each present only when its flag is
+                const unsigned char *stamp = data + 1;
+                size_t stamp_len = (data[0] & 0x80) ? 17 : 7;
+                int bit;
+                
+                for (bit = 0; bit < 3 && stamp + stamp_len <= data + data_len; bit++) {
+                    struct timespec ts;
+                    
+                    if (!(data[0] & (1 << bit))) {
+                        continue;
+                    }
+                    ts = stamp_len == 17 ? iso_long_time(stamp) : iso_time(stamp);
+                    if (bit == 1) {
+                        rr->mtime = ts;
+                        rr->has_mtime = 1;
+                    } else if (bit == 2) {
+                        rr->atime = ts;
+                        rr->has_atime = 1;
+                    }
+                    stamp += stamp_len;
+                }
+            } else if (p[0] == 'C' && p[1] == 'L' && data_len >= 8) {
+                rr->child = le32(data);
+            } else if (p[0] == 'R' && p[1] == 'E') {
+                rr->relocated = 1;
+            }
+            
+            p += p[2];
+        }
+        
+        area = NULL;
+        if (next_length > 0 && next_length <= reader->block_size && ++areas <= SUSP_MAX_AREAS) {
+            unsigned char *buffer = (unsigned char *)realloc(continuation, next_length);
+            
+            if (buffer == NULL) {
+                free(continuation);
+                return -1;
+            }
+            continuation = buffer;
+            if (image_read(reader, continuation, next_length, next_offset) != 0) {
+                free(continuation);
+                return -1;
+            }
+            area = continuation;
+            length = next_length;
+        }
+    }
+    
+    free(continuation);
+    return 0;
+}
+
+// The name a record shows up under with the kernel's default mount options: Joliet names
+// lose their ";1" and trailing dots, plain ISO9660 names are lowercased on top of that
+static void iso_name(ImageReader *reader, const unsigned char *record, char *out, size_t size) {
+    const unsigned char *id = record + 33;
+    size_t id_len = record[32];
+    size_t len;
+    size_t i;
+    
+    if (reader->joliet) {
+        utf16_name(id, id_len / 2, out, size);
+    } else {
+        len = id_len < size - 1 ? id_len : size - 1;
+        for (i = 0; i < len; i++) {
+            out[i] = (char)tolower(id[i]);
+        }
+        out[len] = '\0';
+    }
+    
+    len = strlen(out);
+    if (len > 2 && out[len - 2] == ';' && out[len - 1] == '1') {
+        len -= 2;
+    } else if (!reader->joliet && strchr(out, ';') != NULL) {
+        len = strchr(out, ';') - out;
+    }
+    while (len > 1 && out[len - 1] == '.') {
+        len--;
+    }
+    out[len] = '\0';
+}
+
+// Size of the directory whose first record ("." ) sits at block, for Rock Ridge relocation
+static int iso_directory_size(ImageReader *reader, unsigned long long block, unsigned long long *length) {
+    unsigned char record[ISO_RECORD_SIZE];
+    
+    if (image_read(reader, record, sizeof(record), block * reader->block_size) != 0 || record[0] < ISO_RECORD_SIZE) {
+        return -1;
+    }
+    
+    *length = le32(record + 10);
+    return 0;
+}
+
+// Add everything in one ISO9660 directory, then descend into its subdirectories
+static int iso_walk(ImageReader *reader, SourceManifest *manifest, const char *relative,
+                    unsigned long long offset, unsigned long long length, int depth) {
+    ImageDirList subdirs = { NULL, 0, 0 };
+    unsigned char *buffer;
+    char name[IMAGE_MAX_NAME];
+    unsigned long long pos = 0;
+    unsigned long long part_offset = 0;   // Multi-extent file: where its first part starts
+    unsigned long long part_size = 0;     // and how much of it the earlier parts hold
+    int in_parts = 0;
+    int result = -1;
+    size_t i;
+    
+    if (depth > IMAGE_MAX_DEPTH) {
+        log_write(g_log_ctx, LOG_INFO, "Image directories nest too deep: %s", relative);
+        return -1;
+    }
+    
+    buffer = image_read_directory(reader, offset, length);
+    if (buffer == NULL) {
+        return -1;
+    }
+    
+    while (pos < length) {
+        const unsigned char *record = buffer + pos;
+        unsigned record_len = record[0];
+        unsigned id_len;
+        unsigned flags;
+        unsigned long long data;
+        unsigned long long size;
+        RockRidge rr;
+        mode_t mode;
+        struct timespec mtime;
+        struct timespec atime;
+        
+        // Records never straddle a sector, the rest of one is zero padding
+        if (record_len == 0) {
+            pos = (pos / ISO_SECTOR + 1) * ISO_SECTOR;
+            continue;
+        }
+        
+        id_len = record[32];
+        if (pos + record_len > length || 33 + id_len > record_len) {
+            log_write(g_log_ctx, LOG_INFO, "Bad directory record in image: %s", relative != NULL ? relative : "/");
+            goto done;
+        }
+        pos += record_len;
+        
+        flags = record[25];
+        if ((id_len == 1 && (record[33] == 0 || record[33] == 1)) || (flags & ISO_FLAG_ASSOCIATED)) {
+            continue; // . and .., and associated files nobody shows
+        }
+        
+        if (record[26] != 0 || record[27] != 0) {
+            log_write(g_log_ctx, LOG_INFO, "Image has interleaved files, can't read it directly");
+            goto done;
+        }
+        
+        data = ((unsigned long long)le32(record + 2) + record[1]) * reader->block_size;
+        size = le32(record + 10);
+        mode = (flags & ISO_FLAG_DIRECTORY) ? (S_IFDIR | 0555) : (S_IFREG | 0555);
+        mtime = iso_time(record + 18);
+        atime = mtime;
+        
+        // Files of 4GB and more are split over several records, one per part. Parts that
+        // follow each other on the disc are one extent, anything else needs the kernel
+        if (!(flags & ISO_FLAG_DIRECTORY) && (in_parts || (flags & ISO_FLAG_MULTI_EXTENT))) {
+            if (!in_parts) {
+                part_offset = data;
+                part_size = 0;
+                in_parts = 1;
+            } else if (data != part_offset + part_size) {
+                log_write(g_log_ctx, LOG_INFO, "Image has a fragmented file, can't read it directly");
+                goto done;
+            }
+            part_size += size;
+            if (flags & ISO_FLAG_MULTI_EXTENT) {
+                continue;
+            }
+            data = part_offset;
+            size = part_size;
+            in_parts = 0;
+        }
+        
+        iso_name(reader, record, name, sizeof(name));
+        
+        if (reader->rock_ridge) {
+            // The system use area follows the name, which is padded to an even length
+            unsigned su_start = 33 + id_len + ((id_len & 1) ? 0 : 1) + reader->susp_skip;
+            
+            if (su_start > record_len) {
+                su_start = record_len;
+            }
+            if (rock_ridge_parse(reader, record + su_start, record_len - su_start, &rr) != 0) {
+                log_write(g_log_ctx, LOG_INFO, "Cannot read Rock Ridge entries in image");
+                goto done;
+            }
+            
+            if (rr.relocated) {
+                continue; // Listed again where it belongs, through a CL entry
+            }
+            if (rr.has_name) {
+                snprintf(name, sizeof(name), "%s", rr.name);
+            }
+            if (rr.has_mode) {
+                mode = rr.mode;
+            }
+            if (rr.has_mtime) {
+                mtime = rr.mtime;
+            }
+            if (rr.has_atime) {
+                atime = rr.atime;
+            }
+            if (rr.child >= 0) {
+                // Placeholder file for a directory that was moved to keep the tree 8 deep
+                mode = S_IFDIR | (mode & 07777);
+                data = (unsigned long long)rr.child * reader->block_size;
+                if (iso_directory_size(reader, rr.child, &size) != 0) {
+                    goto done;
+                }
+            }
+        }
+        
+        // Symlinks, devices and the like aren't copied from a mounted source either
+        if (!S_ISDIR(mode) && !S_ISREG(mode)) {
+            continue;
+        }
+        
+        if (!name_usable(name)) {
+            log_write(g_log_ctx, LOG_WARNING, "Skipping file with unusable name in image: %s/%s",
+                      relative != NULL ? relative : "", name);
+            continue;
+        }
+        
+        if (S_ISREG(mode) && (data > (unsigned long long)reader->size || size > (unsigned long long)reader->size - data)) {
+            log_write(g_log_ctx, LOG_INFO, "File extends past the end of the image: %s", name);
+            goto done;
+        }
+        
+        if (image_add(manifest, relative, name, mode, S_ISREG(mode) ? (off_t)size : 0, atime, mtime, data) != 0) {
+            goto done;
+        }
+        
+        if (S_ISDIR(mode) && dir_list_push(&subdirs, manifest->count - 1, data, size) != 0) {
+            goto done;
+        }
+    }
+    
+    if (in_parts) {
+        log_write(g_log_ctx, LOG_INFO, "Image directory ends in the middle of a file: %s", relative != NULL ? relative : "/");
+        goto done;
+    }
+    
+    free(buffer);
+    buffer = NULL;
+    
+    for (i = 0; i < subdirs.count; i++) {
+        if (iso_walk(reader, manifest, manifest->entries[subdirs.dirs[i].index].path,
+                     subdirs.dirs[i].offset, subdirs.dirs[i].length, depth + 1) != 0) {
+            goto done;
+        }
+    }
+    
+    result = 0;
+
+done:
+    free(buffer);
+    free(subdirs.dirs);
+    return result;
+}
+
+// Find the volume descriptors and pick the tree the kernel would show: Rock Ridge when the
+// primary tree has it, then Joliet, then plain ISO9660
+static int iso_read(ImageReader *reader, SourceManifest *manifest) {
+    unsigned char sector[ISO_SECTOR];
+    unsigned char primary[ISO_RECORD_SIZE];
+    unsigned char joliet[ISO_RECORD_SIZE];
+    const unsigned char *root;
+    int have_primary = 0;
+    int have_joliet = 0;
+    unsigned block_size = 0;
+    int i;
+    
+    for (i = 0; i < ISO_MAX_DESCRIPTORS; i++) {
+        if (image_read(reader, sector, sizeof(sector), (unsigned long long)(ISO_FIRST_DESCRIPTOR + i) * ISO_SECTOR) != 0 ||
+            memcmp(sector + 1, "CD001", 5) != 0) {
+            break;
+        }
+        
+        if (sector[0] == 255) {
+            break; // Set terminator
+        }
+        
+        if (sector[0] == 1 && !have_primary) {
+            memcpy(primary, sector + 156, sizeof(primary));
+            block_size = le16(sector + 128);
+            have_primary = 1;
+        } else if (sector[0] == 2 && !have_joliet && sector[88] == '%' && sector[89] == '/' &&
+                   (sector[90] == '@' || sector[90] == 'C' || sector[90] == 'E')) {
+            memcpy(joliet, sector + 156, sizeof(joliet));
+            have_joliet = 1;
+        }
+    }
+    
+    if (!have_primary) {
+        return -1;
+    }
+    
+    if (block_size != 512 && block_size != 1024 && block_size != 2048) {
+        log_write(g_log_ctx, LOG_INFO, "Unusual ISO9660 block size %u, can't read it directly", block_size);
+        return -1;
+    }
+    reader->block_size = block_size;
+    
+    // Rock Ridge announces itself with an SP entry in the root's own "." record
+    if (image_read(reader, sector, sizeof(sector), (unsigned long long)le32(primary + 2) * block_size) == 0 &&
+        sector[0] >= ISO_RECORD_SIZE && sector[32] == 1) {
+        const unsigned char *su = sector + ISO_RECORD_SIZE;
+        
+        if (sector[0] >= ISO_RECORD_SIZE + 7 && su[0] == 'S' && su[1] == 'P' && su[4] == 0xBE && su[5] == 0xEF) {
+            reader->rock_ridge = 1;
+            reader->susp_skip = su[6];
+        }
+    }
+    
+    root = primary;
+    if (!reader->rock_ridge && have_joliet) {
+        reader->joliet = 1;
+        root = joliet;
+    }
+    
+    log_write(g_log_ctx, LOG_INFO, "Image is ISO9660%s", reader->rock_ridge ? " with Rock Ridge" :
+              reader->joliet ? " with Joliet" : "");
+    
+    return iso_walk(reader, manifest, NULL, (unsigned long long)le32(root + 2) * block_size, le32(root + 10), 0);
+}
+
+// Checksum and location of a UDF descriptor tag
+static int udf_tag(const unsigned char *block, unsigned id, unsigned long long location) {
+    unsigned sum = 0;
+    int i;
+    
+    for (i = 0; i < 16; i++) {
+        if (i != 4) {
+            sum += block[i];
+        }
+    }
+    
+    return le16(block) == id && (sum & 0xFF) == block[4] && le32(block + 12) == (uint32_t)location;
+}
+
+// OSTA compressed unicode: 8 bit Latin-1 or 16 bit big endian, the first byte says which
+static void udf_name(const unsigned char *id, size_t length, char *out, size_t size) {
+    size_t len = 0;
+    size_t i;
+    
+    out[0] = '\0';
+    if (length == 0) {
+        return;
+    }
+    
+    if (id[0] == 16) {
+        utf16_name(id + 1, (length - 1) / 2, out, size);
+        return;
+    }
+    
+    for (i = 1; i < length && id[0] == 8; i++) {
+        put_utf8(out, size, &len, id[i]);
+    }
+}
+
+// One UDF file or directory: what it is and where its data lives
+typedef struct {
+    mode_t mode;
+    off_t size;
+    unsigned long long offset;
+    struct timespec atime;
+    struct timespec mtime;
+} UdfFile;
+
+// Read the (extended) file entry at lbn. Returns 1 for things the copy skips like symlinks,
+// -1 for anything that isn't one contiguous run of recorded blocks
+static int udf_file(ImageReader *reader, unsigned long long lbn, UdfFile *file) {
+    unsigned char block[UDF_MAX_BLOCK];
+    unsigned long long block_offset = reader->partition + lbn * reader->block_size;
+    unsigned long long next = 0;
+    unsigned long long recorded = 0;
+    unsigned ad_start;
+    unsigned ad_type;
+    uint32_t ea_len;
+    uint32_t ad_len;
+    uint32_t permissions;
+    unsigned pos;
+    
+    if (image_read(reader, block, reader->block_size, block_offset) != 0) {
+        return -1;
+    }
+    
+    if (udf_tag(block, UDF_TAG_FILE_ENTRY, lbn)) {
+        ea_len = le32(block + 168);
+        ad_len = le32(block + 172);
+        ad_start = 176;
+        file->atime = udf_time(block + 72);
+        file->mtime = udf_time(block + 84);
+    } else if (udf_tag(block, UDF_TAG_EXTENDED_FILE_ENTRY, lbn)) {
+        ea_len = le32(block + 208);
+        ad_len = le32(block + 212);
+        ad_start = 216;
+        file->atime = udf_time(block + 80);
+        file->mtime = udf_time(block + 92);
+    } else {
+        log_write(g_log_ctx, LOG_INFO, "Bad UDF file entry at block %llu", lbn);
+        return -1;
+    }
+    
+    // File type 4 is a directory and 5 a file, the rest isn't copied
+    if (block[27] == 4) {
+        file->mode = S_IFDIR;
+    } else if (block[27] == 5) {
+        file->mode = S_IFREG;
+    } else {
+        return 1;
+    }
+    
+    // Other, group and owner get five bits each, of which read, write and execute are the first three
+    permissions = le32(block + 44);
+    file->mode |= ((permissions >> 10) & 7) << 6 | ((permissions >> 5) & 7) << 3 | (permissions & 7);
+    file->size = (off_t)le64(block + 56);
+    file->offset = 0;
+    
+    if (ea_len > reader->block_size || ad_len > reader->block_size - ad_start - ea_len) {
+        log_write(g_log_ctx, LOG_INFO, "Bad UDF file entry at block %llu", lbn);
+        return -1;
+    }
+    ad_start += ea_len;
+    ad_type = le16(block + 34) & 7;
+    
+    if (ad_type == 3) {
+        // Small enough to live inside the file entry itself
+        if ((unsigned long long)file->size > ad_len) {
+            return -1;
+        }
+        file->offset = block_offset + ad_start;
+        return 0;
+    }
+    
+    if (ad_type != 0 && ad_type != 1) {
+        log_write(g_log_ctx, LOG_INFO, "UDF file uses extended allocation descriptors, can't read it directly");
+        return -1;
+    }
+    
+    // Short descriptors are 8 bytes, long ones 16 with a partition reference
+    for (pos = 0; pos + (ad_type == 0 ? 8 : 16) <= ad_len; pos += ad_type == 0 ? 8 : 16) {
+        const unsigned char *ad = block + ad_start + pos;
+        uint32_t length = le32(ad) & 0x3FFFFFFF;
+        unsigned kind = le32(ad) >> 30;
+        unsigned long long start;
+        
+        if (length == 0) {
+            break;
+        }
+        
+        // Anything but recorded data (sparse, unrecorded, continued elsewhere) goes to the kernel
+        if (kind != 0 || (ad_type == 1 && le16(ad + 8) != 0)) {
+            log_write(g_log_ctx, LOG_INFO, "UDF file isn't a plain run of blocks, can't read it directly");
+            return -1;
+        }
+        
+        start = reader->partition + (unsigned long long)le32(ad + 4) * reader->block_size;
+        if (recorded == 0) {
+            file->offset = start;
+        } else if (start != next) {
+            log_write(g_log_ctx, LOG_INFO, "Image has a fragmented file, can't read it directly");
+            return -1;
+        }
+        next = start + length;
+        recorded += length;
+    }
+    
+    if (recorded < (unsigned long long)file->size || next > (unsigned long long)reader->size) {
+        log_write(g_log_ctx, LOG_INFO, "UDF file extends past its blocks or the image");
+        return -1;
+    }
+    
+    return 0;
+}
+
+// Add everything in one UDF directory, then descend into its subdirectories
+static int udf_walk(ImageReader *reader, SourceManifest *manifest, const char *relative,
+                    unsigned long long offset, unsigned long long length, int depth) {
+    ImageDirList subdirs = { NULL, 0, 0 };
+    unsigned char *buffer;
+    char name[IMAGE_MAX_NAME];
+    unsigned long long pos = 0;
+    int result = -1;
+    size_t i;
+    
+    if (depth > IMAGE_MAX_DEPTH) {
+        log_write(g_log_ctx, LOG_INFO, "Image directories nest too deep: %s", relative);
+        return -1;
+    }
+    
+    buffer = image_read_directory(reader, offset, length);
+    if (buffer == NULL) {
+        return -1;
+    }
+    
+    // File identifier descriptors, each padded to four bytes
+    while (pos + 38 <= length) {
+        const unsigned char *fid = buffer + pos;
+        unsigned characteristics = fid[18];
+        unsigned id_len = fid[19];
+        unsigned use_len = le16(fid + 36);
+        UdfFile file;
+        int found;
+        
+        if (le16(fid) != UDF_TAG_FILE_ID || pos + 38 + use_len + id_len > length) {
+            log_write(g_log_ctx, LOG_INFO, "Bad UDF directory in image: %s", relative != NULL ? relative : "/");
+            goto done;
+        }
+        pos += (38 + use_len + id_len + 3) & ~3U;
+        
+        // Hidden files stay hidden, the same as the kernel mounts them
+        if (characteristics & (UDF_FID_PARENT | UDF_FID_DELETED | UDF_FID_HIDDEN)) {
+            continue;
+        }
+        
+        if (le16(fid + 28) != 0) {
+            log_write(g_log_ctx, LOG_INFO, "UDF file on another partition, can't read it directly");
+            goto done;
+        }
+        
+        found = udf_file(reader, le32(fid + 24), &file);
+        if (found < 0) {
+            goto done;
+        }
+        if (found > 0) {
+            continue;
+        }
+        
+        udf_name(fid + 38 + use_len, id_len, name, sizeof(name));
+        if (!name_usable(name)) {
+            log_write(g_log_ctx, LOG_WARNING, "Skipping file with unusable name in image: %s/%s",
+                      relative != NULL ? relative : "", name);
+            continue;
+        }
+        
+        if (image_add(manifest, relative, name, file.mode, S_ISREG(file.mode) ? file.size : 0,
+                      file.atime, file.mtime, file.offset) != 0) {
+            goto done;
+        }
+        
+        if (S_ISDIR(file.mode) && dir_list_push(&subdirs, manifest->count - 1, file.offset, file.size) != 0) {
+            goto done;
+        }
+    }
+    
+    free(buffer);
+    buffer = NULL;
+    
+    for (i = 0; i < subdirs.count; i++) {
+        if (udf_walk(reader, manifest, manifest->entries[subdirs.dirs[i].index].path,
+                     subdirs.dirs[i].offset, subdirs.dirs[i].length, depth + 1) != 0) {
+            goto done;
+        }
+    }
+    
+    result = 0;
+
+done:
+    free(buffer);
+    free(subdirs.dirs);
+    return result;
+}
+
+// Is there a UDF volume? An NSR descriptor in the volume recognition sequence says so
+static int udf_present(ImageReader *reader) {
+    unsigned char sector[ISO_SECTOR];
+    int i;
+    
+    for (i = 0; i < ISO_MAX_DESCRIPTORS; i++) {
+        if (image_read(reader, sector, sizeof(sector), (unsigned long long)(ISO_FIRST_DESCRIPTOR + i) * ISO_SECTOR) != 0) {
+            return 0;
+        }
+        if (memcmp(sector + 1, "NSR02", 5) == 0 || memcmp(sector + 1, "NSR03", 5) == 0) {
+            return 1;
+        }
+        if (memcmp(sector + 1, "TEA01", 5) == 0) {
+            return 0; // End of the sequence
+        }
+    }
+    
+    return 0;
+}
+
+// Anchor -> volume descriptor sequence -> partition and logical volume -> file set -> root.
+// Only a single plain partition is handled, metadata and sparable partitions go to the kernel
+static int udf_read(ImageReader *reader, SourceManifest *manifest) {
+    unsigned char sector[ISO_SECTOR];
+    unsigned long long vds;
+    unsigned long long vds_end;
+    unsigned long long fsd_lbn = 0;
+    unsigned partition_number = 0;
+    unsigned mapped_partition = 0;
+    unsigned long long partition_start = 0;
+    int have_partition = 0;
+    int have_volume = 0;
+    unsigned long long s;
+    UdfFile root;
+    
+    if (image_read(reader, sector, sizeof(sector), (unsigned long long)UDF_ANCHOR_SECTOR * ISO_SECTOR) != 0 ||
+        !udf_tag(sector, UDF_TAG_AVDP, UDF_ANCHOR_SECTOR)) {
+        log_write(g_log_ctx, LOG_INFO, "No UDF anchor at sector %d", UDF_ANCHOR_SECTOR);
+        return -1;
+    }
+    
+    vds = le32(sector + 20);
+    vds_end = vds + le32(sector + 16) / ISO_SECTOR;
+    
+    for (s = vds; s < vds_end && s < vds + ISO_MAX_DESCRIPTORS; s++) {
+        if (image_read(reader, sector, sizeof(sector), s * ISO_SECTOR) != 0) {
+            return -1;
+        }
+        
+        if (udf_tag(sector, UDF_TAG_TERMINATOR, s)) {
+            break;
+        }
+        
+        if (udf_tag(sector, UDF_TAG_PARTITION, s) && !have_partition) {
+            partition_number = le16(sector + 22);
+            partition_start = le32(sector + 188);
+            have_partition = 1;
+        } else if (udf_tag(sector, UDF_TAG_LOGICAL_VOLUME, s) && !have_volume) {
+            const unsigned char *map = sector + 440;
+            uint32_t maps = le32(sector + 268);
+            
+            reader->block_size = le32(sector + 212);
+            fsd_lbn = le32(sector + 252);
+            
+            if (maps != 1 || map[0] != 1 || le16(sector + 256) != 0) {
+                log_write(g_log_ctx, LOG_INFO, "UDF volume has a partition layout that needs the kernel");
+                return -1;
+            }
+            
+            mapped_partition = le16(map + 4);
+            have_volume = 1;
+        }
+    }
+    
+    if (!have_partition || !have_volume || mapped_partition != partition_number ||
+        reader->block_size != ISO_SECTOR) {
+        log_write(g_log_ctx, LOG_INFO, "UDF volume descriptors incomplete or unusual block size");
+        return -1;
+    }
+    
+    reader->partition = partition_start * reader->block_size;
+    
+    // File set descriptor, its root directory ICB is a long allocation descriptor at 400
+    if (image_read(reader, sector, sizeof(sector), reader->partition + fsd_lbn * reader->block_size) != 0 ||
+        !udf_tag(sector, UDF_TAG_FILE_SET, fsd_lbn) || le16(sector + 408) != 0) {
+        log_write(g_log_ctx, LOG_INFO, "No UDF file set descriptor");
+        return -1;
+    }
+    
+    if (udf_file(reader, le32(sector + 404), &root) != 0 || !S_ISDIR(root.mode)) {
+        return -1;
+    }
+    
+    log_write(g_log_ctx, LOG_INFO, "Image is UDF");
+    return udf_walk(reader, manifest, NULL, root.offset, root.size, 0);
+}
+
+// Build the manifest from the filesystem inside an image, without mounting it. Returns -1
+// when it can't be read directly, the manifest is empty then and the image should be mounted
+int manifest_build_image(SourceManifest *manifest, const char *image) {
+    ImageReader reader;
+    int result;
+    
+    memset(manifest, 0, sizeof(*manifest));
+    manifest->largest = -1;
+    snprintf(manifest->root, sizeof(manifest->root), "%s", image);
+    snprintf(manifest->image, sizeof(manifest->image), "%s", image);
+    
+    log_write(g_log_ctx, LOG_STEP, "Reading source image: %s", image);
+    
+    memset(&reader, 0, sizeof(reader));
+    reader.fd = open(image, O_RDONLY | O_CLOEXEC);
+    if (reader.fd < 0) {
+        log_write(g_log_ctx, LOG_INFO, "Cannot open image: %s - %s", image, strerror(errno));
+        manifest_free(manifest);
+        return -1;
+    }
+    
+    // lseek rather than st_size so a disc drive works too
+    reader.size = lseek(reader.fd, 0, SEEK_END);
+    
+    // A UDF volume we can't read means the ISO9660 side is likely just a "use UDF" readme
+    if (udf_present(&reader)) {
+        result = udf_read(&reader, manifest);
+    } else {
+        result = iso_read(&reader, manifest);
+    }
+    
+    close(reader.fd);
+    
+    if (result != 0) {
+        manifest_free(manifest);
+        return -1;
+    }
+    
+    log_write(g_log_ctx, LOG_INFO, "Source contains %zu files in %zu directories (%llu MB)",
+              manifest->file_count, manifest->dir_count, manifest->total_size / (1024 * 1024));
+    
+    if (manifest->largest >= 0) {
+        log_write(g_log_ctx, LOG_INFO, "Largest file: %s (%llu bytes)", manifest->entries[manifest->largest].path,
+                  (unsigned long long)manifest->entries[manifest->largest].size);
+    }
+    
+    return 0;
+}
@@ -0,0 +1,289 @@
+/*
+    buf - Command line tool for flashing ISO images onto USB drives.
+    Copyright (C) 2026  Bryson Kelly
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+*/
+
+
+// Copy journal
+// Every file that's completely on the target gets a line in JOURNAL_NAME on the target itself,
+// so a flash that dies at 90% can pick up where it left off with --resume instead of starting
+// over. A line is only written once the file's data is durable: straight after its fsync in
+// the default sync mode, or after a syncfs() checkpoint with --sync=deferred. The journal itself
+// is never synced, a line that didn't make it just means that file gets copied again.
+// The journal is removed once the whole copy has gone through
+#define _GNU_SOURCE
+#include "../include/buf.h"
+#include <fcntl.h>
+#include <pthread.h>
+
+#define JOURNAL_NAME ".buf-journal"
+#define JOURNAL_MAGIC "buf-journal 1"
+#define JOURNAL_CHECKPOINT (256ULL * 1024 * 1024) // Deferred mode syncs and journals every 256MB
+#define JOURNAL_MTIME_SLACK 2                     // FAT keeps mtimes to 2 seconds
+
+typedef struct {
+    const char *path;
+    off_t size;
+    time_t mtime;
+} JournalEntry;
+
+static char journal_path[MAX_PATH] = "";
+static int journal_fd = -1;
+static SyncMode journal_sync = SYNC_FILE;
+
+// Files a previous run finished, sorted by path
+static JournalEntry *finished = NULL;
+static size_t finished_count = 0;
+static char *finished_text = NULL; // The old journal, entries point into it
+
+// Lines waiting for the next checkpoint in deferred mode
+static char *pending = NULL;
+static size_t pending_length = 0;
+static size_t pending_capacity = 0;
+static unsigned long long pending_bytes = 0;
+
+static pthread_mutex_t journal_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static int compare_entries(const void *a, const void *b) {
+    return strcmp(((const JournalEntry *)a)->path, ((const JournalEntry *)b)->path);
+}
+
+// Read back what a previous run finished. Anything that doesn't belong to this source is ignored
+static void journal_load(const SourceManifest *manifest) {
+    char header[128];
+    char *line;
+    char *next;
+    size_t capacity = 0;
+    struct stat st;
+    int fd;
+    
+    fd = open(journal_path, O_RDONLY);
+    if (fd < 0) {
+        log_write(g_log_ctx, LOG_INFO, "No copy journal on target, nothing to resume");
+        return;
+    }
+    
+    if (fstat(fd, &st) != 0 || st.st_size == 0 || (finished_text = (char *)malloc(st.st_size + 1)) == NULL) {
+        close(fd);
+        return;
+    }
+    
+    if (read(fd, finished_text, st.st_size) != st.st_size) {
+        log_write(g_log_ctx, LOG_WARNING, "Could not read copy journal, copying everything");
+        close(fd);
+        return;
+    }
+    finished_text[st.st_size] = '\0';
+    close(fd);
+    
+    snprintf(header, sizeof(header), "%s %zu %llu", JOURNAL_MAGIC, manifest->file_count, manifest->total_size);
+    next = strchr(finished_text, '\n');
+    if (next == NULL || (size_t)(next - finished_text) != strlen(header) ||
+        strncmp(finished_text, header, strlen(header)) != 0) {
+        log_write(g_log_ctx, LOG_WARNING, "Copy journal on target is from a different source, copying everything");
+        return;
+    }
+    
+    for (line = next + 1; *line != '\0'; line = next + 1) {
+        long long size;
+        long long mtime;
+        int consumed = 0;
+        
+        next = strchr(line, '\n');
+        if (next == NULL) {
+            break; // Torn last line, that file gets copied again
+        }
+        *next = '\0';
+        
+        if (sscanf(line, "%lld %lld %n", &size, &mtime, &consumed) != 2 || consumed == 0) {
+            continue;
+        }
+        
+        if (finished_count == capacity) {
+            JournalEntry *entries;
+            
+            capacity = capacity ? capacity * 2 : 1024;
+            entries = (JournalEntry *)realloc(finished, capacity * sizeof(JournalEntry));
+            if (entries == NULL) {
+                break;
+            }
+            finished = entries;
+        }
+        
+        finished[finished_count].path = line + consumed;
+        finished[finished_count].size = (off_t)size;
+        finished[finished_count].mtime = (time_t)mtime;
+        finished_count++;
+    }
+    
+    qsort(finished, finished_count, sizeof(JournalEntry), compare_entries);
+    log_write(g_log_ctx, LOG_INFO, "Copy journal lists %zu finished files", finished_count);
+}
+
+// Start a new journal for this copy. With resume the old one is loaded first, and what it
+// lists goes straight back into the new one since those files are still on the target
+int journal_open(const SourceManifest *manifest, const char *target, int resume, SyncMode sync) {
+    char header[128];
+    int length;
+    
+    snprintf(journal_path, sizeof(journal_path), "%s/%s", target, JOURNAL_NAME);
+    journal_sync = sync;
+    
+    if (resume) {
+        journal_load(manifest);
+    }
+    
+    journal_fd = open(journal_path, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC, 0644);
+    if (journal_fd < 0) {
+        // Not fatal, the copy just can't be resumed
+        log_write(g_log_ctx, LOG_WARNING, "Could not create copy journal: %s - %s", journal_path, strerror(errno));
+        return -1;
+    }
+    
+    length = snprintf(header, sizeof(header), "%s %zu %llu\n", JOURNAL_MAGIC, manifest->file_count, manifest->total_size);
+    if (write(journal_fd, header, length) != length) {
+        log_write(g_log_ctx, LOG_WARNING, "Could not write copy journal: %s", journal_path);
+    }
+    
+    return 0;
+}
+
+static int journal_append(const char *text, size_t length) {
+    if (pending_length + length > pending_capacity) {
+        size_t capacity = pending_capacity ? pending_capacity * 2 : 64 * 1024;
+        char *grown;
+        
+        while (capacity < pending_length + length) {
+            capacity *= 2;
+        }
+        grown = (char *)realloc(pending, capacity);
+        if (grown == NULL) {
+            return -1;
+        }
+        pending = grown;
+        pending_capacity = capacity;
+    }
+    
+    memcpy(pending + pending_length, text, length);
+    pending_length += length;
+    return 0;
+}
+
+// Push the pending lines into the journal file. Their data has to be durable by now
+static void journal_flush(void) {
+    if (pending_length == 0 || journal_fd < 0) {
+        return;
+    }
+    
+    if (write(journal_fd, pending, pending_length) != (ssize_t)pending_length) {
+        log_write(g_log_ctx, LOG_WARNING, "Could not write copy journal: %s", journal_path);
+    }
+    pending_length = 0;
+    pending_bytes = 0;
+}
+
+// Did a previous run already put this file on the target? The target copy has to still
+// look like it did when it was journaled, otherwise it's copied again
+int journal_finished(const ManifestEntry *entry, const char *target_path) {
+    JournalEntry key;
+    JournalEntry *found;
+    struct stat st;
+    char line[MAX_PATH + 64];
+    int length;
+    
+    if (finished_count == 0) {
+        return 0;
+    }
+    
+    key.path = entry->path;
+    found = (JournalEntry *)bsearch(&key, finished, finished_count, sizeof(JournalEntry), compare_entries);
+    if (found == NULL || found->size != entry->size || found->mtime != entry->mtime.tv_sec) {
+        return 0;
+    }
+    
+    if (lstat(target_path, &st) != 0 || !S_ISREG(st.st_mode) || st.st_size != entry->size ||
+        llabs((long long)st.st_mtime - (long long)entry->mtime.tv_sec) > JOURNAL_MTIME_SLACK) {
+        return 0;
+    }
+    
+    // Still finished, carry it over into the new journal. Its data was synced by the run
+    // that copied it, so it doesn't have to wait for a checkpoint like the pending lines do
+    length = snprintf(line, sizeof(line), "%lld %lld %s\n", (long long)entry->size,
+                      (long long)entry->mtime.tv_sec, entry->path);
+    pthread_mutex_lock(&journal_lock);
+    if (journal_fd >= 0 && write(journal_fd, line, length) != length) {
+        log_write(g_log_ctx, LOG_WARNING, "Could not write copy journal: %s", journal_path);
+    }
+    pthread_mutex_unlock(&journal_lock);
+    
+    return 1;
+}
+
+// A file is completely copied. In deferred mode it only counts once a checkpoint synced it
+void journal_add(const ManifestEntry *entry) {
+    char line[MAX_PATH + 64];
+    int length;
+    
+    if (journal_fd < 0 || strchr(entry->path, '\n') != NULL) {
+        return;
+    }
+    
+    length = snprintf(line, sizeof(line), "%lld %lld %s\n", (long long)entry->size,
+                      (long long)entry->mtime.tv_sec, entry->path);
+    
+    pthread_mutex_lock(&journal_lock);
+    journal_append(line, length);
+    pending_bytes += entry->size;
+    
+    if (journal_sync != SYNC_DEFERRED) {
+        // copy_file already fsync'd this one
+        journal_flush();
+    } else if (pending_bytes >= JOURNAL_CHECKPOINT) {
+        if (syncfs(journal_fd) == 0) {
+            journal_flush();
+        }
+    }
+    pthread_mutex_unlock(&journal_lock);
+}
+
+// The copy succeeded and is synced, so the journal has nothing left to say. After a failure
+// in deferred mode the files finished since the last checkpoint are synced and kept
+void journal_close(int success) {
+    if (journal_fd >= 0 && !success && syncfs(journal_fd) == 0) {
+        journal_flush();
+    }
+    
+    if (journal_fd >= 0) {
+        close(journal_fd);
+        journal_fd = -1;
+        
+        if (success) {
+            unlink(journal_path);
+        }
+    }
+    
+    free(finished);
+    free(finished_text);
+    free(pending);
+    finished = NULL;
+    finished_text = NULL;
+    pending = NULL;
+    finished_count = 0;
+    pending_length = 0;
+    pending_capacity = 0;
+    pending_bytes = 0;
+}
@@ -185,6 +185,8 @@ void log_write(LogContext *ctx, LogLevel level, const char *format, ...) {
     
     get_timestamp(timestamp, sizeof(timestamp));
     
+    // Fan-out copies log from several threads, keep each line in one piece
+    flockfile(ctx->file);
     fprintf(ctx->file, "%s %s ", timestamp, get_level_string(level));
     
     va_start(args, format);
@@ -193,6 +195,7 @@ void log_write(LogContext *ctx, LogLevel level, const char *format, ...) {
     
     fprintf(ctx->file, "\n");
     fflush(ctx->file);
+    funlockfile(ctx->file);
 }
 
 // Write a section header to organize the log file and make it fancy
@@ -260,6 +263,7 @@ void log_config(LogContext *ctx, Config *config) {
     const char *mode_str;
     const char *fs_str;
     const char *iso_str;
+    int i;
     
     if (ctx == NULL || !ctx->enabled || ctx->file == NULL || config == NULL) {
         return;
@@ -270,6 +274,7 @@ void log_config(LogContext *ctx, Config *config) {
     switch (config->mode) {
         case MODE_WIPE:      mode_str = "Wipe Mode (Full Device)"; break;
         case MODE_PARTITION: mode_str = "Partition Mode"; break;
+        case MODE_RAW:       mode_str = "Raw Image (Full Device)"; break;
         default:             mode_str = "Unknown"; break;
     }
     
@@ -289,10 +294,13 @@ void log_config(LogContext *ctx, Config *config) {
     log_write(ctx, LOG_INFO, "Installation Mode: %s", mode_str);
     log_write(ctx, LOG_INFO, "Source Media: %s", config->source);
     log_write(ctx, LOG_INFO, "Target Device: %s", config->target);
+    for (i = 1; i < config->target_count; i++) {
+        log_write(ctx, LOG_INFO, "Target Device: %s", config->targets[i]);
+    }
     
     if (config->mode == MODE_WIPE) {
         log_write(ctx, LOG_INFO, "Target Partition (will be created): %s", config->target_partition);
-    } else {
+    } else if (config->mode == MODE_PARTITION) {
         log_write(ctx, LOG_INFO, "Target Partition (existing): %s", config->target_partition);
     }
     
@@ -300,6 +308,24 @@ void log_config(LogContext *ctx, Config *config) {
     log_write(ctx, LOG_INFO, "Filesystem Label: %s", config->label);
     log_write(ctx, LOG_INFO, "ISO Type: %s", iso_str);
     log_write(ctx, LOG_INFO, "Verbose Mode: %s", config->verbose ? "Enabled" : "Disabled");
+    log_write(ctx, LOG_INFO, "Copy Jobs: %d", config->copy.jobs);
+    log_write(ctx, LOG_INFO, "Copy Engine: %s", copy_engine_name(config->copy.engine));
+    log_write(ctx, LOG_INFO, "Copy Order: %s", config->copy.order == ORDER_PHYSICAL ? "Physical" :
+              config->copy.order == ORDER_LARGEST ? "Largest first" : "Directory");
+    log_write(ctx, LOG_INFO, "Sync Mode: %s", config->copy.sync == SYNC_DEFERRED ? "Deferred (syncfs)" : "Per-file (fsync)");
+    log_write(ctx, LOG_INFO, "Direct I/O: %s", config->copy.direct_io ? "Enabled" : "Disabled");
+    log_write(ctx, LOG_INFO, "Resume: %s", config->copy.resume ? "Enabled" : "Disabled");
+    log_write(ctx, LOG_INFO, "Verify: %s", config->copy.verify ? "Enabled" : "Disabled");
+    log_write(ctx, LOG_INFO, "Checksums File: %s", config->copy.checksums[0] ? config->copy.checksums : "None");
+    if (config->progress_fd >= 0) {
+        log_write(ctx, LOG_INFO, "Progress Stream: JSON on fd %d", config->progress_fd);
+    } else {
+        log_write(ctx, LOG_INFO, "Progress Stream: None");
+    }
+    log_write(ctx, LOG_INFO, "Metrics File: %s", config->metrics[0] ? config->metrics : "None");
+    log_write(ctx, LOG_INFO, "Metrics Textfile: %s", config->metrics_textfile[0] ? config->metrics_textfile : "None");
+    log_write(ctx, LOG_INFO, "Native FAT32 Writer: %s", config->native_fat ? "Enabled" : "Disabled");
+    log_write(ctx, LOG_INFO, "Source Reader: %s", config->mount_source ? "Loop mount" : "Direct, mount if unsupported");
     
     fprintf(ctx->file, "\n");
     fflush(ctx->file);
@@ -314,7 +340,7 @@ void log_command_invocation(LogContext *ctx, int argc, char *argv[]) {
 	}
 
 	full_command[0] = '\0';
-
+    
     // Concatenate all arguments into a single string
 	for (i = 0; i < argc; i++) {
 		if (i > 0) {
@@ -332,15 +358,15 @@ void log_command_invocation(LogContext *ctx, int argc, char *argv[]) {
 	fflush(ctx->file);
 }
 
-// Log the command execution and it's result
-void log_command(LogContext *ctx, const char *command, int result) {
+// Log the command execution, it's result and how long it took
+void log_command(LogContext *ctx, const char *command, int result, double seconds) {
     if (ctx == NULL || !ctx->enabled || ctx->file == NULL) {
         return;
     }
     
     if (result == 0) {
-        log_write(ctx, LOG_INFO, "Command succeeded: %s", command);
+        log_write(ctx, LOG_INFO, "Command succeeded (%.3fs): %s", seconds, command);
     } else {
-        log_write(ctx, LOG_ERROR, "Command failed (exit code %d): %s", result, command);
+        log_write(ctx, LOG_ERROR, "Command failed (exit code %d, %.3fs): %s", result, seconds, command);
     }
 }
@@ -25,6 +25,7 @@ int main(int argc, char *argv[]) {
     MountPoints mounts = {0};
     char uefi_partition[MAX_PATH];
     LogContext log_ctx = {0};
+    SourceManifest manifest = {0};
     int operation_success = 0;
 
     // Error out if not running with root privileges
@@ -38,6 +39,19 @@ int main(int argc, char *argv[]) {
     config.verbose = 0;
     config.no_log = 0;
     config.iso_type = ISO_UNKNOWN;
+    config.copy.jobs = 1;
+    config.copy.engine = ENGINE_DEFAULT;
+    config.copy.sync = SYNC_FILE;
+    config.copy.order = ORDER_NONE;
+    config.copy.direct_io = 0;
+    config.copy.resume = 0;
+    config.copy.verify = 0;
+    config.copy.checksums[0] = '\0';
+    config.metrics[0] = '\0';
+    config.metrics_textfile[0] = '\0';
+    config.progress_fd = -1;
+    config.native_fat = 0;
+    config.mount_source = 0;
     strncpy(config.label, DEFAULT_FS_LABEL, sizeof(config.label) - 1);
 
     if (parse_arguments(argc, argv, &config) != 0) {
@@ -45,6 +59,14 @@ int main(int argc, char *argv[]) {
         return 1;
     }
 
+    progress_init(config.progress_fd);
+    
+    // Every phase from here on is timed when --metrics or --metrics-textfile is given
+    if (metrics_init(config.metrics, config.metrics_textfile) != 0) {
+        fprintf(stderr, "Warning: Could not set up metrics, none will be written\n");
+    }
+    metrics_phase("checks");
+    
     // Ignore logging if --no-log flag is passed
     if (!config.no_log) {
         if (log_init(&log_ctx, NULL) == 0) {
@@ -78,6 +100,27 @@ int main(int argc, char *argv[]) {
     
     log_write(&log_ctx, LOG_SUCCESS, "Source media validated: %s", config.source);
 
+    // Several sticks at once go through their own path, every step once per stick
+    if (config.target_count > 1) {
+        if (flash_targets(&config) != 0) {
+            fprintf(stderr, "Error: Not every target was flashed\n");
+            log_write(&log_ctx, LOG_ERROR, "Multi-target flash finished with failures");
+            log_close(&log_ctx, 0);
+            return 1;
+        }
+        
+        print_colored("Installation complete!", "green");
+        log_write(&log_ctx, LOG_SUCCESS, "USB installation completed successfully on %d devices!", config.target_count);
+        print_colored("You may now safely remove the USB devices", "green");
+        metrics_success();
+        
+        if (!config.no_log) {
+            log_close(&log_ctx, 1);
+        }
+        
+        return 0;
+    }
+    
     // Check target device/partition is correct for selected mode
     if (check_target_media(config.target, config.mode) != 0) {
         log_write(&log_ctx, LOG_ERROR, "Target media validation failed: %s", config.target);
@@ -121,7 +164,7 @@ int main(int argc, char *argv[]) {
             log_write(&log_ctx, LOG_SUCCESS, "Target partition unmounted successfully");
         }
     } else {
-        // Wipe mode handling
+        // Wipe and raw mode handling
         if (is_device_busy(config.target_device)) {
             print_colored("Target device is mounted, unmounting...", "yellow");
             log_write(&log_ctx, LOG_WARNING, "Target device is mounted, attempting to unmount");
@@ -137,6 +180,33 @@ int main(int argc, char *argv[]) {
         }
     }
 
+    // Raw mode writes the image as it is, nothing gets mounted, partitioned or copied
+    if (config.mode == MODE_RAW) {
+        log_config(&log_ctx, &config);
+        log_section(&log_ctx, "RAW IMAGE WRITE");
+        metrics_phase("raw_write");
+        
+        if (write_raw_image(config.source, config.target_device, &config.copy) != 0) {
+            fprintf(stderr, "Error: Failed to write image\n");
+            log_write(&log_ctx, LOG_ERROR, "Raw image write failed: %s", config.target_device);
+            log_close(&log_ctx, 0);
+            return 1;
+        }
+        
+        print_colored("Installation complete!", "green");
+        log_write(&log_ctx, LOG_SUCCESS, "USB installation completed successfully!");
+        print_colored("You may now safely remove the USB device", "green");
+        metrics_success();
+        
+        if (!config.no_log) {
+            log_close(&log_ctx, 1);
+        }
+        
+        return 0;
+    }
+
+    metrics_phase("source_scan");
+    
     // Create temporary mount points
     if (create_mountpoints(&mounts) != 0) {
         fprintf(stderr, "Error: Failed to create mountpoints\n");
@@ -149,25 +219,43 @@ int main(int argc, char *argv[]) {
     log_write(&log_ctx, LOG_INFO, "Source mountpoint: %s", mounts.source_mountpoint);
     log_write(&log_ctx, LOG_INFO, "Target mountpoint: %s", mounts.target_mountpoint);
 
-    if (mount_source(config.source, mounts.source_mountpoint) != 0) {
-        fprintf(stderr, "Error: Failed to mount source media\n");
-        log_write(&log_ctx, LOG_ERROR, "Failed to mount source media: %s", config.source);
-        cleanup(&mounts, config.target);
-        log_close(&log_ctx, 0);
-        return 1;
+    // Read the files straight out of the image when buf understands its filesystem.
+    // Only what it doesn't, or everything with --mount-source, gets mounted
+    if (!config.mount_source && manifest_build_image(&manifest, config.source) == 0) {
+        log_write(&log_ctx, LOG_SUCCESS, "Reading source files directly from the image, no mount needed");
+    } else {
+        log_write(&log_ctx, LOG_INFO, config.mount_source ? "Mounting the image as requested by --mount-source" :
+                  "Cannot read the image directly, mounting it instead");
+        
+        if (mount_source(config.source, mounts.source_mountpoint) != 0) {
+            fprintf(stderr, "Error: Failed to mount source media\n");
+            log_write(&log_ctx, LOG_ERROR, "Failed to mount source media: %s", config.source);
+            cleanup(&mounts, config.target);
+            log_close(&log_ctx, 0);
+            return 1;
+        }
+        
+        log_write(&log_ctx, LOG_SUCCESS, "Source media mounted successfully");
+        
+        // Walk the source once. Every check and the copy work from this list
+        if (manifest_build(&manifest, mounts.source_mountpoint) != 0) {
+            fprintf(stderr, "Error: Failed to read source files\n");
+            log_write(&log_ctx, LOG_ERROR, "Failed to scan source: %s", mounts.source_mountpoint);
+            cleanup(&mounts, config.target);
+            log_close(&log_ctx, 0);
+            return 1;
+        }
     }
-    
-    log_write(&log_ctx, LOG_SUCCESS, "Source media mounted successfully");
 
     // What ISO is this?
-    config.iso_type = detect_iso_type(mounts.source_mountpoint);
+    config.iso_type = detect_iso_type(&manifest);
     log_write(&log_ctx, LOG_INFO, "Detected ISO type: %s", 
               config.iso_type == ISO_WINDOWS ? "Windows" : 
               config.iso_type == ISO_LINUX ? "Linux" : "Other");
 
     // Check if files exceed FAT32 limits. If so, switch to NTFS.
     if (config.iso_type == ISO_WINDOWS) {
-        if (check_fat32_limitation(mounts.source_mountpoint, &config.filesystem) != 0) {
+        if (check_fat32_limitation(&manifest, &config.filesystem) != 0) {
             print_colored("Notice: Large files detected, switching to NTFS", "yellow");
             log_write(&log_ctx, LOG_WARNING, "Large files detected (>4GB), switching to NTFS filesystem");
             config.filesystem = FS_NTFS;
@@ -178,14 +266,23 @@ int main(int argc, char *argv[]) {
     
     log_config(&log_ctx, &config);
 
-    // Wipe mode execution
-    if (config.mode == MODE_WIPE) {
+    // With --native-fat a freshly wiped device gets its FAT32 written by buf itself in one pass, no
+    // mkfs and no mount. An ISO that needed NTFS after all still goes through mkfs
+    int native_fat = config.native_fat && config.filesystem == FS_FAT;
+
+    // Wipe mode execution. When resuming, the partition a failed run already made is kept
+    if (config.mode == MODE_WIPE && config.copy.resume && is_block_device(config.target_partition)) {
+        log_section(&log_ctx, "DEVICE PREPARATION");
+        print_colored("Resuming on existing partition...", "green");
+        log_write(&log_ctx, LOG_INFO, "Resume requested, keeping existing partition: %s", config.target_partition);
+    } else if (config.mode == MODE_WIPE) {
         log_section(&log_ctx, "DEVICE PREPARATION");
         
         print_colored("Preparing target device...", "green");
         log_write(&log_ctx, LOG_STEP, "Starting device preparation (wipe mode)");
         
         // Wipe existing FS signatures
+        metrics_phase("wipe");
         if (wipe_device(config.target_device) != 0) {
             fprintf(stderr, "Error: Failed to wipe device\n");
             log_write(&log_ctx, LOG_ERROR, "Failed to wipe device: %s", config.target_device);
@@ -197,6 +294,7 @@ int main(int argc, char *argv[]) {
         log_write(&log_ctx, LOG_SUCCESS, "Device wiped successfully");
 
         // Create MSDOS partition table
+        metrics_phase("partition_table");
         if (create_partition_table(config.target_device) != 0) {
             fprintf(stderr, "Error: Failed to create partition table\n");
             log_write(&log_ctx, LOG_ERROR, "Failed to create partition table on: %s", config.target_device);
@@ -208,8 +306,8 @@ int main(int argc, char *argv[]) {
         log_write(&log_ctx, LOG_SUCCESS, "Partition table created (MSDOS/MBR)");
 
         // Create and format partition
-        if (create_partition(config.target_device, config.target_partition, 
-                           config.filesystem, config.label) != 0) {
+        metrics_phase("partition");
+        if (create_partition(config.target_device, config.target_partition, config.filesystem) != 0) {
             fprintf(stderr, "Error: Failed to create partition\n");
             log_write(&log_ctx, LOG_ERROR, "Failed to create partition: %s", config.target_partition);
             cleanup(&mounts, config.target);
@@ -217,12 +315,24 @@ int main(int argc, char *argv[]) {
             return 1;
         }
         
-        log_write(&log_ctx, LOG_SUCCESS, "Partition created and formatted: %s (%s)", 
+        if (!native_fat) {
+            metrics_phase("format");
+            if (format_partition(config.target_partition, config.filesystem, config.label) != 0) {
+                fprintf(stderr, "Error: Failed to format partition\n");
+                log_write(&log_ctx, LOG_ERROR, "Failed to format partition: %s", config.target_partition);
+                cleanup(&mounts, config.target);
+                log_close(&log_ctx, 0);
+                return 1;
+            }
+        }
+        
+        log_write(&log_ctx, LOG_SUCCESS, "Partition created%s: %s (%s)", native_fat ? "" : " and formatted",
                   config.target_partition, config.filesystem == FS_NTFS ? "NTFS" : "FAT32");
 
         // Create UEFI:NTFS helper partition for windows NTFS installs
         if (config.iso_type == ISO_WINDOWS && config.filesystem == FS_NTFS) {
             log_write(&log_ctx, LOG_INFO, "Creating UEFI:NTFS support partition for Windows NTFS installation");
+            metrics_phase("uefi_ntfs");
             
             if (create_uefi_ntfs_partition(config.target_device) != 0) {
                 print_colored("Warning: Failed to create UEFI:NTFS partition", "yellow");
@@ -246,60 +356,98 @@ int main(int argc, char *argv[]) {
         log_write(&log_ctx, LOG_INFO, "Using existing partition: %s", config.target_partition);
     }
 
-    // Mount partition for writing
-    if (mount_target(config.target_partition, mounts.target_mountpoint) != 0) {
-        fprintf(stderr, "Error: Failed to mount target partition\n");
-        log_write(&log_ctx, LOG_ERROR, "Failed to mount target partition: %s", config.target_partition);
-        cleanup(&mounts, config.target);
-        log_close(&log_ctx, 0);
-        return 1;
+    if (native_fat) {
+        log_section(&log_ctx, "FILE COPY OPERATION");
+        
+        metrics_phase("fat32_write");
+        print_colored("Writing FAT32 filesystem...", "green");
+        log_write(&log_ctx, LOG_STEP, "Writing FAT32 filesystem and files straight to the partition");
+        log_write(&log_ctx, LOG_INFO, "Copying from: %s", manifest.root);
+        log_write(&log_ctx, LOG_INFO, "Copying to: %s", config.target_partition);
+        
+        if (write_fat32(&manifest, config.target_partition, config.label, config.verbose, &config.copy) != 0) {
+            fprintf(stderr, "Error: Failed to write FAT32 filesystem\n");
+            manifest_free(&manifest);
+            log_write(&log_ctx, LOG_ERROR, "Native FAT32 write failed");
+            cleanup(&mounts, config.target);
+            log_close(&log_ctx, 0);
+            return 1;
+        }
+        
+        log_write(&log_ctx, LOG_SUCCESS, "All files copied successfully");
     }
-    
-    log_write(&log_ctx, LOG_SUCCESS, "Target partition mounted successfully");
 
-    // Check if we have free space on target. If not, stop the bastard
-    if (check_free_space(mounts.source_mountpoint, mounts.target_mountpoint, 
-                        config.target_partition) != 0) {
-        log_write(&log_ctx, LOG_ERROR, "Insufficient space on target partition");
-        cleanup(&mounts, config.target);
-        log_close(&log_ctx, 0);
-        return 1;
+    // Mount partition for writing. A FAT32 buf wrote itself is only mounted for the Windows bootloader
+    if (!native_fat || config.iso_type == ISO_WINDOWS) {
+        metrics_phase("mount");
+        if (mount_target(config.target_partition, mounts.target_mountpoint) != 0) {
+            fprintf(stderr, "Error: Failed to mount target partition\n");
+            log_write(&log_ctx, LOG_ERROR, "Failed to mount target partition: %s", config.target_partition);
+            cleanup(&mounts, config.target);
+            log_close(&log_ctx, 0);
+            return 1;
+        }
+        
+        log_write(&log_ctx, LOG_SUCCESS, "Target partition mounted successfully");
     }
-    
-    // Calculate and log space info
-    unsigned long long source_size = get_directory_size(mounts.source_mountpoint);
-    unsigned long long target_free = get_free_space(mounts.target_mountpoint);
-    
-    log_write(&log_ctx, LOG_SUCCESS, "Space check passed");
-    log_write(&log_ctx, LOG_INFO, "Source size: %llu MB", source_size / (1024 * 1024));
-    log_write(&log_ctx, LOG_INFO, "Target free space: %llu MB", target_free / (1024 * 1024));
 
-    log_section(&log_ctx, "FILE COPY OPERATION");
-    
-    print_colored("Copying installation files...", "green");
-    log_write(&log_ctx, LOG_STEP, "Starting file copy operation");
-    log_write(&log_ctx, LOG_INFO, "Copying from: %s", mounts.source_mountpoint);
-    log_write(&log_ctx, LOG_INFO, "Copying to: %s", mounts.target_mountpoint);
-    
-    // Copy all files from source to target
-    if (copy_filesystem_files(mounts.source_mountpoint, mounts.target_mountpoint, 
-                             config.verbose) != 0) {
-        fprintf(stderr, "Error: Failed to copy files\n");
-        log_write(&log_ctx, LOG_ERROR, "File copy operation failed");
-        cleanup(&mounts, config.target);
-        log_close(&log_ctx, 0);
-        return 1;
+    // An existing partition may hold an earlier flash, then only the differences get copied
+    if (config.mode == MODE_PARTITION) {
+        delta_load(mounts.target_mountpoint);
+    }
+
+    if (!native_fat) {
+        metrics_phase("copy");
+        
+        // Check if we have free space on target. If not, stop the bastard
+        if (check_free_space(&manifest, mounts.target_mountpoint) != 0) {
+            log_write(&log_ctx, LOG_ERROR, "Insufficient space on target partition");
+            cleanup(&mounts, config.target);
+            log_close(&log_ctx, 0);
+            return 1;
+        }
+        
+        // Calculate and log space info
+        unsigned long long source_size = manifest.total_size;
+        unsigned long long target_free = get_free_space(mounts.target_mountpoint);
+        
+        log_write(&log_ctx, LOG_SUCCESS, "Space check passed");
+        log_write(&log_ctx, LOG_INFO, "Source size: %llu MB", source_size / (1024 * 1024));
+        log_write(&log_ctx, LOG_INFO, "Target free space: %llu MB", target_free / (1024 * 1024));
+
+        log_section(&log_ctx, "FILE COPY OPERATION");
+        
+        print_colored("Copying installation files...", "green");
+        log_write(&log_ctx, LOG_STEP, "Starting file copy operation");
+        log_write(&log_ctx, LOG_INFO, "Copying from: %s", manifest.root);
+        log_write(&log_ctx, LOG_INFO, "Copying to: %s", mounts.target_mountpoint);
+        
+        // Copy all files from source to target
+        if (copy_filesystem_files(&manifest, mounts.target_mountpoint, 
+                                 config.verbose, &config.copy) != 0) {
+            fprintf(stderr, "Error: Failed to copy files\n");
+            manifest_free(&manifest);
+            log_write(&log_ctx, LOG_ERROR, "File copy operation failed");
+            cleanup(&mounts, config.target);
+            log_close(&log_ctx, 0);
+            return 1;
+        }
+        
+        log_write(&log_ctx, LOG_SUCCESS, "All files copied successfully");
     }
     
-    log_write(&log_ctx, LOG_SUCCESS, "All files copied successfully");
+    // Nothing is mounted when the image was read directly, but the target has the same files now
+    const char *windows_source = manifest.image[0] != '\0' ? mounts.target_mountpoint : mounts.source_mountpoint;
+    manifest_free(&manifest);
 
     // Some windows-specific crap
     if (config.iso_type == ISO_WINDOWS) {
         log_section(&log_ctx, "BOOTLOADER INSTALLATION");
+        metrics_phase("bootloader");
         
         log_write(&log_ctx, LOG_STEP, "Applying Windows-specific configurations");
         
-        if (workaround_win7_uefi(mounts.source_mountpoint, mounts.target_mountpoint) != 0) {
+        if (workaround_win7_uefi(windows_source, mounts.target_mountpoint) != 0) {
             print_colored("Notice: Windows 7 UEFI workaround applied", "");
             log_write(&log_ctx, LOG_INFO, "Windows 7 UEFI workaround was necessary and applied");
         } else {
@@ -333,8 +481,10 @@ int main(int argc, char *argv[]) {
     }
 
     operation_success = 1;
+    metrics_success();
     
     log_section(&log_ctx, "CLEANUP");
+    metrics_phase("cleanup");
     log_write(&log_ctx, LOG_STEP, "Starting cleanup operations");
     
     print_colored("Installation complete!", "green");
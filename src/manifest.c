@@ -0,0 +1,301 @@
+/*
+    buf - Command line tool for flashing ISO images onto USB drives.
+    Copyright (C) 2026  Bryson Kelly
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+*/
+
+
+// Source manifest
+// The source tree is walked exactly once. The size check, the FAT32 check, the space check
+// and the copy itself all work from the list this builds instead of walking it again.
+// The walk is relative to directory fds, so the kernel never re-resolves a full path per file
+#define _GNU_SOURCE
+#include "../include/buf.h"
+#include <fcntl.h>
+#include <sys/syscall.h>
+
+#define ARENA_BLOCK_SIZE (1024 * 1024) // Paths are packed into 1MB blocks
+#define DENTS_BUFFER_SIZE (256 * 1024) // One getdents64 call covers most ISO directories
+
+// What getdents64 hands back. glibc only started wrapping it in 2.30
+struct linux_dirent64 {
+    unsigned long long d_ino;
+    long long d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+};
+
+struct ArenaBlock {
+    ArenaBlock *next;
+    size_t used;
+    char data[];
+};
+
+// Store "parent/name" (or just name at the root) in the manifest arena.
+// Nothing is freed until manifest_free
+static const char *arena_join(SourceManifest *manifest, const char *parent, const char *name) {
+    size_t parent_len = parent != NULL ? strlen(parent) : 0;
+    size_t name_len = strlen(name);
+    size_t len = parent_len + name_len + 2;
+    ArenaBlock *block = manifest->arena;
+    char *copy;
+    
+    if (block == NULL || block->used + len > ARENA_BLOCK_SIZE) {
+        size_t size = len > ARENA_BLOCK_SIZE ? len : ARENA_BLOCK_SIZE;
+        block = (ArenaBlock *)malloc(sizeof(ArenaBlock) + size);
+        if (block == NULL) {
+            return NULL;
+        }
+        block->next = manifest->arena;
+        block->used = 0;
+        manifest->arena = block;
+    }
+    
+    copy = block->data + block->used;
+    if (parent_len > 0) {
+        memcpy(copy, parent, parent_len);
+        copy[parent_len++] = '/';
+    }
+    memcpy(copy + parent_len, name, name_len + 1);
+    block->used += parent_len + name_len + 1;
+    return copy;
+}
+
+// statx with only the fields the manifest keeps, falling back to fstatat on old kernels
+static int stat_entry(int dir_fd, const char *name, struct stat *st) {
+#ifdef STATX_BASIC_STATS
+    struct statx stx;
+    
+    if (statx(dir_fd, name, AT_SYMLINK_NOFOLLOW | AT_NO_AUTOMOUNT, 
+              STATX_TYPE | STATX_MODE | STATX_SIZE | STATX_ATIME | STATX_MTIME, &stx) == 0) {
+        memset(st, 0, sizeof(*st));
+        st->st_mode = stx.stx_mode;
+        st->st_size = (off_t)stx.stx_size;
+        st->st_atim.tv_sec = stx.stx_atime.tv_sec;
+        st->st_atim.tv_nsec = stx.stx_atime.tv_nsec;
+        st->st_mtim.tv_sec = stx.stx_mtime.tv_sec;
+        st->st_mtim.tv_nsec = stx.stx_mtime.tv_nsec;
+        return 0;
+    }
+    
+    if (errno != ENOSYS) {
+        return -1;
+    }
+#endif
+    
+    return fstatat(dir_fd, name, st, AT_SYMLINK_NOFOLLOW);
+}
+
+// Add one file or directory. extent is where a file's data starts when it's read out of an
+// image rather than by its path, -1 otherwise
+int manifest_add(SourceManifest *manifest, const char *parent, const char *name, const struct stat *st, off_t extent) {
+    ManifestEntry *entry;
+    
+    if (manifest->count == manifest->capacity) {
+        size_t capacity = manifest->capacity ? manifest->capacity * 2 : 1024;
+        ManifestEntry *entries = (ManifestEntry *)realloc(manifest->entries, capacity * sizeof(ManifestEntry));
+        if (entries == NULL) {
+            return -1;
+        }
+        manifest->entries = entries;
+        manifest->capacity = capacity;
+    }
+    
+    entry = &manifest->entries[manifest->count];
+    entry->path = arena_join(manifest, parent, name);
+    if (entry->path == NULL) {
+        return -1;
+    }
+    entry->size = S_ISREG(st->st_mode) ? st->st_size : 0;
+    entry->mode = st->st_mode;
+    entry->atime = st->st_atim;
+    entry->mtime = st->st_mtim;
+    entry->extent = extent;
+    entry->physical = extent >= 0 ? (unsigned long long)extent : PHYSICAL_UNKNOWN;
+    entry->hash = 0;
+    entry->hashed = 0;
+    entry->unchanged = 0;
+    
+    if (S_ISDIR(st->st_mode)) {
+        manifest->dir_count++;
+    } else {
+        manifest->file_count++;
+        manifest->total_size += st->st_size;
+        if (manifest->largest < 0 || st->st_size > manifest->entries[manifest->largest].size) {
+            manifest->largest = (long)manifest->count;
+        }
+    }
+    
+    manifest->count++;
+    return 0;
+}
+
+// Add everything in one directory, then descend into its subdirectories. The entries of
+// this level sit at [first, last) in the manifest, so the subdirectories are found there
+// and a single getdents buffer serves the whole walk. relative is NULL for the root
+static int manifest_walk(SourceManifest *manifest, int dir_fd, const char *relative, char *dents) {
+    struct linux_dirent64 *entry;
+    struct stat st;
+    size_t first = manifest->count;
+    size_t last;
+    size_t i;
+    long nread;
+    long pos;
+    
+    while ((nread = syscall(SYS_getdents64, dir_fd, dents, DENTS_BUFFER_SIZE)) > 0) {
+        for (pos = 0; pos < nread; pos += entry->d_reclen) {
+            entry = (struct linux_dirent64 *)(dents + pos);
+            
+            // Skip . and ..
+            if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
+                continue;
+            }
+            
+            // Skip symlinks, device files, etc. without even stat'ing them
+            if (entry->d_type != DT_UNKNOWN && entry->d_type != DT_DIR && entry->d_type != DT_REG) {
+                continue;
+            }
+            
+            if (stat_entry(dir_fd, entry->d_name, &st) != 0) {
+                fprintf(stderr, "Warning: Cannot stat: %s/%s - %s\n", 
+                        relative != NULL ? relative : manifest->root, entry->d_name, strerror(errno));
+                log_write(g_log_ctx, LOG_WARNING, "Cannot stat: %s/%s", 
+                          relative != NULL ? relative : manifest->root, entry->d_name);
+                continue;
+            }
+            
+            if (!S_ISDIR(st.st_mode) && !S_ISREG(st.st_mode)) {
+                continue;
+            }
+            
+            if (manifest_add(manifest, relative, entry->d_name, &st, -1) != 0) {
+                log_write(g_log_ctx, LOG_ERROR, "Memory allocation failed");
+                return -1;
+            }
+        }
+    }
+    
+    if (nread < 0) {
+        fprintf(stderr, "Error: Failed to read directory: %s - %s\n", 
+                relative != NULL ? relative : manifest->root, strerror(errno));
+        log_write(g_log_ctx, LOG_ERROR, "Failed to read directory: %s", relative != NULL ? relative : manifest->root);
+        return -1;
+    }
+    
+    // Directories went in before their contents, now fill them in
+    last = manifest->count;
+    for (i = first; i < last; i++) {
+        const char *path = manifest->entries[i].path;
+        const char *name;
+        int child_fd;
+        int result;
+        
+        if (!S_ISDIR(manifest->entries[i].mode)) {
+            continue;
+        }
+        
+        name = strrchr(path, '/');
+        name = name != NULL ? name + 1 : path;
+        
+        child_fd = openat(dir_fd, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+        if (child_fd < 0) {
+            fprintf(stderr, "Error: Failed to open directory: %s - %s\n", path, strerror(errno));
+            log_write(g_log_ctx, LOG_ERROR, "Failed to open directory: %s", path);
+            return -1;
+        }
+        
+        result = manifest_walk(manifest, child_fd, path, dents);
+        close(child_fd);
+        if (result != 0) {
+            return -1;
+        }
+    }
+    
+    return 0;
+}
+
+int manifest_build(SourceManifest *manifest, const char *root) {
+    char *dents;
+    int root_fd;
+    int result;
+    
+    memset(manifest, 0, sizeof(*manifest));
+    manifest->largest = -1;
+    snprintf(manifest->root, sizeof(manifest->root), "%s", root);
+    
+    log_write(g_log_ctx, LOG_STEP, "Scanning source: %s", root);
+    
+    root_fd = open(root, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (root_fd < 0) {
+        fprintf(stderr, "Error: Failed to open directory: %s - %s\n", root, strerror(errno));
+        log_write(g_log_ctx, LOG_ERROR, "Failed to open directory: %s", root);
+        return -1;
+    }
+    
+    dents = (char *)malloc(DENTS_BUFFER_SIZE);
+    if (dents == NULL) {
+        log_write(g_log_ctx, LOG_ERROR, "Memory allocation failed");
+        close(root_fd);
+        return -1;
+    }
+    
+    result = manifest_walk(manifest, root_fd, NULL, dents);
+    free(dents);
+    close(root_fd);
+    
+    if (result != 0) {
+        manifest_free(manifest);
+        return -1;
+    }
+    
+    log_write(g_log_ctx, LOG_INFO, "Source contains %zu files in %zu directories (%llu MB)",
+              manifest->file_count, manifest->dir_count, manifest->total_size / (1024 * 1024));
+    
+    if (manifest->largest >= 0) {
+        log_write(g_log_ctx, LOG_INFO, "Largest file: %s (%llu bytes)", manifest->entries[manifest->largest].path,
+                  (unsigned long long)manifest->entries[manifest->largest].size);
+    }
+    
+    return 0;
+}
+
+// Look up an entry by its path relative to the source root, NULL if there's none
+const ManifestEntry *manifest_find(const SourceManifest *manifest, const char *path) {
+    size_t i;
+    
+    for (i = 0; i < manifest->count; i++) {
+        if (strcmp(manifest->entries[i].path, path) == 0) {
+            return &manifest->entries[i];
+        }
+    }
+    
+    return NULL;
+}
+
+void manifest_free(SourceManifest *manifest) {
+    ArenaBlock *block = manifest->arena;
+    
+    while (block != NULL) {
+        ArenaBlock *next = block->next;
+        free(block);
+        block = next;
+    }
+    
+    free(manifest->entries);
+    memset(manifest, 0, sizeof(*manifest));
+    manifest->largest = -1;
+}
@@ -0,0 +1,319 @@
+/*
+    buf - Command line tool for flashing ISO images onto USB drives.
+    Copyright (C) 2026  Bryson Kelly
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+*/
+
+
+// Run metrics
+// main() marks where each phase of a flash starts, and every phase gets its wall time off the
+// monotonic clock plus what the kernel accounted to us in the meantime: bytes and syscalls
+// from /proc/self/io, CPU time and peak RSS from getrusage (the mkfs and grub-install children
+// included), and how long we sat in fsync and umount. Written out at exit as JSON for
+// --metrics and as a node_exporter textfile for --metrics-textfile
+#include "../include/buf.h"
+#include <sys/resource.h>
+
+#define MAX_PHASES 32
+
+// Counters read at the start and end of a phase, the phase gets the difference
+typedef struct {
+    double clock;
+    unsigned long long rchar;       // Bytes read and written through syscalls, page cache or not
+    unsigned long long wchar;
+    unsigned long long syscr;       // Read and write syscalls
+    unsigned long long syscw;
+    unsigned long long read_bytes;  // Bytes that actually came from or went to a block device
+    unsigned long long write_bytes;
+    double user_cpu;
+    double system_cpu;
+    long voluntary_switches;        // Mostly time spent waiting on I/O
+    unsigned long long wait_ns[WAIT_KINDS];
+} MetricsSample;
+
+typedef struct {
+    const char *name;
+    MetricsSample start;
+    MetricsSample end;
+    long peak_rss_kb;
+    long children_peak_rss_kb;
+} MetricsPhase;
+
+static MetricsPhase phases[MAX_PHASES];
+static int phase_count = 0;
+static int phase_open = 0;
+static int enabled = 0;
+static int succeeded = 0;
+static double run_start;
+static time_t run_started_at;
+static char json_path[MAX_PATH];
+static char textfile_path[MAX_PATH];
+static _Atomic unsigned long long wait_ns[WAIT_KINDS];
+
+static const char *wait_names[WAIT_KINDS] = { "sync", "umount" };
+
+// Account the time since started, a tune_now() reading, to kind. Safe from any thread
+void metrics_wait(MetricsWait kind, double started) {
+    double seconds = tune_now() - started;
+    
+    if (seconds > 0) {
+        wait_ns[kind] += (unsigned long long)(seconds * 1e9);
+    }
+}
+
+static double timeval_seconds(const struct timeval *tv) {
+    return (double)tv->tv_sec + (double)tv->tv_usec / 1e6;
+}
+
+// Fields of /proc/self/io, all left at zero when the kernel doesn't do I/O accounting
+static void read_proc_io(MetricsSample *sample) {
+    char name[32];
+    unsigned long long value;
+    FILE *file;
+    
+    file = fopen("/proc/self/io", "r");
+    if (file == NULL) {
+        return;
+    }
+    
+    while (fscanf(file, "%31[^:]: %llu\n", name, &value) == 2) {
+        if (strcmp(name, "rchar") == 0) {
+            sample->rchar = value;
+        } else if (strcmp(name, "wchar") == 0) {
+            sample->wchar = value;
+        } else if (strcmp(name, "syscr") == 0) {
+            sample->syscr = value;
+        } else if (strcmp(name, "syscw") == 0) {
+            sample->syscw = value;
+        } else if (strcmp(name, "read_bytes") == 0) {
+            sample->read_bytes = value;
+        } else if (strcmp(name, "write_bytes") == 0) {
+            sample->write_bytes = value;
+        }
+    }
+    
+    fclose(file);
+}
+
+static void take_sample(MetricsSample *sample) {
+    struct rusage self;
+    struct rusage children;
+    int i;
+    
+    memset(sample, 0, sizeof(*sample));
+    sample->clock = tune_now();
+    read_proc_io(sample);
+    
+    getrusage(RUSAGE_SELF, &self);
+    getrusage(RUSAGE_CHILDREN, &children);
+    sample->user_cpu = timeval_seconds(&self.ru_utime) + timeval_seconds(&children.ru_utime);
+    sample->system_cpu = timeval_seconds(&self.ru_stime) + timeval_seconds(&children.ru_stime);
+    sample->voluntary_switches = self.ru_nvcsw;
+    
+    for (i = 0; i < WAIT_KINDS; i++) {
+        sample->wait_ns[i] = wait_ns[i];
+    }
+}
+
+static void end_phase(void) {
+    MetricsPhase *phase = &phases[phase_count - 1];
+    struct rusage usage;
+    
+    take_sample(&phase->end);
+    
+    // ru_maxrss only ever grows, so this is the peak up to the end of the phase
+    getrusage(RUSAGE_SELF, &usage);
+    phase->peak_rss_kb = usage.ru_maxrss;
+    getrusage(RUSAGE_CHILDREN, &usage);
+    phase->children_peak_rss_kb = usage.ru_maxrss;
+    
+    phase_open = 0;
+}
+
+// The previous phase ends and name starts. name must stay valid, a string literal
+void metrics_phase(const char *name) {
+    progress_phase(name);
+    
+    if (!enabled) {
+        return;
+    }
+    
+    if (phase_open) {
+        end_phase();
+    }
+    
+    if (phase_count == MAX_PHASES) {
+        return;
+    }
+    
+    phases[phase_count].name = name;
+    take_sample(&phases[phase_count].start);
+    phase_count++;
+    phase_open = 1;
+}
+
+// The run got all the way through, recorded as its outcome
+void metrics_success(void) {
+    succeeded = 1;
+}
+
+static void write_json(FILE *file) {
+    double now = tune_now();
+    int i;
+    int k;
+    
+    fprintf(file, "{\n");
+    fprintf(file, "  \"version\": \"%s\",\n", VERSION);
+    fprintf(file, "  \"started\": %lld,\n", (long long)run_started_at);
+    fprintf(file, "  \"success\": %s,\n", succeeded ? "true" : "false");
+    fprintf(file, "  \"duration_seconds\": %.6f,\n", now - run_start);
+    fprintf(file, "  \"phases\": [");
+    
+    for (i = 0; i < phase_count; i++) {
+        const MetricsPhase *phase = &phases[i];
+        const MetricsSample *a = &phase->start;
+        const MetricsSample *b = &phase->end;
+        
+        fprintf(file, "%s\n    {\n", i > 0 ? "," : "");
+        fprintf(file, "      \"name\": \"%s\",\n", phase->name);
+        fprintf(file, "      \"start_seconds\": %.6f,\n", a->clock - run_start);
+        fprintf(file, "      \"duration_seconds\": %.6f,\n", b->clock - a->clock);
+        fprintf(file, "      \"bytes_read\": %llu,\n", b->rchar - a->rchar);
+        fprintf(file, "      \"bytes_written\": %llu,\n", b->wchar - a->wchar);
+        fprintf(file, "      \"device_bytes_read\": %llu,\n", b->read_bytes - a->read_bytes);
+        fprintf(file, "      \"device_bytes_written\": %llu,\n", b->write_bytes - a->write_bytes);
+        fprintf(file, "      \"read_syscalls\": %llu,\n", b->syscr - a->syscr);
+        fprintf(file, "      \"write_syscalls\": %llu,\n", b->syscw - a->syscw);
+        fprintf(file, "      \"user_cpu_seconds\": %.6f,\n", b->user_cpu - a->user_cpu);
+        fprintf(file, "      \"system_cpu_seconds\": %.6f,\n", b->system_cpu - a->system_cpu);
+        fprintf(file, "      \"voluntary_context_switches\": %ld,\n", b->voluntary_switches - a->voluntary_switches);
+        for (k = 0; k < WAIT_KINDS; k++) {
+            fprintf(file, "      \"%s_wait_seconds\": %.6f,\n", wait_names[k], (double)(b->wait_ns[k] - a->wait_ns[k]) / 1e9);
+        }
+        fprintf(file, "      \"peak_rss_kb\": %ld,\n", phase->peak_rss_kb);
+        fprintf(file, "      \"children_peak_rss_kb\": %ld\n", phase->children_peak_rss_kb);
+        fprintf(file, "    }");
+    }
+    
+    fprintf(file, "\n  ]\n}\n");
+}
+
+// One gauge per phase, with its HELP and TYPE lines
+static void write_prometheus_metric(FILE *file, const char *metric, const char *help, int field) {
+    int i;
+    
+    fprintf(file, "# HELP buf_phase_%s %s\n", metric, help);
+    fprintf(file, "# TYPE buf_phase_%s gauge\n", metric);
+    
+    for (i = 0; i < phase_count; i++) {
+        const MetricsSample *a = &phases[i].start;
+        const MetricsSample *b = &phases[i].end;
+        double value = 0;
+        
+        switch (field) {
+            case 0: value = b->clock - a->clock; break;
+            case 1: value = (double)(b->rchar - a->rchar); break;
+            case 2: value = (double)(b->wchar - a->wchar); break;
+            case 3: value = (double)(b->read_bytes - a->read_bytes); break;
+            case 4: value = (double)(b->write_bytes - a->write_bytes); break;
+            case 5: value = (double)((b->syscr - a->syscr) + (b->syscw - a->syscw)); break;
+            case 6: value = (b->user_cpu - a->user_cpu) + (b->system_cpu - a->system_cpu); break;
+            case 7: value = (double)(b->wait_ns[WAIT_SYNC] - a->wait_ns[WAIT_SYNC]) / 1e9; break;
+            case 8: value = (double)(b->wait_ns[WAIT_UMOUNT] - a->wait_ns[WAIT_UMOUNT]) / 1e9; break;
+            case 9: value = (double)phases[i].peak_rss_kb * 1024; break;
+        }
+        
+        fprintf(file, "buf_phase_%s{phase=\"%s\"} %.6f\n", metric, phases[i].name, value);
+    }
+}
+
+static void write_prometheus(FILE *file) {
+    fprintf(file, "# HELP buf_run_success Whether the last flash completed\n");
+    fprintf(file, "# TYPE buf_run_success gauge\n");
+    fprintf(file, "buf_run_success %d\n", succeeded);
+    fprintf(file, "# HELP buf_run_duration_seconds Wall time of the last flash\n");
+    fprintf(file, "# TYPE buf_run_duration_seconds gauge\n");
+    fprintf(file, "buf_run_duration_seconds %.6f\n", tune_now() - run_start);
+    fprintf(file, "# HELP buf_run_timestamp_seconds When the last flash started\n");
+    fprintf(file, "# TYPE buf_run_timestamp_seconds gauge\n");
+    fprintf(file, "buf_run_timestamp_seconds %lld\n", (long long)run_started_at);
+    
+    write_prometheus_metric(file, "duration_seconds", "Wall time of each phase of the last flash", 0);
+    write_prometheus_metric(file, "read_bytes", "Bytes read through syscalls in each phase", 1);
+    write_prometheus_metric(file, "written_bytes", "Bytes written through syscalls in each phase", 2);
+    write_prometheus_metric(file, "device_read_bytes", "Bytes read from block devices in each phase", 3);
+    write_prometheus_metric(file, "device_written_bytes", "Bytes written to block devices in each phase", 4);
+    write_prometheus_metric(file, "syscalls", "Read and write syscalls in each phase", 5);
+    write_prometheus_metric(file, "cpu_seconds", "CPU time of buf and its child processes in each phase", 6);
+    write_prometheus_metric(file, "sync_wait_seconds", "Time spent in fsync and syncfs in each phase", 7);
+    write_prometheus_metric(file, "umount_wait_seconds", "Time spent unmounting in each phase", 8);
+    write_prometheus_metric(file, "peak_rss_bytes", "Peak resident memory of buf by the end of each phase", 9);
+}
+
+// Write through a temporary file and rename it over path, so whoever reads it (node_exporter
+// scrapes the textfile whenever it likes) never sees half of it
+static void write_metrics_file(const char *path, void (*write)(FILE *file)) {
+    char temp_path[MAX_PATH];
+    FILE *file;
+    
+    snprintf(temp_path, sizeof(temp_path), "%s.tmp", path);
+    file = fopen(temp_path, "w");
+    if (file == NULL) {
+        fprintf(stderr, "Warning: Could not write metrics: %s - %s\n", temp_path, strerror(errno));
+        return;
+    }
+    
+    write(file);
+    
+    if (fclose(file) != 0 || rename(temp_path, path) != 0) {
+        fprintf(stderr, "Warning: Could not write metrics: %s - %s\n", path, strerror(errno));
+        unlink(temp_path);
+    }
+}
+
+// Runs at exit, so every way out of main() gets its metrics written
+static void metrics_finish(void) {
+    if (phase_open) {
+        end_phase();
+    }
+    
+    if (json_path[0] != '\0') {
+        write_metrics_file(json_path, write_json);
+    }
+    if (textfile_path[0] != '\0') {
+        write_metrics_file(textfile_path, write_prometheus);
+    }
+}
+
+// Start collecting, for either output or both. Nothing is collected when neither is given
+int metrics_init(const char *json, const char *textfile) {
+    if (json[0] == '\0' && textfile[0] == '\0') {
+        return 0;
+    }
+    
+    snprintf(json_path, sizeof(json_path), "%s", json);
+    snprintf(textfile_path, sizeof(textfile_path), "%s", textfile);
+    run_start = tune_now();
+    run_started_at = time(NULL);
+    enabled = 1;
+    
+    if (atexit(metrics_finish) != 0) {
+        enabled = 0;
+        return -1;
+    }
+    
+    return 0;
+}
@@ -19,6 +19,7 @@
 
 
 #include "../include/buf.h"
+#include <sys/sysmacros.h>
 
 // Create temp mount points
 int create_mountpoints(MountPoints *mounts) {
@@ -57,7 +58,9 @@ int create_mountpoints(MountPoints *mounts) {
 }
 
 int mount_source(const char *source, const char *mountpoint) {
-    char command[MAX_PATH];
+    const char *loop_argv[] = { "mount", "-o", "loop,ro", "-t", "udf,iso9660", source, mountpoint, NULL };
+    const char *device_argv[] = { "mount", "-o", "ro", source, mountpoint, NULL };
+    const char *const *argv;
     struct stat st;
     
     print_colored("Mounting source media...", "green");
@@ -66,19 +69,15 @@ int mount_source(const char *source, const char *mountpoint) {
     // Check if source is a regular ISO or block device
     if (stat(source, &st) == 0 && S_ISREG(st.st_mode)) {
         // It's a regular ISO, mount as loop device with UDF or ISO9660 filesystem
-        snprintf(command, sizeof(command), 
-                "mount -o loop,ro -t udf,iso9660 '%s' '%s' 2>/dev/null", 
-                source, mountpoint);
+        argv = loop_argv;
         log_write(g_log_ctx, LOG_INFO, "Source is a file, mounting as loop device");
     } else {
         // It's a block device, mount directly as read-only
-        snprintf(command, sizeof(command), 
-                "mount -o ro '%s' '%s' 2>/dev/null", 
-                source, mountpoint);
+        argv = device_argv;
         log_write(g_log_ctx, LOG_INFO, "Source is a block device");
     }
     
-    if (run_command(command) != 0) {
+    if (run_program(argv, COMMAND_TIMEOUT) != 0) {
         fprintf(stderr, "Error: Failed to mount source media\n");
         log_write(g_log_ctx, LOG_ERROR, "Mount command failed for source media");
         return -1;
@@ -89,14 +88,12 @@ int mount_source(const char *source, const char *mountpoint) {
 }
 
 int mount_target(const char *target, const char *mountpoint) {
-    char command[MAX_PATH];
+    const char *argv[] = { "mount", target, mountpoint, NULL };
     
     print_colored("Mounting target partition...", "green");
     log_write(g_log_ctx, LOG_STEP, "Mounting target partition: %s -> %s", target, mountpoint);
     
-    snprintf(command, sizeof(command), "mount '%s' '%s' 2>/dev/null", target, mountpoint);
-    
-    if (run_command(command) != 0) {
+    if (run_program(argv, COMMAND_TIMEOUT) != 0) {
         fprintf(stderr, "Error: Failed to mount target partition\n");
         log_write(g_log_ctx, LOG_ERROR, "Mount command failed for target partition");
         return -1;
@@ -106,27 +103,145 @@ int mount_target(const char *target, const char *mountpoint) {
     return 0;
 }
 
+// mountinfo writes spaces, tabs, newlines and backslashes in paths as \ooo octal escapes
+static void unescape_mount_field(char *field) {
+    char *in = field;
+    char *out = field;
+    
+    while (*in != '\0') {
+        if (in[0] == '\\' && in[1] >= '0' && in[1] <= '3' && in[2] >= '0' && in[2] <= '7' && in[3] >= '0' && in[3] <= '7') {
+            *out++ = (char)((in[1] - '0') * 64 + (in[2] - '0') * 8 + (in[3] - '0'));
+            in += 4;
+        } else {
+            *out++ = *in++;
+        }
+    }
+    *out = '\0';
+}
+
+// Every mounted filesystem, read straight from /proc/self/mountinfo in mount order, so
+// anything mounted on top of another mount comes after it. Free with mount_table_free()
+int mount_table_read(MountEntry **entries, size_t *count) {
+    MountEntry *table = NULL;
+    MountEntry *grown;
+    size_t capacity = 0;
+    size_t used = 0;
+    size_t line_size = 0;
+    char *line = NULL;
+    FILE *file;
+    
+    file = fopen("/proc/self/mountinfo", "re");
+    if (file == NULL) {
+        log_write(g_log_ctx, LOG_ERROR, "Cannot read /proc/self/mountinfo: %s", strerror(errno));
+        return -1;
+    }
+    
+    // 36 35 98:0 /mnt1 /mnt2 rw,noatime master:1 - ext3 /dev/root rw,errors=continue
+    while (getline(&line, &line_size, file) > 0) {
+        char *fields[6];
+        char *save = NULL;
+        char *field;
+        unsigned int major_number, minor_number;
+        int n = 0;
+        
+        for (field = strtok_r(line, " \n", &save); field != NULL && n < 6; field = strtok_r(NULL, " \n", &save)) {
+            fields[n++] = field;
+        }
+        if (n < 6 || sscanf(fields[2], "%u:%u", &major_number, &minor_number) != 2) {
+            continue;
+        }
+        
+        // Optional fields run up to the "-", the filesystem type and the source follow it
+        while (field != NULL && strcmp(field, "-") != 0) {
+            field = strtok_r(NULL, " \n", &save);
+        }
+        if (field == NULL || strtok_r(NULL, " \n", &save) == NULL || (field = strtok_r(NULL, " \n", &save)) == NULL) {
+            continue;
+        }
+        
+        if (used == capacity) {
+            capacity = capacity > 0 ? capacity * 2 : 64;
+            grown = realloc(table, capacity * sizeof(MountEntry));
+            if (grown == NULL) {
+                break;
+            }
+            table = grown;
+        }
+        
+        unescape_mount_field(fields[4]);
+        unescape_mount_field(field);
+        table[used].device = makedev(major_number, minor_number);
+        table[used].mountpoint = strdup(fields[4]);
+        table[used].source = strdup(field);
+        if (table[used].mountpoint == NULL || table[used].source == NULL) {
+            free(table[used].mountpoint);
+            free(table[used].source);
+            break;
+        }
+        used++;
+    }
+    
+    free(line);
+    fclose(file);
+    
+    *entries = table;
+    *count = used;
+    return 0;
+}
+
+void mount_table_free(MountEntry *entries, size_t count) {
+    size_t i;
+    
+    for (i = 0; i < count; i++) {
+        free(entries[i].mountpoint);
+        free(entries[i].source);
+    }
+    free(entries);
+}
+
+// Is something mounted right at path
+int is_mountpoint(const char *path) {
+    MountEntry *mounts;
+    char resolved[MAX_PATH];
+    size_t count;
+    size_t i;
+    int mounted = 0;
+    
+    if (realpath(path, resolved) == NULL || mount_table_read(&mounts, &count) != 0) {
+        return 0;
+    }
+    
+    for (i = 0; i < count && !mounted; i++) {
+        mounted = strcmp(mounts[i].mountpoint, resolved) == 0;
+    }
+    
+    mount_table_free(mounts, count);
+    return mounted;
+}
+
 int cleanup_mountpoint(const char *mountpoint) {
-    char command[MAX_PATH];
     struct stat st;
+    double started;
     
     // Check if mount point directory exists
     if (stat(mountpoint, &st) != 0) {
         return 0; // Directory doesn't exist, nothing for us to cleanup
     }
     
-    snprintf(command, sizeof(command), "mountpoint -q '%s'", mountpoint);
-    if (run_command(command) == 0) {
+    if (is_mountpoint(mountpoint)) {
         // Mount point is mounted, unmount it
         print_colored("Unmounting filesystem...", "");
         log_write(g_log_ctx, LOG_INFO, "Unmounting: %s", mountpoint);
         
-        snprintf(command, sizeof(command), "umount '%s' 2>/dev/null", mountpoint);
-        if (run_command(command) != 0) {
+        // Waits for everything still dirty to reach the stick. A loop device from mounting
+        // the ISO detaches itself once this is done
+        started = tune_now();
+        if (umount2(mountpoint, 0) != 0) {
             fprintf(stderr, "Warning: Failed to unmount %s\n", mountpoint);
-            log_write(g_log_ctx, LOG_WARNING, "Failed to unmount: %s", mountpoint);
+            log_write(g_log_ctx, LOG_WARNING, "Failed to unmount: %s - %s", mountpoint, strerror(errno));
             return -1;
         }
+        metrics_wait(WAIT_UMOUNT, started);
         
         log_write(g_log_ctx, LOG_SUCCESS, "Unmounted: %s", mountpoint);
     }
@@ -144,7 +259,7 @@ int cleanup_mountpoint(const char *mountpoint) {
 // Cleanup all the mount points and temp directories
 void cleanup(MountPoints *mounts, const char *target_media) {
     int unsafe = 0;
-    char command[MAX_PATH];
+    const char *remove_argv[] = { "rm", "-rf", mounts->temp_directory, NULL };
     
     if (cleanup_mountpoint(mounts->source_mountpoint) != 0) {
         print_colored("Warning: Source mountpoint not fully cleaned", "yellow");
@@ -157,8 +272,7 @@ void cleanup(MountPoints *mounts, const char *target_media) {
     
     if (mounts->temp_directory[0] != '\0') {
         log_write(g_log_ctx, LOG_INFO, "Removing temp directory: %s", mounts->temp_directory);
-        snprintf(command, sizeof(command), "rm -rf '%s' 2>/dev/null", mounts->temp_directory);
-        run_command(command);
+        run_program(remove_argv, COMMAND_TIMEOUT);
     }
     
     if (unsafe) {
@@ -22,14 +22,16 @@
 
 // Wipe all filesystem signatures off a device
 int wipe_device(const char *device) {
-    char command[MAX_PATH];
-    char output[1024];
+    const char *wipe_argv[] = { "wipefs", "--all", device, NULL };
+    const char *list_argv[] = { "lsblk", "--pairs", "--output", "NAME,TYPE", device, NULL };
+    char output[4096];
+    const char *part;
+    int partitions = 0;
     
     print_colored("Wiping device signatures...", "green");
     log_write(g_log_ctx, LOG_STEP, "Wiping device signatures from: %s", device);
     
-    snprintf(command, sizeof(command), "wipefs --all '%s' 2>/dev/null", device);
-    if (run_command(command) != 0) {
+    if (run_program(wipe_argv, COMMAND_TIMEOUT) != 0) {
         fprintf(stderr, "Error: Failed to wipe device\n");
         log_write(g_log_ctx, LOG_ERROR, "wipefs command failed");
         return -1;
@@ -38,9 +40,11 @@ int wipe_device(const char *device) {
     print_colored("Verifying device is clean...", "");
     log_write(g_log_ctx, LOG_INFO, "Verifying device is clean");
     
-    snprintf(command, sizeof(command), "lsblk --pairs --output NAME,TYPE '%s' | grep -c 'TYPE=\"part\"'", device);
-    if (run_command_with_output(command, output, sizeof(output)) == 0) {
-        if (atoi(trim_whitespace(output)) != 0) {
+    if (run_program_output(list_argv, COMMAND_TIMEOUT, output, sizeof(output)) == 0) {
+        for (part = strstr(output, "TYPE=\"part\""); part != NULL; part = strstr(part + 1, "TYPE=\"part\"")) {
+            partitions++;
+        }
+        if (partitions != 0) {
             fprintf(stderr, "Error: Device still has partitions after wiping\n");
             fprintf(stderr, "       Device may be write-protected\n");
             log_write(g_log_ctx, LOG_ERROR, "Device still has partitions after wiping - may be write-protected");
@@ -54,13 +58,12 @@ int wipe_device(const char *device) {
 
 // Create MBR partition table on target device
 int create_partition_table(const char *device) {
-    char command[MAX_PATH];
+    const char *argv[] = { "parted", "--script", device, "mklabel", "msdos", NULL };
     
     print_colored("Creating partition table...", "green");
     log_write(g_log_ctx, LOG_STEP, "Creating MSDOS partition table on: %s", device);
     
-    snprintf(command, sizeof(command), "parted --script '%s' mklabel msdos 2>/dev/null", device);
-    if (run_command(command) != 0) {
+    if (run_program(argv, COMMAND_TIMEOUT) != 0) {
         fprintf(stderr, "Error: Failed to create partition table\n");
         log_write(g_log_ctx, LOG_ERROR, "parted mklabel command failed");
         return -1;
@@ -70,28 +73,17 @@ int create_partition_table(const char *device) {
     return 0;
 }
 
-int create_partition(const char *device, const char *partition, 
-                    FilesystemType fs_type, const char *label) {
-    char command[MAX_PATH];
+int create_partition(const char *device, const char *partition, FilesystemType fs_type) {
     const char *fs_name = (fs_type == FS_NTFS) ? "ntfs" : "fat32";
-    char mkfs_cmd[256];
+    // We're using FAT32, so use the entire disk (start at 4MiB for alignment, end at 100%)
+    const char *fat_argv[] = { "parted", "--script", device, "mkpart", "primary", fs_name, "4MiB", "100%", NULL };
+    // We're using NTFS, leave 2MB at the end for UEFI:NTFS partition (start at 4MiB, and at -2049 sectors)
+    const char *ntfs_argv[] = { "parted", "--script", device, "mkpart", "primary", fs_name, "4MiB", "--", "-2049s", NULL };
     
     print_colored("Creating partition...", "green");
     log_write(g_log_ctx, LOG_STEP, "Creating %s partition: %s", fs_name, partition);
     
-    if (fs_type == FS_FAT) {
-        // We're using FAT32, so use the entire disk (start at 4MiB for alignment, end at 100%)
-        snprintf(command, sizeof(command), 
-                "parted --script '%s' mkpart primary %s 4MiB 100%% 2>/dev/null", 
-                device, fs_name);
-    } else {
-        // We're using NTFS, leave 2MB at the end for UEFI:NTFS partition (start at 4MiB, and at -2049 sectors)
-        snprintf(command, sizeof(command), 
-                "parted --script '%s' mkpart primary %s 4MiB -- -2049s 2>/dev/null", 
-                device, fs_name);
-    }
-    
-    if (run_command(command) != 0) {
+    if (run_program(fs_type == FS_FAT ? fat_argv : ntfs_argv, COMMAND_TIMEOUT) != 0) {
         fprintf(stderr, "Error: Failed to create partition\n");
         log_write(g_log_ctx, LOG_ERROR, "parted mkpart command failed");
         return -1;
@@ -102,28 +94,28 @@ int create_partition(const char *device, const char *partition,
     // Force kernel to re-read partition table
     make_system_realize_partition_changed(device);
     
+    return 0;
+}
+
+// Put an empty filesystem on a partition. Not needed for FAT32 when buf writes it natively
+int format_partition(const char *partition, FilesystemType fs_type, const char *label) {
+    const char *fs_name = (fs_type == FS_NTFS) ? "ntfs" : "fat32";
+    const char *fat_argv[] = { "mkdosfs", "-F", "32", partition, NULL };
+    const char *ntfs_argv[] = { "mkntfs", "--quick", "--label", label, partition, NULL };
+    
     print_colored("Formatting partition...", "green");
     log_write(g_log_ctx, LOG_STEP, "Formatting partition as %s", fs_name);
     
     // Format partition based off the filesystem type
     if (fs_type == FS_FAT) {
-        // Check what is available for formatting FAT32
-        snprintf(mkfs_cmd, sizeof(mkfs_cmd), "which mkdosfs >/dev/null 2>&1");
-        if (run_command(mkfs_cmd) == 0) {
-            // Use mkdosfs if available
-            snprintf(command, sizeof(command), "mkdosfs -F 32 '%s' 2>/dev/null", partition);
-        } else {
-            // Fall back to mkfs.vfat
-            snprintf(command, sizeof(command), "mkfs.vfat -F 32 '%s' 2>/dev/null", partition);
+        // Use mkdosfs if available, otherwise whichever name dosfstools installed it under
+        if (find_program("mkdosfs") == NULL) {
+            fat_argv[0] = find_program("mkfs.vfat") != NULL ? "mkfs.vfat" : "mkfs.fat";
         }
-    } else {
-        // Use quick format and set label, NTFS
-        snprintf(command, sizeof(command), 
-                "mkntfs --quick --label '%s' '%s' 2>/dev/null", 
-                label, partition);
     }
     
-    if (run_command(command) != 0) {
+    // Use quick format and set label for NTFS
+    if (run_program(fs_type == FS_FAT ? fat_argv : ntfs_argv, COMMAND_TIMEOUT_LONG) != 0) {
         fprintf(stderr, "Error: Failed to format partition\n");
         log_write(g_log_ctx, LOG_ERROR, "Filesystem creation failed");
         return -1;
@@ -137,17 +129,13 @@ int create_partition(const char *device, const char *partition,
 // This 1MB FAT16 partition will let UEFI systems boot from NTFS partitions
 // Only needed because UEFI firmware blows and cannot natively read NTFS
 int create_uefi_ntfs_partition(const char *device) {
-    char command[MAX_PATH];
+    const char *argv[] = { "parted", "--align", "none", "--script", device, "mkpart", "primary", "fat16", "--", "-2048s", "-1s", NULL };
     
     print_colored("Creating UEFI:NTFS support partition...", "");
     log_write(g_log_ctx, LOG_STEP, "Creating UEFI:NTFS partition on: %s", device);
     
     // Create the FAT16 partition at the end (last 2048 sectors = 1MB)
-    snprintf(command, sizeof(command), 
-            "parted --align none --script '%s' mkpart primary fat16 -- -2048s -1s 2>/dev/null", 
-            device);
-    
-    if (run_command(command) != 0) {
+    if (run_program(argv, COMMAND_TIMEOUT) != 0) {
         fprintf(stderr, "Warning: Failed to create UEFI:NTFS partition\n");
         log_write(g_log_ctx, LOG_WARNING, "Failed to create UEFI:NTFS partition");
         return -1;
@@ -163,19 +151,19 @@ int create_uefi_ntfs_partition(const char *device) {
 // Install UEFT:NTFS bootloader image to the FAT16 partition
 // Big ups to pbatard for making Rufus
 int install_uefi_ntfs(const char *partition, const char *temp_dir) {
-    char command[MAX_PATH];
     char image_path[MAX_PATH];
+    char input[MAX_PATH + 8];
+    char output[MAX_PATH + 8];
+    const char *download_argv[] = { "wget", "-q", "-O", image_path,
+                                    "https://github.com/pbatard/rufus/raw/master/res/uefi/uefi-ntfs.img", NULL };
+    const char *write_argv[] = { "dd", input, output, "bs=1M", NULL };
     
     print_colored("Installing UEFI:NTFS support...", "");
     log_write(g_log_ctx, LOG_STEP, "Downloading UEFI:NTFS image");
     
     snprintf(image_path, sizeof(image_path), "%s/uefi-ntfs.img", temp_dir);
     
-    snprintf(command, sizeof(command), 
-            "wget -q -O '%s' https://github.com/pbatard/rufus/raw/master/res/uefi/uefi-ntfs.img 2>/dev/null", 
-            image_path);
-    
-    if (run_command(command) != 0) {
+    if (run_program(download_argv, COMMAND_TIMEOUT) != 0) {
         print_colored("Warning: Failed to download UEFI:NTFS image", "yellow");
         log_write(g_log_ctx, LOG_WARNING, "Failed to download UEFI:NTFS image from GitHub");
         return -1;
@@ -185,8 +173,9 @@ int install_uefi_ntfs(const char *partition, const char *temp_dir) {
     log_write(g_log_ctx, LOG_STEP, "Writing UEFI:NTFS image to partition: %s", partition);
     
     // write bootloader image directly to partition
-    snprintf(command, sizeof(command), "dd if='%s' of='%s' bs=1M 2>/dev/null", image_path, partition);
-    if (run_command(command) != 0) {
+    snprintf(input, sizeof(input), "if=%s", image_path);
+    snprintf(output, sizeof(output), "of=%s", partition);
+    if (run_program(write_argv, COMMAND_TIMEOUT) != 0) {
         fprintf(stderr, "Warning: Failed to write UEFI:NTFS image\n");
         log_write(g_log_ctx, LOG_WARNING, "Failed to write UEFI:NTFS image with dd");
         return -1;
@@ -0,0 +1,270 @@
+/*
+    buf - Command line tool for flashing ISO images onto USB drives.
+    Copyright (C) 2026  Bryson Kelly
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+*/
+
+
+// Progress rate and ETA
+// The progress lines feed every update through here. Bytes handed to the kernel run ahead of
+// the stick by however much the page cache holds, so the rate is taken on what has actually
+// left the cache: bytes written minus the dirty and writeback pages that built up since the
+// bar started. That's smoothed with an exponentially weighted moving average, so one slow
+// erase block doesn't make the ETA jump around. With --progress=json:FD every update is also
+// written to FD as one JSON object per line, for wrappers that shouldn't have to scrape the
+// terminal
+#include "../include/buf.h"
+#include <pthread.h>
+#include <signal.h>
+
+#define PROGRESS_TAU 5.0          // Seconds the moving average mostly looks back over
+#define PROGRESS_MIN_SAMPLE 0.25  // Shorter gaps between samples are just noise
+#define PROGRESS_STALL 10.0       // Seconds without the device taking anything before it counts as stalled
+#define PROGRESS_RECORD_SIZE 8192
+
+static pthread_mutex_t progress_lock = PTHREAD_MUTEX_INITIALIZER;
+static int stream_fd = -1;
+static double stream_start;
+static const char *phase = "";
+
+// State of the bar currently showing
+static unsigned long long bar_total;
+static unsigned long long pending_base;  // Dirty pages that were already there when the bar started
+static unsigned long long device_bytes;  // Best guess at how much reached the device, never goes down
+static double sample_time;
+static unsigned long long sample_bytes;
+static double rate;                      // Bytes per second, 0 until there is an estimate
+static double last_moved;                // When device_bytes last grew
+static double last_record;
+
+// Dirty and writeback pages system wide, in bytes. 0 if /proc/meminfo can't be read
+static unsigned long long pending_writeback(void) {
+    char line[128];
+    unsigned long long kb;
+    unsigned long long total = 0;
+    FILE *file;
+    
+    file = fopen("/proc/meminfo", "r");
+    if (file == NULL) {
+        return 0;
+    }
+    
+    while (fgets(line, sizeof(line), file) != NULL) {
+        if (sscanf(line, "Dirty: %llu kB", &kb) == 1 || sscanf(line, "Writeback: %llu kB", &kb) == 1) {
+            total += kb * 1024;
+        }
+    }
+    
+    fclose(file);
+    return total;
+}
+
+// Send progress records to fd as well as drawing the line. -1 turns it off
+void progress_init(int fd) {
+    stream_fd = fd;
+    stream_start = tune_now();
+    
+    // A wrapper that goes away shouldn't take the flash down with it, writes just fail instead
+    if (fd >= 0) {
+        signal(SIGPIPE, SIG_IGN);
+    }
+}
+
+static void stream_write(const char *record, size_t length) {
+    ssize_t written;
+    size_t done = 0;
+    
+    while (done < length) {
+        written = write(stream_fd, record + done, length - done);
+        if (written < 0 && errno == EINTR) {
+            continue;
+        }
+        if (written <= 0) {
+            log_write(g_log_ctx, LOG_WARNING, "Progress stream closed: %s, no more records", strerror(errno));
+            stream_fd = -1;
+            return;
+        }
+        done += (size_t)written;
+    }
+}
+
+// Append text to a JSON record as a quoted string
+static size_t json_string(char *out, size_t size, size_t used, const char *text) {
+    const unsigned char *p = (const unsigned char *)text;
+    
+    if (used + 2 >= size) {
+        return used;
+    }
+    out[used++] = '"';
+    
+    for (; *p != '\0' && used + 8 < size; p++) {
+        if (*p == '"' || *p == '\\') {
+            out[used++] = '\\';
+            out[used++] = (char)*p;
+        } else if (*p < 0x20) {
+            used += (size_t)snprintf(out + used, size - used, "\\u%04x", *p);
+        } else {
+            out[used++] = (char)*p;
+        }
+    }
+    
+    out[used++] = '"';
+    out[used] = '\0';
+    return used;
+}
+
+// The phase the run is in, from metrics_phase(). Written to the stream straight away
+void progress_phase(const char *name) {
+    char record[PROGRESS_RECORD_SIZE];
+    int used;
+    
+    pthread_mutex_lock(&progress_lock);
+    phase = name;
+    
+    if (stream_fd >= 0) {
+        used = snprintf(record, sizeof(record), "{\"type\":\"phase\",\"elapsed\":%.3f,\"phase\":\"%s\"}\n",
+                        tune_now() - stream_start, name);
+        stream_write(record, (size_t)used);
+    }
+    
+    pthread_mutex_unlock(&progress_lock);
+}
+
+// A new bar of total bytes begins, the rate starts over
+void progress_start(unsigned long long total) {
+    pthread_mutex_lock(&progress_lock);
+    bar_total = total;
+    pending_base = pending_writeback();
+    device_bytes = 0;
+    sample_time = tune_now();
+    sample_bytes = 0;
+    rate = 0;
+    last_moved = sample_time;
+    last_record = 0;
+    pthread_mutex_unlock(&progress_lock);
+}
+
+// Fold in a new reading of done bytes. Called with progress_lock held
+static void update_rate(unsigned long long done, double now) {
+    unsigned long long pending = pending_writeback();
+    unsigned long long reached = done;
+    double elapsed = now - sample_time;
+    double instant;
+    double weight;
+    
+    // Whatever piled up in the cache since the bar started hasn't reached the stick yet
+    if (pending > pending_base) {
+        reached = pending - pending_base < done ? done - (pending - pending_base) : 0;
+    }
+    if (reached > device_bytes) {
+        device_bytes = reached;
+        last_moved = now;
+    }
+    
+    if (elapsed < PROGRESS_MIN_SAMPLE) {
+        return;
+    }
+    
+    instant = (double)(device_bytes - sample_bytes) / elapsed;
+    weight = elapsed / (elapsed + PROGRESS_TAU);
+    rate = rate > 0 ? rate + weight * (instant - rate) : instant;
+    sample_time = now;
+    sample_bytes = device_bytes;
+}
+
+// Seconds left at the current rate, -1 when there's no estimate
+static double eta_seconds(void) {
+    if (rate <= 0 || device_bytes >= bar_total) {
+        return device_bytes >= bar_total && bar_total > 0 ? 0 : -1;
+    }
+    return (double)(bar_total - device_bytes) / rate;
+}
+
+static void write_record(const char *operation, unsigned long long done, const char *file,
+                         const FanoutTarget *targets, int count, double now) {
+    char record[PROGRESS_RECORD_SIZE];
+    double eta = eta_seconds();
+    size_t used;
+    int i;
+    
+    used = (size_t)snprintf(record, sizeof(record),
+                            "{\"type\":\"progress\",\"elapsed\":%.3f,\"phase\":\"%s\",\"operation\":\"%s\","
+                            "\"bytes\":%llu,\"device_bytes\":%llu,\"total\":%llu,\"percent\":%.1f,"
+                            "\"rate\":%.0f,\"eta\":",
+                            now - stream_start, phase, operation, done, device_bytes, bar_total,
+                            bar_total > 0 ? (double)done * 100.0 / (double)bar_total : 100.0, rate);
+    if (eta >= 0) {
+        used += (size_t)snprintf(record + used, sizeof(record) - used, "%.0f", eta);
+    } else {
+        used += (size_t)snprintf(record + used, sizeof(record) - used, "null");
+    }
+    used += (size_t)snprintf(record + used, sizeof(record) - used, ",\"stalled\":%s,\"file\":",
+                             now - last_moved >= PROGRESS_STALL && device_bytes < bar_total ? "true" : "false");
+    used = json_string(record, sizeof(record), used, file != NULL ? file : "");
+    
+    if (targets != NULL) {
+        used += (size_t)snprintf(record + used, sizeof(record) - used, ",\"targets\":[");
+        for (i = 0; i < count && used < sizeof(record) - 128; i++) {
+            used += (size_t)snprintf(record + used, sizeof(record) - used, "%s{\"name\":", i > 0 ? "," : "");
+            used = json_string(record, sizeof(record), used, targets[i].name);
+            used += (size_t)snprintf(record + used, sizeof(record) - used, ",\"bytes\":%llu,\"failed\":%s}",
+                                     (unsigned long long)targets[i].written, targets[i].failed ? "true" : "false");
+        }
+        used += (size_t)snprintf(record + used, sizeof(record) - used, "]");
+    }
+    
+    if (used >= sizeof(record) - 2) {
+        used = sizeof(record) - 3;
+    }
+    used += (size_t)snprintf(record + used, sizeof(record) - used, "}\n");
+    stream_write(record, used);
+}
+
+// done of the bar's bytes are written. operation says what the bar is ("copy", "verify"),
+// file is what's being worked on and targets, when not NULL, are the sticks of a fan-out copy.
+// Returns the rate and ETA for the human line in text, like " - 12.5 MB/s, 1:23 left"
+void progress_update(const char *operation, unsigned long long done, const char *file,
+                     const FanoutTarget *targets, int count, char *text, size_t size) {
+    double now = tune_now();
+    double eta;
+    long left;
+    
+    pthread_mutex_lock(&progress_lock);
+    update_rate(done, now);
+    
+    // Records go out at most once a second, whatever the line does with --verbose
+    if (stream_fd >= 0 && now - last_record >= 1.0) {
+        last_record = now;
+        write_record(operation, done, file, targets, count, now);
+    }
+    
+    eta = eta_seconds();
+    if (now - last_moved >= PROGRESS_STALL && device_bytes < bar_total) {
+        snprintf(text, size, " - stalled for %.0fs", now - last_moved);
+    } else if (rate > 0 && eta >= 0) {
+        left = (long)(eta + 0.5);
+        if (left >= 3600) {
+            snprintf(text, size, " - %.1f MB/s, %ld:%02ld:%02ld left", rate / (1024 * 1024),
+                     left / 3600, (left / 60) % 60, left % 60);
+        } else {
+            snprintf(text, size, " - %.1f MB/s, %ld:%02ld left", rate / (1024 * 1024), left / 60, left % 60);
+        }
+    } else if (size > 0) {
+        text[0] = '\0';
+    }
+    
+    pthread_mutex_unlock(&progress_lock);
+}
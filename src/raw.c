@@ -0,0 +1,296 @@
+/*
+    buf - Command line tool for flashing ISO images onto USB drives.
+    Copyright (C) 2026  Bryson Kelly
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+*/
+
+
+// Raw mode
+// Most Linux ISOs are isohybrid: the image carries an MBR with a partition table in its
+// first sector next to the ISO9660 filesystem, so written block for block it boots from a
+// stick as is. That's one sequential write instead of partitioning, formatting and copying
+// thousands of files
+#define _GNU_SOURCE
+#include "../include/buf.h"
+#include <fcntl.h>
+
+#define MBR_SIZE 512
+#define MBR_TABLE_OFFSET 446          // Four 16 byte partition entries start here
+#define ISO_DESCRIPTOR_OFFSET 32769   // "CD001" of the first volume descriptor (sector 16 + 1)
+#define ELTORITO_OFFSET 34823         // Boot record volume descriptor identifier (sector 17 + 7)
+
+// Is source an ISO that can be written straight onto a device? It needs the 0x55AA boot
+// signature and at least one sane partition entry, a plain ISO has neither
+int is_hybrid_image(const char *source) {
+    unsigned char mbr[MBR_SIZE];
+    char magic[24];
+    int partitions = 0;
+    int fd;
+    int i;
+    
+    fd = open(source, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return 0;
+    }
+    
+    if (pread(fd, mbr, sizeof(mbr), 0) != (ssize_t)sizeof(mbr) ||
+        pread(fd, magic, 5, ISO_DESCRIPTOR_OFFSET) != 5) {
+        close(fd);
+        return 0;
+    }
+    
+    if (mbr[510] != 0x55 || mbr[511] != 0xAA || memcmp(magic, "CD001", 5) != 0) {
+        close(fd);
+        return 0;
+    }
+    
+    for (i = 0; i < 4; i++) {
+        const unsigned char *entry = mbr + MBR_TABLE_OFFSET + i * 16;
+        
+        // Boot flag is either 0x00 or 0x80, and type 0 is an empty slot
+        if ((entry[0] == 0x00 || entry[0] == 0x80) && entry[4] != 0) {
+            partitions++;
+        } else if (entry[0] != 0x00) {
+            close(fd);
+            return 0; // Garbage, not a partition table
+        }
+    }
+    
+    if (partitions > 0 && pread(fd, magic, 23, ELTORITO_OFFSET) == 23 &&
+        memcmp(magic, "EL TORITO SPECIFICATION", 23) == 0) {
+        log_write(g_log_ctx, LOG_INFO, "Image is El Torito bootable with %d MBR partitions", partitions);
+    }
+    
+    close(fd);
+    return partitions > 0;
+}
+
+// Size of a file or block device, -1 if it can't be opened
+static off_t raw_size(const char *path) {
+    off_t size;
+    int fd;
+    
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return -1;
+    }
+    size = lseek(fd, 0, SEEK_END);
+    close(fd);
+    return size;
+}
+
+// Write a hybrid image onto the whole device, then optionally read it back
+int write_raw_image(const char *source, const char *device, const CopyOptions *options) {
+    uint64_t written_hash;
+    uint64_t device_hash;
+    off_t image_size;
+    off_t device_size;
+    
+    if (!is_hybrid_image(source)) {
+        fprintf(stderr, "Error: %s is not a hybrid image and can't be written raw, use --wipe instead\n", source);
+        log_write(g_log_ctx, LOG_ERROR, "Not an isohybrid image: %s", source);
+        return -1;
+    }
+    
+    log_write(g_log_ctx, LOG_SUCCESS, "Source is an isohybrid image");
+    
+    image_size = raw_size(source);
+    device_size = raw_size(device);
+    if (image_size <= 0 || device_size <= 0) {
+        fprintf(stderr, "Error: Cannot determine the size of %s\n", image_size <= 0 ? source : device);
+        log_write(g_log_ctx, LOG_ERROR, "Cannot determine the size of %s", image_size <= 0 ? source : device);
+        return -1;
+    }
+    
+    if (image_size > device_size) {
+        fprintf(stderr, "Error: Image (%lld MB) is bigger than the device (%lld MB)\n",
+                (long long)image_size / (1024 * 1024), (long long)device_size / (1024 * 1024));
+        log_write(g_log_ctx, LOG_ERROR, "Image is %lld bytes, device only %lld",
+                  (long long)image_size, (long long)device_size);
+        return -1;
+    }
+    
+    print_colored("Writing image to device...", "green");
+    log_write(g_log_ctx, LOG_STEP, "Writing %s to %s", source, device);
+    
+    if (copy_image(source, device, options, &written_hash) != 0) {
+        return -1;
+    }
+    
+    log_write(g_log_ctx, LOG_INFO, "Image xxh64 %016llx", (unsigned long long)written_hash);
+    
+    if (options->verify) {
+        print_colored("Verifying image on device...", "green");
+        log_write(g_log_ctx, LOG_STEP, "Reading back %lld bytes from %s", (long long)image_size, device);
+        
+        if (hash_file_range(device, 0, image_size, 1, &device_hash) != 0) {
+            fprintf(stderr, "Error: Cannot read back %s - %s\n", device, strerror(errno));
+            log_write(g_log_ctx, LOG_ERROR, "Cannot read back %s - %s", device, strerror(errno));
+            return -1;
+        }
+        
+        if (device_hash != written_hash) {
+            fprintf(stderr, "Error: Data on %s does not match the image\n", device);
+            log_write(g_log_ctx, LOG_ERROR, "Verification failed: %016llx on device, expected %016llx",
+                      (unsigned long long)device_hash, (unsigned long long)written_hash);
+            return -1;
+        }
+        
+        log_write(g_log_ctx, LOG_SUCCESS, "Verified %lld MB on device", (long long)image_size / (1024 * 1024));
+    }
+    
+    // The kernel still has the old partition table of the stick
+    make_system_realize_partition_changed(device);
+    
+    print_colored("Image written", "green");
+    return 0;
+}
+
+// The whole image is one file that starts at the beginning of every device
+static int raw_begin_file(FanoutTarget *target, const ManifestEntry *entry) {
+    (void)entry;
+    target->base = 0;
+    return 0;
+}
+
+// Write a hybrid image onto several devices at once, reading it only once. targets name the
+// devices, every one that fails gets its failed flag set. Returns -1 if none of them made it
+int write_raw_targets(const char *source, FanoutTarget *targets, int count, const CopyOptions *options) {
+    SourceManifest image;
+    ManifestEntry entry;
+    ManifestEntry *files[1];
+    uint64_t device_hash;
+    off_t image_size;
+    off_t device_size;
+    double synced;
+    int alive = 0;
+    int result;
+    int t;
+    
+    if (!is_hybrid_image(source)) {
+        fprintf(stderr, "Error: %s is not a hybrid image and can't be written raw, use --wipe instead\n", source);
+        log_write(g_log_ctx, LOG_ERROR, "Not an isohybrid image: %s", source);
+        return -1;
+    }
+    
+    image_size = raw_size(source);
+    if (image_size <= 0) {
+        fprintf(stderr, "Error: Cannot determine the size of %s\n", source);
+        log_write(g_log_ctx, LOG_ERROR, "Cannot determine the size of %s", source);
+        return -1;
+    }
+    
+    // Fan-out copies files of a manifest, so the image goes as a single file read out of itself
+    memset(&image, 0, sizeof(image));
+    memset(&entry, 0, sizeof(entry));
+    snprintf(image.image, sizeof(image.image), "%s", source);
+    entry.path = source;
+    entry.mode = S_IFREG | 0644;
+    entry.size = image_size;
+    entry.extent = 0;
+    files[0] = &entry;
+    
+    for (t = 0; t < count; t++) {
+        targets[t].fd = -1;
+        targets[t].pad = 1;
+        targets[t].begin_file = raw_begin_file;
+        targets[t].end_file = NULL;
+        targets[t].wrote = NULL;
+        
+        if (targets[t].failed) {
+            continue;
+        }
+        
+        device_size = raw_size(targets[t].name);
+        if (device_size < image_size) {
+            fprintf(stderr, "Error: Image (%lld MB) doesn't fit on %s (%lld MB)\n", (long long)image_size / (1024 * 1024),
+                    targets[t].name, (long long)device_size / (1024 * 1024));
+            log_write(g_log_ctx, LOG_ERROR, "Image is %lld bytes, %s only %lld",
+                      (long long)image_size, targets[t].name, (long long)device_size);
+            targets[t].failed = 1;
+            continue;
+        }
+        
+        targets[t].fd = open(targets[t].name, O_WRONLY | O_DIRECT | O_CLOEXEC);
+        if (targets[t].fd < 0 && errno == EINVAL) {
+            targets[t].fd = open(targets[t].name, O_WRONLY | O_CLOEXEC);
+        }
+        if (targets[t].fd < 0) {
+            fprintf(stderr, "Error: Cannot open device: %s - %s\n", targets[t].name, strerror(errno));
+            log_write(g_log_ctx, LOG_ERROR, "Cannot open device: %s - %s", targets[t].name, strerror(errno));
+            targets[t].failed = 1;
+        }
+    }
+    
+    print_colored("Writing image to devices...", "green");
+    log_write(g_log_ctx, LOG_STEP, "Writing %s to %d devices", source, count);
+    printf("Image size: %lld MB\n", (long long)image_size / (1024 * 1024));
+    
+    result = fanout_copy(&image, files, 1, targets, count, 0);
+    
+    for (t = 0; t < count; t++) {
+        if (targets[t].fd < 0) {
+            continue;
+        }
+        
+        // Raw mode always waits for the device, the stick is only usable once every block is on it
+        synced = tune_now();
+        if (result == 0 && !targets[t].failed && fsync(targets[t].fd) != 0) {
+            fprintf(stderr, "Error: Failed to sync %s: %s\n", targets[t].name, strerror(errno));
+            log_write(g_log_ctx, LOG_ERROR, "Failed to sync %s: %s", targets[t].name, strerror(errno));
+            targets[t].failed = 1;
+        }
+        metrics_wait(WAIT_SYNC, synced);
+        close(targets[t].fd);
+        targets[t].fd = -1;
+    }
+    
+    if (result != 0) {
+        return -1;
+    }
+    
+    log_write(g_log_ctx, LOG_INFO, "Image xxh64 %016llx", (unsigned long long)entry.hash);
+    
+    for (t = 0; t < count; t++) {
+        if (targets[t].failed) {
+            continue;
+        }
+        
+        if (options->verify) {
+            print_colored("Verifying image on device...", "green");
+            log_write(g_log_ctx, LOG_STEP, "Reading back %lld bytes from %s", (long long)image_size, targets[t].name);
+            
+            if (hash_file_range(targets[t].name, 0, image_size, 1, &device_hash) != 0 || device_hash != entry.hash) {
+                fprintf(stderr, "Error: Data on %s does not match the image\n", targets[t].name);
+                log_write(g_log_ctx, LOG_ERROR, "Verification failed on %s", targets[t].name);
+                targets[t].failed = 1;
+                continue;
+            }
+            
+            log_write(g_log_ctx, LOG_SUCCESS, "Verified %lld MB on %s", (long long)image_size / (1024 * 1024), targets[t].name);
+        }
+        
+        make_system_realize_partition_changed(targets[t].name);
+        alive++;
+    }
+    
+    if (alive == 0) {
+        return -1;
+    }
+    
+    print_colored("Image written", "green");
+    return 0;
+}
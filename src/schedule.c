@@ -0,0 +1,112 @@
+/*
+    buf - Command line tool for flashing ISO images onto USB drives.
+    Copyright (C) 2026  Bryson Kelly
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+*/
+
+
+// Copy scheduling
+// Reading files in readdir order makes the source seek all over the image.
+// Sorting them by where they actually live on the source lets us read it front to back
+#include "../include/buf.h"
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#include <linux/fiemap.h>
+
+// Byte offset of the first block of a file on the device it lives on.
+// FIEMAP where the filesystem has it, FIBMAP (iso9660 and udf only have this one) otherwise
+unsigned long long get_physical_offset(const char *path) {
+    struct {
+        struct fiemap map;
+        struct fiemap_extent extent;
+    } request;
+    int fd;
+    int block = 0;
+    int block_size;
+    unsigned long long offset = PHYSICAL_UNKNOWN;
+    
+    fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return PHYSICAL_UNKNOWN;
+    }
+    
+    memset(&request, 0, sizeof(request));
+    request.map.fm_start = 0;
+    request.map.fm_length = ~0ULL;
+    request.map.fm_extent_count = 1;
+    
+    if (ioctl(fd, FS_IOC_FIEMAP, &request.map) == 0 && request.map.fm_mapped_extents > 0) {
+        offset = request.extent.fe_physical;
+    } else if (ioctl(fd, FIGETBSZ, &block_size) == 0 && ioctl(fd, FIBMAP, &block) == 0 && block > 0) {
+        offset = (unsigned long long)block * block_size;
+    }
+    
+    close(fd);
+    return offset;
+}
+
+// Disc order. Files we couldn't locate go last, biggest first
+static int compare_physical(const void *a, const void *b) {
+    const ManifestEntry *x = *(const ManifestEntry * const *)a;
+    const ManifestEntry *y = *(const ManifestEntry * const *)b;
+    
+    if (x->physical != y->physical) {
+        return x->physical < y->physical ? -1 : 1;
+    }
+    if (x->size != y->size) {
+        return x->size > y->size ? -1 : 1;
+    }
+    return 0;
+}
+
+// Biggest first so the ETA settles early, disc order between files of the same size
+static int compare_largest(const void *a, const void *b) {
+    const ManifestEntry *x = *(const ManifestEntry * const *)a;
+    const ManifestEntry *y = *(const ManifestEntry * const *)b;
+    
+    if (x->size != y->size) {
+        return x->size > y->size ? -1 : 1;
+    }
+    if (x->physical != y->physical) {
+        return x->physical < y->physical ? -1 : 1;
+    }
+    return 0;
+}
+
+// Sort the files of a manifest into copy order, locating each one on the source first
+void schedule_files(ManifestEntry **files, size_t count, const char *root, CopyOrder order) {
+    char path[MAX_PATH];
+    size_t located = 0;
+    size_t i;
+    
+    if (order == ORDER_NONE || count == 0) {
+        return;
+    }
+    
+    for (i = 0; i < count; i++) {
+        if (files[i]->physical == PHYSICAL_UNKNOWN) {
+            snprintf(path, sizeof(path), "%s/%s", root, files[i]->path);
+            files[i]->physical = get_physical_offset(path);
+        }
+        if (files[i]->physical != PHYSICAL_UNKNOWN) {
+            located++;
+        }
+    }
+    
+    log_write(g_log_ctx, LOG_INFO, "Located %zu of %zu files on the source", located, count);
+    
+    qsort(files, count, sizeof(ManifestEntry *), order == ORDER_LARGEST ? compare_largest : compare_physical);
+}
@@ -0,0 +1,398 @@
+/*
+    buf - Command line tool for flashing ISO images onto USB drives.
+    Copyright (C) 2026  Bryson Kelly
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+*/
+
+
+// Multiple targets
+// The same steps main() goes through for one stick, for several at once. Every stick gets its
+// own copy of the config and its own mountpoints, the source is scanned once and the copy
+// reads it once for all of them. A stick that fails anywhere along the way is dropped and
+// the others carry on
+#include "../include/buf.h"
+#include <pthread.h>
+
+typedef struct {
+    Config config;              // The run's config with this stick as the target
+    MountPoints mounts;
+    char uefi_partition[MAX_PATH];
+    int mounted;
+    int failed;
+    int started;                // Prepared in its own thread
+    pthread_t thread;
+} TargetRun;
+
+static void target_failed(TargetRun *run, const char *what) {
+    run->failed = 1;
+    fprintf(stderr, "Error: %s failed on %s, carrying on without it\n", what, run->config.target);
+    log_write(g_log_ctx, LOG_ERROR, "%s failed on %s, target dropped", what, run->config.target);
+}
+
+// Check the stick is what the mode needs and nothing on it is mounted any more
+static int target_validate(TargetRun *run) {
+    Config *config = &run->config;
+    
+    if (check_target_media(config->target, config->mode) != 0 || determine_target_parameters(config) != 0) {
+        return -1;
+    }
+    
+    if (is_device_busy(config->target_device)) {
+        log_write(g_log_ctx, LOG_WARNING, "Target device is mounted, attempting to unmount: %s", config->target_device);
+        
+        if (unmount_device(config->target_device) != 0) {
+            fprintf(stderr, "Error: Failed to unmount target device: %s\n", config->target_device);
+            return -1;
+        }
+    }
+    
+    log_write(g_log_ctx, LOG_SUCCESS, "Target media validated: %s (partition %s)", config->target_device, config->target_partition);
+    return 0;
+}
+
+// Per stick mountpoints next to the shared ones, which only the source uses
+static int target_mountpoints(TargetRun *run, const MountPoints *shared, int index) {
+    MountPoints *mounts = &run->mounts;
+    
+    mounts->source_mountpoint[0] = '\0';
+    snprintf(mounts->target_mountpoint, sizeof(mounts->target_mountpoint), "%s_%d", shared->target_mountpoint, index);
+    snprintf(mounts->temp_directory, sizeof(mounts->temp_directory), "%s_%d", shared->temp_directory, index);
+    
+    if (make_directory(mounts->target_mountpoint) != 0 || make_directory(mounts->temp_directory) != 0) {
+        fprintf(stderr, "Error: Failed to create mountpoints for %s\n", run->config.target);
+        log_write(g_log_ctx, LOG_ERROR, "Failed to create mountpoints for %s", run->config.target);
+        return -1;
+    }
+    
+    return 0;
+}
+
+// Wipe, partition and format one stick. Runs in a thread per stick
+static void *target_prepare(void *arg) {
+    TargetRun *run = (TargetRun *)arg;
+    Config *config = &run->config;
+    int native_fat = config->native_fat && config->filesystem == FS_FAT;
+    
+    if (wipe_device(config->target_device) != 0) {
+        target_failed(run, "Wiping the device");
+        return NULL;
+    }
+    
+    if (create_partition_table(config->target_device) != 0) {
+        target_failed(run, "Creating the partition table");
+        return NULL;
+    }
+    
+    if (create_partition(config->target_device, config->target_partition, config->filesystem) != 0) {
+        target_failed(run, "Creating the partition");
+        return NULL;
+    }
+    
+    if (!native_fat && format_partition(config->target_partition, config->filesystem, config->label) != 0) {
+        target_failed(run, "Formatting the partition");
+        return NULL;
+    }
+    
+    log_write(g_log_ctx, LOG_SUCCESS, "Partition created%s: %s (%s)", native_fat ? "" : " and formatted",
+              config->target_partition, config->filesystem == FS_NTFS ? "NTFS" : "FAT32");
+    
+    // Create UEFI:NTFS helper partition for windows NTFS installs
+    if (config->iso_type == ISO_WINDOWS && config->filesystem == FS_NTFS) {
+        if (create_uefi_ntfs_partition(config->target_device) != 0) {
+            print_colored("Warning: Failed to create UEFI:NTFS partition", "yellow");
+            log_write(g_log_ctx, LOG_WARNING, "Failed to create UEFI:NTFS partition on %s", config->target_device);
+        } else {
+            snprintf(run->uefi_partition, sizeof(run->uefi_partition), "%s2", config->target_device);
+            
+            if (install_uefi_ntfs(run->uefi_partition, run->mounts.temp_directory) != 0) {
+                print_colored("Warning: Failed to install UEFI:NTFS support", "yellow");
+                log_write(g_log_ctx, LOG_WARNING, "Failed to install UEFI:NTFS support on %s", run->uefi_partition);
+            } else {
+                log_write(g_log_ctx, LOG_SUCCESS, "UEFI:NTFS support installed on %s", run->uefi_partition);
+            }
+        }
+    }
+    
+    return NULL;
+}
+
+static int target_mount(TargetRun *run) {
+    if (run->mounted) {
+        return 0;
+    }
+    
+    if (mount_target(run->config.target_partition, run->mounts.target_mountpoint) != 0) {
+        target_failed(run, "Mounting the partition");
+        return -1;
+    }
+    
+    run->mounted = 1;
+    return 0;
+}
+
+// Copy the files onto every stick that's still in the running
+static int targets_copy(TargetRun *runs, int count, SourceManifest *manifest, const Config *config, int native_fat) {
+    FanoutTarget targets[MAX_TARGETS];
+    int result;
+    int i;
+    
+    memset(targets, 0, sizeof(targets));
+    
+    for (i = 0; i < count; i++) {
+        if (!native_fat && !runs[i].failed && target_mount(&runs[i]) == 0 &&
+            check_free_space(manifest, runs[i].mounts.target_mountpoint) != 0) {
+            target_failed(&runs[i], "Space check");
+        }
+        
+        targets[i].name = native_fat ? runs[i].config.target_partition : runs[i].mounts.target_mountpoint;
+        targets[i].failed = runs[i].failed;
+    }
+    
+    log_section(g_log_ctx, "FILE COPY OPERATION");
+    metrics_phase(native_fat ? "fat32_write" : "copy");
+    log_write(g_log_ctx, LOG_INFO, "Copying from: %s", manifest->root);
+    
+    if (native_fat) {
+        print_colored("Writing FAT32 filesystem...", "green");
+        log_write(g_log_ctx, LOG_STEP, "Writing FAT32 filesystem and files straight to %d partitions", count);
+        result = write_fat32_targets(manifest, targets, count, config->label, config->verbose, &config->copy);
+    } else {
+        print_colored("Copying installation files...", "green");
+        log_write(g_log_ctx, LOG_STEP, "Starting file copy operation to %d targets", count);
+        result = copy_fanout_mounted(manifest, targets, count, config->verbose, &config->copy);
+    }
+    
+    for (i = 0; i < count; i++) {
+        if (!runs[i].failed && (result != 0 || targets[i].failed)) {
+            target_failed(&runs[i], "Copying the files");
+        }
+    }
+    
+    return result;
+}
+
+// GRUB for BIOS boot and the Windows 7 UEFI workaround, one stick at a time
+static void target_windows_boot(TargetRun *run, const SourceManifest *manifest, const char *source_mountpoint) {
+    // Nothing is mounted when the image was read directly, but the target has the same files now
+    const char *windows_source = manifest->image[0] != '\0' ? run->mounts.target_mountpoint : source_mountpoint;
+    
+    if (target_mount(run) != 0) {
+        return;
+    }
+    
+    log_write(g_log_ctx, LOG_STEP, "Applying Windows-specific configurations to %s", run->config.target);
+    
+    if (workaround_win7_uefi(windows_source, run->mounts.target_mountpoint) != 0) {
+        log_write(g_log_ctx, LOG_INFO, "Windows 7 UEFI workaround was necessary and applied");
+    }
+    
+    print_colored("Installing GRUB bootloader...", "green");
+    if (install_grub(run->mounts.target_mountpoint, run->config.target_device) != 0) {
+        target_failed(run, "Installing GRUB");
+        return;
+    }
+    
+    if (install_grub_config(run->mounts.target_mountpoint) != 0) {
+        target_failed(run, "Installing the GRUB configuration");
+        return;
+    }
+    
+    log_write(g_log_ctx, LOG_SUCCESS, "GRUB bootloader installed on %s", run->config.target_device);
+}
+
+// Which sticks made it. Returns how many didn't
+static int targets_summary(const TargetRun *runs, int count) {
+    int failed = 0;
+    int i;
+    
+    printf("\n");
+    for (i = 0; i < count; i++) {
+        if (runs[i].failed) {
+            printf("  %-24s FAILED\n", runs[i].config.target);
+            log_write(g_log_ctx, LOG_ERROR, "Target %s failed", runs[i].config.target);
+            failed++;
+        } else {
+            printf("  %-24s OK\n", runs[i].config.target);
+            log_write(g_log_ctx, LOG_SUCCESS, "Target %s completed", runs[i].config.target);
+        }
+    }
+    printf("\n");
+    
+    return failed;
+}
+
+static int targets_alive(const TargetRun *runs, int count) {
+    int alive = 0;
+    int i;
+    
+    for (i = 0; i < count; i++) {
+        alive += !runs[i].failed;
+    }
+    return alive;
+}
+
+// Raw mode for several sticks, nothing to mount or partition
+static int flash_raw_targets(TargetRun *runs, int count, Config *config) {
+    FanoutTarget targets[MAX_TARGETS];
+    int i;
+    
+    memset(targets, 0, sizeof(targets));
+    for (i = 0; i < count; i++) {
+        targets[i].name = runs[i].config.target_device;
+        targets[i].failed = runs[i].failed;
+    }
+    
+    log_config(g_log_ctx, config);
+    log_section(g_log_ctx, "RAW IMAGE WRITE");
+    metrics_phase("raw_write");
+    
+    write_raw_targets(config->source, targets, count, &config->copy);
+    
+    for (i = 0; i < count; i++) {
+        if (!runs[i].failed && targets[i].failed) {
+            target_failed(&runs[i], "Writing the image");
+        }
+    }
+    
+    return targets_summary(runs, count) == 0 ? 0 : -1;
+}
+
+// Flash config->source onto every device in config->targets. Returns -1 if any of them failed
+int flash_targets(Config *config) {
+    TargetRun *runs;
+    MountPoints shared = {0};
+    SourceManifest manifest = {0};
+    int count = config->target_count;
+    int native_fat;
+    int result = -1;
+    int i;
+    
+    if (is_device_busy(config->source)) {
+        fprintf(stderr, "Error: Source media is currently in use\n");
+        log_write(g_log_ctx, LOG_ERROR, "Source media is currently in use");
+        return -1;
+    }
+    
+    runs = calloc(count, sizeof(TargetRun));
+    if (runs == NULL) {
+        fprintf(stderr, "Error: Out of memory\n");
+        log_write(g_log_ctx, LOG_ERROR, "Out of memory for %d targets", count);
+        return -1;
+    }
+    
+    log_section(g_log_ctx, "TARGET VALIDATION");
+    metrics_phase("validate");
+    for (i = 0; i < count; i++) {
+        runs[i].config = *config;
+        strncpy(runs[i].config.target, config->targets[i], sizeof(runs[i].config.target) - 1);
+        
+        if (target_validate(&runs[i]) != 0) {
+            target_failed(&runs[i], "Validation");
+        }
+    }
+    
+    if (targets_alive(runs, count) == 0) {
+        fprintf(stderr, "Error: None of the targets can be used\n");
+        log_write(g_log_ctx, LOG_ERROR, "None of the %d targets can be used", count);
+        free(runs);
+        return -1;
+    }
+    
+    if (config->mode == MODE_RAW) {
+        result = flash_raw_targets(runs, count, config);
+        free(runs);
+        return result;
+    }
+    
+    metrics_phase("source_scan");
+    if (create_mountpoints(&shared) != 0) {
+        fprintf(stderr, "Error: Failed to create mountpoints\n");
+        log_write(g_log_ctx, LOG_ERROR, "Failed to create temporary mountpoints");
+        free(runs);
+        return -1;
+    }
+    
+    // Same source handling as a single stick, the manifest is shared by every target
+    if (!config->mount_source && manifest_build_image(&manifest, config->source) == 0) {
+        log_write(g_log_ctx, LOG_SUCCESS, "Reading source files directly from the image, no mount needed");
+    } else if (mount_source(config->source, shared.source_mountpoint) != 0 ||
+               manifest_build(&manifest, shared.source_mountpoint) != 0) {
+        fprintf(stderr, "Error: Failed to read source files\n");
+        log_write(g_log_ctx, LOG_ERROR, "Failed to read source media: %s", config->source);
+        goto done;
+    }
+    
+    config->iso_type = detect_iso_type(&manifest);
+    if (config->iso_type == ISO_WINDOWS && check_fat32_limitation(&manifest, &config->filesystem) != 0) {
+        print_colored("Notice: Large files detected, switching to NTFS", "yellow");
+        log_write(g_log_ctx, LOG_WARNING, "Large files detected (>4GB), switching to NTFS filesystem");
+        config->filesystem = FS_NTFS;
+    }
+    native_fat = config->native_fat && config->filesystem == FS_FAT;
+    
+    log_config(g_log_ctx, config);
+    log_section(g_log_ctx, "DEVICE PREPARATION");
+    metrics_phase("prepare");
+    print_colored("Preparing target devices...", "green");
+    
+    // The slow part is waiting on the sticks, so they all get prepared at the same time
+    for (i = 0; i < count; i++) {
+        runs[i].config.iso_type = config->iso_type;
+        runs[i].config.filesystem = config->filesystem;
+        
+        if (runs[i].failed || target_mountpoints(&runs[i], &shared, i) != 0) {
+            runs[i].failed = 1;
+            continue;
+        }
+        
+        runs[i].started = pthread_create(&runs[i].thread, NULL, target_prepare, &runs[i]) == 0;
+        if (!runs[i].started) {
+            target_prepare(&runs[i]);
+        }
+    }
+    for (i = 0; i < count; i++) {
+        if (runs[i].started) {
+            pthread_join(runs[i].thread, NULL);
+        }
+    }
+    
+    if (targets_alive(runs, count) > 0 && targets_copy(runs, count, &manifest, config, native_fat) == 0 &&
+        config->iso_type == ISO_WINDOWS) {
+        log_section(g_log_ctx, "BOOTLOADER INSTALLATION");
+        metrics_phase("bootloader");
+        
+        for (i = 0; i < count; i++) {
+            if (!runs[i].failed) {
+                target_windows_boot(&runs[i], &manifest, shared.source_mountpoint);
+            }
+        }
+    }
+    
+    log_section(g_log_ctx, "CLEANUP");
+    metrics_phase("cleanup");
+    result = targets_summary(runs, count) == 0 ? 0 : -1;
+
+done:
+    manifest_free(&manifest);
+    for (i = 0; i < count; i++) {
+        if (runs[i].mounts.target_mountpoint[0] != '\0') {
+            cleanup(&runs[i].mounts, runs[i].config.target);
+        }
+    }
+    cleanup(&shared, config->target);
+    free(runs);
+    return result;
+}
@@ -0,0 +1,205 @@
+/*
+    buf - Command line tool for flashing ISO images onto USB drives.
+    Copyright (C) 2026  Bryson Kelly
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+*/
+
+
+// Adaptive copy tuning
+// A USB2 stick and an NVMe enclosure want very different chunk sizes. Every engine reports
+// how long each chunk took to land on the target, and this nudges the chunk size and the
+// number of chunks in flight AIMD style: grow slowly while writes come back quickly,
+// halve as soon as they start stalling (which is what freezes the progress line)
+#include "../include/buf.h"
+#include <pthread.h>
+
+#define TUNE_MIN_CHUNK (1024 * 1024)          // 1MB
+#define TUNE_MAX_CHUNK (32 * 1024 * 1024)     // 32MB, the old fixed block size
+#define TUNE_START_CHUNK (16 * 1024 * 1024)   // Same as the old pipeline halves
+#define TUNE_CHUNK_STEP (1024 * 1024)         // Additive increase per window
+#define TUNE_MIN_DEPTH 2
+#define TUNE_MAX_DEPTH 16
+#define TUNE_MEMORY_CAP (256 * 1024 * 1024)   // Chunk * depth * jobs never goes above this
+#define TUNE_MIN_SAMPLE (256 * 1024)          // Smaller writes say nothing about the device
+#define TUNE_WINDOW 4                         // Samples per decision
+#define TUNE_LATENCY_LOW 0.1                  // Below this per chunk there's room to grow
+#define TUNE_LATENCY_HIGH 0.5                 // Above this the progress line starts to stall
+
+typedef struct {
+    size_t chunk;
+    int depth;
+    int jobs;
+    
+    // Current window
+    int samples;
+    double bytes;
+    double seconds;
+    double worst;
+    
+    double last_rate;  // Throughput of the previous window, to spot when growing stops paying
+    int grew;          // Previous window ended with an increase
+    int changes;
+} CopyTuner;
+
+static CopyTuner tuner = { .chunk = TUNE_START_CHUNK, .depth = TUNE_MIN_DEPTH, .jobs = 1 };
+static pthread_mutex_t tuner_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Would chunk * depth stay under the memory cap with every worker copying at once
+static int tune_fits(size_t chunk, int depth, int jobs) {
+    return (unsigned long long)chunk * depth * jobs <= TUNE_MEMORY_CAP;
+}
+
+// Monotonic clock in seconds, for timing chunks
+double tune_now(void) {
+    struct timespec now;
+    
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+void tune_reset(int jobs) {
+    pthread_mutex_lock(&tuner_lock);
+    memset(&tuner, 0, sizeof(tuner));
+    tuner.jobs = jobs > 0 ? jobs : 1;
+    tuner.chunk = TUNE_START_CHUNK;
+    tuner.depth = TUNE_MIN_DEPTH;
+    
+    while (tuner.chunk > TUNE_MIN_CHUNK && !tune_fits(tuner.chunk, tuner.depth, tuner.jobs)) {
+        tuner.chunk /= 2;
+    }
+    pthread_mutex_unlock(&tuner_lock);
+}
+
+size_t tune_chunk_size(void) {
+    size_t chunk;
+    
+    pthread_mutex_lock(&tuner_lock);
+    chunk = tuner.chunk;
+    pthread_mutex_unlock(&tuner_lock);
+    
+    return chunk;
+}
+
+int tune_depth(void) {
+    int depth;
+    
+    pthread_mutex_lock(&tuner_lock);
+    depth = tuner.depth;
+    pthread_mutex_unlock(&tuner_lock);
+    
+    return depth;
+}
+
+// Biggest chunk the current depth may ever grow to, for sizing buffers up front
+size_t tune_chunk_limit(int depth) {
+    size_t limit = TUNE_MAX_CHUNK;
+    int jobs;
+    
+    pthread_mutex_lock(&tuner_lock);
+    jobs = tuner.jobs;
+    pthread_mutex_unlock(&tuner_lock);
+    
+    while (limit > TUNE_MIN_CHUNK && !tune_fits(limit, depth, jobs)) {
+        limit /= 2;
+    }
+    return limit;
+}
+
+// One chunk of bytes took seconds to write. Every TUNE_WINDOW samples decide whether to move
+void tune_record(size_t bytes, double seconds) {
+    size_t chunk;
+    int depth;
+    double latency;
+    double rate;
+    int changed = 0;
+    
+    if (bytes < TUNE_MIN_SAMPLE || seconds <= 0) {
+        return;
+    }
+    
+    pthread_mutex_lock(&tuner_lock);
+    
+    tuner.samples++;
+    tuner.bytes += bytes;
+    tuner.seconds += seconds;
+    if (seconds > tuner.worst) {
+        tuner.worst = seconds;
+    }
+    
+    if (tuner.samples < TUNE_WINDOW) {
+        pthread_mutex_unlock(&tuner_lock);
+        return;
+    }
+    
+    latency = tuner.seconds / tuner.samples;
+    rate = tuner.bytes / tuner.seconds;
+    chunk = tuner.chunk;
+    depth = tuner.depth;
+    
+    if (tuner.worst > TUNE_LATENCY_HIGH) {
+        // Multiplicative decrease, the device can't keep up with this much at once
+        chunk = chunk / 2 > TUNE_MIN_CHUNK ? chunk / 2 : TUNE_MIN_CHUNK;
+        depth = depth / 2 > TUNE_MIN_DEPTH ? depth / 2 : TUNE_MIN_DEPTH;
+        tuner.grew = 0;
+    } else if (tuner.grew && rate < tuner.last_rate * 0.9) {
+        // Last increase made things slower, take it back and stay there
+        if (chunk > TUNE_MIN_CHUNK) {
+            chunk -= TUNE_CHUNK_STEP;
+        }
+        if (depth > TUNE_MIN_DEPTH) {
+            depth--;
+        }
+        tuner.grew = 0;
+    } else if (latency < TUNE_LATENCY_LOW) {
+        // Additive increase while there's headroom
+        if (chunk + TUNE_CHUNK_STEP <= TUNE_MAX_CHUNK && tune_fits(chunk + TUNE_CHUNK_STEP, depth, tuner.jobs)) {
+            chunk += TUNE_CHUNK_STEP;
+        }
+        if (depth < TUNE_MAX_DEPTH && tune_fits(chunk, depth + 1, tuner.jobs)) {
+            depth++;
+        }
+        tuner.grew = chunk != tuner.chunk || depth != tuner.depth;
+    } else {
+        tuner.grew = 0;
+    }
+    
+    if (chunk != tuner.chunk || depth != tuner.depth) {
+        tuner.chunk = chunk;
+        tuner.depth = depth;
+        tuner.changes++;
+        changed = 1;
+    }
+    
+    tuner.last_rate = rate;
+    tuner.samples = 0;
+    tuner.bytes = 0;
+    tuner.seconds = 0;
+    tuner.worst = 0;
+    
+    pthread_mutex_unlock(&tuner_lock);
+    
+    if (changed) {
+        log_write(g_log_ctx, LOG_INFO, "Copy tuning: %zu KB chunks, %d in flight (%.0f ms per chunk, %.1f MB/s)",
+                  chunk / 1024, depth, latency * 1000, rate / (1024 * 1024));
+    }
+}
+
+void tune_report(void) {
+    pthread_mutex_lock(&tuner_lock);
+    log_write(g_log_ctx, LOG_INFO, "Copy tuning settled on %zu KB chunks, %d in flight after %d adjustments",
+              tuner.chunk / 1024, tuner.depth, tuner.changes);
+    pthread_mutex_unlock(&tuner_lock);
+}
@@ -0,0 +1,492 @@
+/*
+    buf - Command line tool for flashing ISO images onto USB drives.
+    Copyright (C) 2026  Bryson Kelly
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+*/
+
+
+// io_uring copy engine
+// Keeps up to URING_DEPTH reads/writes in flight so the USB device actually sees a queue.
+// How many of them are used at once follows the adaptive tuner's depth.
+// Talks to the kernel with raw syscalls so we don't need liburing installed
+#define _GNU_SOURCE
+
+#include "../include/buf.h"
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <stdatomic.h>
+
+#if __has_include(<linux/io_uring.h>) && defined(__NR_io_uring_setup)
+#include <linux/io_uring.h>
+
+#define URING_DEPTH 16                // Most chunks in flight per ring
+#define URING_CHUNK (1024 * 1024)     // 1MB per registered buffer
+
+typedef enum {
+    SLOT_IDLE,
+    SLOT_READING,
+    SLOT_WRITING,
+    SLOT_WRITTEN   // On the target, but the buffer waits for the chunks before it to be hashed
+} SlotState;
+
+// One registered buffer and the chunk of the file it's currently moving
+typedef struct {
+    SlotState state;
+    off_t offset;  // Where the chunk starts in the file
+    size_t want;   // Chunk length
+    size_t done;   // Bytes read (SLOT_READING) or written (SLOT_WRITING) so far
+    double started; // When the write was queued, for the tuner
+    int hashed;    // Chunk has gone into the file hash, or nobody wants one
+} UringSlot;
+
+typedef struct {
+    int fd;
+    
+    // Submission queue
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_array;
+    struct io_uring_sqe *sqes;
+    unsigned pending; // SQEs queued but not yet submitted
+    
+    // Completion queue
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    struct io_uring_cqe *cqes;
+    
+    void *sq_ptr;
+    size_t sq_size;
+    void *cq_ptr;
+    size_t cq_size;
+    size_t sqes_size;
+    
+    char *buffers; // URING_DEPTH * URING_CHUNK, registered with the kernel
+    UringSlot slots[URING_DEPTH];
+    off_t source_offset; // Where the file being copied starts in the source, non-zero inside an image
+} UringContext;
+
+static atomic_int uring_unsupported = 0;          // Set once the kernel refuses io_uring
+static __thread UringContext *thread_ring = NULL; // Each copy thread gets its own ring
+
+static int sys_io_uring_setup(unsigned entries, struct io_uring_params *params) {
+    return (int)syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int sys_io_uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags) {
+    return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+static int sys_io_uring_register(int fd, unsigned opcode, void *arg, unsigned nr_args) {
+    return (int)syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+static void ring_destroy(UringContext *ring) {
+    if (ring->sqes != NULL && ring->sqes != MAP_FAILED) {
+        munmap(ring->sqes, ring->sqes_size);
+    }
+    if (ring->cq_ptr != NULL && ring->cq_ptr != MAP_FAILED && ring->cq_ptr != ring->sq_ptr) {
+        munmap(ring->cq_ptr, ring->cq_size);
+    }
+    if (ring->sq_ptr != NULL && ring->sq_ptr != MAP_FAILED) {
+        munmap(ring->sq_ptr, ring->sq_size);
+    }
+    if (ring->fd >= 0) {
+        close(ring->fd);
+    }
+    free(ring->buffers);
+    free(ring);
+}
+
+static UringContext *ring_create(void) {
+    UringContext *ring;
+    struct io_uring_params params;
+    struct iovec iov[URING_DEPTH];
+    int saved_errno;
+    int i;
+    
+    ring = (UringContext *)calloc(1, sizeof(UringContext));
+    if (ring == NULL) {
+        return NULL;
+    }
+    
+    memset(&params, 0, sizeof(params));
+    ring->fd = sys_io_uring_setup(URING_DEPTH * 2, &params);
+    if (ring->fd < 0) {
+        saved_errno = errno;
+        // ENOSYS on old kernels, EPERM when disabled by sysctl or seccomp
+        if (saved_errno == ENOSYS || saved_errno == EPERM || saved_errno == EACCES) {
+            atomic_store(&uring_unsupported, 1);
+        }
+        log_write(g_log_ctx, LOG_WARNING, "io_uring unavailable (%s), using standard copy", strerror(saved_errno));
+        free(ring);
+        // copy_file() decides from errno whether to give up on io_uring
+        errno = saved_errno;
+        return NULL;
+    }
+    
+    ring->sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    ring->cq_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    
+    // Newer kernels let the SQ and CQ rings share a single mapping
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        if (ring->cq_size > ring->sq_size) {
+            ring->sq_size = ring->cq_size;
+        }
+        ring->cq_size = ring->sq_size;
+    }
+    
+    ring->sq_ptr = mmap(NULL, ring->sq_size, PROT_READ | PROT_WRITE,
+                        MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+    if (ring->sq_ptr == MAP_FAILED) {
+        goto fail;
+    }
+    
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        ring->cq_ptr = ring->sq_ptr;
+    } else {
+        ring->cq_ptr = mmap(NULL, ring->cq_size, PROT_READ | PROT_WRITE,
+                            MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+        if (ring->cq_ptr == MAP_FAILED) {
+            goto fail;
+        }
+    }
+    
+    ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED) {
+        goto fail;
+    }
+    
+    ring->sq_head = (unsigned *)((char *)ring->sq_ptr + params.sq_off.head);
+    ring->sq_tail = (unsigned *)((char *)ring->sq_ptr + params.sq_off.tail);
+    ring->sq_mask = (unsigned *)((char *)ring->sq_ptr + params.sq_off.ring_mask);
+    ring->sq_array = (unsigned *)((char *)ring->sq_ptr + params.sq_off.array);
+    ring->cq_head = (unsigned *)((char *)ring->cq_ptr + params.cq_off.head);
+    ring->cq_tail = (unsigned *)((char *)ring->cq_ptr + params.cq_off.tail);
+    ring->cq_mask = (unsigned *)((char *)ring->cq_ptr + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)((char *)ring->cq_ptr + params.cq_off.cqes);
+    
+    // Register the buffers once so the kernel doesn't have to pin pages on every I/O
+    if (posix_memalign((void **)&ring->buffers, 4096, (size_t)URING_DEPTH * URING_CHUNK) != 0) {
+        ring->buffers = NULL;
+        goto fail;
+    }
+    
+    for (i = 0; i < URING_DEPTH; i++) {
+        iov[i].iov_base = ring->buffers + (size_t)i * URING_CHUNK;
+        iov[i].iov_len = URING_CHUNK;
+    }
+    
+    if (sys_io_uring_register(ring->fd, IORING_REGISTER_BUFFERS, iov, URING_DEPTH) != 0) {
+        log_write(g_log_ctx, LOG_WARNING, "io_uring buffer registration failed (%s), using standard copy",
+                  strerror(errno));
+        goto fail;
+    }
+    
+    return ring;
+
+fail:
+    ring_destroy(ring);
+    return NULL;
+}
+
+// Queue a fixed-buffer read or write for a slot, it goes to the kernel on the next ring_submit
+static void ring_queue(UringContext *ring, int slot_index, int fd, int opcode) {
+    UringSlot *slot = &ring->slots[slot_index];
+    unsigned tail = *ring->sq_tail + ring->pending;
+    unsigned index = tail & *ring->sq_mask;
+    struct io_uring_sqe *sqe = &ring->sqes[index];
+    
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = (unsigned char)opcode;
+    sqe->fd = fd;
+    sqe->addr = (unsigned long long)(uintptr_t)(ring->buffers + (size_t)slot_index * URING_CHUNK + slot->done);
+    sqe->len = (unsigned)(slot->want - slot->done);
+    sqe->off = (unsigned long long)(slot->offset + slot->done);
+    if (opcode == IORING_OP_READ_FIXED) {
+        sqe->off += (unsigned long long)ring->source_offset;
+    }
+    sqe->buf_index = (unsigned short)slot_index;
+    sqe->user_data = (unsigned long long)slot_index;
+    
+    ring->sq_array[index] = index;
+    ring->pending++;
+}
+
+// Hand queued SQEs to the kernel and wait for at least one completion
+static int ring_submit(UringContext *ring) {
+    unsigned to_submit = ring->pending;
+    int ret;
+    
+    __atomic_store_n(ring->sq_tail, *ring->sq_tail + to_submit, __ATOMIC_RELEASE);
+    ring->pending = 0;
+    
+    // The kernel only takes what's between sq_head and sq_tail, so retrying with the same count is safe
+    do {
+        ret = sys_io_uring_enter(ring->fd, to_submit, 1, IORING_ENTER_GETEVENTS);
+    } while (ret < 0 && errno == EINTR);
+    
+    return ret < 0 ? -1 : 0;
+}
+
+// Start the next chunk of the file on an idle slot
+static int slot_start(UringContext *ring, int slot_index, int src_fd, off_t *next_offset, off_t size) {
+    UringSlot *slot = &ring->slots[slot_index];
+    
+    if (*next_offset >= size) {
+        slot->state = SLOT_IDLE;
+        return 0;
+    }
+    
+    slot->offset = *next_offset;
+    slot->want = (size - *next_offset) > URING_CHUNK ? URING_CHUNK : (size_t)(size - *next_offset);
+    slot->done = 0;
+    slot->state = SLOT_READING;
+    *next_offset += slot->want;
+    
+    ring_queue(ring, slot_index, src_fd, IORING_OP_READ_FIXED);
+    return 1;
+}
+
+// Start idle slots until the tuned depth is in flight. Returns the new in-flight count
+static int slot_refill(UringContext *ring, int in_flight, int src_fd, off_t *next_offset, off_t size) {
+    int depth = tune_depth();
+    int i;
+    
+    if (depth > URING_DEPTH) {
+        depth = URING_DEPTH;
+    }
+    
+    for (i = 0; i < URING_DEPTH && in_flight < depth && *next_offset < size; i++) {
+        if (ring->slots[i].state == SLOT_IDLE) {
+            in_flight += slot_start(ring, i, src_fd, next_offset, size);
+        }
+    }
+    
+    return in_flight;
+}
+
+// Chunks complete in any order but the hash has to see them in file order. Feed it every
+// chunk that's next in line, and free the written slots that were only waiting for that.
+// Returns how many slots were freed
+static int slot_hash_ready(UringContext *ring, HashState *hash, off_t *hashed_offset, int failed) {
+    int freed = 0;
+    int progress = 1;
+    int i;
+    
+    while (progress) {
+        progress = 0;
+        
+        for (i = 0; i < URING_DEPTH; i++) {
+            UringSlot *slot = &ring->slots[i];
+            
+            if (slot->state == SLOT_WRITTEN && failed) {
+                // The hash is useless now, just let the buffer go
+                slot->state = SLOT_IDLE;
+                freed++;
+                continue;
+            }
+            
+            if ((slot->state != SLOT_WRITING && slot->state != SLOT_WRITTEN) || slot->hashed ||
+                slot->offset != *hashed_offset) {
+                continue;
+            }
+            
+            hash_update(hash, ring->buffers + (size_t)i * URING_CHUNK, slot->want);
+            slot->hashed = 1;
+            *hashed_offset += slot->want;
+            progress = 1;
+            
+            if (slot->state == SLOT_WRITTEN) {
+                slot->state = SLOT_IDLE;
+                freed++;
+            }
+        }
+    }
+    
+    return freed;
+}
+
+int uring_available(void) {
+    return !atomic_load(&uring_unsupported);
+}
+
+int uring_copy_fd(int src_fd, off_t src_offset, int dst_fd, off_t size, HashState *hash,
+                  void (*written)(int dst_fd, off_t written, off_t *flushed)) {
+    UringContext *ring;
+    off_t next_offset = 0;
+    off_t hashed_offset = 0;
+    off_t written_bytes = 0;
+    off_t flushed = 0;
+    int in_flight = 0;
+    int failed = 0;
+    int failed_errno = 0;
+    
+    if (!uring_available()) {
+        return -1;
+    }
+    
+    if (thread_ring == NULL) {
+        thread_ring = ring_create();
+        if (thread_ring == NULL) {
+            return -1;
+        }
+    }
+    ring = thread_ring;
+    ring->source_offset = src_offset;
+    
+    in_flight = slot_refill(ring, in_flight, src_fd, &next_offset, size);
+    
+    while (in_flight > 0) {
+        unsigned head;
+        unsigned tail;
+        
+        if (ring_submit(ring) != 0) {
+            log_write(g_log_ctx, LOG_ERROR, "io_uring submit failed: %s", strerror(errno));
+            // Nothing we queued can be trusted at this point, drop the ring
+            ring_destroy(ring);
+            thread_ring = NULL;
+            return -1;
+        }
+        
+        head = *ring->cq_head;
+        tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+        
+        while (head != tail) {
+            struct io_uring_cqe *cqe = &ring->cqes[head & *ring->cq_mask];
+            int slot_index = (int)cqe->user_data;
+            UringSlot *slot = &ring->slots[slot_index];
+            int res = cqe->res;
+            
+            head++;
+            
+            if (res == -EINVAL && slot->state == SLOT_WRITING && (fcntl(dst_fd, F_GETFL) & O_DIRECT)) {
+                // Unaligned tail of the file, or a filesystem that won't do O_DIRECT after all.
+                // Drop it for the rest of this file and write the chunk again
+                fcntl(dst_fd, F_SETFL, fcntl(dst_fd, F_GETFL) & ~O_DIRECT);
+                res = -EAGAIN;
+            }
+            
+            if (res == -EINTR || res == -EAGAIN) {
+                // Retry the same request
+                ring_queue(ring, slot_index, slot->state == SLOT_READING ? src_fd : dst_fd,
+                           slot->state == SLOT_READING ? IORING_OP_READ_FIXED : IORING_OP_WRITE_FIXED);
+                continue;
+            }
+            
+            if (res <= 0) {
+                // A read that hits end of file early or a write that takes nothing would
+                // otherwise be queued again forever. Keep reaping so the ring is clean for
+                // the next file, but stop starting new work
+                if (!failed) {
+                    log_write(g_log_ctx, LOG_ERROR, "io_uring %s failed: %s",
+                              slot->state == SLOT_READING ? "read" : "write",
+                              res < 0 ? strerror(-res) : "no progress, 0 bytes transferred");
+                    // Callers decide on a fallback from errno, so hand back the ring's reason
+                    failed_errno = res < 0 ? -res : EIO;
+                }
+                failed = 1;
+                slot->state = SLOT_IDLE;
+                in_flight--;
+                continue;
+            }
+            
+            slot->done += res;
+            
+            if (slot->done < slot->want) {
+                // Short read or write, queue the rest of the chunk
+                ring_queue(ring, slot_index, slot->state == SLOT_READING ? src_fd : dst_fd,
+                           slot->state == SLOT_READING ? IORING_OP_READ_FIXED : IORING_OP_WRITE_FIXED);
+                continue;
+            }
+            
+            if (slot->state == SLOT_READING) {
+                // Chunk is in the buffer, write it out
+                slot->state = SLOT_WRITING;
+                slot->done = 0;
+                slot->hashed = hash == NULL;
+                slot->started = tune_now();
+                ring_queue(ring, slot_index, dst_fd, IORING_OP_WRITE_FIXED);
+                continue;
+            }
+            
+            // Chunk is on the target, the slot is free for the next one
+            tune_record(slot->want, tune_now() - slot->started);
+            copy_progress_add(slot->want);
+            written_bytes += slot->want;
+            if (written != NULL) {
+                written(dst_fd, written_bytes, &flushed);
+            }
+            if (!slot->hashed) {
+                slot->state = SLOT_WRITTEN; // Still counts as in flight until it's hashed
+                continue;
+            }
+            slot->state = SLOT_IDLE;
+            in_flight--;
+        }
+        
+        __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+        
+        if (hash != NULL) {
+            in_flight -= slot_hash_ready(ring, hash, &hashed_offset, failed);
+        }
+        
+        if (!failed) {
+            in_flight = slot_refill(ring, in_flight, src_fd, &next_offset, size);
+        }
+    }
+    
+    if (failed) {
+        errno = failed_errno;
+        return -1;
+    }
+    
+    return 0;
+}
+
+void uring_release(void) {
+    if (thread_ring != NULL) {
+        ring_destroy(thread_ring);
+        thread_ring = NULL;
+    }
+}
+
+#else
+
+// Built without io_uring headers, always use the standard copy path
+int uring_available(void) {
+    return 0;
+}
+
+int uring_copy_fd(int src_fd, off_t src_offset, int dst_fd, off_t size, HashState *hash,
+                  void (*written)(int dst_fd, off_t written, off_t *flushed)) {
+    (void)src_fd;
+    (void)src_offset;
+    (void)dst_fd;
+    (void)size;
+    (void)hash;
+    (void)written;
+    return -1;
+}
+
+void uring_release(void) {
+}
+
+#endif
@@ -41,11 +41,27 @@ void print_usage(const char *program_name) {
     printf("Create a bootable USB installer from an ISO image\n\n");
     printf("Required options:\n");
     printf("  -s, --source=PATH          Source ISO file or DVD device\n");
-    printf("  -t, --target=PATH          Target USB device or partition\n");
+    printf("  -t, --target=PATH          Target USB device or partition. With -w or -r, a comma\n");
+    printf("                             separated list flashes several devices at once\n");
     printf("  -w, --wipe                 Wipe mode (wipe entire USB)\n");
-    printf("  -p, --partition            Partition mode (use existing partition)\n\n");
+    printf("  -p, --partition            Partition mode (use existing partition)\n");
+    printf("  -r, --raw                  Raw mode (write a hybrid ISO block for block)\n\n");
     printf("Optional:\n");
     printf("  -l, --label=LABEL          Filesystem label (default: 'BOOTABLE USB')\n");
+    printf("  -j, --jobs=N               Copy N files at a time (default: 1, max: %d)\n", MAX_JOBS);
+    printf("  --copy-engine=ENGINE       How file data is copied: default, auto, copy_file_range,\n");
+    printf("                             sendfile, mmap, buffered, direct, io_uring\n");
+    printf("  --sync=MODE                When data is synced: file (default), deferred\n");
+    printf("  --order=ORDER              File copy order: none (default), physical, largest\n");
+    printf("  --direct-io                Write the target with O_DIRECT, bypassing the page cache\n");
+    printf("  --resume                   Continue a failed flash, skipping files already copied\n");
+    printf("  --verify                   Read every file back from the target and compare it\n");
+    printf("  --checksums=FILE           Write the xxh64 digest of every copied file to FILE\n");
+    printf("  --progress=json:FD         Also write progress as JSON lines to file descriptor FD\n");
+    printf("  --metrics=FILE             Write the time and I/O of every phase to FILE as JSON\n");
+    printf("  --metrics-textfile=FILE    Same as a node_exporter textfile (FILE ending in .prom)\n");
+    printf("  --native-fat               With -w, write the FAT32 filesystem in one pass, no mkfs\n");
+    printf("  --mount-source             Loop mount the ISO instead of reading it directly\n");
     printf("  -v, --verbose              Verbose output\n");
     printf("  -nl, --no-log              Disable logging (no log file created)\n");
     printf("  -ls, --list                List all removable drives\n");
@@ -54,6 +70,7 @@ void print_usage(const char *program_name) {
     printf("Examples:\n");
     printf("  sudo %s -w -s=/path/to/image.iso -t=/dev/sdb\n", program_name);
     printf("  sudo %s -p -s=/path/to/windows.iso -t=/dev/sdb1\n", program_name);
+    printf("  sudo %s -w -s=/path/to/image.iso -t=/dev/sdb,/dev/sdc,/dev/sdd\n", program_name);
 }
 
 void print_version(void) {
@@ -136,67 +153,6 @@ int make_directory(const char *path) {
     return 0;
 }
 
-// The sole purpose of this is to just execute shell commands
-// You're gonna see this everywhere
-int run_command(const char *command) {
-    int ret = system(command);
-    return WEXITSTATUS(ret);
-}
-
-int run_command_with_output(const char *command, char *output, size_t output_size) {
-    FILE *fp;
-    size_t bytes_read;
-    
-    fp = popen(command, "r");
-    if (fp == NULL) {
-        return -1;
-    }
-    
-    bytes_read = fread(output, 1, output_size - 1, fp);
-    output[bytes_read] = '\0';
-    
-    pclose(fp);
-    return 0;
-}
-
-// Calculate the total size of a directory and all its contents
-// Returns size in bytes
-unsigned long long get_directory_size(const char *path) {
-    DIR *dir;
-    struct dirent *entry;
-    struct stat st;
-    unsigned long long total = 0;
-    char full_path[MAX_PATH];
-    
-    dir = opendir(path);
-    if (dir == NULL) {
-        return 0;
-    }
-    // Skip . and ..
-    while ((entry = readdir(dir)) != NULL) {
-        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
-            continue;
-        }
-        
-        snprintf(full_path, sizeof(full_path), "%s/%s", path, entry->d_name);
-        
-        if (lstat(full_path, &st) != 0) {
-            continue;
-        }
-        // Process subdirectories
-        if (S_ISDIR(st.st_mode)) {
-            total += get_directory_size(full_path);
-        }
-        // Add the file size 
-        else if (S_ISREG(st.st_mode)) {
-            total += st.st_size;
-        }
-    }
-    
-    closedir(dir);
-    return total;
-}
-
 // Get free space on a filesystem
 // Get the free space in bytes
 unsigned long long get_free_space(const char *path) {
@@ -212,120 +168,103 @@ unsigned long long get_free_space(const char *path) {
 
 // Force the kernel to re-read partition table after modifying it
 void make_system_realize_partition_changed(const char *device) {
-    char command[MAX_PATH];
+    const char *argv[] = { "blockdev", "--rereadpt", device, NULL };
     
     print_colored("Refreshing partition table...", "");
     
-    snprintf(command, sizeof(command), "blockdev --rereadpt %s 2>/dev/null", device);
-    run_command(command);
+    run_program(argv, COMMAND_TIMEOUT);
     
     sleep(3);
 }
 
+// Pull KEY="value" out of one line of lsblk --pairs output. Returns 0 if the key is there
+static int lsblk_value(const char *line, const char *key, char *value, size_t size) {
+    size_t key_length = strlen(key);
+    const char *pair = line;
+    const char *close;
+    size_t length;
+    
+    while (*pair != '\0') {
+        while (*pair == ' ') {
+            pair++;
+        }
+        
+        // lsblk escapes quotes inside a value, so the next quote always ends it
+        close = strchr(pair, '=');
+        if (close == NULL || close[1] != '"') {
+            return -1;
+        }
+        close = strchr(close + 2, '"');
+        if (close == NULL) {
+            return -1;
+        }
+        
+        if (strncmp(pair, key, key_length) == 0 && pair[key_length] == '=') {
+            length = (size_t)(close - (pair + key_length + 2));
+            if (length >= size) {
+                length = size - 1;
+            }
+            memcpy(value, pair + key_length + 2, length);
+            value[length] = '\0';
+            return 0;
+        }
+        
+        pair = close + 1;
+    }
+    
+    return -1;
+}
+
 int list_removable_devices(void) {
-    FILE *pipe;
-    char buffer[1024];
-    char command[MAX_PATH];
-    char **devices = NULL;
+    const char *argv[] = { "lsblk", "-d", "-n", "-P", "-o", "NAME,TRAN,TYPE,SIZE,MODEL", NULL };
+    char output[16384];
+    char *line;
+    char *next;
     int device_count = 0;
-    int i;
+    char name[64];
     char device_path[MAX_PATH];
     char size[64];
     char model[256];
     char type[64];
-    char cmd[MAX_PATH];
+    char kind[64];
     
     printf("\033[1mRemovable Devices:\033[0m\n");
     printf("%-15s %-20s %-10s %-10s\n", "DEVICE", "MODEL", "SIZE", "TYPE");
     printf("================================================================\n");
     
-    // Find all USB/UAS connected disk devices
-    snprintf(command, sizeof(command), 
-             "lsblk -d -o NAME,TRAN,TYPE -n | awk '($2==\"usb\" || $2==\"uas\") && $3==\"disk\" {print $1}'");
-    
-    pipe = popen(command, "r");
-    if (pipe == NULL) {
+    // Every disk with its details in one go, one line per disk
+    if (run_program_output(argv, COMMAND_TIMEOUT, output, sizeof(output)) != 0) {
         fprintf(stderr, "Error: Failed to list devices\n");
         return -1;
     }
     
-    // Allocate array to store device names
-    devices = (char **)malloc(MAX_DEVICES * sizeof(char *));
-    if (devices == NULL) {
-        pclose(pipe);
-        fprintf(stderr, "Error: Memory allocation failed\n");
-        return -1;
-    }
-    
-    // Read device names
-    while (fgets(buffer, sizeof(buffer), pipe) != NULL && device_count < MAX_DEVICES) {
-        buffer[strcspn(buffer, "\n")] = 0;
-        devices[device_count] = strdup(buffer);
-        if (devices[device_count] == NULL) {
-            pclose(pipe);
-            for (i = 0; i < device_count; i++) {
-                free(devices[i]);
-            }
-            free(devices);
-            fprintf(stderr, "Error: Memory allocation failed\n");
-            return -1;
+    for (line = output; line != NULL && *line != '\0' && device_count < MAX_DEVICES; line = next) {
+        next = strchr(line, '\n');
+        if (next != NULL) {
+            *next++ = '\0';
         }
-        device_count++;
-    }
-    
-    pclose(pipe);
-    
-    // Couldn't find a device
-    // Should probably tell the user the purpose of this software
-    if (device_count == 0) {
-        printf("No removable devices found.\n");
-        free(devices);
-        return 0;
-    }
-    
-    for (i = 0; i < device_count; i++) {
-        size[0] = '\0';
-        model[0] = '\0';
-        type[0] = '\0';
         
-        snprintf(device_path, sizeof(device_path), "/dev/%s", devices[i]);
-
-        // Get device size
-        snprintf(cmd, sizeof(cmd), 
-                 "lsblk -d -o SIZE -n '%s' 2>/dev/null", device_path);
-        pipe = popen(cmd, "r");
-        if (pipe != NULL) {
-            if (fgets(size, sizeof(size), pipe) != NULL) {
-                size[strcspn(size, "\n")] = 0;
-                char *trimmed = trim_whitespace(size);
-                memmove(size, trimmed, strlen(trimmed) + 1);
-            }
-            pclose(pipe);
+        if (lsblk_value(line, "NAME", name, sizeof(name)) != 0 || name[0] == '\0') {
+            continue;
         }
         
-        // Get device model
-        snprintf(cmd, sizeof(cmd), 
-                 "lsblk -d -o MODEL -n '%s' 2>/dev/null", device_path);
-        pipe = popen(cmd, "r");
-        if (pipe != NULL) {
-            if (fgets(model, sizeof(model), pipe) != NULL) {
-                model[strcspn(model, "\n")] = 0;
-                char *trimmed = trim_whitespace(model);
-                memmove(model, trimmed, strlen(trimmed) + 1);
-            }
-            pclose(pipe);
+        // Only USB/UAS connected disk devices
+        if (lsblk_value(line, "TRAN", type, sizeof(type)) != 0 ||
+            (strcmp(type, "usb") != 0 && strcmp(type, "uas") != 0)) {
+            continue;
+        }
+        if (lsblk_value(line, "TYPE", kind, sizeof(kind)) != 0 || strcmp(kind, "disk") != 0) {
+            continue;
         }
         
-        // Get transport type (usb/uas)
-        snprintf(cmd, sizeof(cmd), 
-                 "lsblk -d -o TRAN -n '%s' 2>/dev/null", device_path);
-        pipe = popen(cmd, "r");
-        if (pipe != NULL) {
-            if (fgets(type, sizeof(type), pipe) != NULL) {
-                type[strcspn(type, "\n")] = 0;
-                trim_whitespace(type);
-            }
-            pclose(pipe);
+        if (lsblk_value(line, "SIZE", size, sizeof(size)) != 0) {
+            size[0] = '\0';
+        }
+        if (lsblk_value(line, "MODEL", model, sizeof(model)) != 0) {
+            model[0] = '\0';
+        } else {
+            char *trimmed = trim_whitespace(model);
+            memmove(model, trimmed, strlen(trimmed) + 1);
         }
         
         // Use defaults if information not available
@@ -333,16 +272,17 @@ int list_removable_devices(void) {
             strncpy(model, "Unknown", sizeof(model) - 1);
         }
         
-        if (strlen(type) == 0) {
-            strncpy(type, "usb", sizeof(type) - 1);
-        }
-        
+        snprintf(device_path, sizeof(device_path), "/dev/%s", name);
         printf("%-15s %-20s %-10s %-10s\n", device_path, model, size, type);
-        
-        free(devices[i]);
+        device_count++;
     }
     
-    free(devices);
+    // Couldn't find a device
+    // Should probably tell the user the purpose of this software
+    if (device_count == 0) {
+        printf("No removable devices found.\n");
+        return 0;
+    }
     
     printf("\n\033[33mNote: Run 'sudo buf -h' for help with creating a bootable USB\033[0m\n");
     
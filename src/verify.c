@@ -0,0 +1,173 @@
+/*
+    buf - Command line tool for flashing ISO images onto USB drives.
+    Copyright (C) 2026  Bryson Kelly
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+*/
+
+
+// Post-flash verification
+// Reads every file back off the target around the page cache and checks its hash against
+// the source. Fake capacity sticks happily accept writes past their real size and hand back
+// garbage later, this catches them before the installer does.
+// Several threads read at once so the stick's queue stays full and the hashing never
+// becomes the bottleneck
+#include "../include/buf.h"
+#include <pthread.h>
+#include <stdatomic.h>
+
+#define VERIFY_THREADS 4 // Readers when --jobs doesn't ask for more
+
+typedef struct {
+    ManifestEntry **files;
+    size_t count;
+    const SourceManifest *manifest;
+    const char *target;
+    _Atomic size_t next;                     // Next file to hand out
+    _Atomic size_t failed;                   // Files that didn't match
+    _Atomic unsigned long long verified;     // Bytes checked so far
+    unsigned long long total;
+    time_t last_update;
+    pthread_mutex_t progress_lock;
+} VerifyPool;
+
+static void verify_progress(VerifyPool *pool) {
+    time_t now = time(NULL);
+    unsigned long long verified;
+    char rate[64];
+    
+    if (pthread_mutex_trylock(&pool->progress_lock) != 0) {
+        return;
+    }
+    
+    if (now - pool->last_update >= 1 && pool->total > 0) {
+        pool->last_update = now;
+        verified = atomic_load(&pool->verified);
+        progress_update("verify", verified, pool->target, NULL, 0, rate, sizeof(rate));
+        printf("\rVerifying: %llu MB / %llu MB (%d%%)%s", verified / (1024 * 1024), pool->total / (1024 * 1024),
+               (int)((verified * 100) / pool->total), rate);
+        fflush(stdout);
+    }
+    
+    pthread_mutex_unlock(&pool->progress_lock);
+}
+
+// Hash one file on both sides. The source side is skipped when the copy already hashed it
+static int verify_file(VerifyPool *pool, ManifestEntry *entry) {
+    char path[MAX_PATH];
+    uint64_t target_hash;
+    
+    if (!entry->hashed && hash_entry(pool->manifest, entry) != 0) {
+        log_write(g_log_ctx, LOG_ERROR, "Verify: cannot read source %s/%s - %s",
+                  pool->manifest->root, entry->path, strerror(errno));
+        return -1;
+    }
+    
+    snprintf(path, sizeof(path), "%s/%s", pool->target, entry->path);
+    if (hash_file(path, 1, &target_hash) != 0) {
+        log_write(g_log_ctx, LOG_ERROR, "Verify: cannot read back %s - %s", path, strerror(errno));
+        return -1;
+    }
+    
+    if (target_hash != entry->hash) {
+        log_write(g_log_ctx, LOG_ERROR, "Verify: %s does not match the source (%016llx, expected %016llx)",
+                  path, (unsigned long long)target_hash, (unsigned long long)entry->hash);
+        return -1;
+    }
+    
+    return 0;
+}
+
+static void *verify_worker(void *arg) {
+    VerifyPool *pool = (VerifyPool *)arg;
+    size_t index;
+    
+    while ((index = atomic_fetch_add(&pool->next, 1)) < pool->count) {
+        if (verify_file(pool, pool->files[index]) != 0) {
+            atomic_fetch_add(&pool->failed, 1);
+        }
+        
+        atomic_fetch_add(&pool->verified, pool->files[index]->size);
+        verify_progress(pool);
+    }
+    
+    return NULL;
+}
+
+// Check every file of the manifest on the target. Returns -1 if anything doesn't match
+int verify_target(SourceManifest *manifest, const char *target, int jobs) {
+    VerifyPool pool;
+    pthread_t threads[MAX_JOBS];
+    int started = 0;
+    size_t i;
+    int t;
+    
+    print_colored("Verifying files on target...", "green");
+    log_write(g_log_ctx, LOG_STEP, "Verifying %zu files on target", manifest->file_count);
+    
+    memset(&pool, 0, sizeof(pool));
+    pool.manifest = manifest;
+    pool.target = target;
+    pool.total = manifest->total_size;
+    progress_start(pool.total);
+    pool.files = (ManifestEntry **)malloc((manifest->file_count + 1) * sizeof(ManifestEntry *));
+    if (pool.files == NULL) {
+        log_write(g_log_ctx, LOG_ERROR, "Memory allocation failed");
+        return -1;
+    }
+    
+    for (i = 0; i < manifest->count; i++) {
+        if (S_ISREG(manifest->entries[i].mode)) {
+            pool.files[pool.count++] = &manifest->entries[i];
+        }
+    }
+    
+    pthread_mutex_init(&pool.progress_lock, NULL);
+    
+    if (jobs < VERIFY_THREADS) {
+        jobs = VERIFY_THREADS;
+    }
+    
+    for (t = 0; t < jobs; t++) {
+        if (pthread_create(&threads[t], NULL, verify_worker, &pool) != 0) {
+            break;
+        }
+        started++;
+    }
+    
+    if (started == 0) {
+        // No threads at all, verify on this one
+        verify_worker(&pool);
+    }
+    
+    for (t = 0; t < started; t++) {
+        pthread_join(threads[t], NULL);
+    }
+    
+    pthread_mutex_destroy(&pool.progress_lock);
+    free(pool.files);
+    printf("\n");
+    
+    if (atomic_load(&pool.failed) > 0) {
+        fprintf(stderr, "Error: %zu files on the target do not match the source\n", atomic_load(&pool.failed));
+        log_write(g_log_ctx, LOG_ERROR, "Verification failed: %zu of %zu files do not match the source",
+                  atomic_load(&pool.failed), pool.count);
+        return -1;
+    }
+    
+    log_write(g_log_ctx, LOG_SUCCESS, "Verified %zu files (%llu MB) on target",
+              pool.count, pool.total / (1024 * 1024));
+    return 0;
+}